@@ -48,7 +48,15 @@ HRESULT WINAPI DllGetActivationFactory( _In_ HSTRING activatibleClassId, _Outptr
 HRESULT WINAPI DllCanUnloadNow()
 {
     auto &module = Microsoft::WRL::Module<Microsoft::WRL::InProc>::GetModule();    
-    return (module.Terminate()) ? S_OK : S_FALSE;
+    if (!module.Terminate())
+    {
+        return S_FALSE;
+    }
+
+    // No sink is left; idle pooled handles go while the backend is still
+    // loaded, see PpboxCapturePool.
+    PpboxCapturePool::Instance().Trim();
+    return S_OK;
 }
 
 STDAPI DllGetClassObject( _In_ REFCLSID rclsid, _In_ REFIID riid, _Outptr_ LPVOID FAR* ppv )
@@ -0,0 +1,178 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxAac.cpp
+// AAC configuration and ADTS framing.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+#include "PpboxAac.h"
+
+// MF_MT_USER_DATA of AAC is a HEAACWAVEINFO without its WAVEFORMATEX:
+// wPayloadType, wAudioProfileLevelIndication, wStructType, wReserved1,
+// dwReserved2, then the AudioSpecificConfig.
+const unsigned long HEAACWAVEINFO_EXTRA = 12;
+
+const unsigned long AAC_OBJECT_LC = 2;
+
+static unsigned long const s_SampleRates[] = 
+{
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+    16000, 12000, 11025, 8000, 7350,
+};
+
+static unsigned long ReadBits(unsigned char const * pData, unsigned long & uPos, unsigned long cBits)
+{
+    unsigned long v = 0;
+    for (unsigned long i = 0; i < cBits; ++i, ++uPos)
+    {
+        v = (v << 1) | ((pData[uPos >> 3] >> (7 - (uPos & 7))) & 1);
+    }
+    return v;
+}
+
+// Checks the fixed head of an AudioSpecificConfig: object type, sampling
+// frequency and channel configuration, with their escapes.
+static bool ParseAudioSpecificConfig(unsigned char const * pData, unsigned long cbData)
+{
+    unsigned long cBits = cbData * 8;
+    unsigned long uPos = 0;
+
+    // 5 + 4 + 4 bits at least.
+    if (cBits < 13)
+    {
+        return false;
+    }
+
+    unsigned long uObject = ReadBits(pData, uPos, 5);
+    if (uObject == 31)
+    {
+        if (cBits < uPos + 6)
+        {
+            return false;
+        }
+        uObject = 32 + ReadBits(pData, uPos, 6);
+    }
+    if (uObject == 0)
+    {
+        return false;
+    }
+
+    if (cBits < uPos + 4)
+    {
+        return false;
+    }
+    unsigned long uFrequency = ReadBits(pData, uPos, 4);
+    if (uFrequency == 15)
+    {
+        uPos += 24;
+    }
+    else if (uFrequency >= sizeof(s_SampleRates) / sizeof(s_SampleRates[0]))
+    {
+        return false;
+    }
+
+    // Channel configuration, 0 = in a program config element.
+    return cBits >= uPos + 4;
+}
+
+bool CreateAudioSpecificConfig(PpboxCoreMediaType const & type, unsigned char * pConfig, unsigned long * pcbConfig)
+{
+    if (type.cbUserData > HEAACWAVEINFO_EXTRA
+        && type.cbUserData - HEAACWAVEINFO_EXTRA <= AAC_MAX_CONFIG
+        && ParseAudioSpecificConfig(type.userData + HEAACWAVEINFO_EXTRA, type.cbUserData - HEAACWAVEINFO_EXTRA))
+    {
+        *pcbConfig = type.cbUserData - HEAACWAVEINFO_EXTRA;
+        memcpy(pConfig, type.userData + HEAACWAVEINFO_EXTRA, *pcbConfig);
+        return true;
+    }
+
+    // Channel configurations 1 to 6 are that many channels, 7 is 7.1.
+    if (type.channel_count == 0 || type.channel_count == 7 || type.channel_count > 8 || type.sample_rate == 0)
+    {
+        return false;
+    }
+    unsigned long uChannels = type.channel_count == 8 ? 7 : type.channel_count;
+
+    unsigned long uFrequency = 15;
+    for (unsigned long i = 0; i < sizeof(s_SampleRates) / sizeof(s_SampleRates[0]); ++i)
+    {
+        if (s_SampleRates[i] == type.sample_rate)
+        {
+            uFrequency = i;
+            break;
+        }
+    }
+
+    // 5 bits object type, 4 bits frequency index [24 bits frequency],
+    // 4 bits channels, 3 bits GASpecificConfig (all zero).
+    if (uFrequency != 15)
+    {
+        pConfig[0] = (unsigned char)((AAC_OBJECT_LC << 3) | (uFrequency >> 1));
+        pConfig[1] = (unsigned char)(((uFrequency & 1) << 7) | (uChannels << 3));
+        *pcbConfig = 2;
+    }
+    else
+    {
+        unsigned long uRate = type.sample_rate & 0xffffff;
+        pConfig[0] = (unsigned char)((AAC_OBJECT_LC << 3) | (15 >> 1));
+        pConfig[1] = (unsigned char)(((15 & 1) << 7) | (uRate >> 17));
+        pConfig[2] = (unsigned char)(uRate >> 9);
+        pConfig[3] = (unsigned char)(uRate >> 1);
+        pConfig[4] = (unsigned char)(((uRate & 1) << 7) | (uChannels << 3));
+        *pcbConfig = 5;
+    }
+
+    return true;
+}
+
+bool StripAdtsHeaders(unsigned char const * pData, unsigned long cbData, unsigned char * pOut, unsigned long * pcbRaw)
+{
+    unsigned char const * p = pData;
+    unsigned char const * pEnd = pData + cbData;
+    unsigned long cbOut = 0;
+
+    // Check all headers first, so that a bad sample is left untouched.
+    while (p < pEnd)
+    {
+        // 12 bits sync, 1 bit id, 2 bits layer (0).
+        if (pEnd - p < 7 || p[0] != 0xFF || (p[1] & 0xF6) != 0xF0)
+        {
+            return false;
+        }
+        unsigned long cbHeader = (p[1] & 1) ? 7 : 9;    // protection_absent, else a CRC follows.
+        unsigned long cbFrame = ((p[3] & 3) << 11) | (p[4] << 3) | (p[5] >> 5);
+        if (cbFrame <= cbHeader || cbFrame > (unsigned long)(pEnd - p) || (p[6] & 3) != 0)
+        {
+            return false;
+        }
+        p += cbFrame;
+    }
+
+    if (cbData == 0)
+    {
+        return false;
+    }
+
+    // The output never gets ahead of the input, pOut may be pData.
+    for (p = pData; p < pEnd; )
+    {
+        unsigned long cbHeader = (p[1] & 1) ? 7 : 9;
+        unsigned long cbFrame = ((p[3] & 3) << 11) | (p[4] << 3) | (p[5] >> 5);
+        memmove(pOut + cbOut, p + cbHeader, cbFrame - cbHeader);
+        cbOut += cbFrame - cbHeader;
+        p += cbFrame;
+    }
+
+    *pcbRaw = cbOut;
+    return true;
+}
@@ -0,0 +1,42 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxAac.h
+// AAC configuration and ADTS framing.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+// MF_MT_AAC_PAYLOAD_TYPE values.
+enum PpboxAacPayload
+{
+    AacPayload_Raw = 0,
+    AacPayload_ADTS = 1,
+    AacPayload_ADIF = 2,
+    AacPayload_LOAS = 3,
+};
+
+const unsigned long AAC_MAX_CONFIG = 64;
+
+// Writes the AudioSpecificConfig of an AAC type to pConfig. It is the one
+// in the user data (after the HEAACWAVEINFO fields) if that parses, or
+// else an AAC LC config built from the sample rate and channel count:
+// 1 to 6 channels, or 8 (7.1). 7 channels have no channel configuration
+// of their own and are refused.
+bool CreateAudioSpecificConfig(PpboxCoreMediaType const & type, unsigned char * pConfig, unsigned long * pcbConfig);
+
+// Turns a sample of ADTS frames into raw AAC, the frame payloads one
+// after another in pOut, which holds cbData bytes and may be pData
+// itself. On success the raw data is *pcbRaw bytes. Fails, with nothing
+// written, unless pData is a whole number of frames of one raw data
+// block each.
+bool StripAdtsHeaders(unsigned char const * pData, unsigned long cbData, unsigned char * pOut, unsigned long * pcbRaw);
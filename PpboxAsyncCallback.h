@@ -0,0 +1,41 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxAsyncCallback.h
+// IMFAsyncCallback that forwards to a member function, for work items
+// scheduled by the sink and its streams.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// The callback keeps its parent alive until the work item is done or
+// canceled, so parents cancel their work items at Shutdown and check for
+// shutdown when invoked.
+template <class T>
+class PpboxAsyncCallback
+    : public Microsoft::WRL::RuntimeClass<
+        Microsoft::WRL::RuntimeClassFlags< Microsoft::WRL::RuntimeClassType::ClassicCom >, 
+        IMFAsyncCallback >
+{
+public:
+    typedef HRESULT (T::*InvokeFn)(IMFAsyncResult *pResult);
+
+    PpboxAsyncCallback(T *pParent, InvokeFn pfnInvoke) 
+        : m_spParent(pParent), m_pfnInvoke(pfnInvoke)
+    {
+    }
+
+    IFACEMETHOD (GetParameters) (DWORD *pdwFlags, DWORD *pdwQueue) { return E_NOTIMPL; }
+    IFACEMETHOD (Invoke) (IMFAsyncResult *pResult) { return (m_spParent.Get()->*m_pfnInvoke)(pResult); }
+
+private:
+    ComPtr<T>   m_spParent;
+    InvokeFn    m_pfnInvoke;
+};
@@ -0,0 +1,34 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxAutoLock.h
+// Scoped critical section lock, for the sink and the objects it owns.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+class AutoLock
+{
+private:
+    CRITICAL_SECTION *m_pCriticalSection;
+public:
+	_Acquires_lock_(m_pCriticalSection)
+    AutoLock(CRITICAL_SECTION& crit)
+    {
+        m_pCriticalSection = &crit;
+        EnterCriticalSection(m_pCriticalSection);
+    }
+
+	_Releases_lock_(m_pCriticalSection)
+    ~AutoLock()
+    {
+        LeaveCriticalSection(m_pCriticalSection);
+    }
+};
@@ -0,0 +1,161 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxBitrate.cpp
+// Estimates how much the backend can take per stream, and recommends a
+// bitrate to the encoder controller.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+#include "PpboxBitrate.h"
+
+const double BITRATE_SMOOTHING = 0.3;       // Weight of the newest measurement.
+const double BITRATE_TARGET_BACKLOG = 1.0;  // Seconds of backlog a saturated backend may hold.
+const double BITRATE_SAFETY = 0.85;         // Of the throughput, when saturated.
+const double BITRATE_PROBE = 1.15;          // Of the input rate, when not; above BITRATE_MIN_CHANGE.
+const double BITRATE_GROWTH = 0.02;         // Queue growth, of the input rate, that means saturated.
+
+PpboxBitrateEstimator::PpboxBitrateEstimator()
+{
+    Reset();
+}
+
+unsigned long PpboxBitrateEstimator::Update(PpboxSinkStats & stats)
+{
+    unsigned long dwRaise = 0;
+
+    for (unsigned long i = 0; i < stats.cStreams; ++i)
+    {
+        PpboxStreamStats & info = stats.streams[i];
+        if (info.dwIdentifier >= MAX_STREAMS)
+        {
+            continue;
+        }
+
+        Stream & stream = m_Streams[info.dwIdentifier];
+        Estimate(stream, info, stats.uTime);
+
+        if (stream.uRecommended == 0 || stats.uTime - stream.uRaisedTime < BITRATE_MIN_INTERVAL)
+        {
+            continue;
+        }
+
+        unsigned long uDelta = stream.uRecommended > stream.uRaised
+            ? stream.uRecommended - stream.uRaised
+            : stream.uRaised - stream.uRecommended;
+        if (stream.uRaised == 0
+            || (unsigned long long)uDelta * 100 >= (unsigned long long)stream.uRaised * BITRATE_MIN_CHANGE)
+        {
+            stream.uRaised = stream.uRecommended;
+            stream.uRaisedTime = stats.uTime;
+            dwRaise |= 1UL << info.dwIdentifier;
+        }
+    }
+
+    return dwRaise;
+}
+
+void PpboxBitrateEstimator::GetEstimate(PpboxStreamStats & stats) const
+{
+    if (stats.dwIdentifier >= MAX_STREAMS)
+    {
+        return;
+    }
+
+    Stream const & stream = m_Streams[stats.dwIdentifier];
+    stats.uDrainBytesPerSecond = (unsigned long long)stream.dDrain;
+    stats.llQueueGrowth = (long long)stream.dGrowth;
+    stats.uThroughput = stream.uThroughput;
+    stats.uRecommendedBitrate = stream.uRecommended;
+}
+
+unsigned long PpboxBitrateEstimator::GetRecommendedBitrate(unsigned long dwStream) const
+{
+    return dwStream < MAX_STREAMS ? m_Streams[dwStream].uRecommended : 0;
+}
+
+void PpboxBitrateEstimator::Reset()
+{
+    memset(m_Streams, 0, sizeof(m_Streams));
+}
+
+/* Private methods */
+
+void PpboxBitrateEstimator::Estimate(Stream & stream, PpboxStreamStats & stats, unsigned long long uTime)
+{
+    // Counters went back: a new stream on the same identifier.
+    if (stream.fValid && (stats.cbSamples < stream.cbSamples || stats.cbFreed < stream.cbFreed))
+    {
+        memset(&stream, 0, sizeof(stream));
+    }
+
+    // Spilled samples count as input only once they are replayed, so the
+    // backlog includes them: a backend that keeps up with the replay
+    // while the spill ring fills is still saturated.
+    unsigned long long cbBacklog = stats.cbInFlight + stats.cbSpilled;
+
+    if (stream.fValid && uTime > stream.uTime)
+    {
+        double dElapsed = (double)(uTime - stream.uTime) / 1000000.0;
+        double dInput = (double)(stats.cbSamples - stream.cbSamples) / dElapsed;
+        double dDrain = (double)(stats.cbFreed - stream.cbFreed) / dElapsed;
+        double dGrowth = ((double)cbBacklog - (double)stream.cbBacklog) / dElapsed;
+
+        // The first measurement seeds the averages.
+        double dWeight = stream.fSeeded ? BITRATE_SMOOTHING : 1.0;
+        stream.dInput += (dInput - stream.dInput) * dWeight;
+        stream.dDrain += (dDrain - stream.dDrain) * dWeight;
+        stream.dGrowth += (dGrowth - stream.dGrowth) * dWeight;
+        stream.fSeeded = true;
+
+        // Nothing went in or out, nothing learned.
+        if (stream.dInput >= 1.0 || stream.dDrain >= 1.0)
+        {
+            double dBacklog = stream.dDrain >= 1.0
+                ? (double)cbBacklog / stream.dDrain
+                : (cbBacklog > 0 ? BITRATE_TARGET_BACKLOG * 2 : 0);
+            bool fSaturated = stream.dGrowth > stream.dInput * BITRATE_GROWTH
+                || dBacklog > BITRATE_TARGET_BACKLOG;
+
+            double dThroughput;
+            double dRecommended;
+            if (fSaturated)
+            {
+                dThroughput = stream.dDrain;
+                dRecommended = dThroughput * 8 * BITRATE_SAFETY;
+                // Leave room to work off the backlog, at most halving.
+                if (dBacklog > BITRATE_TARGET_BACKLOG)
+                {
+                    double dScale = BITRATE_TARGET_BACKLOG / dBacklog;
+                    dRecommended *= dScale < 0.5 ? 0.5 : dScale;
+                }
+            }
+            else
+            {
+                dThroughput = stream.dDrain > stream.dInput ? stream.dDrain : stream.dInput;
+                dRecommended = stream.dInput * 8 * BITRATE_PROBE;
+            }
+
+            stream.uThroughput = (unsigned long long)dThroughput;
+            stream.uRecommended = dRecommended >= 4294967295.0 ? 0xffffffffUL
+                : (unsigned long)dRecommended;
+        }
+    }
+
+    stream.fValid = true;
+    stream.uTime = uTime;
+    stream.cbSamples = stats.cbSamples;
+    stream.cbFreed = stats.cbFreed;
+    stream.cbBacklog = cbBacklog;
+
+    GetEstimate(stats);
+}
@@ -0,0 +1,77 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxBitrate.h
+// Estimates how much the backend can take per stream, and recommends a
+// bitrate to the encoder controller.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+const unsigned long BITRATE_DEFAULT_INTERVAL = 500;         // Milliseconds between estimates, if no StatsInterval.
+const unsigned long long BITRATE_MIN_INTERVAL = 1000000;    // Microseconds between two recommendations of a stream.
+const unsigned long BITRATE_MIN_CHANGE = 10;                // Percent change worth a new recommendation.
+
+// PpboxBitrateEstimator:
+// Fed with the periodic PpboxSinkStats snapshot. Per stream, it smooths
+// the input rate, the drain rate (bytes the backend freed) and the queue
+// growth (change of the backlog: bytes in flight and spilled). A stream
+// whose queue grows, or
+// whose backlog takes more than a second to drain, is saturated: the
+// available throughput is the drain rate, and the recommendation is below
+// it, lower still while the backlog is large. Otherwise the backend keeps
+// up, and the recommendation is a little above the input rate so the
+// encoder may probe upwards. Recommendations are throttled: a stream's
+// changes by less than BITRATE_MIN_CHANGE percent, or within
+// BITRATE_MIN_INTERVAL of the last one, are not raised.
+// Not thread safe, the sink lock protects it.
+class PpboxBitrateEstimator
+{
+public:
+    PpboxBitrateEstimator();
+
+public:
+    // Fills in the estimate fields of stats. Returns a bit per stream
+    // identifier with a recommendation to raise.
+    unsigned long   Update(PpboxSinkStats & stats);
+
+    // Copies the last estimate of the stream into stats.
+    void    GetEstimate(PpboxStreamStats & stats) const;
+
+    // Last recommendation in bits per second, 0 = none yet.
+    unsigned long   GetRecommendedBitrate(unsigned long dwStream) const;
+
+    void    Reset();
+
+private:
+    struct Stream
+    {
+        bool                fValid;         // A previous snapshot was seen.
+        bool                fSeeded;        // The averages have a first measurement.
+        unsigned long long  uTime;
+        unsigned long long  cbSamples;
+        unsigned long long  cbFreed;
+        unsigned long long  cbBacklog;      // In flight and spilled.
+        double              dInput;         // Bytes per second, smoothed.
+        double              dDrain;
+        double              dGrowth;
+        unsigned long long  uThroughput;
+        unsigned long       uRecommended;   // Bits per second.
+        unsigned long       uRaised;        // Last recommendation raised.
+        unsigned long long  uRaisedTime;
+    };
+
+    void    Estimate(Stream & stream, PpboxStreamStats & stats, unsigned long long uTime);
+
+private:
+    Stream      m_Streams[MAX_STREAMS];
+};
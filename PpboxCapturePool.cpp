@@ -0,0 +1,192 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxCapturePool.cpp
+// Process-wide pool of initialized capture handles, reused by sessions
+// with the same destination and stream layout.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+#include "PpboxCapturePool.h"
+
+static PpboxCapturePool s_CapturePool;
+
+PpboxCapturePool & PpboxCapturePool::Instance()
+{
+    return s_CapturePool;
+}
+
+PpboxCapturePool::PpboxCapturePool() :
+    m_cMaxIdle(CAPTURE_POOL_DEFAULT_SIZE),
+    m_uIdleMs(CAPTURE_POOL_DEFAULT_IDLE)
+{
+}
+
+PpboxCapturePool::~PpboxCapturePool()
+{
+    // Static destruction, the backend may be gone already; idle handles
+    // are left to the process exit.
+}
+
+void PpboxCapturePool::Configure(unsigned long cMaxIdle, unsigned long uIdleMs)
+{
+    std::vector<PP_handle> expired;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_cMaxIdle = cMaxIdle;
+        m_uIdleMs = uIdleMs;
+        Evict(PpboxGetMicroseconds(), expired);
+    }
+
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        JUST_CaptureDestroy(expired[i]);
+    }
+}
+
+PP_handle PpboxCapturePool::Acquire(char const * pszDest, unsigned long long uLayout, JUST_CaptureConfigData & config)
+{
+    std::vector<PP_handle> expired;
+    PP_handle hCapture = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        Evict(PpboxGetMicroseconds(), expired);
+
+        // Newest first, it was connected most recently.
+        for (size_t i = m_Idle.size(); i > 0; --i)
+        {
+            Entry & entry = m_Idle[i - 1];
+            if (entry.uLayout == uLayout && entry.dest == pszDest)
+            {
+                hCapture = entry.hCapture;
+                m_Idle.erase(m_Idle.begin() + (i - 1));
+                break;
+            }
+        }
+    }
+
+    // Destroying and creating may block, not under the lock.
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        JUST_CaptureDestroy(expired[i]);
+    }
+
+    if (hCapture == NULL)
+    {
+        hCapture = JUST_CaptureCreate("winrt", *pszDest ? pszDest : NULL);
+    }
+
+    // A pooled handle still has the last session's callbacks and streams.
+    JUST_CaptureInit(hCapture, &config);
+
+    return hCapture;
+}
+
+void PpboxCapturePool::Release(char const * pszDest, unsigned long long uLayout, PP_handle hCapture)
+{
+    std::vector<PP_handle> expired;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (m_cMaxIdle > 0)
+        {
+            Entry entry;
+            entry.dest = pszDest;
+            entry.uLayout = uLayout;
+            entry.hCapture = hCapture;
+            entry.uIdleSince = PpboxGetMicroseconds();
+            m_Idle.push_back(entry);
+        }
+        else
+        {
+            expired.push_back(hCapture);
+        }
+
+        Evict(PpboxGetMicroseconds(), expired);
+    }
+
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        JUST_CaptureDestroy(expired[i]);
+    }
+}
+
+void PpboxCapturePool::Trim()
+{
+    std::vector<PP_handle> expired;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (size_t i = 0; i < m_Idle.size(); ++i)
+        {
+            expired.push_back(m_Idle[i].hCapture);
+        }
+        m_Idle.clear();
+    }
+
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        JUST_CaptureDestroy(expired[i]);
+    }
+}
+
+unsigned long PpboxCapturePool::GetIdleCount()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return (unsigned long)m_Idle.size();
+}
+
+void PpboxCapturePool::Evict(unsigned long long uNow, std::vector<PP_handle> & expired)
+{
+    unsigned long long uIdle = (unsigned long long)m_uIdleMs * 1000;
+
+    // Entries are in release order, the expired ones are in front.
+    size_t cEvict = 0;
+    while (cEvict < m_Idle.size() 
+        && (m_Idle.size() - cEvict > m_cMaxIdle || uNow - m_Idle[cEvict].uIdleSince > uIdle))
+    {
+        expired.push_back(m_Idle[cEvict].hCapture);
+        ++cEvict;
+    }
+    m_Idle.erase(m_Idle.begin(), m_Idle.begin() + cEvict);
+}
+
+/* PpboxCaptureLayout */
+
+// FNV-1a, as GetMediaTypeFingerprint.
+const unsigned long long LAYOUT_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+const unsigned long long LAYOUT_PRIME = 0x100000001b3ULL;
+
+PpboxCaptureLayout::PpboxCaptureLayout(JUST_CaptureConfigData const & config) :
+    m_uHash(LAYOUT_OFFSET_BASIS)
+{
+    Mix(config.stream_count);
+    Mix(config.flags);
+}
+
+void PpboxCaptureLayout::AddStream(unsigned long dwIdentifier, bool fVideo)
+{
+    Mix(dwIdentifier);
+    Mix(fVideo ? 1 : 0);
+}
+
+void PpboxCaptureLayout::Mix(unsigned long long uValue)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        m_uHash ^= (uValue >> (i * 8)) & 0xff;
+        m_uHash *= LAYOUT_PRIME;
+    }
+}
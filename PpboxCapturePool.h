@@ -0,0 +1,98 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxCapturePool.h
+// Process-wide pool of initialized capture handles, reused by sessions
+// with the same destination and stream layout.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+const unsigned long CAPTURE_POOL_DEFAULT_SIZE = 4;         // Idle handles kept, over all destinations.
+const unsigned long CAPTURE_POOL_DEFAULT_IDLE = 30000;     // Milliseconds an idle handle is kept.
+
+// PpboxCapturePool:
+// A sink gives its handles back at Shutdown instead of leaving them, if
+// the backend holds none of its samples any more. The next session with
+// the same destination and layout (see GetCaptureLayout) takes one back,
+// initializes it again with its own config, which resets it, and
+// describes its streams to it again. Idle handles are destroyed when the
+// pool is full (oldest first) and once idle for longer than the timeout;
+// the pool has no timer, expired handles go on the next Acquire, Release
+// or Trim. Whatever is left is destroyed by an explicit Trim, see
+// DllCanUnloadNow, never when the pool itself goes: the backend may be
+// unloaded by then. Thread safe.
+class PpboxCapturePool
+{
+public:
+    PpboxCapturePool();
+    ~PpboxCapturePool();
+
+public:
+    static PpboxCapturePool & Instance();
+
+public:
+    // 0 handles = no pooling, Release destroys.
+    void        Configure(unsigned long cMaxIdle, unsigned long uIdleMs);
+
+    // An idle handle for the key, or a new one created; either way
+    // initialized with config.
+    PP_handle   Acquire(char const * pszDest, unsigned long long uLayout, JUST_CaptureConfigData & config);
+
+    // The handle must have no samples left with the backend.
+    void        Release(char const * pszDest, unsigned long long uLayout, PP_handle hCapture);
+
+    // Destroys all idle handles.
+    void        Trim();
+
+    unsigned long   GetIdleCount();
+
+private:
+    struct Entry
+    {
+        std::string         dest;
+        unsigned long long  uLayout;
+        PP_handle           hCapture;
+        unsigned long long  uIdleSince;     // PpboxGetMicroseconds.
+    };
+
+    // Moves what has to go to expired, with m_Mutex held.
+    void        Evict(unsigned long long uNow, std::vector<PP_handle> & expired);
+
+private:
+    std::mutex          m_Mutex;
+    std::vector<Entry>  m_Idle;             // Oldest first.
+    unsigned long       m_cMaxIdle;
+    unsigned long       m_uIdleMs;
+};
+
+// Hash of what a handle was set up for: the track count and flags it was
+// initialized with, and the identifier and kind of each stream.
+class PpboxCaptureLayout
+{
+public:
+    PpboxCaptureLayout(JUST_CaptureConfigData const & config);
+
+    void    AddStream(unsigned long dwIdentifier, bool fVideo);
+
+    unsigned long long  GetValue() const { return m_uHash; }
+
+private:
+    void    Mix(unsigned long long uValue);
+
+private:
+    unsigned long long  m_uHash;
+};
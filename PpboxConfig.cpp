@@ -0,0 +1,305 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxConfig.cpp
+// Compiled sink configuration: the stream types and destinations of a
+// property set in one binary blob.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+#include "PpboxConfig.h"
+
+#pragma pack(push, 1)
+struct ConfigHeader
+{
+    unsigned int    uMagic;
+    unsigned short  uVersion;
+    unsigned short  cbHeader;
+    unsigned int    cbTotal;
+    unsigned int    cStreams;
+    unsigned int    cDestinations;
+    unsigned int    uReserved;
+};
+
+struct ConfigStream
+{
+    unsigned int    cAttributes;
+    unsigned int    uReserved;
+};
+
+struct ConfigAttribute
+{
+    unsigned char   key[16];
+    unsigned int    uType;
+    unsigned int    cbValue;
+};
+
+struct ConfigDestination
+{
+    unsigned int    cchDest;
+    unsigned int    uReserved;
+};
+#pragma pack(pop)
+
+static unsigned long ConfigPad(unsigned long cbData)
+{
+    return (cbData + 7) & ~7UL;
+}
+
+/* PpboxConfigWriter */
+
+PpboxConfigWriter::PpboxConfigWriter() :
+    m_cStreams(0),
+    m_cDestinations(0),
+    m_oStream(0),
+    m_fFailed(false)
+{
+}
+
+void PpboxConfigWriter::BeginStream()
+{
+    if (m_cDestinations > 0 || m_cStreams >= MAX_STREAMS)
+    {
+        m_fFailed = true;
+        return;
+    }
+
+    ConfigStream stream = {0};
+    m_oStream = m_Records.size();
+    Append(&stream, sizeof(stream));
+    ++m_cStreams;
+}
+
+void PpboxConfigWriter::AddAttribute(unsigned char const * pKey, PpboxConfigType type, void const * pValue, unsigned long cbValue)
+{
+    if (m_cStreams == 0 || m_cDestinations > 0)
+    {
+        m_fFailed = true;
+        return;
+    }
+
+    ConfigStream * pStream = (ConfigStream *)&m_Records[m_oStream];
+    if (pStream->cAttributes >= CONFIG_MAX_ATTRIBUTES)
+    {
+        m_fFailed = true;
+        return;
+    }
+    ++pStream->cAttributes;
+
+    ConfigAttribute attribute;
+    memcpy(attribute.key, pKey, sizeof(attribute.key));
+    attribute.uType = type;
+    attribute.cbValue = cbValue;
+    Append(&attribute, sizeof(attribute));
+    Append(pValue, cbValue);
+}
+
+void PpboxConfigWriter::AddDestination(unsigned short const * pszDest, unsigned long cchDest)
+{
+    if (m_cDestinations >= MAX_DESTINATIONS)
+    {
+        m_fFailed = true;
+        return;
+    }
+
+    ConfigDestination dest = {0};
+    dest.cchDest = cchDest;
+    Append(&dest, sizeof(dest));
+    Append(pszDest, cchDest * sizeof(unsigned short));
+    ++m_cDestinations;
+}
+
+bool PpboxConfigWriter::Finish(std::vector<unsigned char> & blob)
+{
+    if (m_fFailed || m_cStreams == 0 || m_cDestinations == 0)
+    {
+        return false;
+    }
+
+    ConfigHeader header = {0};
+    header.uMagic = CONFIG_MAGIC;
+    header.uVersion = CONFIG_VERSION;
+    header.cbHeader = sizeof(header);
+    header.cbTotal = (unsigned int)(sizeof(header) + m_Records.size());
+    header.cStreams = m_cStreams;
+    header.cDestinations = m_cDestinations;
+
+    blob.resize(header.cbTotal);
+    memcpy(&blob[0], &header, sizeof(header));
+    if (!m_Records.empty())
+    {
+        memcpy(&blob[sizeof(header)], &m_Records[0], m_Records.size());
+    }
+    return true;
+}
+
+void PpboxConfigWriter::Append(void const * pData, unsigned long cbData)
+{
+    size_t oData = m_Records.size();
+    m_Records.resize(oData + ConfigPad(cbData), 0);
+    if (cbData > 0)
+    {
+        memcpy(&m_Records[oData], pData, cbData);
+    }
+}
+
+/* PpboxConfigReader */
+
+PpboxConfigReader::PpboxConfigReader() :
+    m_pBlob(NULL)
+{
+}
+
+bool PpboxConfigReader::Open(unsigned char const * pBlob, unsigned long cbBlob)
+{
+    m_pBlob = NULL;
+    m_Streams.clear();
+    m_Attributes.clear();
+    m_Destinations.clear();
+
+    if (!Parse(pBlob, cbBlob))
+    {
+        m_Streams.clear();
+        m_Attributes.clear();
+        m_Destinations.clear();
+        return false;
+    }
+
+    m_pBlob = pBlob;
+    return true;
+}
+
+bool PpboxConfigReader::Parse(unsigned char const * pBlob, unsigned long cbBlob)
+{
+    ConfigHeader header;
+    if (pBlob == NULL || cbBlob < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, pBlob, sizeof(header));
+    if (header.uMagic != CONFIG_MAGIC
+        || header.uVersion != CONFIG_VERSION
+        || header.cbHeader != sizeof(header)
+        || header.cbTotal != cbBlob
+        || header.cStreams == 0
+        || header.cStreams > MAX_STREAMS
+        || header.cDestinations == 0
+        || header.cDestinations > MAX_DESTINATIONS)
+    {
+        return false;
+    }
+
+    unsigned long oRecord = sizeof(header);
+
+    for (unsigned long i = 0; i < header.cStreams; ++i)
+    {
+        ConfigStream stream;
+        if (cbBlob - oRecord < sizeof(stream))
+        {
+            return false;
+        }
+        memcpy(&stream, pBlob + oRecord, sizeof(stream));
+        oRecord += sizeof(stream);
+        if (stream.cAttributes > CONFIG_MAX_ATTRIBUTES)
+        {
+            return false;
+        }
+
+        m_Streams.push_back((unsigned long)m_Attributes.size());
+        for (unsigned long j = 0; j < stream.cAttributes; ++j)
+        {
+            ConfigAttribute attribute;
+            if (cbBlob - oRecord < sizeof(attribute))
+            {
+                return false;
+            }
+            memcpy(&attribute, pBlob + oRecord, sizeof(attribute));
+
+            bool fSize = false;
+            switch (attribute.uType)
+            {
+            case ConfigType_UInt32: fSize = attribute.cbValue == 4; break;
+            case ConfigType_UInt64: fSize = attribute.cbValue == 8; break;
+            case ConfigType_Double: fSize = attribute.cbValue == 8; break;
+            case ConfigType_Guid:   fSize = attribute.cbValue == 16; break;
+            case ConfigType_String: fSize = (attribute.cbValue & 1) == 0; break;
+            case ConfigType_Blob:   fSize = true; break;
+            }
+            if (!fSize || attribute.cbValue > cbBlob
+                || cbBlob - oRecord - sizeof(attribute) < ConfigPad(attribute.cbValue))
+            {
+                return false;
+            }
+
+            m_Attributes.push_back(oRecord);
+            oRecord += sizeof(attribute) + ConfigPad(attribute.cbValue);
+        }
+    }
+
+    for (unsigned long i = 0; i < header.cDestinations; ++i)
+    {
+        ConfigDestination dest;
+        if (cbBlob - oRecord < sizeof(dest))
+        {
+            return false;
+        }
+        memcpy(&dest, pBlob + oRecord, sizeof(dest));
+        if (dest.cchDest > (cbBlob - oRecord - sizeof(dest)) / sizeof(unsigned short)
+            || cbBlob - oRecord - sizeof(dest) < ConfigPad(dest.cchDest * sizeof(unsigned short)))
+        {
+            return false;
+        }
+
+        m_Destinations.push_back(oRecord);
+        oRecord += sizeof(dest) + ConfigPad(dest.cchDest * sizeof(unsigned short));
+    }
+
+    return oRecord == cbBlob;
+}
+
+unsigned long PpboxConfigReader::GetAttributeCount(unsigned long iStream) const
+{
+    unsigned long iEnd = iStream + 1 < m_Streams.size()
+        ? m_Streams[iStream + 1] : (unsigned long)m_Attributes.size();
+    return iEnd - m_Streams[iStream];
+}
+
+void PpboxConfigReader::GetAttribute(unsigned long iStream, unsigned long iAttribute, PpboxConfigAttribute & attribute) const
+{
+    unsigned long oRecord = m_Attributes[m_Streams[iStream] + iAttribute];
+    ConfigAttribute const * pRecord = (ConfigAttribute const *)(m_pBlob + oRecord);
+
+    attribute.pKey = pRecord->key;
+    attribute.type = (PpboxConfigType)pRecord->uType;
+    attribute.pValue = m_pBlob + oRecord + sizeof(ConfigAttribute);
+    attribute.cbValue = pRecord->cbValue;
+}
+
+void PpboxConfigReader::GetDestination(unsigned long iDest, unsigned short const ** ppszDest, unsigned long * pcchDest) const
+{
+    unsigned long oRecord = m_Destinations[iDest];
+    ConfigDestination const * pRecord = (ConfigDestination const *)(m_pBlob + oRecord);
+
+    *ppszDest = (unsigned short const *)(m_pBlob + oRecord + sizeof(ConfigDestination));
+    *pcchDest = pRecord->cchDest;
+}
+
+unsigned long long GetConfigHash(unsigned char const * pBlob, unsigned long cbBlob)
+{
+    unsigned long long uHash = 0xcbf29ce484222325ULL;
+    for (unsigned long i = 0; i < cbBlob; ++i)
+    {
+        uHash ^= pBlob[i];
+        uHash *= 0x100000001b3ULL;
+    }
+    return uHash;
+}
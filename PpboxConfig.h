@@ -0,0 +1,110 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxConfig.h
+// Compiled sink configuration: the stream types and destinations of a
+// property set in one binary blob.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+#include <vector>
+
+// Blob layout, host byte order (little endian on every target), each
+// record 8-byte aligned:
+//   Header
+//   cStreams times:      Stream, then its cAttributes Attribute records
+//   cDestinations times: Destination
+// Attribute keys are MF attribute GUIDs in memory layout. Strings are
+// UTF-16, without terminator.
+
+const unsigned long CONFIG_MAGIC = 'PPCF';
+const unsigned short CONFIG_VERSION = 1;
+const unsigned long CONFIG_MAX_ATTRIBUTES = 256;    // Per stream.
+
+// As the MF attribute setters.
+enum PpboxConfigType
+{
+    ConfigType_UInt32 = 1,
+    ConfigType_UInt64,
+    ConfigType_Double,
+    ConfigType_Guid,
+    ConfigType_String,
+    ConfigType_Blob,
+};
+
+struct PpboxConfigAttribute
+{
+    unsigned char const *   pKey;       // 16 bytes.
+    PpboxConfigType         type;
+    unsigned char const *   pValue;     // Not aligned beyond 8 bytes.
+    unsigned long           cbValue;
+};
+
+// PpboxConfigWriter: Builds a blob, streams and destinations in order.
+class PpboxConfigWriter
+{
+public:
+    PpboxConfigWriter();
+
+public:
+    // Attributes go to the stream begun last.
+    void    BeginStream();
+    void    AddAttribute(unsigned char const * pKey, PpboxConfigType type, void const * pValue, unsigned long cbValue);
+    void    AddDestination(unsigned short const * pszDest, unsigned long cchDest);
+
+    // False if the configuration cannot be described (no streams or no
+    // destinations, too many of them or of attributes, or an attribute
+    // before any stream).
+    bool    Finish(std::vector<unsigned char> & blob);
+
+private:
+    void    Append(void const * pData, unsigned long cbData);
+
+private:
+    std::vector<unsigned char>  m_Records;
+    unsigned long               m_cStreams;
+    unsigned long               m_cDestinations;
+    size_t                      m_oStream;          // Of the current Stream record.
+    bool                        m_fFailed;
+};
+
+// PpboxConfigReader: Checks a whole blob once in Open, nothing is read
+// out of bounds afterwards. A blob without streams or destinations is
+// rejected. The blob must stay valid while it is read.
+class PpboxConfigReader
+{
+public:
+    PpboxConfigReader();
+
+public:
+    bool    Open(unsigned char const * pBlob, unsigned long cbBlob);
+
+    unsigned long   GetStreamCount() const { return (unsigned long)m_Streams.size(); }
+    unsigned long   GetAttributeCount(unsigned long iStream) const;
+    void    GetAttribute(unsigned long iStream, unsigned long iAttribute, PpboxConfigAttribute & attribute) const;
+
+    unsigned long   GetDestinationCount() const { return (unsigned long)m_Destinations.size(); }
+    void    GetDestination(unsigned long iDest, unsigned short const ** ppszDest, unsigned long * pcchDest) const;
+
+private:
+    bool    Parse(unsigned char const * pBlob, unsigned long cbBlob);
+
+private:
+    unsigned char const *       m_pBlob;
+    std::vector<unsigned long>  m_Streams;          // Index of the stream's first attribute.
+    std::vector<unsigned long>  m_Attributes;       // Offsets of all Attribute records.
+    std::vector<unsigned long>  m_Destinations;     // Offsets of the Destination records.
+};
+
+// FNV-1a of a blob, the key of compiled configurations in caches.
+unsigned long long GetConfigHash(unsigned char const * pBlob, unsigned long cbBlob);
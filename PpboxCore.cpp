@@ -0,0 +1,893 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxCore.cpp
+// Platform neutral part of the sink: sample marshalling to the capture
+// backend, media type mapping and the stream state matrix.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, so that it compiles anywhere.
+
+#include "PpboxCore.h"
+#include "PpboxSlabPool.h"
+#include "PpboxAac.h"
+
+#include <new>
+
+/* Stream state matrix */
+
+static bool const ValidStateMatrix[State_Count][Op_Count] =
+{
+// States:    Operations:
+//            SetType   Start     Restart   Pause     Stop      Sample    Marker
+/* NotSet */  true,     false,    false,    false,    false,    false,    false,
+
+/* Ready */   true,     true,     false,    true,     true,     false,    true,
+
+/* Start */   true,     true,     false,    true,     true,     true,     true,
+
+/* Pause */   false,    true,     true,     true,     true,     true,     true,
+
+/* Stop */    false,    true,     false,    false,    true,     false,    true,
+
+};
+
+bool IsValidOperation(PpboxCoreState state, PpboxCoreOperation op)
+{
+    return ValidStateMatrix[state][op];
+}
+
+/* In-flight accounting */
+
+PpboxCoreSink::PpboxCoreSink() :
+    m_cRef(1),
+    m_cInFlight(0),
+    m_cbHeld(0),
+    m_lWeight(1),
+    m_uSegmentBase(0),
+    m_fSegmentBase(false),
+    m_fSegmentFromSample(false)
+{
+    PpboxMemoryGovernor::Instance().AddWeight(m_lWeight);
+}
+
+PpboxCoreSink::~PpboxCoreSink()
+{
+    PpboxMemoryGovernor::Instance().AddWeight(-m_lWeight);
+}
+
+void PpboxCoreSink::SetWeight(long lWeight)
+{
+    if (lWeight < 1)
+    {
+        lWeight = 1;
+    }
+    PpboxMemoryGovernor::Instance().AddWeight(lWeight - m_lWeight);
+    m_lWeight = lWeight;
+}
+
+void PpboxCoreSink::BeginSegment(unsigned long long uBase, bool fFromSample)
+{
+    m_uSegmentBase = uBase;
+    m_fSegmentBase = !fFromSample;
+    m_fSegmentFromSample = fFromSample;
+}
+
+/* Statistics */
+
+void PpboxCoreStream::GetStats(PpboxStreamStats & stats)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.dwIdentifier = m_dwIdentifier;
+    stats.cSamples = (unsigned long)m_cSamples;
+    stats.cbSamples = (unsigned long long)PpboxInterlockedRead64(&m_cbSamples);
+    stats.cInFlight = (unsigned long)m_cInFlight;
+    stats.cbInFlight = (unsigned long long)PpboxInterlockedRead64(&m_cbInFlight);
+    stats.cDropped = (unsigned long)m_cDropped;
+    stats.cRequests = m_cRequests > 0 ? (unsigned long)m_cRequests : 0;
+    stats.cStateChanges = (unsigned long)m_cStateChanges;
+    stats.cFormatChanges = (unsigned long)m_cFormatChanges;
+    stats.cbFreed = (unsigned long long)PpboxInterlockedRead64(&m_cbFreed);
+}
+
+/* Media types */
+
+static unsigned char * CopyBlob(unsigned char const * pData, unsigned long cbData)
+{
+    unsigned char * buf = new (std::nothrow) unsigned char[cbData];
+    if (buf)
+    {
+        memcpy(buf, pData, cbData);
+    }
+    return buf;
+}
+
+// Codec config blob of the stream, on top of MF_MT_USER_DATA.
+typedef bool (*PpboxCodecConfigFn)(JUST_StreamInfo& info, PpboxCoreMediaType const & type);
+
+static bool SequenceHeaderConfig(JUST_StreamInfo& info, PpboxCoreMediaType const & type)
+{
+    // Parameter sets in Annex B form, instead of the user data.
+    if (type.cbSequenceHeader)
+    {
+        if (type.cbSequenceHeader > MAX_FORMAT_BLOB)
+        {
+            return false;
+        }
+        delete [] info.format_buffer;
+        info.format_buffer = CopyBlob(type.sequenceHeader, type.cbSequenceHeader);
+        info.format_size = info.format_buffer ? type.cbSequenceHeader : 0;
+        return info.format_buffer != NULL;
+    }
+    return true;
+}
+
+static bool AacConfig(JUST_StreamInfo& info, PpboxCoreMediaType const & type)
+{
+    // The backend takes raw AAC with its AudioSpecificConfig, whatever
+    // the framing upstream (ADTS headers are stripped from the samples).
+    unsigned char config[AAC_MAX_CONFIG];
+    unsigned long cbConfig = 0;
+    if (!CreateAudioSpecificConfig(type, config, &cbConfig))
+    {
+        return false;
+    }
+
+    delete [] info.format_buffer;
+    info.format_buffer = CopyBlob(config, cbConfig);
+    info.format_size = info.format_buffer ? cbConfig : 0;
+    return info.format_buffer != NULL;
+}
+
+struct PpboxCodecEntry
+{
+    PpboxCoreCodec      codec;
+    bool                fVideo;
+    PP_uint             sub_type;       // JUST_VideoSubType or JUST_AudioSubType, 0 = not in this SDK.
+    PP_uint             format_type;
+    PpboxCodecConfigFn  pfnConfig;      // NULL = user data as is.
+};
+
+// In PpboxCoreCodec order, looked up by index.
+static PpboxCodecEntry const s_Codecs[] = 
+{
+    { PpboxCodec_H264, true,  JUST_VideoSubType::AVC1, JUST_FormatType::video_avc_byte_stream,  SequenceHeaderConfig },
+    { PpboxCodec_WMV3, true,  JUST_VideoSubType::WMV3, JUST_FormatType::none,                   NULL },
+    { PpboxCodec_AAC,  false, JUST_AudioSubType::MP4A, JUST_FormatType::audio_raw,              AacConfig },
+    { PpboxCodec_MP3,  false, JUST_AudioSubType::MP3,  JUST_FormatType::audio_raw,              NULL },
+    { PpboxCodec_WMA2, false, JUST_AudioSubType::WMA2, JUST_FormatType::none,                   NULL },
+#ifdef PPBOX_JUST_HEVC
+    { PpboxCodec_HEVC, true,  JUST_VideoSubType::HVC1, JUST_FormatType::video_hevc_byte_stream, SequenceHeaderConfig },
+#else
+    { PpboxCodec_HEVC, true,  0,                       JUST_FormatType::none,                   NULL },
+#endif
+#ifdef PPBOX_JUST_VP9
+    { PpboxCodec_VP9,  true,  JUST_VideoSubType::VP09, JUST_FormatType::none,                   NULL },
+#else
+    { PpboxCodec_VP9,  true,  0,                       JUST_FormatType::none,                   NULL },
+#endif
+#ifdef PPBOX_JUST_OPUS
+    { PpboxCodec_Opus, false, JUST_AudioSubType::OPUS, JUST_FormatType::audio_raw,              NULL },     // OpusHead
+#else
+    { PpboxCodec_Opus, false, 0,                       JUST_FormatType::none,                   NULL },
+#endif
+};
+
+static_assert(sizeof(s_Codecs) / sizeof(s_Codecs[0]) == PpboxCodec_Count - 1, "s_Codecs out of step with PpboxCoreCodec");
+
+static bool SetCodec(JUST_StreamInfo& info, PpboxCoreMediaType const & type, bool fVideo)
+{
+    if (type.codec <= PpboxCodec_Unknown || type.codec >= PpboxCodec_Count)
+    {
+        return false;
+    }
+
+    PpboxCodecEntry const & entry = s_Codecs[type.codec - 1];
+    assert(entry.codec == type.codec);
+    if (entry.fVideo != fVideo || entry.sub_type == 0)
+    {
+        return false;
+    }
+
+    info.sub_type = entry.sub_type;
+    info.format_type = entry.format_type;
+    return entry.pfnConfig == NULL || entry.pfnConfig(info, type);
+}
+
+static bool CreateVideoStreamInfo(JUST_StreamInfo& info, PpboxCoreMediaType const & type)
+{
+    if (!SetCodec(info, type, true))
+    {
+        return false;
+    }
+
+    info.format.video.width = type.width;
+    info.format.video.height = type.height;
+    info.format.video.frame_rate_num = type.frame_rate_num;
+    info.format.video.frame_rate_den = type.frame_rate_den;
+
+    return true;
+}
+
+static bool CreateAudioStreamInfo(JUST_StreamInfo& info, PpboxCoreMediaType const & type)
+{
+    if (!SetCodec(info, type, false))
+    {
+        return false;
+    }
+
+    info.format.audio.sample_size = type.bits_per_sample;
+    info.format.audio.channel_count = type.channel_count;
+    info.format.audio.sample_rate = type.sample_rate;
+
+    return true;
+}
+
+bool CreateStreamInfo(JUST_StreamInfo& info, PpboxCoreMediaType const & type)
+{
+    memset(&info, 0, sizeof(info));
+
+    if (type.fVideo) {
+        info.type = JUST_StreamType::VIDE;
+    } else if (type.fAudio) {
+        info.type = JUST_StreamType::AUDI;
+    } else {
+        return false;
+    }
+    info.time_scale = 10 * 1000 * 1000;
+
+    if (type.cbUserData)
+    {
+        // foramt data
+        if (type.cbUserData > MAX_FORMAT_BLOB)
+        {
+            return false;
+        }
+        info.format_buffer = CopyBlob(type.userData, type.cbUserData);
+        if (info.format_buffer == NULL)
+        {
+            return false;
+        }
+        info.format_size = type.cbUserData;
+    }
+
+    if (type.fVideo)
+        return CreateVideoStreamInfo(info, type);
+    else
+        return CreateAudioStreamInfo(info, type);
+}
+
+PpboxStreamFormat * CreateStreamFormat(PpboxCoreMediaType const & type)
+{
+    PpboxStreamFormat * pFormat = new (std::nothrow) PpboxStreamFormat;
+    if (pFormat == NULL)
+    {
+        return NULL;
+    }
+
+    pFormat->cRef = 1;
+    if (!CreateStreamInfo(pFormat->info, type))
+    {
+        delete [] pFormat->info.format_buffer;
+        delete pFormat;
+        return NULL;
+    }
+
+    return pFormat;
+}
+
+//-------------------------------------------------------------------
+// GetPreferredCodecs:
+// Every codec the backend takes as is, in order of preference.
+//-------------------------------------------------------------------
+
+struct PpboxCodecCapability
+{
+    PpboxCoreCodec      codec;
+    bool                fVideo;
+    unsigned long       uProfile;       // 0 = not set.
+    bool                fUserData;      // Needs MF_MT_USER_DATA.
+};
+
+static PpboxCodecCapability const s_Capabilities[] = 
+{
+    { PpboxCodec_H264, true,  100, false },         // High
+    { PpboxCodec_H264, true,  77, false },          // Main
+    { PpboxCodec_H264, true,  66, false },          // Baseline
+    { PpboxCodec_WMV3, true,  0, true },
+#ifdef PPBOX_JUST_HEVC
+    { PpboxCodec_HEVC, true,  0, false },
+#endif
+#ifdef PPBOX_JUST_VP9
+    { PpboxCodec_VP9,  true,  0, false },
+#endif
+    { PpboxCodec_AAC,  false, 0x29, false },        // AAC, level 2
+    { PpboxCodec_AAC,  false, 0x2C, false },        // HE-AAC, level 2
+    { PpboxCodec_MP3,  false, 0, false },
+    { PpboxCodec_WMA2, false, 0, true },
+#ifdef PPBOX_JUST_OPUS
+    { PpboxCodec_Opus, false, 0, false },
+#endif
+};
+
+unsigned long GetPreferredCodecs(bool fVideo, PpboxCoreCodec codec, unsigned long uProfile, 
+    PpboxPreferredCodec * pCodecs, unsigned long cMax)
+{
+    unsigned long cCodecs = 0;
+    if (cMax == 0)
+    {
+        return 0;
+    }
+
+    pCodecs[cCodecs].codec = codec;
+    pCodecs[cCodecs].uProfile = uProfile;
+    ++cCodecs;
+
+    for (size_t i = 0; i < sizeof(s_Capabilities) / sizeof(s_Capabilities[0]) && cCodecs < cMax; ++i)
+    {
+        PpboxCodecCapability const & cap = s_Capabilities[i];
+        if (cap.fVideo != fVideo)
+        {
+            continue;
+        }
+        // The configured codec is first already.
+        if (cap.codec == codec && (cap.uProfile == 0 || cap.uProfile == uProfile))
+        {
+            continue;
+        }
+        // The user data of another codec is no use, and there is none
+        // to make up.
+        if (cap.fUserData)
+        {
+            continue;
+        }
+        pCodecs[cCodecs].codec = cap.codec;
+        pCodecs[cCodecs].uProfile = cap.uProfile;
+        ++cCodecs;
+    }
+
+    return cCodecs;
+}
+
+void PpboxCoreStream::SetFormat(PpboxStreamFormat * pFormat, bool fDeferred)
+{
+    PpboxStreamFormat ** ppSlot = fDeferred ? &m_pPendingFormat : &m_pFormat;
+
+    if (*ppSlot)
+    {
+        (*ppSlot)->Release();
+    }
+    *ppSlot = pFormat;
+
+    // A format applied now supersedes any that waits.
+    if (!fDeferred && m_pPendingFormat)
+    {
+        m_pPendingFormat->Release();
+        m_pPendingFormat = NULL;
+    }
+}
+
+/* Samples */
+
+// Over all sinks; samples are created and released on many threads.
+static long SampleCount = 0;
+static long LockSampleCount = 0;
+
+//-------------------------------------------------------------------
+// CopySampleBuffers:
+// Gathers the payload of a host sample into pDest.
+//-------------------------------------------------------------------
+
+bool CopySampleBuffers(PpboxSampleOps const * pOps, void * pSample, unsigned char * pDest, unsigned long cbDest, unsigned long * pcbCopied)
+{
+    unsigned long dwBufferCount = pOps->GetBufferCount(pSample);
+    unsigned long cbCopied = 0;
+
+    for (unsigned long i = 0; i < dwBufferCount; ++i)
+    {
+        unsigned char * pData = NULL;
+        unsigned long dwSize = 0;
+        if (!pOps->LockBuffer(pSample, i, &pData, &dwSize))
+        {
+            return false;
+        }
+        bool fFits = cbCopied + dwSize <= cbDest;
+        if (fFits)
+        {
+            memcpy(pDest + cbCopied, pData, dwSize);
+            cbCopied += dwSize;
+        }
+        pOps->UnlockBuffer(pSample, i);
+        if (!fFits)
+        {
+            return false;
+        }
+    }
+
+    *pcbCopied = cbCopied;
+    return true;
+}
+
+//-------------------------------------------------------------------
+// CopyOutSample:
+// Flattens the payload of a host sample into a slab block, so that the
+// host buffers can be given back to the encoder right away.
+//-------------------------------------------------------------------
+
+static bool CopyOutSample(PpboxSampleOps const * pOps, void * pSample, unsigned long cbTotal, PpboxSampleContext *pContext)
+{
+    unsigned long cbCopied = 0;
+
+    unsigned char * pCopy = (unsigned char *)PpboxSlabPool::Instance().Alloc(cbTotal);
+    if (pCopy == NULL)
+    {
+        return false;
+    }
+
+    if (!CopySampleBuffers(pOps, pSample, pCopy, cbTotal, &cbCopied))
+    {
+        PpboxSlabPool::Instance().Free(pCopy);
+        return false;
+    }
+
+    pContext->pCopy = pCopy;
+    pContext->cbCopy = cbCopied;
+    return true;
+}
+
+//-------------------------------------------------------------------
+// AdvanceFormat:
+// Switches the stream to its pending format at a sync sample, and
+// returns the format the sample is in.
+//-------------------------------------------------------------------
+
+PpboxStreamFormat * AdvanceFormat(JUST_Sample& sample, PpboxCoreStream * pStream)
+{
+    if (pStream->m_pPendingFormat && (sample.flags & JUST_SampleFlag::sync))
+    {
+        if (pStream->m_pFormat)
+        {
+            pStream->m_pFormat->Release();
+        }
+        pStream->m_pFormat = pStream->m_pPendingFormat;
+        pStream->m_pPendingFormat = NULL;
+        sample.flags |= SampleFlag_FormatChange;
+    }
+
+    return pStream->m_pFormat;
+}
+
+// Gives the sample a reference to its format.
+static void AttachFormat(PpboxSampleContext * pContext, PpboxStreamFormat * pFormat)
+{
+    pContext->pFormat = pFormat;
+    if (pContext->pFormat)
+    {
+        pContext->pFormat->AddRef();
+    }
+}
+
+//-------------------------------------------------------------------
+// RebaseSample:
+// After a warm restart, marks the first sample of each stream as the
+// start of a segment, with its format, and makes times count from the
+// segment start. Streams share the base, so they stay in step; only one
+// that starts before a base taken from another stream's first sample
+// gets its own. Times before the base are clamped.
+//-------------------------------------------------------------------
+
+static void RebaseSample(JUST_Sample& sample, PpboxSampleContext * pContext, PpboxCoreStream * pStream)
+{
+    PpboxCoreSink * pSink = pStream->m_pSink;
+
+    if (pStream->m_fSegmentStart)
+    {
+        pStream->m_fSegmentStart = false;
+        sample.flags |= JUST_SampleFlag::discontinuity;
+        if (pContext->pFormat)
+        {
+            sample.flags |= SampleFlag_FormatChange;
+        }
+        if (!pSink->m_fSegmentBase)
+        {
+            pSink->m_uSegmentBase = sample.decode_time;
+            pSink->m_fSegmentBase = true;
+        }
+        pStream->m_uSegmentBase = pSink->m_uSegmentBase;
+        if (pSink->m_fSegmentFromSample && sample.decode_time < pStream->m_uSegmentBase)
+        {
+            pStream->m_uSegmentBase = sample.decode_time;
+        }
+        pStream->m_fSegmentBase = true;
+    }
+
+    if (pSink->m_fSegmentBase)
+    {
+        unsigned long long uBase = pStream->m_fSegmentBase ? pStream->m_uSegmentBase : pSink->m_uSegmentBase;
+        sample.decode_time = sample.decode_time > uBase ? sample.decode_time - uBase : 0;
+        sample.time = sample.time > uBase ? sample.time - uBase : 0;
+    }
+}
+
+//-------------------------------------------------------------------
+// StripSample:
+// ADTS streams: drops the frame headers, the backend never parses
+// frames. The raw data is moved to the front of the buffer it is in:
+// the slab block of a copied-out sample, the host's locked buffer of a
+// zero-copy one, which the sink owns until it releases the sample.
+// Samples in several host buffers are left as they are, encoders
+// deliver AAC in one. The accounting stays with the size the sample
+// came with.
+//-------------------------------------------------------------------
+
+static void StripSample(JUST_Sample& sample, PpboxSampleContext * pContext, PpboxCoreStream * pStream)
+{
+    if (!pStream->m_fStripAdts || sample.buffer == NULL)
+    {
+        return;
+    }
+
+    unsigned char * pData = (unsigned char *)sample.buffer;
+    unsigned long cbRaw = 0;
+    if (StripAdtsHeaders(pData, sample.size, pData, &cbRaw))
+    {
+        if (pContext->pCopy)
+        {
+            pContext->cbCopy = cbRaw;
+        }
+        else
+        {
+            pContext->cbStripped = cbRaw;
+        }
+        sample.size = cbRaw;
+    }
+}
+
+//-------------------------------------------------------------------
+// LockSample:
+// Zero-copy: locks the host buffers once, however many destinations
+// ask for them later.
+//-------------------------------------------------------------------
+
+static bool LockSample(JUST_Sample& sample, PpboxSampleOps const * pOps, void * pSample)
+{
+    unsigned long dwBufferCount = pOps->GetBufferCount(pSample);
+
+    if (dwBufferCount == 1) {
+        unsigned char * pData = NULL;
+        unsigned long dwSize = 0;
+        if (!pOps->LockBuffer(pSample, 0, &pData, &dwSize))
+        {
+            return false;
+        }
+        assert(dwSize == sample.size);
+        sample.buffer = pData;
+    } else {
+        for (unsigned long i = 0; i < dwBufferCount; ++i)
+        {
+            unsigned char * pData = NULL;
+            unsigned long dwSize = 0;
+            if (!pOps->LockBuffer(pSample, i, &pData, &dwSize))
+            {
+                while (i--)
+                {
+                    pOps->UnlockBuffer(pSample, i);
+                }
+                return false;
+            }
+        }
+        sample.size = dwBufferCount;
+        sample.buffer = NULL;
+    }
+
+    return true;
+}
+
+bool CreateSample(JUST_Sample& sample, PpboxSampleOps const * pOps, void * pSample, PpboxCoreStream * pStream, bool fCopyOut)
+{
+    memset(&sample, 0, sizeof(sample));
+
+    if (!pOps->GetInfo(pSample, sample))
+    {
+        return false;
+    }
+
+    PpboxSampleContext * pContext = new (std::nothrow) PpboxSampleContext;
+    if (pContext == NULL)
+    {
+        return false;
+    }
+    memset(pContext, 0, sizeof(*pContext));
+    pContext->cbData = sample.size;
+
+    bool fOk = false;
+
+    if (fCopyOut)
+    {
+        // copy out, host sample is not kept
+        fOk = CopyOutSample(pOps, pSample, sample.size, pContext);
+        if (fOk)
+        {
+            sample.size = pContext->cbCopy;
+            sample.buffer = (unsigned char const *)pContext->pCopy;
+        }
+    }
+    else
+    {
+        fOk = LockSample(sample, pOps, pSample);
+        if (fOk)
+        {
+            pContext->pOps = pOps;
+            pContext->pSample = pSample;
+            pOps->AddRef(pSample);
+            PpboxInterlockedIncrement(&LockSampleCount);
+        }
+    }
+
+    if (!fOk)
+    {
+        delete pContext;
+        return false;
+    }
+
+    pContext->cRef = 1;
+    pContext->pStream = pStream;
+    pContext->uEnterTime = PpboxGetMicroseconds();
+    pStream->AddRef();
+    sample.itrack = pStream->m_dwIdentifier;
+    sample.context = pContext;
+    PpboxInterlockedIncrement(&SampleCount);
+
+    AttachFormat(pContext, AdvanceFormat(sample, pStream));
+    RebaseSample(sample, pContext, pStream);
+    StripSample(sample, pContext, pStream);
+
+    return true;
+}
+
+//-------------------------------------------------------------------
+// CreateSampleFromBuffer:
+// Makes a copy-out sample from a payload that is not backed by a host
+// sample, such as a sample replayed from the spill ring. The metadata
+// in sample is kept, pFormat is the format it was recorded in; the
+// stream may be in another one by now.
+//-------------------------------------------------------------------
+
+bool CreateSampleFromBuffer(JUST_Sample& sample, unsigned char const * pData, unsigned long cbData, PpboxCoreStream * pStream, PpboxStreamFormat * pFormat)
+{
+    PpboxSampleContext * pContext = new (std::nothrow) PpboxSampleContext;
+    if (pContext == NULL)
+    {
+        return false;
+    }
+    memset(pContext, 0, sizeof(*pContext));
+
+    pContext->pCopy = PpboxSlabPool::Instance().Alloc(cbData);
+    if (pContext->pCopy == NULL)
+    {
+        delete pContext;
+        return false;
+    }
+
+    memcpy(pContext->pCopy, pData, cbData);
+    pContext->cbCopy = cbData;
+    pContext->cbData = cbData;
+    pContext->cRef = 1;
+    pContext->pStream = pStream;
+    pContext->uEnterTime = PpboxGetMicroseconds();
+    pStream->AddRef();
+    sample.size = cbData;
+    sample.buffer = (unsigned char const *)pContext->pCopy;
+    sample.context = pContext;
+    PpboxInterlockedIncrement(&SampleCount);
+
+    AttachFormat(pContext, pFormat);
+    RebaseSample(sample, pContext, pStream);
+    StripSample(sample, pContext, pStream);
+
+    return true;
+}
+
+bool GetSampleBuffers(void const *context, JUST_ConstBuffer * buffers)
+{
+    PpboxSampleContext  *pContext = ((PpboxSampleRef *)context)->pContext;
+    void                *pSample = pContext->pSample;
+
+    // With several destinations, only the first fetch counts.
+    if (PpboxInterlockedCompareExchange(&pContext->fFetched, 1, 0) == 0)
+    {
+        pContext->uFetchTime = PpboxGetMicroseconds();
+    }
+
+    // Copied out.
+    if (pContext->pCopy)
+    {
+        buffers[0].data = (unsigned char const *)pContext->pCopy;
+        buffers[0].len = pContext->cbCopy;
+        return true;
+    }
+
+    PpboxSampleOps const * pOps = pContext->pOps;
+    unsigned long dwBufferCount = pOps->GetBufferCount(pSample);
+    unsigned long dwTotalSize = 0;
+
+    // The buffers are locked by CreateSample already, the nested lock
+    // just gives us the pointers.
+    for (unsigned long i = 0; i < dwBufferCount; ++i)
+    {
+        unsigned char * pData = NULL;
+        unsigned long dwSize = 0;
+        if (!pOps->LockBuffer(pSample, i, &pData, &dwSize))
+        {
+            return false;
+        }
+        pOps->UnlockBuffer(pSample, i);
+        buffers[i].data = pData;
+        buffers[i].len = dwSize;
+        dwTotalSize += dwSize;
+    }
+
+    // Stripped in place, the raw data is at the front.
+    if (pContext->cbStripped)
+    {
+        buffers[0].len = pContext->cbStripped;
+        return true;
+    }
+
+    assert(dwTotalSize == pContext->cbData);
+    return true;
+}
+
+static unsigned long long Elapsed(unsigned long long uFrom, unsigned long long uTo)
+{
+    return uTo > uFrom ? uTo - uFrom : 0;
+}
+
+static void RecordLatency(PpboxSampleContext *pContext)
+{
+    PpboxLatencyHistogram * pLatency = pContext->pStream->m_Latency;
+    unsigned long long uNow = PpboxGetMicroseconds();
+
+    pLatency[Latency_Put].Add(Elapsed(pContext->uEnterTime, pContext->uPutTime));
+    pLatency[Latency_Total].Add(Elapsed(pContext->uEnterTime, uNow));
+
+    // A sample freed without a fetch never got to the backend's output.
+    if (pContext->fFetched)
+    {
+        pLatency[Latency_Fetch].Add(Elapsed(pContext->uPutTime, pContext->uFetchTime));
+        pLatency[Latency_Write].Add(Elapsed(pContext->uFetchTime, uNow));
+    }
+}
+
+//-------------------------------------------------------------------
+// ReleaseSample:
+// Gives the host sample back (or the slab block), called when the
+// last destination freed the sample.
+//-------------------------------------------------------------------
+
+void ReleaseSample(PpboxSampleContext *pContext)
+{
+    void * pSample = pContext->pSample;
+
+    if (pSample)
+    {
+        PpboxSampleOps const * pOps = pContext->pOps;
+        unsigned long dwBufferCount = pOps->GetBufferCount(pSample);
+
+        for (unsigned long i = 0; i < dwBufferCount; ++i)
+        {
+            pOps->UnlockBuffer(pSample, i);
+        }
+
+        pOps->Release(pSample);
+
+        PpboxInterlockedDecrement(&LockSampleCount);
+    }
+
+    // Copied out.
+    if (pContext->pCopy)
+    {
+        PpboxSlabPool::Instance().Free(pContext->pCopy);
+    }
+
+    if (pContext->pFormat)
+    {
+        pContext->pFormat->Release();
+    }
+
+    RecordLatency(pContext);
+    pContext->pStream->OnSampleFreed(pContext->cbData);
+    pContext->pStream->Release();
+    delete pContext;
+}
+
+void PutCaptureSample(PP_handle hCapture, JUST_Sample & sample)
+{
+    if (sample.flags & SampleFlag_FormatChange)
+    {
+        PpboxStreamFormat * pFormat = ((PpboxSampleRef *)sample.context)->pContext->pFormat;
+        if (pFormat)
+        {
+            JUST_CaptureSetStream(hCapture, sample.itrack, &pFormat->info);
+        }
+    }
+
+    JUST_CapturePutSample(hCapture, &sample);
+}
+
+PpboxCaptureDest * CreateCaptureDest(PP_handle hCapture, unsigned long long uLayout)
+{
+    PpboxCaptureDest * pDest = new (std::nothrow) PpboxCaptureDest();
+    if (pDest)
+    {
+        pDest->cRef = 1;
+        pDest->hCapture = hCapture;
+        pDest->uLayout = uLayout;
+    }
+    return pDest;
+}
+
+static void DestroyCaptureDest(void * pContext)
+{
+    PpboxCaptureDest * pDest = (PpboxCaptureDest *)pContext;
+
+    if (pDest->pQueue)
+    {
+        pDest->pQueue->Release();
+    }
+
+    // Neither the sink nor the backend has anything of the handle left.
+    if (pDest->pPool)
+    {
+        pDest->pPool->Release(pDest->dest.c_str(), pDest->uLayout, pDest->hCapture);
+    }
+
+    delete pDest;
+}
+
+void PpboxCaptureDest::Release()
+{
+    if (PpboxInterlockedDecrement(&cRef) == 0)
+    {
+        // The last reference is mostly a sample's, freed by the backend in
+        // its own callback; the pool may destroy the handle, not there.
+        if (pPool == NULL || pExecutor == NULL || !pExecutor->Submit(DestroyCaptureDest, this))
+        {
+            DestroyCaptureDest(this);
+        }
+    }
+}
+
+static void ReleaseSampleTask(void * pContext)
+{
+    ReleaseSample((PpboxSampleContext *)pContext);
+}
+
+bool FreeSample(void const *context)
+{
+    PpboxSampleRef      *pRef = (PpboxSampleRef *)context;
+    PpboxSampleContext  *pContext = pRef->pContext;
+
+    PpboxInterlockedDecrement(&pRef->pDest->cInFlight);
+    pRef->pDest->Release();
+
+    if (PpboxInterlockedDecrement(&pContext->cRef) == 0)
+    {
+        // Unlocking and releasing the host sample is left to the pool,
+        // the backend's thread goes back to writing.
+        if (pContext->pExecutor == NULL 
+            || !pContext->pExecutor->Submit(ReleaseSampleTask, pContext))
+        {
+            ReleaseSample(pContext);
+        }
+    }
+
+    return true;
+}
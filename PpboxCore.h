@@ -0,0 +1,474 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxCore.h
+// Platform neutral part of the sink: sample marshalling to the capture
+// backend, media type mapping and the stream state matrix.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Nothing in here depends on WRL or Media Foundation. The sink plugs in
+// IMFSample and IMFMediaType through PpboxSampleOps and PpboxCoreMediaType
+// (see PpboxMediaType.cpp); other hosts can plug in plain memory.
+
+#ifdef _WIN32
+#include <windows.h>
+#define PpboxInterlockedIncrement(p)    InterlockedIncrement(p)
+#define PpboxInterlockedDecrement(p)    InterlockedDecrement(p)
+#define PpboxInterlockedCompareExchange(p, v, c)    InterlockedCompareExchange(p, v, c)
+#define PpboxInterlockedAdd(p, v)       InterlockedExchangeAdd(p, v)
+#define PpboxInterlockedAdd64(p, v)     InterlockedExchangeAdd64(p, v)
+#define PpboxInterlockedExchange64(p, v)    InterlockedExchange64(p, v)
+#define PpboxInterlockedRead64(p)       InterlockedCompareExchange64(p, 0, 0)
+#else
+#define PpboxInterlockedIncrement(p)    __sync_add_and_fetch(p, 1)
+#define PpboxInterlockedDecrement(p)    __sync_sub_and_fetch(p, 1)
+#define PpboxInterlockedCompareExchange(p, v, c)    __sync_val_compare_and_swap(p, c, v)
+#define PpboxInterlockedAdd(p, v)       __sync_fetch_and_add(p, v)
+#define PpboxInterlockedAdd64(p, v)     __sync_fetch_and_add(p, v)
+#define PpboxInterlockedExchange64(p, v)    __sync_lock_test_and_set(p, v)
+#define PpboxInterlockedRead64(p)       __sync_fetch_and_add(p, 0)
+#endif
+
+#include <string.h>
+#include <assert.h>
+
+#include <just/just/IPpboxBoostTypes.h>
+#include <just/just/IPpboxRuntime.h>
+
+const unsigned long MAX_STREAMS = 32;
+const unsigned long MAX_DESTINATIONS = 8;
+
+// Streams are tracked in 32-bit masks. Tracks come from the host and
+// the backend, one outside the table has no bit.
+static_assert(MAX_STREAMS <= 32, "stream masks are 32 bits");
+inline unsigned long StreamBit(unsigned long dwStream)
+{
+    return dwStream < MAX_STREAMS ? 1UL << dwStream : 0;
+}
+
+#include "PpboxLatency.h"
+#include "PpboxGovernor.h"
+#include "PpboxPriority.h"
+#include "PpboxNegotiation.h"
+#include "PpboxExecutor.h"
+#include "PpboxCapturePool.h"
+
+//-------------------------------------------------------------------
+// Stream state matrix
+//-------------------------------------------------------------------
+
+// PpboxCoreState: Defines the current state of a stream.
+enum PpboxCoreState
+{
+    State_TypeNotSet = 0,    // No media type is set
+    State_Ready,             // Media type is set, Start has never been called.
+    State_Started,
+    State_Stopped,
+    State_Paused,
+    State_Count              // Number of states
+};
+
+// PpboxCoreOperation: Defines various operations that can be performed on a stream.
+enum PpboxCoreOperation
+{
+    OpSetMediaType = 0,
+    OpStart,
+    OpRestart,
+    OpPause,
+    OpStop,
+    OpProcessSample,
+    OpPlaceMarker,
+
+    Op_Count                // Number of operations
+};
+
+bool IsValidOperation(PpboxCoreState state, PpboxCoreOperation op);
+
+//-------------------------------------------------------------------
+// Media types
+//-------------------------------------------------------------------
+
+// HEVC, VP9 and Opus need a JUST SDK that has their sub types; the
+// build defines PPBOX_JUST_HEVC, PPBOX_JUST_VP9 and PPBOX_JUST_OPUS for
+// one that does. Without them such a stream is refused.
+enum PpboxCoreCodec
+{
+    PpboxCodec_Unknown = 0,
+    PpboxCodec_H264,
+    PpboxCodec_WMV3,
+    PpboxCodec_AAC,
+    PpboxCodec_MP3,
+    PpboxCodec_WMA2,
+    PpboxCodec_HEVC,
+    PpboxCodec_VP9,
+    PpboxCodec_Opus,
+    PpboxCodec_Count
+};
+
+// A longer blob fails the conversion rather than being cut short.
+const unsigned long MAX_FORMAT_BLOB = 256;
+
+// PpboxCoreMediaType: What the backend needs to know about a stream.
+struct PpboxCoreMediaType
+{
+    bool            fVideo;
+    bool            fAudio;
+    PpboxCoreCodec  codec;
+
+    // video
+    unsigned long   width;
+    unsigned long   height;
+    unsigned long   frame_rate_num;
+    unsigned long   frame_rate_den;
+
+    // audio
+    unsigned long   bits_per_sample;
+    unsigned long   channel_count;
+    unsigned long   sample_rate;
+    unsigned long   aacPayloadType;         // MF_MT_AAC_PAYLOAD_TYPE, see PpboxAacPayload.
+
+    unsigned long   cbUserData;             // MF_MT_USER_DATA
+    unsigned char   userData[MAX_FORMAT_BLOB];
+    unsigned long   cbSequenceHeader;       // MF_MT_MPEG_SEQUENCE_HEADER: SPS/PPS, HEVC VPS/SPS/PPS
+    unsigned char   sequenceHeader[MAX_FORMAT_BLOB];
+};
+
+// Fills in info, the format buffer is allocated with new[].
+bool CreateStreamInfo(JUST_StreamInfo& info, PpboxCoreMediaType const & type);
+
+// Set on the first sample of a stream in a new format. The capture handle
+// is given the format (JUST_CaptureSetStream) right before that sample,
+// see PutCaptureSample.
+const PP_uint SampleFlag_FormatChange = 0x100;
+
+// PpboxStreamFormat: A stream format as given to the backend. Every
+// sample holds the format it was sent in, so the buffers the backend was
+// given stay valid until the last sample in that format is freed.
+struct PpboxStreamFormat
+{
+    long            cRef;
+    JUST_StreamInfo info;
+
+    void    AddRef() { PpboxInterlockedIncrement(&cRef); }
+    void    Release()
+    {
+        if (PpboxInterlockedDecrement(&cRef) == 0)
+        {
+            delete [] info.format_buffer;
+            delete this;
+        }
+    }
+};
+
+// NULL if the type cannot be described to the backend.
+PpboxStreamFormat * CreateStreamFormat(PpboxCoreMediaType const & type);
+
+const unsigned long MAX_PREFERRED_CODECS = 16;
+
+// PpboxPreferredCodec: A codec and profile a stream takes directly. The
+// profile is MF_MT_MPEG2_PROFILE for video and
+// MF_MT_AAC_AUDIO_PROFILE_LEVEL_INDICATION for audio, 0 = not set.
+struct PpboxPreferredCodec
+{
+    PpboxCoreCodec  codec;
+    unsigned long   uProfile;
+};
+
+// Fills pCodecs with what a stream configured with codec and uProfile
+// takes directly, best first: that codec itself, then the other entries
+// of the codec capability table of its kind (H.264 profiles, HEVC and
+// VP9; AAC profiles, MP3 and Opus). WMV3 and WMA do not decode without
+// their user data and come only as the configured codec. Returns the
+// count, at most cMax.
+unsigned long GetPreferredCodecs(bool fVideo, PpboxCoreCodec codec, unsigned long uProfile, 
+    PpboxPreferredCodec * pCodecs, unsigned long cMax);
+
+//-------------------------------------------------------------------
+// Statistics
+//-------------------------------------------------------------------
+
+struct PpboxStreamStats
+{
+    unsigned long       dwIdentifier;
+    unsigned long       cSamples;           // Put to the backend, spilled ones when they are replayed.
+    unsigned long long  cbSamples;
+    unsigned long       uSamplesPerSecond;  // Since the previous snapshot.
+    unsigned long long  uBytesPerSecond;
+    unsigned long       cInFlight;
+    unsigned long long  cbInFlight;
+    unsigned long long  cbSpilled;          // Payload waiting in the spill ring, not put yet.
+    unsigned long       cDropped;           // Skipped by a destination, once per destination.
+    unsigned long       cRequests;          // MEStreamSinkRequestSample not answered yet.
+    unsigned long       cStateChanges;
+    unsigned long       cFormatChanges;
+    unsigned long long  cbFreed;            // Given back by the backend.
+    unsigned long long  uDrainBytesPerSecond;   // Smoothed, see PpboxBitrateEstimator.
+    long long           llQueueGrowth;      // Bytes in flight, change per second.
+    unsigned long long  uThroughput;        // Bytes per second the backend is estimated to take.
+    unsigned long       uRecommendedBitrate;    // Bits per second, 0 = no estimate yet.
+};
+
+struct PpboxDestStats
+{
+    unsigned long       cInFlight;
+    unsigned long       cPut;
+    unsigned long       cSkipped;
+    bool                fSkipping;          // Waiting for a sync sample on some stream.
+};
+
+struct PpboxSinkStats
+{
+    unsigned long long  uTime;              // PpboxGetMicroseconds of the snapshot.
+    unsigned long       cInFlight;
+    unsigned long       cSpilled;
+    unsigned long       cStreams;
+    PpboxStreamStats    streams[MAX_STREAMS];
+    unsigned long       cDests;
+    PpboxDestStats      dests[MAX_DESTINATIONS];
+    unsigned long long  uCaptureReadyTime;  // Microseconds from activation, 0 = not yet.
+    unsigned long long  uFirstSampleTime;   // Same, to the first sample a destination took.
+    unsigned long long  uStartLatency;      // Microseconds from the last clock start to the first sample out after it, 0 = not yet.
+};
+
+// Called with each periodic snapshot, see PpboxMediaSink::SetStatsCallback.
+typedef void (*PpboxStatsCallback)(void * pContext, PpboxSinkStats const & stats);
+
+// Called when a stream's recommended bitrate (bits per second) changed
+// enough, see PpboxMediaSink::SetBitrateCallback.
+typedef void (*PpboxBitrateCallback)(void * pContext, unsigned long dwStream, unsigned long uBitrate);
+
+//-------------------------------------------------------------------
+// Samples
+//-------------------------------------------------------------------
+
+// PpboxSampleOps: How the core reaches into a host sample.
+struct PpboxSampleOps
+{
+    void            (*AddRef)(void * sample);
+    void            (*Release)(void * sample);
+    bool            (*GetInfo)(void * sample, JUST_Sample & info);     // flags, times and total size
+    unsigned long   (*GetBufferCount)(void * sample);
+    bool            (*LockBuffer)(void * sample, unsigned long index, unsigned char ** ppData, unsigned long * pcbData);
+    void            (*UnlockBuffer)(void * sample, unsigned long index);
+};
+
+// PpboxCoreSink / PpboxCoreStream:
+// In-flight accounting and counters. Samples keep their stream alive, and
+// the stream keeps its sink alive, so FreeSample may run after the host
+// objects are gone. Counters are only touched with interlocked operations,
+// GetStats reads them without a lock.
+class PpboxCoreSink
+{
+public:
+    PpboxCoreSink();
+    ~PpboxCoreSink();
+
+    void    AddRef() { PpboxInterlockedIncrement(&m_cRef); }
+    void    Release() { if (PpboxInterlockedDecrement(&m_cRef) == 0) delete this; }
+
+    // Share of the process-wide memory budget, see PpboxMemoryGovernor.
+    void    SetWeight(long lWeight);
+    bool    IsOverBudget() const { return PpboxMemoryGovernor::Instance().IsOverBudget(this); }
+
+    // Warm restart: sample times of the new segment count from uBase
+    // (100ns), or from the first sample of any stream if fFromSample; a
+    // stream whose first sample is earlier than that counts from its own
+    // first sample instead, rather than have its samples clamped to 0.
+    // The streams' m_fSegmentStart are set by the caller. Called with the
+    // sink lock held, as CreateSample.
+    void    BeginSegment(unsigned long long uBase, bool fFromSample);
+
+public:
+    long        m_cRef;
+    long        m_cInFlight;        // Samples of all streams held by the backend.
+    long long   m_cbHeld;           // Their payload bytes.
+    long        m_lWeight;
+    unsigned long long  m_uSegmentBase;
+    bool        m_fSegmentBase;     // m_uSegmentBase applies; never set before the first restart.
+    bool        m_fSegmentFromSample;
+};
+
+class PpboxCoreStream
+{
+public:
+    PpboxCoreStream(PpboxCoreSink * pSink, unsigned long dwIdentifier)
+        : m_cRef(1), m_cInFlight(0), m_cbInFlight(0), m_cSamples(0), m_cbSamples(0), m_cbFreed(0)
+        , m_cDropped(0), m_cRequests(0), m_cStateChanges(0), m_cFormatChanges(0)
+        , m_fVideo(false), m_fStripAdts(false), m_Priority(Priority_Audio)
+        , m_pFormat(NULL), m_pPendingFormat(NULL), m_fSegmentStart(false), m_fSegmentBase(false), m_uSegmentBase(0), m_dwIdentifier(dwIdentifier), m_pSink(pSink)
+    {
+        m_pSink->AddRef();
+    }
+
+    ~PpboxCoreStream()
+    {
+        if (m_pFormat)
+        {
+            m_pFormat->Release();
+        }
+        if (m_pPendingFormat)
+        {
+            m_pPendingFormat->Release();
+        }
+        m_pSink->Release();
+    }
+
+    void    AddRef() { PpboxInterlockedIncrement(&m_cRef); }
+    void    Release() { if (PpboxInterlockedDecrement(&m_cRef) == 0) delete this; }
+
+    void    OnSampleQueued(unsigned long cbData)
+    {
+        PpboxInterlockedIncrement(&m_cInFlight);
+        PpboxInterlockedIncrement(&m_pSink->m_cInFlight);
+        PpboxInterlockedAdd64(&m_cbInFlight, (long long)cbData);
+        PpboxInterlockedAdd64(&m_pSink->m_cbHeld, (long long)cbData);
+        PpboxMemoryGovernor::Instance().OnAcquire(cbData);
+        PpboxInterlockedIncrement(&m_cSamples);
+        PpboxInterlockedAdd64(&m_cbSamples, (long long)cbData);
+    }
+
+    void    OnSampleFreed(unsigned long cbData)
+    {
+        PpboxInterlockedDecrement(&m_cInFlight);
+        PpboxInterlockedDecrement(&m_pSink->m_cInFlight);
+        PpboxInterlockedAdd64(&m_cbInFlight, -(long long)cbData);
+        PpboxInterlockedAdd64(&m_pSink->m_cbHeld, -(long long)cbData);
+        PpboxMemoryGovernor::Instance().OnRelease(cbData);
+        PpboxInterlockedAdd64(&m_cbFreed, (long long)cbData);
+    }
+
+    // Fills in everything but the rates.
+    void    GetStats(PpboxStreamStats & stats);
+
+    // Takes over pFormat. Deferred, it applies from the next sync sample
+    // on, samples up to there keep the format they were encoded in.
+    // Called with the sink lock held, as CreateSample.
+    void    SetFormat(PpboxStreamFormat * pFormat, bool fDeferred);
+
+public:
+    long            m_cRef;
+    long            m_cInFlight;    // Samples of this stream held by the backend.
+    long long       m_cbInFlight;
+    long            m_cSamples;
+    long long       m_cbSamples;
+    long long       m_cbFreed;
+    long            m_cDropped;
+    long            m_cRequests;
+    long            m_cStateChanges;
+    long            m_cFormatChanges;
+    bool            m_fVideo;
+    bool            m_fStripAdts;   // AAC in ADTS frames, the backend gets raw AAC.
+    PpboxPriority   m_Priority;     // Class of the stream in held queues, see PpboxPriorityQueue.
+    PpboxStreamFormat * m_pFormat;          // Of the samples created now, or NULL.
+    PpboxStreamFormat * m_pPendingFormat;   // Waits for a sync sample, or NULL.
+    bool            m_fSegmentStart;    // The next sample opens a segment, see PpboxCoreSink::BeginSegment.
+    bool            m_fSegmentBase;     // m_uSegmentBase applies instead of the sink's.
+    unsigned long long  m_uSegmentBase;
+    PpboxLatencyHistogram   m_Latency[Latency_Count];   // Filled in by ReleaseSample.
+    unsigned long   m_dwIdentifier;
+    PpboxCoreSink * m_pSink;
+};
+
+// PpboxCaptureDest: One capture handle of the sink, with its delivery
+// state. The sink holds a reference until Shutdown, and so does every
+// sample put to the handle until the backend frees it, so FreeSample may
+// run after the sink is gone. The queue goes with the last reference,
+// and the handle back to its pool, if it came from one.
+struct PpboxCaptureDest
+{
+    long                cRef;
+    PP_handle           hCapture;
+    long                cInFlight;      // Samples held by this handle.
+    long                cPut;
+    long                cSkipped;
+    PpboxDeliveryQueue *pQueue;         // Asynchronous delivery, or NULL to put inline.
+    unsigned long       dwSkipStreams;  // Bit per stream that waits for a sync sample after an overrun.
+    unsigned long long  uLayout;        // Key of the handle in pPool.
+    PpboxCapturePool *  pPool;          // Takes the handle back, or NULL to leave it.
+    std::string         dest;           // Key of the handle in pPool.
+    PpboxExecutor *     pExecutor;      // Gives the handle back off the backend's thread, or NULL.
+
+    void    AddRef() { PpboxInterlockedIncrement(&cRef); }
+    void    Release();
+};
+
+// With one reference, NULL if out of memory.
+PpboxCaptureDest * CreateCaptureDest(PP_handle hCapture, unsigned long long uLayout);
+
+struct PpboxSampleContext;
+
+// PpboxSampleRef: What JUST_Sample::context points to, one per
+// destination the sample was put to. Holds a reference to pDest, which
+// FreeSample releases.
+struct PpboxSampleRef
+{
+    PpboxSampleContext *pContext;
+    PpboxCaptureDest *  pDest;
+};
+
+// PpboxSampleContext:
+// A sample is either zero-copy (the host sample stays referenced and its
+// buffers locked until FreeSample) or copied out into a slab block, in
+// which case the host sample is released before CreateSample returns.
+// Either way it is shared by all destinations, and released when the last
+// of them frees it.
+struct PpboxSampleContext
+{
+    long                    cRef;
+    PpboxSampleOps const *  pOps;
+    void *                  pSample;        // Zero-copy host sample, or NULL.
+    void *                  pCopy;          // Copy-out payload (PpboxSlabPool block), or NULL.
+    unsigned long           cbCopy;
+    unsigned long           cbStripped;     // Zero-copy payload stripped in the host's buffer (StripSample), or 0.
+    unsigned long           cbData;         // Payload size, whatever the layout.
+    PpboxCoreStream *       pStream;        // Owning stream, referenced for in-flight accounting.
+    PpboxStreamFormat *     pFormat;        // Referenced, or NULL.
+
+    // PpboxGetMicroseconds stamps, see PpboxLatencyStage.
+    unsigned long long      uEnterTime;     // Set by CreateSample, the host may set an earlier one.
+    unsigned long long      uPutTime;       // Set by the host before putting to the first destination.
+    unsigned long long      uFetchTime;     // First GetSampleBuffers, if any.
+    long                    fFetched;
+
+    PpboxExecutor *         pExecutor;      // Runs ReleaseSample after the last FreeSample, or NULL.
+    PpboxSampleRef          refs[MAX_DESTINATIONS];
+};
+
+bool CopySampleBuffers(PpboxSampleOps const * pOps, void * pSample, unsigned char * pDest, unsigned long cbDest, unsigned long * pcbCopied);
+
+bool CreateSample(JUST_Sample& sample, PpboxSampleOps const * pOps, void * pSample, PpboxCoreStream * pStream, bool fCopyOut);
+bool CreateSampleFromBuffer(JUST_Sample& sample, unsigned char const * pData, unsigned long cbData, PpboxCoreStream * pStream, PpboxStreamFormat * pFormat);
+
+// The format a sample is in, as CreateSample would attach it: at a sync
+// sample the stream switches to its pending format, and the sample is
+// flagged SampleFlag_FormatChange. For samples put aside before they are
+// created, such as spilled ones. Not referenced.
+PpboxStreamFormat * AdvanceFormat(JUST_Sample& sample, PpboxCoreStream * pStream);
+
+void ReleaseSample(PpboxSampleContext *pContext);
+
+// JUST_CapturePutSample, preceded by the sample's new format if it starts
+// one; sample.context is the destination's PpboxSampleRef.
+void PutCaptureSample(PP_handle hCapture, JUST_Sample & sample);
+
+#ifdef PPBOX_JUST_DYNAMIC_STREAMS
+// JUST_CaptureConfigData flag: stream_count is the size of the track
+// table, not the number of tracks. Tracks are the ones described with
+// JUST_CaptureSetStream, and may be described while capturing. Only in
+// JUST SDKs that take it, the build defines PPBOX_JUST_DYNAMIC_STREAMS
+// for those.
+const PP_uint CaptureFlag_DynamicStreams = 0x1;
+#endif
+
+// Backend callbacks, see JUST_CaptureConfigData.
+bool GetSampleBuffers(void const *context, JUST_ConstBuffer * buffers);
+bool FreeSample(void const *context);
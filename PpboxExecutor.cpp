@@ -0,0 +1,278 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxExecutor.cpp
+// Shared worker pool for sample delivery and completion, and the
+// per-destination queues that keep delivery in order on it.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+
+const unsigned long DELIVERY_BATCH = 16;    // Samples a queue puts before it yields its worker.
+
+/* PpboxWorkStealingExecutor */
+
+PpboxWorkStealingExecutor::PpboxWorkStealingExecutor(unsigned long cWorkers) :
+    m_cPending(0),
+    m_fStop(false),
+    m_uNext(0)
+{
+    if (cWorkers == 0)
+    {
+        cWorkers = std::thread::hardware_concurrency();
+        if (cWorkers == 0)
+        {
+            cWorkers = 2;
+        }
+    }
+
+    for (unsigned long i = 0; i < cWorkers; ++i)
+    {
+        m_Workers.push_back(new Worker);
+    }
+
+    // Start only once all deques exist, workers steal from each other.
+    for (unsigned long i = 0; i < cWorkers; ++i)
+    {
+        m_Workers[i]->thread = std::thread(&PpboxWorkStealingExecutor::Run, this, i);
+    }
+}
+
+PpboxWorkStealingExecutor::~PpboxWorkStealingExecutor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_WaitMutex);
+        m_fStop = true;
+    }
+    m_Wake.notify_all();
+
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        m_Workers[i]->thread.join();
+        delete m_Workers[i];
+    }
+}
+
+bool PpboxWorkStealingExecutor::Submit(PpboxTaskFn pfnTask, void * pContext)
+{
+    return Push(pfnTask, pContext, false);
+}
+
+bool PpboxWorkStealingExecutor::SubmitBehind(PpboxTaskFn pfnTask, void * pContext)
+{
+    return Push(pfnTask, pContext, true);
+}
+
+bool PpboxWorkStealingExecutor::Push(PpboxTaskFn pfnTask, void * pContext, bool fBehind)
+{
+    Task task = { pfnTask, pContext };
+    long iWorker = CurrentWorker();
+
+    {
+        // Checked and pushed under one lock, so no task is queued after
+        // the workers were told to stop.
+        std::lock_guard<std::mutex> lock(m_WaitMutex);
+        if (m_fStop)
+        {
+            return false;
+        }
+        if (iWorker < 0)
+        {
+            iWorker = (long)(m_uNext++ % m_Workers.size());
+        }
+
+        Worker * pWorker = m_Workers[iWorker];
+        std::lock_guard<std::mutex> lockWorker(pWorker->mutex);
+        if (fBehind)
+        {
+            pWorker->tasks.push_front(task);
+        }
+        else
+        {
+            pWorker->tasks.push_back(task);
+        }
+        ++m_cPending;
+    }
+    m_Wake.notify_one();
+
+    return true;
+}
+
+void PpboxWorkStealingExecutor::Run(unsigned long uIndex)
+{
+    for (;;)
+    {
+        Task task;
+        if (Pop(uIndex, task))
+        {
+            task.pfnTask(task.pContext);
+            continue;
+        }
+
+        // Tasks queued before the stop still run, they hold samples.
+        std::unique_lock<std::mutex> lock(m_WaitMutex);
+        m_Wake.wait(lock, [this]() { return m_fStop || m_cPending > 0; });
+        if (m_fStop && m_cPending == 0)
+        {
+            break;
+        }
+    }
+}
+
+bool PpboxWorkStealingExecutor::Pop(unsigned long uIndex, Task & task)
+{
+    // Popped and counted under one lock, a waiting worker never sees a
+    // task that is gone.
+    std::lock_guard<std::mutex> lockWait(m_WaitMutex);
+    if (m_cPending == 0)
+    {
+        return false;
+    }
+
+    // Own deque, newest first.
+    {
+        Worker * pWorker = m_Workers[uIndex];
+        std::lock_guard<std::mutex> lock(pWorker->mutex);
+        if (!pWorker->tasks.empty())
+        {
+            task = pWorker->tasks.back();
+            pWorker->tasks.pop_back();
+            --m_cPending;
+            return true;
+        }
+    }
+
+    // Steal, oldest first.
+    for (size_t i = 1; i < m_Workers.size(); ++i)
+    {
+        Worker * pVictim = m_Workers[(uIndex + i) % m_Workers.size()];
+        std::lock_guard<std::mutex> lock(pVictim->mutex);
+        if (!pVictim->tasks.empty())
+        {
+            task = pVictim->tasks.front();
+            pVictim->tasks.pop_front();
+            --m_cPending;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+long PpboxWorkStealingExecutor::CurrentWorker() const
+{
+    std::thread::id id = std::this_thread::get_id();
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        if (m_Workers[i]->thread.get_id() == id)
+        {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+/* Process-wide executor */
+
+static std::mutex s_ExecutorMutex;
+static PpboxExecutor * s_pExecutor = NULL;
+
+void PpboxSetExecutor(PpboxExecutor * pExecutor)
+{
+    std::lock_guard<std::mutex> lock(s_ExecutorMutex);
+    s_pExecutor = pExecutor;
+}
+
+PpboxExecutor * PpboxGetExecutor(unsigned long cWorkers)
+{
+    std::lock_guard<std::mutex> lock(s_ExecutorMutex);
+    if (s_pExecutor == NULL)
+    {
+        s_pExecutor = new (std::nothrow) PpboxWorkStealingExecutor(cWorkers);
+    }
+    return s_pExecutor;
+}
+
+/* PpboxDeliveryQueue */
+
+PpboxDeliveryQueue::PpboxDeliveryQueue(PP_handle hCapture, PpboxExecutor * pExecutor, bool fPriority) :
+    m_cRef(1),
+    m_hCapture(hCapture),
+    m_pExecutor(pExecutor),
+    m_fScheduled(false)
+{
+    m_Samples.EnablePriority(fPriority);
+}
+
+void PpboxDeliveryQueue::AddRef()
+{
+    PpboxInterlockedIncrement(&m_cRef);
+}
+
+void PpboxDeliveryQueue::Release()
+{
+    if (PpboxInterlockedDecrement(&m_cRef) == 0)
+    {
+        delete this;
+    }
+}
+
+void PpboxDeliveryQueue::Put(JUST_Sample const & sample, PpboxPriority priority)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Samples.Push(sample, priority);
+        if (m_fScheduled)
+        {
+            return;
+        }
+        m_fScheduled = true;
+    }
+
+    AddRef();
+    if (!m_pExecutor->Submit(Drain, this))
+    {
+        Drain(this);
+    }
+}
+
+void PpboxDeliveryQueue::Drain(void * pContext)
+{
+    PpboxDeliveryQueue * pQueue = (PpboxDeliveryQueue *)pContext;
+
+    for (unsigned long i = 0; ; ++i)
+    {
+        JUST_Sample sample;
+        {
+            std::lock_guard<std::mutex> lock(pQueue->m_Mutex);
+            if (pQueue->m_Samples.IsEmpty())
+            {
+                pQueue->m_fScheduled = false;
+                break;
+            }
+            // Give other queues a turn, the reference moves on with the
+            // task. Submit would put it where this worker looks first.
+            if (i == DELIVERY_BATCH)
+            {
+                if (pQueue->m_pExecutor->SubmitBehind(Drain, pQueue))
+                {
+                    return;
+                }
+                i = 0;
+            }
+            pQueue->m_Samples.Pop(sample);
+        }
+        PutCaptureSample(pQueue->m_hCapture, sample);
+    }
+
+    pQueue->Release();
+}
@@ -0,0 +1,126 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxExecutor.h
+// Shared worker pool for sample delivery and completion, and the
+// per-destination queues that keep delivery in order on it.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+typedef void (*PpboxTaskFn)(void * pContext);
+
+// PpboxExecutor: Runs tasks on some thread, soon. Tasks may be submitted
+// from any thread, including from tasks. Apps that have a pool of their
+// own implement this and pass it to PpboxSetExecutor.
+class PpboxExecutor
+{
+public:
+    virtual ~PpboxExecutor() {}
+
+    // Returns false if the task was not taken, the caller runs it inline.
+    virtual bool    Submit(PpboxTaskFn pfnTask, void * pContext) = 0;
+
+    // As Submit, for a task that gave up its thread so that others get a
+    // turn: it should run after the tasks waiting already.
+    virtual bool    SubmitBehind(PpboxTaskFn pfnTask, void * pContext) { return Submit(pfnTask, pContext); }
+};
+
+// PpboxWorkStealingExecutor:
+// A fixed number of workers, each with its own deque. A worker takes its
+// newest task first (cache-warm), and when it runs dry steals the oldest
+// task of another worker. Tasks submitted from outside the pool are
+// spread round-robin. SubmitBehind from a worker puts the task at the
+// oldest end of its deque, where thieves take it first. Once the pool
+// is being destroyed, Submit returns false, and the workers run what is
+// queued already before they exit.
+class PpboxWorkStealingExecutor : public PpboxExecutor
+{
+public:
+    // 0 = one worker per core.
+    PpboxWorkStealingExecutor(unsigned long cWorkers);
+    virtual ~PpboxWorkStealingExecutor();
+
+    virtual bool    Submit(PpboxTaskFn pfnTask, void * pContext);
+    virtual bool    SubmitBehind(PpboxTaskFn pfnTask, void * pContext);
+
+private:
+    struct Task
+    {
+        PpboxTaskFn     pfnTask;
+        void *          pContext;
+    };
+
+    struct Worker
+    {
+        std::mutex          mutex;
+        std::deque<Task>    tasks;
+        std::thread         thread;
+    };
+
+    bool    Push(PpboxTaskFn pfnTask, void * pContext, bool fBehind);
+    void    Run(unsigned long uIndex);
+    bool    Pop(unsigned long uIndex, Task & task);
+    long    CurrentWorker() const;
+
+private:
+    std::vector<Worker *>   m_Workers;
+    std::mutex              m_WaitMutex;
+    std::condition_variable m_Wake;
+    long                    m_cPending;     // Tasks in all deques, guarded by m_WaitMutex, as are pushes and pops.
+    bool                    m_fStop;
+    unsigned long           m_uNext;        // Round-robin for outside submissions.
+};
+
+// Process-wide executor. PpboxSetExecutor installs the app's own, it must
+// be called before any sink starts delivering, and the executor must
+// outlive all sinks. Otherwise the first PpboxGetExecutor creates a
+// PpboxWorkStealingExecutor with cWorkers workers, which lives until the
+// process ends.
+void PpboxSetExecutor(PpboxExecutor * pExecutor);
+PpboxExecutor * PpboxGetExecutor(unsigned long cWorkers);
+
+// PpboxDeliveryQueue:
+// Puts samples to one capture handle in order, from executor tasks, so
+// the thread that produced the sample does not wait for the backend. At
+// most one task per queue is scheduled at a time. With fPriority, samples
+// held while the backend is behind go by priority class instead, each
+// stream still in order, see PpboxPriorityQueue.
+class PpboxDeliveryQueue
+{
+public:
+    PpboxDeliveryQueue(PP_handle hCapture, PpboxExecutor * pExecutor, bool fPriority);
+
+    void    AddRef();
+    void    Release();
+
+    void    Put(JUST_Sample const & sample, PpboxPriority priority);
+
+private:
+    ~PpboxDeliveryQueue() {}
+
+    static void     Drain(void * pContext);
+
+private:
+    long                    m_cRef;
+    PP_handle               m_hCapture;
+    PpboxExecutor *         m_pExecutor;
+    std::mutex              m_Mutex;
+    PpboxPriorityQueue      m_Samples;
+    bool                    m_fScheduled;
+};
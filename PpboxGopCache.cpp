@@ -0,0 +1,197 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxGopCache.cpp
+// Keeps the samples since the last video keyframe, so that a capture
+// destination attached in the middle of a live session can start at once.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+#include "PpboxGopCache.h"
+
+PpboxGopCache::PpboxGopCache() :
+    m_cbLimit(0),
+    m_cbCached(0)
+{
+    for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+    {
+        m_Streams[i].fVideo = false;
+        m_Streams[i].fStarted = false;
+    }
+}
+
+PpboxGopCache::~PpboxGopCache()
+{
+    Clear();
+}
+
+void PpboxGopCache::Add(JUST_Sample const & sample, bool fVideo)
+{
+    if (!IsEnabled() || sample.itrack >= MAX_STREAMS)
+    {
+        return;
+    }
+
+    Stream & stream = m_Streams[sample.itrack];
+    PpboxSampleContext * pContext = (PpboxSampleContext *)sample.context;
+    bool fSync = (sample.flags & JUST_SampleFlag::sync) != 0;
+
+    stream.fVideo = fVideo;
+
+    if (fVideo)
+    {
+        if (fSync)
+        {
+            ClearStream(stream);
+            stream.fStarted = true;
+        }
+        else if (!stream.fStarted)
+        {
+            return;
+        }
+    }
+    else
+    {
+        // Audio is only useful along with some video keyframe.
+        bool fAnchored = false;
+        for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+        {
+            fAnchored |= m_Streams[i].fVideo && m_Streams[i].fStarted;
+        }
+        if (!fAnchored)
+        {
+            return;
+        }
+    }
+
+    // Over the limit, wait for the next keyframe.
+    if (m_cbCached + pContext->cbData > m_cbLimit)
+    {
+        Clear();
+        return;
+    }
+
+    // The sample as the host put it; destinations get their own refs.
+    PpboxInterlockedIncrement(&pContext->cRef);
+    stream.samples.push_back(sample);
+    m_cbCached += pContext->cbData;
+
+    if (fVideo && fSync)
+    {
+        TrimAudio();
+    }
+}
+
+void PpboxGopCache::Replay(PpboxCaptureDest * pDest, unsigned long iDest)
+{
+    size_t next[MAX_STREAMS] = {0};
+
+    for (;;)
+    {
+        // Pick the oldest of the streams' next samples.
+        unsigned long iBest = MAX_STREAMS;
+        for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+        {
+            if (next[i] < m_Streams[i].samples.size()
+                && (iBest == MAX_STREAMS
+                    || m_Streams[i].samples[next[i]].decode_time < m_Streams[iBest].samples[next[iBest]].decode_time))
+            {
+                iBest = i;
+            }
+        }
+        if (iBest == MAX_STREAMS)
+        {
+            break;
+        }
+
+        JUST_Sample sample = m_Streams[iBest].samples[next[iBest]++];
+        PpboxSampleContext * pContext = (PpboxSampleContext *)sample.context;
+        PpboxSampleRef & ref = pContext->refs[iDest];
+        ref.pContext = pContext;
+        ref.pDest = pDest;
+        pDest->AddRef();
+        PpboxInterlockedIncrement(&pContext->cRef);
+        PpboxInterlockedIncrement(&pDest->cInFlight);
+
+        sample.context = &ref;
+        PutCaptureSample(pDest->hCapture, sample);
+    }
+}
+
+void PpboxGopCache::Clear()
+{
+    for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+    {
+        ClearStream(m_Streams[i]);
+        m_Streams[i].fStarted = false;
+    }
+    assert(m_cbCached == 0);
+}
+
+void PpboxGopCache::RemoveStream(unsigned long dwStream)
+{
+    if (dwStream < MAX_STREAMS)
+    {
+        ClearStream(m_Streams[dwStream]);
+        m_Streams[dwStream].fStarted = false;
+    }
+}
+
+void PpboxGopCache::ClearStream(Stream & stream)
+{
+    for (size_t i = 0; i < stream.samples.size(); ++i)
+    {
+        PpboxSampleContext * pContext = (PpboxSampleContext *)stream.samples[i].context;
+        m_cbCached -= pContext->cbData;
+        if (PpboxInterlockedDecrement(&pContext->cRef) == 0)
+        {
+            ReleaseSample(pContext);
+        }
+    }
+    stream.samples.clear();
+}
+
+// Drops audio older than the oldest cached video keyframe.
+void PpboxGopCache::TrimAudio()
+{
+    unsigned long long uAnchor = (unsigned long long)-1;
+    for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+    {
+        if (m_Streams[i].fVideo && !m_Streams[i].samples.empty()
+            && m_Streams[i].samples.front().decode_time < uAnchor)
+        {
+            uAnchor = m_Streams[i].samples.front().decode_time;
+        }
+    }
+
+    for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+    {
+        Stream & stream = m_Streams[i];
+        if (stream.fVideo)
+        {
+            continue;
+        }
+
+        size_t n = 0;
+        while (n < stream.samples.size() && stream.samples[n].decode_time < uAnchor)
+        {
+            PpboxSampleContext * pContext = (PpboxSampleContext *)stream.samples[n].context;
+            m_cbCached -= pContext->cbData;
+            if (PpboxInterlockedDecrement(&pContext->cRef) == 0)
+            {
+                ReleaseSample(pContext);
+            }
+            ++n;
+        }
+        stream.samples.erase(stream.samples.begin(), stream.samples.begin() + n);
+    }
+}
@@ -0,0 +1,67 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxGopCache.h
+// Keeps the samples since the last video keyframe, so that a capture
+// destination attached in the middle of a live session can start at once.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+#include "PpboxCore.h"
+
+#include <vector>
+
+// The cache keeps a reference to each cached sample, as a destination
+// does: nothing is copied, and cached samples count in flight and against
+// the spill threshold like samples the backend holds. Video streams keep
+// the samples since their last sync sample, audio streams keep the
+// samples from the oldest cached keyframe on. If the cache outgrows its
+// limit, it is emptied and refilled from the next keyframe. Not thread
+// safe, the sink lock protects it.
+class PpboxGopCache
+{
+public:
+    PpboxGopCache();
+    ~PpboxGopCache();
+
+public:
+    void    SetLimit(unsigned long cbLimit) { m_cbLimit = cbLimit; }
+    bool    IsEnabled() const { return m_cbLimit > 0; }
+
+    void    Add(JUST_Sample const & sample, bool fVideo);
+
+    // Puts all cached samples to pDest, in decode time order. iDest is
+    // the index of pDest's reference slot in PpboxSampleContext.
+    void    Replay(PpboxCaptureDest * pDest, unsigned long iDest);
+
+    void    Clear();
+
+    // Forgets a removed stream.
+    void    RemoveStream(unsigned long dwStream);
+
+private:
+    struct Stream
+    {
+        bool                        fVideo;
+        bool                        fStarted;   // Video: a sync sample was seen since the last clear.
+        std::vector<JUST_Sample>    samples;
+    };
+
+    void    ClearStream(Stream & stream);
+    void    TrimAudio();
+
+private:
+    Stream          m_Streams[MAX_STREAMS];
+    unsigned long   m_cbLimit;
+    unsigned long   m_cbCached;
+};
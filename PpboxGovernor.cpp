@@ -0,0 +1,74 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxGovernor.cpp
+// Process-wide budget for the sample memory held by all sinks.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+
+static PpboxMemoryGovernor s_Governor;
+
+PpboxMemoryGovernor & PpboxMemoryGovernor::Instance()
+{
+    return s_Governor;
+}
+
+PpboxMemoryGovernor::PpboxMemoryGovernor() :
+    m_cbBudget(0),
+    m_cbHeld(0),
+    m_lTotalWeight(0)
+{
+}
+
+void PpboxMemoryGovernor::SetBudget(unsigned long long cbBudget)
+{
+    PpboxInterlockedExchange64(&m_cbBudget, (long long)cbBudget);
+}
+
+unsigned long long PpboxMemoryGovernor::GetHeld() const
+{
+    return (unsigned long long)PpboxInterlockedRead64(const_cast<long long *>(&m_cbHeld));
+}
+
+void PpboxMemoryGovernor::AddWeight(long lDelta)
+{
+    PpboxInterlockedAdd(&m_lTotalWeight, lDelta);
+}
+
+void PpboxMemoryGovernor::OnAcquire(unsigned long cbData)
+{
+    PpboxInterlockedAdd64(&m_cbHeld, (long long)cbData);
+}
+
+void PpboxMemoryGovernor::OnRelease(unsigned long cbData)
+{
+    PpboxInterlockedAdd64(&m_cbHeld, -(long long)cbData);
+}
+
+bool PpboxMemoryGovernor::IsOverBudget(PpboxCoreSink const * pSink) const
+{
+    long long cbBudget = PpboxInterlockedRead64(const_cast<long long *>(&m_cbBudget));
+    if (cbBudget == 0 || (long long)GetHeld() < cbBudget)
+    {
+        return false;
+    }
+
+    long lTotalWeight = m_lTotalWeight;
+    if (lTotalWeight <= 0)
+    {
+        return true;
+    }
+
+    long long cbShare = cbBudget / lTotalWeight * pSink->m_lWeight;
+    return PpboxInterlockedRead64(const_cast<long long *>(&pSink->m_cbHeld)) >= cbShare;
+}
@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxGovernor.h
+// Process-wide budget for the sample memory held by all sinks.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+class PpboxCoreSink;
+
+// What a sink does with new samples while it is over budget.
+enum PpboxMemoryPolicy
+{
+    MemoryPolicy_Throttle = 0,  // Hold back MEStreamSinkRequestSample until memory is freed.
+    MemoryPolicy_Drop,          // Drop video up to the next sync sample, audio is kept.
+    MemoryPolicy_Spill,         // Spill (or copy out) instead of holding upstream samples.
+};
+
+// PpboxMemoryGovernor:
+// Counts the payload bytes of samples between CreateSample and the last
+// FreeSample, over all sinks of the process. Once the total reaches the
+// budget, sinks holding more than their share are over budget; a sink's
+// share is the budget split by the weights of all live sinks. Sinks under
+// their share are never held back by others. All counters are updated
+// with interlocked operations, from any thread.
+class PpboxMemoryGovernor
+{
+public:
+    PpboxMemoryGovernor();
+
+public:
+    static PpboxMemoryGovernor & Instance();
+
+public:
+    // 0 = no budget, the default.
+    void    SetBudget(unsigned long long cbBudget);
+    unsigned long long  GetBudget() const { return (unsigned long long)m_cbBudget; }
+    unsigned long long  GetHeld() const;
+
+    // Called by PpboxCoreSink.
+    void    AddWeight(long lDelta);
+    void    OnAcquire(unsigned long cbData);
+    void    OnRelease(unsigned long cbData);
+
+    bool    IsOverBudget(PpboxCoreSink const * pSink) const;
+
+private:
+    long long   m_cbBudget;
+    long long   m_cbHeld;
+    long        m_lTotalWeight;
+};
@@ -0,0 +1,190 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxKeyIndex.cpp
+// Keyframe index written next to the recording while capturing.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "StdAfx.h"
+
+#include "Trace.h"
+
+#include "PpboxMediaSink.h"
+#include "PpboxAutoLock.h"
+#include "PpboxKeyIndex.h"
+
+const UINT32 KEYINDEX_MAGIC = 'PPKI';
+const UINT16 KEYINDEX_VERSION = 1;
+
+PpboxKeyIndex::PpboxKeyIndex() :
+    m_hFile(INVALID_HANDLE_VALUE)
+{
+    InitializeCriticalSectionEx(&m_critWrite, 1000, 0);
+    InitializeCriticalSectionEx(&m_critPending, 1000, 0);
+    memset(m_Streams, 0, sizeof(m_Streams));
+}
+
+PpboxKeyIndex::~PpboxKeyIndex()
+{
+    Close();
+    DeleteCriticalSection(&m_critPending);
+    DeleteCriticalSection(&m_critWrite);
+}
+
+HRESULT PpboxKeyIndex::Open(PCWSTR pszPath)
+{
+    HRESULT hr = S_OK;
+
+    if (pszPath == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    Close();
+
+    AutoLock lock(m_critWrite);
+
+    m_hFile = CreateFile2(pszPath, GENERIC_WRITE, FILE_SHARE_READ, CREATE_ALWAYS, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        Header header = {0};
+        header.uMagic = KEYINDEX_MAGIC;
+        header.uVersion = KEYINDEX_VERSION;
+        header.cbEntry = sizeof(Entry);
+        header.uTimeScale = 10 * 1000 * 1000;
+
+        DWORD cbWritten = 0;
+        if (!WriteFile(m_hFile, &header, sizeof(header), &cbWritten, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        for (DWORD i = 0; i < MAX_STREAMS; ++i)
+        {
+            m_Streams[i].uSequence = 0;
+            m_Streams[i].uOffset = 0;
+            m_Streams[i].uLastTime = 0;
+            m_Streams[i].fAllSync = TRUE;
+            m_Streams[i].fNewSegment = FALSE;
+        }
+        m_Pending.reserve(KEYINDEX_FLUSH_ENTRIES);
+        m_Writing.reserve(KEYINDEX_FLUSH_ENTRIES);
+    }
+    else if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    TRACEHR_RET(hr);
+}
+
+void PpboxKeyIndex::Close()
+{
+    Flush();
+
+    AutoLock lock(m_critWrite);
+
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    AutoLock lockPending(m_critPending);
+    m_Pending.clear();
+}
+
+void PpboxKeyIndex::Add(JUST_Sample const & sample, DWORD cbSize)
+{
+    if (!IsOpen() || sample.itrack >= MAX_STREAMS)
+    {
+        return;
+    }
+
+    Stream & stream = m_Streams[sample.itrack];
+
+    if (sample.flags & JUST_SampleFlag::sync)
+    {
+        // Audio has every sample sync, indexing all of them is no use.
+        if (!stream.fAllSync
+            || stream.uSequence == 0
+            || stream.fNewSegment
+            || sample.decode_time >= stream.uLastTime + KEYINDEX_MIN_INTERVAL)
+        {
+            Entry entry;
+            entry.uStream = sample.itrack;
+            entry.cbSize = cbSize;
+            entry.uDecodeTime = sample.decode_time;
+            entry.uSequence = stream.uSequence;
+            entry.uOffset = stream.uOffset;
+
+            AutoLock lock(m_critPending);
+            m_Pending.push_back(entry);
+            stream.uLastTime = sample.decode_time;
+            stream.fNewSegment = FALSE;
+        }
+    }
+    else
+    {
+        stream.fAllSync = FALSE;
+    }
+
+    ++stream.uSequence;
+    stream.uOffset += cbSize;
+}
+
+void PpboxKeyIndex::NewSegment()
+{
+    for (DWORD i = 0; i < MAX_STREAMS; ++i)
+    {
+        m_Streams[i].uLastTime = 0;
+        m_Streams[i].fNewSegment = TRUE;
+    }
+}
+
+//-------------------------------------------------------------------
+// Flush
+// Takes the pending entries and writes them. Add goes on meanwhile, it
+// only waits for the swap.
+//-------------------------------------------------------------------
+
+HRESULT PpboxKeyIndex::Flush()
+{
+    HRESULT hr = S_OK;
+
+    AutoLock lock(m_critWrite);
+
+    {
+        AutoLock lockPending(m_critPending);
+        m_Writing.swap(m_Pending);
+    }
+
+    if (m_hFile != INVALID_HANDLE_VALUE && !m_Writing.empty())
+    {
+        DWORD cbWritten = 0;
+        if (!WriteFile(m_hFile, &m_Writing[0], (DWORD)(m_Writing.size() * sizeof(Entry)), &cbWritten, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    m_Writing.clear();
+
+    TRACEHR_RET(hr);
+}
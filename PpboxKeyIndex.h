@@ -0,0 +1,92 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxKeyIndex.h
+// Keyframe index written next to the recording while capturing.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <vector>
+
+const DWORD KEYINDEX_FLUSH_ENTRIES = 32;            // Entries reserved for a write.
+const DWORD KEYINDEX_FLUSH_MS = 1000;               // The sink writes pending entries this often, and at Stop.
+const UINT64 KEYINDEX_MIN_INTERVAL = 10000000;      // Streams where every sample is sync (audio): one entry per second.
+
+// Sidecar file layout, little endian:
+//   Header, then Entry records until the end of the file.
+// Entries are appended in the order samples reach the sink, so the decode
+// times of a stream's entries increase and readers can binary search them;
+// after a warm restart, times start over, see NewSegment.
+// A crash loses at most the last KEYINDEX_FLUSH_MS of entries.
+//
+// Add and NewSegment run with the sink lock held and never touch the
+// file. Flush runs without the sink lock; it writes with a lock of its
+// own, so batches reach the file in the order they were added.
+class PpboxKeyIndex
+{
+public:
+#pragma pack(push, 1)
+    struct Header
+    {
+        UINT32  uMagic;             // 'PPKI'
+        UINT16  uVersion;
+        UINT16  cbEntry;
+        UINT32  uTimeScale;         // Of decode_time, 100ns units.
+        UINT32  uReserved;
+    };
+
+    struct Entry
+    {
+        UINT32  uStream;
+        UINT32  cbSize;
+        UINT64  uDecodeTime;
+        UINT64  uSequence;          // Number of the sample in its stream.
+        UINT64  uOffset;            // Bytes of the stream before this sample.
+    };
+#pragma pack(pop)
+
+public:
+    PpboxKeyIndex();
+    ~PpboxKeyIndex();
+
+public:
+    HRESULT Open(PCWSTR pszPath);
+    void    Close();
+
+    BOOL    IsOpen() const { return m_hFile != INVALID_HANDLE_VALUE; }
+
+    // Called for every sample, in order.
+    void    Add(JUST_Sample const & sample, DWORD cbSize);
+
+    HRESULT Flush();
+
+    // Sample times start over (warm restart). Sequence numbers and
+    // offsets go on, they tell the segments apart.
+    void    NewSegment();
+
+private:
+    struct Stream
+    {
+        UINT64  uSequence;
+        UINT64  uOffset;
+        UINT64  uLastTime;          // Of the last entry.
+        BOOL    fAllSync;           // No non-sync sample seen so far.
+        BOOL    fNewSegment;        // Index the next sync sample whatever its time.
+    };
+
+private:
+    CRITICAL_SECTION    m_critWrite;        // The file; taken before m_critPending.
+    CRITICAL_SECTION    m_critPending;
+    HANDLE              m_hFile;
+    Stream              m_Streams[MAX_STREAMS];
+    std::vector<Entry>  m_Pending;
+    std::vector<Entry>  m_Writing;          // Swapped with m_Pending by Flush.
+};
@@ -0,0 +1,146 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxLatency.cpp
+// Lock-free latency histograms for samples on their way through the
+// capture backend.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+// Longer is clamped, so that the max fits a long everywhere (35 minutes).
+const unsigned long LATENCY_MAX = 0x7fffffff;
+
+unsigned long long PpboxGetMicroseconds()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER s_liFrequency = {0};
+    if (s_liFrequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&s_liFrequency);
+    }
+    LARGE_INTEGER liNow;
+    QueryPerformanceCounter(&liNow);
+    unsigned long long uTicks = liNow.QuadPart;
+    unsigned long long uFrequency = s_liFrequency.QuadPart;
+    return (uTicks / uFrequency) * 1000000 + (uTicks % uFrequency) * 1000000 / uFrequency;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void PpboxLatencyHistogram::Add(unsigned long long uMicroseconds)
+{
+    unsigned long uValue = uMicroseconds > LATENCY_MAX ? LATENCY_MAX : (unsigned long)uMicroseconds;
+
+    PpboxInterlockedIncrement(&m_Buckets[BucketIndex(uValue)]);
+
+    // The max is kept exact, racing writers retry.
+    long uMax = m_uMax;
+    while ((unsigned long)uMax < uValue)
+    {
+        long uPrev = PpboxInterlockedCompareExchange(&m_uMax, (long)uValue, uMax);
+        if (uPrev == uMax)
+        {
+            break;
+        }
+        uMax = uPrev;
+    }
+}
+
+void PpboxLatencyHistogram::GetSummary(PpboxLatencySummary & summary) const
+{
+    unsigned long cSamples = 0;
+    for (unsigned long i = 0; i < BUCKETS; ++i)
+    {
+        cSamples += m_Buckets[i];
+    }
+
+    summary.cSamples = cSamples;
+    summary.uP50 = Percentile(cSamples, 500);
+    summary.uP99 = Percentile(cSamples, 990);
+    summary.uP999 = Percentile(cSamples, 999);
+    summary.uMax = (unsigned long)m_uMax;
+}
+
+void PpboxLatencyHistogram::Reset()
+{
+    m_uMax = 0;
+    memset(m_Buckets, 0, sizeof(m_Buckets));
+}
+
+/* Private methods */
+
+unsigned long PpboxLatencyHistogram::BucketIndex(unsigned long uValue)
+{
+    if (uValue < SUB_BUCKETS)
+    {
+        return uValue;
+    }
+
+    unsigned long uExponent = 0;
+#ifdef _WIN32
+    _BitScanReverse(&uExponent, uValue);
+#else
+    uExponent = 31 - __builtin_clz((unsigned int)uValue);
+#endif
+
+    unsigned long uShift = uExponent - SUB_BUCKET_BITS;
+    unsigned long uSub = (uValue >> uShift) & (SUB_BUCKETS - 1);
+    return (uShift + 1) * SUB_BUCKETS + uSub;
+}
+
+unsigned long PpboxLatencyHistogram::BucketUpperBound(unsigned long uIndex)
+{
+    if (uIndex < SUB_BUCKETS)
+    {
+        return uIndex;
+    }
+
+    unsigned long uShift = uIndex / SUB_BUCKETS - 1;
+    unsigned long uSub = uIndex % SUB_BUCKETS;
+    unsigned long long uLower = (unsigned long long)(SUB_BUCKETS + uSub) << uShift;
+    unsigned long long uUpper = uLower + (1ULL << uShift) - 1;
+    return uUpper > LATENCY_MAX ? LATENCY_MAX : (unsigned long)uUpper;
+}
+
+unsigned long PpboxLatencyHistogram::Percentile(unsigned long cSamples, unsigned long uPerMille) const
+{
+    if (cSamples == 0)
+    {
+        return 0;
+    }
+
+    // Rank of the sample at or above the percentile, 1 based.
+    unsigned long long uRank = ((unsigned long long)cSamples * uPerMille + 999) / 1000;
+    if (uRank == 0)
+    {
+        uRank = 1;
+    }
+
+    unsigned long long cSeen = 0;
+    for (unsigned long i = 0; i < BUCKETS; ++i)
+    {
+        cSeen += m_Buckets[i];
+        if (cSeen >= uRank)
+        {
+            return BucketUpperBound(i);
+        }
+    }
+    return (unsigned long)m_uMax;
+}
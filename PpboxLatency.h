@@ -0,0 +1,79 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxLatency.h
+// Lock-free latency histograms for samples on their way through the
+// capture backend.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+// Monotonic clock, microseconds.
+unsigned long long PpboxGetMicroseconds();
+
+// Stages a sample is timed over:
+//   Latency_Put:       ProcessSample entry to the first
+//                      JUST_CapturePutSample (or queueing, with
+//                      asynchronous delivery), time spent in the sink
+//                      itself.
+//   Latency_Fetch:     First PutSample to the first GetSampleBuffers,
+//                      the backend's queue.
+//   Latency_Write:     First GetSampleBuffers to the last FreeSample, the
+//                      backend's output.
+//   Latency_Total:     ProcessSample entry to the last FreeSample.
+enum PpboxLatencyStage
+{
+    Latency_Put = 0,
+    Latency_Fetch,
+    Latency_Write,
+    Latency_Total,
+    Latency_Count
+};
+
+struct PpboxLatencySummary
+{
+    unsigned long       cSamples;
+    unsigned long       uP50;       // Microseconds, upper bound of the bucket.
+    unsigned long       uP99;
+    unsigned long       uP999;
+    unsigned long       uMax;       // Exact.
+};
+
+// Log-linear buckets as in HdrHistogram: 16 linear sub-buckets per power
+// of two, so any value is off by less than 1/16. Values are microseconds
+// up to 2^31. Add is a couple of interlocked operations and safe from any
+// thread; GetSummary reads the buckets without a lock and may miss
+// samples added meanwhile.
+class PpboxLatencyHistogram
+{
+public:
+    static const unsigned long SUB_BUCKET_BITS = 4;
+    static const unsigned long SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const unsigned long BUCKETS = (31 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+public:
+    PpboxLatencyHistogram() { Reset(); }
+
+public:
+    void    Add(unsigned long long uMicroseconds);
+    void    GetSummary(PpboxLatencySummary & summary) const;
+    void    Reset();
+
+private:
+    static unsigned long    BucketIndex(unsigned long uValue);
+    static unsigned long    BucketUpperBound(unsigned long uIndex);
+    unsigned long           Percentile(unsigned long cSamples, unsigned long uPerMille) const;
+
+private:
+    long            m_uMax;
+    long            m_Buckets[BUCKETS];
+};
@@ -39,25 +39,6 @@
 #pragma warning( push )
 #pragma warning( disable : 4355 )  // 'this' used in base member initializer list
 
-class AutoLock
-{
-private:
-    CRITICAL_SECTION *m_pCriticalSection;
-public:
-	_Acquires_lock_(m_pCriticalSection)
-    AutoLock(CRITICAL_SECTION& crit)
-    {
-        m_pCriticalSection = &crit;
-        InitializeCriticalSectionEx(m_pCriticalSection, 1000, 0);
-    }
-
-	_Releases_lock_(m_pCriticalSection)
-    ~AutoLock()
-    {
-        LeaveCriticalSection(m_pCriticalSection);
-    }
-};
-
 /* Public class methods */
 
 PpboxMediaSink::PpboxMediaSink() :
@@ -65,8 +46,47 @@ PpboxMediaSink::PpboxMediaSink() :
     m_state(STATE_INVALID),
 	m_bLive(FALSE),
     m_uDuration(0),
-	m_uTime(0)
+	m_uTime(0),
+    m_uCopyOutThreshold(0),
+    m_pCore(new PpboxCoreSink),
+    m_uSpillLimit(SPILL_DEFAULT_LIMIT),
+    m_SpillKey(0),
+    m_IndexKey(0),
+    m_cCaptures(0),
+    m_uDestinationLimit(0),
+    m_hCaptureReady(NULL),
+    m_fCaptureReady(FALSE),
+    m_hrCapture(S_OK),
+    m_cbStartup(0),
+    m_cbStartupLimit(STARTUP_DEFAULT_BUFFER),
+    m_dwStartupSkip(0),
+    m_uActivateTime(0),
+    m_uCaptureReadyTime(0),
+    m_uFirstSampleTime(0),
+    m_uClockStartTime(0),
+    m_uStartLatency(0),
+    m_MemoryPolicy(MemoryPolicy_Throttle),
+    m_pExecutor(NULL),
+    m_uStatsInterval(0),
+    m_StatsKey(0),
+    m_pfnStats(NULL),
+    m_pStatsContext(NULL),
+    m_fBitrateFeedback(FALSE),
+    m_pfnBitrate(NULL),
+    m_pBitrateContext(NULL),
+    m_fPriority(FALSE),
+    m_fDynamicStreams(FALSE),
+    m_fCapturePool(FALSE),
+    m_fWarmRestart(FALSE),
+    m_fPacing(FALSE),
+    m_PacingKey(0),
+    m_llPacingTime(0),
+    m_fClockPaused(FALSE)
 {
+    InitializeCriticalSectionEx(&m_critSec, 1000, 0);
+    memset(&m_StatsPrev, 0, sizeof(m_StatsPrev));
+    memset(&m_StatsPolled, 0, sizeof(m_StatsPolled));
+    memset(m_Captures, 0, sizeof(m_Captures));
     auto module = ::Microsoft::WRL::GetModuleBase();
     if (module != nullptr)
     {
@@ -81,6 +101,19 @@ PpboxMediaSink::~PpboxMediaSink()
         Shutdown();
     }
 
+    // Samples still held by the backend keep the core alive.
+    if (m_pCore)
+    {
+        m_pCore->Release();
+    }
+
+    if (m_hCaptureReady)
+    {
+        CloseHandle(m_hCaptureReady);
+    }
+
+    DeleteCriticalSection(&m_critSec);
+
     auto module = ::Microsoft::WRL::GetModuleBase();
     if (module != nullptr)
     {
@@ -93,444 +126,2155 @@ PpboxMediaSink::~PpboxMediaSink()
 IFACEMETHODIMP PpboxMediaSink::SetProperties(ABI::Windows::Foundation::Collections::IPropertySet *pConfiguration)
 {
     HRESULT hr = S_OK;
-    hr = ConvertConfigurationsToMediaTypes(pConfiguration, &m_MediaTypes);
-    if (SUCCEEDED(hr))
-    {
-        auto pos = m_MediaTypes.FrontPosition();
-        for (DWORD i = 0; i < m_MediaTypes.GetCount(); ++i)
-        {
-            ComPtr<IMFMediaType> spMT;
-            ComPtr<IMFStreamSink> spStream;
-            hr = m_MediaTypes.GetItemByPosition(pos, &spMT);
-            if (FAILED(hr))
-            {
-                break;
-            }
-            hr = AddStreamSink(i, spMT.Get(), &spStream);
-            if (FAILED(hr))
-            {
-                break;
-            }
-            pos = m_MediaTypes.Next(pos);
-        }
-    }
 
-    if (SUCCEEDED(hr))
+    // Already set up: only attach destinations that are new in the list.
+    if (m_hCaptureReady != NULL)
     {
-        USES_CONVERSION;
-
-        HSTRING dest = NULL;
-        GetDestinationtFromConfigurations(pConfiguration, &dest);
-        PCWSTR pswDest = WindowsGetStringRawBuffer(dest, NULL);
-        LPSTR pszDest = pswDest ? W2A(pswDest) : NULL;
-        m_PpboxCapture = JUST_CaptureCreate("winrt", pszDest);
-        JUST_CaptureConfigData config;
-        config.stream_count = m_streams.GetCount();
-        config.flags = 0;
-        config.get_sample_buffers = GetSampleBuffers;
-        config.free_sample = FreeSample;
-        JUST_CaptureInit(m_PpboxCapture, &config);
+        return AttachDestinations(pConfiguration);
     }
 
-    TRACEHR_RET(hr);
-}
-
-//-------------------------------------------------------------------
-// IMFMediaSink methods
-//-------------------------------------------------------------------
+    m_uActivateTime = PpboxGetMicroseconds();
 
-//-------------------------------------------------------------------
-// GetCharacteristics
-// Returns capabilities flags.
-//-------------------------------------------------------------------
+    // Optional, stays zero-copy if not present.
+    GetUInt32FromConfigurations(pConfiguration, L"CopyOutThreshold", &m_uCopyOutThreshold);
 
-HRESULT PpboxMediaSink::GetCharacteristics(DWORD* pdwCharacteristics)
-{
-    if (pdwCharacteristics == NULL)
+    // Optional, puts samples and releases freed ones on the shared pool
+    // instead of the calling thread. The first sink to create the pool
+    // decides its size, one worker per core by default.
     {
-        return E_POINTER;
+        UINT32 fAsyncDelivery = 0;
+        GetUInt32FromConfigurations(pConfiguration, L"AsyncDelivery", &fAsyncDelivery);
+        if (fAsyncDelivery)
+        {
+            UINT32 cThreads = 0;
+            GetUInt32FromConfigurations(pConfiguration, L"DeliveryThreads", &cThreads);
+            m_pExecutor = PpboxGetExecutor(cThreads);
+        }
     }
 
-    HRESULT hr = S_OK;
-
-    AutoLock lock(m_critSec);
-
-    hr = CheckShutdown();
-
-    if (SUCCEEDED(hr))
+    // Optional, streams may be added and removed while capturing. The
+    // track of a stream is its identifier, below MAX_STREAMS. Without
+    // backend support streams are added before the first capture only.
+#ifdef PPBOX_JUST_DYNAMIC_STREAMS
     {
-		*pdwCharacteristics = MEDIASINK_RATELESS;
+        UINT32 fDynamicStreams = 0;
+        GetUInt32FromConfigurations(pConfiguration, L"DynamicStreams", &fDynamicStreams);
+        m_fDynamicStreams = fDynamicStreams != 0;
     }
+#endif
 
-    TRACEHR_RET(hr);
-}
-
-HRESULT PpboxMediaSink:: AddStreamSink(DWORD dwStreamSinkIdentifier, IMFMediaType *pMediaType, IMFStreamSink **ppStreamSink)
-{
-    PpboxStreamSink *pStream = nullptr;
-    ComPtr<IMFStreamSink> spMFStream;
-
-    AutoLock lock(m_critSec);
-
-    HRESULT hr = CheckShutdown();
-
-    if (SUCCEEDED(hr))
+    // Optional, capture handles are reused across sessions. The pool is
+    // process-wide, the last sink to size it wins.
     {
-        hr = GetStreamSinkById(dwStreamSinkIdentifier, &spMFStream);
+        UINT32 fCapturePool = 0;
+        GetUInt32FromConfigurations(pConfiguration, L"CapturePool", &fCapturePool);
+        m_fCapturePool = fCapturePool != 0;
+
+        UINT32 cPoolSize = CAPTURE_POOL_DEFAULT_SIZE;
+        UINT32 uPoolIdle = CAPTURE_POOL_DEFAULT_IDLE;
+        HRESULT hrSize = GetUInt32FromConfigurations(pConfiguration, L"CapturePoolSize", &cPoolSize);
+        HRESULT hrIdle = GetUInt32FromConfigurations(pConfiguration, L"CapturePoolIdle", &uPoolIdle);
+        if (SUCCEEDED(hrSize) || SUCCEEDED(hrIdle))
+        {
+            PpboxCapturePool::Instance().Configure(cPoolSize, uPoolIdle);
+        }
     }
 
-    if (SUCCEEDED(hr))
+    // Optional, Stop and Start cut the recording into segments on the
+    // same streams and capture handles.
     {
-        hr = MF_E_STREAMSINK_EXISTS;
+        UINT32 fWarmRestart = 0;
+        GetUInt32FromConfigurations(pConfiguration, L"WarmRestart", &fWarmRestart);
+        m_fWarmRestart = fWarmRestart != 0;
     }
-    else
+
+    // Optional, samples held back (async delivery, pacing) go audio first.
     {
-        hr = S_OK;
+        UINT32 fPriorityDelivery = 0;
+        GetUInt32FromConfigurations(pConfiguration, L"PriorityDelivery", &fPriorityDelivery);
+        m_fPriority = fPriorityDelivery != 0;
+        m_Pacer.EnablePriority(m_fPriority != FALSE);
     }
 
-    if (SUCCEEDED(hr))
+    // Optional pacing, smooths encoder bursts for live destinations.
     {
-        pStream = new PpboxStreamSink(dwStreamSinkIdentifier);
-        if (pStream == nullptr)
+        UINT32 fPacedDelivery = 0;
+        GetUInt32FromConfigurations(pConfiguration, L"PacedDelivery", &fPacedDelivery);
+        if (fPacedDelivery)
         {
-            hr = E_OUTOFMEMORY;
+            UINT32 uBurst = PACING_DEFAULT_BURST;
+            UINT32 uHeadroom = PACING_DEFAULT_HEADROOM;
+            GetUInt32FromConfigurations(pConfiguration, L"PacingBurst", &uBurst);
+            GetUInt32FromConfigurations(pConfiguration, L"PacingHeadroom", &uHeadroom);
+            m_Pacer.Configure(uBurst, uHeadroom);
+            m_fPacing = TRUE;
         }
-        spMFStream.Attach(pStream);
     }
 
-    // Initialize the stream.
-    if (SUCCEEDED(hr))
+    // Optional spill ring, only when a file is given.
     {
-        hr = pStream->Initialize(this, pMediaType);
+        HString spillFile;
+        if (SUCCEEDED(GetStringFromConfigurations(pConfiguration, L"SpillFile", spillFile.GetAddressOf())))
+        {
+            UINT32 uSpillSize = (UINT32)SPILL_DEFAULT_SIZE;
+            GetUInt32FromConfigurations(pConfiguration, L"SpillSize", &uSpillSize);
+            GetUInt32FromConfigurations(pConfiguration, L"SpillLimit", &m_uSpillLimit);
+            if (uSpillSize < SPILL_FLUSH_BYTES)
+            {
+                hr = E_INVALIDARG;
+            }
+            else if (!m_SpillRing.Open(WindowsGetStringRawBuffer(spillFile.Get(), NULL), uSpillSize))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+        }
     }
 
+    // Optional keyframe index sidecar.
     if (SUCCEEDED(hr))
     {
-        hr = m_streams.InsertBack(pStream);
+        HString indexFile;
+        if (SUCCEEDED(GetStringFromConfigurations(pConfiguration, L"IndexFile", indexFile.GetAddressOf())))
+        {
+            hr = m_KeyIndex.Open(WindowsGetStringRawBuffer(indexFile.Get(), NULL));
+            if (SUCCEEDED(hr))
+            {
+                hr = StartIndexTimer();
+            }
+        }
     }
 
+    // Optional session trace, payloads only if asked for.
     if (SUCCEEDED(hr))
     {
-        *ppStreamSink = spMFStream.Detach();
+        HString traceFile;
+        if (SUCCEEDED(GetStringFromConfigurations(pConfiguration, L"TraceFile", traceFile.GetAddressOf())))
+        {
+            UINT32 fTracePayload = 0;
+            GetUInt32FromConfigurations(pConfiguration, L"TracePayload", &fTracePayload);
+            hr = m_Trace.Open(WindowsGetStringRawBuffer(traceFile.Get(), NULL), fTracePayload != 0);
+        }
     }
 
-    TRACEHR_RET(hr);
-}
+    std::vector<std::wstring> destinations;
 
-HRESULT PpboxMediaSink:: RemoveStreamSink(DWORD dwStreamSinkIdentifier)
-{
-    AutoLock lock(m_critSec);
+    // A compiled configuration stands for the profile and destinations.
+    // Else they are read from the set, and compiled for the app if asked;
+    // asking to compile always reads the set, so a stale blob in it is
+    // never used in place of the types the app passed this time.
+    if (SUCCEEDED(hr))
+    {
+        UINT32 fCompile = 0;
+        UINT32 cbCompiled = 0;
+        BYTE * pCompiled = nullptr;
+        GetUInt32FromConfigurations(pConfiguration, L"CompileConfiguration", &fCompile);
+        if (!fCompile
+            && SUCCEEDED(GetUInt8ArrayFromConfigurations(pConfiguration, L"CompiledConfiguration", &cbCompiled, &pCompiled)))
+        {
+            hr = ConvertCompiledConfiguration(pCompiled, cbCompiled, &m_MediaTypes, destinations);
+            CoTaskMemFree(pCompiled);
+        }
+        else
+        {
+            hr = ConvertConfigurationsToMediaTypes(pConfiguration, &m_MediaTypes);
 
-    HRESULT hr = CheckShutdown();
+            if (SUCCEEDED(hr))
+            {
+                hr = GetDestinationsFromConfigurations(pConfiguration, destinations);
+            }
 
-    auto pos = m_streams.FrontPosition();
-    auto end = m_streams.EndPosition();
-    ComPtr<PpboxStreamSink> spStream;
+            // Best effort, the set just has no blob if the types cannot
+            // be compiled.
+            if (SUCCEEDED(hr) && fCompile)
+            {
+                std::vector<BYTE> blob;
+                if (SUCCEEDED(CompileConfiguration(&m_MediaTypes, destinations, blob)))
+                {
+                    PublishCompiledConfigurationToConfigurations(pConfiguration, blob);
+                }
+            }
+        }
+    }
 
     if (SUCCEEDED(hr))
     {
-
-        for (; pos != end; pos = m_streams.Next(pos))
+        auto pos = m_MediaTypes.FrontPosition();
+        for (DWORD i = 0; i < m_MediaTypes.GetCount(); ++i)
         {
-            hr = m_streams.GetItemByPosition(pos, &spStream);
+            ComPtr<IMFMediaType> spMT;
+            ComPtr<IMFStreamSink> spStream;
+            hr = m_MediaTypes.GetItemByPosition(pos, &spMT);
             if (FAILED(hr))
             {
                 break;
             }
-
-            DWORD dwId;
-            hr = spStream->GetIdentifier(&dwId);
-            if (FAILED(hr) || dwId == dwStreamSinkIdentifier)
+            hr = AddStreamSink(i, spMT.Get(), &spStream);
+            if (FAILED(hr))
             {
                 break;
             }
+            pos = m_MediaTypes.Next(pos);
         }
+    }
 
-        if (pos == end)
+    // Optional, a destination that holds more samples than this skips
+    // ahead to the next sync sample instead of holding back the others.
+    GetUInt32FromConfigurations(pConfiguration, L"DestinationLimit", &m_uDestinationLimit);
+
+    // Optional, what samples may wait for the capture handles to come up.
+    GetUInt32FromConfigurations(pConfiguration, L"StartupBufferSize", &m_cbStartupLimit);
+
+    // Optional, keeps the current GOP for destinations attached later.
+    {
+        UINT32 cbGopCache = 0;
+        GetUInt32FromConfigurations(pConfiguration, L"GopCacheSize", &cbGopCache);
+        m_GopCache.SetLimit(cbGopCache);
+    }
+
+    // Optional process-wide memory budget (megabytes, shared by all
+    // sinks), this sink's weight and what it does when over budget.
+    if (SUCCEEDED(hr))
+    {
+        UINT32 uBudget = 0;
+        if (SUCCEEDED(GetUInt32FromConfigurations(pConfiguration, L"MemoryBudget", &uBudget)))
         {
-            hr = MF_E_INVALIDSTREAMNUMBER;
+            PpboxMemoryGovernor::Instance().SetBudget((unsigned long long)uBudget << 20);
+        }
+
+        UINT32 uWeight = 1;
+        GetUInt32FromConfigurations(pConfiguration, L"MemoryWeight", &uWeight);
+        m_pCore->SetWeight((long)uWeight);
+
+        HString policy;
+        if (SUCCEEDED(GetStringFromConfigurations(pConfiguration, L"MemoryPolicy", policy.GetAddressOf())))
+        {
+            PCWSTR pszPolicy = WindowsGetStringRawBuffer(policy.Get(), NULL);
+            if (_wcsicmp(pszPolicy, L"Throttle") == 0)
+                m_MemoryPolicy = MemoryPolicy_Throttle;
+            else if (_wcsicmp(pszPolicy, L"Drop") == 0)
+                m_MemoryPolicy = MemoryPolicy_Drop;
+            else if (_wcsicmp(pszPolicy, L"Spill") == 0)
+                m_MemoryPolicy = MemoryPolicy_Spill;
+            else
+                hr = E_INVALIDARG;
         }
     }
 
+    // Optional periodic snapshot, published to the configuration set.
+    // Bitrate feedback is estimated from it, and needs one.
     if (SUCCEEDED(hr))
     {
-        hr = m_streams.RemoveItemByPosition(pos, nullptr);
-        spStream->Shutdown();
-    }
+        UINT32 fBitrateFeedback = 0;
+        GetUInt32FromConfigurations(pConfiguration, L"BitrateFeedback", &fBitrateFeedback);
+        m_fBitrateFeedback = fBitrateFeedback != 0;
 
-    TRACEHR_RET(hr);
-}
+        GetUInt32FromConfigurations(pConfiguration, L"StatsInterval", &m_uStatsInterval);
+        if (m_fBitrateFeedback && m_uStatsInterval == 0)
+        {
+            m_uStatsInterval = BITRATE_DEFAULT_INTERVAL;
+        }
+        if (m_uStatsInterval > 0)
+        {
+            m_spStatsSet = pConfiguration;
+            hr = StartStatsTimer();
+        }
+    }
 
-HRESULT PpboxMediaSink:: GetStreamSinkCount(DWORD *pcStreamSinkCount)
-{
-    if (pcStreamSinkCount == NULL)
+    // Connecting the destinations may take a while, it is left to a
+    // work queue. The streams take samples meanwhile. The event marks
+    // the set as accepted, so it only exists once all of it is.
+    if (SUCCEEDED(hr))
     {
-        return E_POINTER;
+        m_hCaptureReady = CreateEventEx(NULL, NULL, CREATE_EVENT_MANUAL_RESET, EVENT_ALL_ACCESS);
+        if (m_hCaptureReady == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
     }
 
-    AutoLock lock(m_critSec);
-
-    HRESULT hr = CheckShutdown();
-
     if (SUCCEEDED(hr))
     {
-        *pcStreamSinkCount = m_streams.GetCount();
+        m_spStatusSet = pConfiguration;
+        m_PendingDestinations.swap(destinations);
+        hr = StartCaptureInit();
+    }
+
+    if (FAILED(hr))
+    {
+        DiscardProperties();
     }
 
     TRACEHR_RET(hr);
 }
 
-HRESULT PpboxMediaSink:: GetStreamSinkByIndex(DWORD dwIndex, IMFStreamSink **ppStreamSink)
+//-------------------------------------------------------------------
+// DiscardProperties
+// Undoes a SetProperties that failed part way, so that the next one
+// starts over instead of attaching to a sink without streams.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::DiscardProperties()
 {
-    if (ppStreamSink == NULL)
+    AutoLock lock(m_critSec);
+
+    ForEach(m_streams, [](PpboxStreamSink * pStream){
+        pStream->Shutdown();
+        return S_OK;
+    });
+    m_streams.Clear();
+    m_MediaTypes.Clear();
+    m_PendingDestinations.clear();
+
+    m_SpillRing.Close();
+    m_KeyIndex.Close();
+    m_Trace.Close();
+
+    if (m_spStatsTimer)
     {
-        return E_POINTER;
+        MFCancelWorkItem(m_StatsKey);
+        m_spStatsTimer.Reset();
+    }
+    if (m_spIndexTimer)
+    {
+        MFCancelWorkItem(m_IndexKey);
+        m_spIndexTimer.Reset();
     }
+    m_spStatsSet.Reset();
+    m_spStatusSet.Reset();
 
-    AutoLock lock(m_critSec);
+    if (m_hCaptureReady)
+    {
+        CloseHandle(m_hCaptureReady);
+        m_hCaptureReady = NULL;
+    }
+}
 
-    HRESULT hr = CheckShutdown();
+//-------------------------------------------------------------------
+// AttachDestinations
+// SetProperties on a running sink: attaches the destinations of the
+// list that are not attached yet.
+//-------------------------------------------------------------------
 
-    ComPtr<PpboxStreamSink> spStream;
+HRESULT PpboxMediaSink::AttachDestinations(ABI::Windows::Foundation::Collections::IPropertySet *pConfiguration)
+{
+    std::vector<std::wstring> destinations;
+
+    HRESULT hr = GetDestinationsFromConfigurations(pConfiguration, destinations);
+
+    AutoLock lock(m_critSec);
 
     if (SUCCEEDED(hr))
     {
-        auto pos = m_streams.FrontPosition();
-        auto end = m_streams.EndPosition();
-        DWORD dwCurrent = 0;
+        hr = CheckShutdown();
+    }
 
-        for (;pos != end && dwCurrent < dwIndex; pos = m_streams.Next(pos), ++dwCurrent)
+    for (size_t i = 0; SUCCEEDED(hr) && i < destinations.size(); ++i)
+    {
+        if (std::find(m_Destinations.begin(), m_Destinations.end(), destinations[i]) != m_Destinations.end())
         {
-            // Just move to proper position
+            continue;
         }
-
-        if (pos == end)
+        if (m_fCaptureReady)
         {
-            hr = MF_E_UNEXPECTED;
+            hr = AttachDestination(destinations[i].c_str());
         }
-        else
+        else if (std::find(m_PendingDestinations.begin(), m_PendingDestinations.end(), destinations[i]) == m_PendingDestinations.end())
         {
-            hr = m_streams.GetItemByPosition(pos, &spStream);
+            // Still coming up, OnCaptureInit takes it along.
+            m_PendingDestinations.push_back(destinations[i]);
         }
     }
 
-    if (SUCCEEDED(hr))
-    {
-        *ppStreamSink = spStream.Detach();
-    }
-
     TRACEHR_RET(hr);
 }
 
-HRESULT PpboxMediaSink:: GetStreamSinkById(DWORD dwStreamSinkIdentifier, IMFStreamSink **ppStreamSink)
+//-------------------------------------------------------------------
+// AttachDestination
+// Creates a capture handle for pszDest. On a running sink, the handle
+// is told about the streams and gets the cached GOP right away.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::AttachDestination(PCWSTR pszDest)
 {
-    if (ppStreamSink == NULL)
+    if (m_cCaptures >= MAX_DESTINATIONS)
     {
         return E_INVALIDARG;
     }
 
-    AutoLock lock(m_critSec);
+    JUST_CaptureConfigData config;
+    UINT64 uLayout = GetCaptureConfig(config);
 
-    HRESULT hr = CheckShutdown();
-    ComPtr<PpboxStreamSink> spResult;
+    return AddCapture(pszDest, CreateCapture(pszDest, config, uLayout), uLayout);
+}
 
-    if (SUCCEEDED(hr))
-    {
-        auto pos = m_streams.FrontPosition();
-        auto end = m_streams.EndPosition();
+//-------------------------------------------------------------------
+// GetCaptureConfig
+// How a handle for the current streams is initialized, and the layout
+// it is pooled under.
+//-------------------------------------------------------------------
 
-        for (;pos != end; pos = m_streams.Next(pos))
-        {
-            ComPtr<PpboxStreamSink> spStream;
-            hr = m_streams.GetItemByPosition(pos, &spStream);
-            if (FAILED(hr))
-            {
-                break;
-            }
+UINT64 PpboxMediaSink::GetCaptureConfig(JUST_CaptureConfigData & config)
+{
+#ifdef PPBOX_JUST_DYNAMIC_STREAMS
+    config.stream_count = m_fDynamicStreams ? MAX_STREAMS : m_streams.GetCount();
+    config.flags = m_fDynamicStreams ? CaptureFlag_DynamicStreams : 0;
+#else
+    config.stream_count = m_streams.GetCount();
+    config.flags = 0;
+#endif
+    config.get_sample_buffers = GetSampleBuffers;
+    config.free_sample = FreeSample;
+
+    PpboxCaptureLayout layout(config);
+    ForEach(m_streams, [&layout](PpboxStreamSink * pStream){
+        layout.AddStream(pStream->GetCore()->m_dwIdentifier, pStream->GetCore()->m_fVideo);
+        return S_OK;
+    });
 
-            DWORD dwId;
-            hr = spStream->GetIdentifier(&dwId);
-            if (FAILED(hr))
-            {
-                break;
-            }
-            else if (dwId == dwStreamSinkIdentifier)
-            {
-                spResult = spStream;
-                break;
-            }
-        }
+    return layout.GetValue();
+}
+
+//-------------------------------------------------------------------
+// CreateCapture
+// Creates and connects a capture handle, or takes a pooled one. Touches
+// no sink state, so it can run without the sink lock. An empty
+// destination is none at all, see GetDestinationsFromConfigurations.
+//-------------------------------------------------------------------
+
+PP_handle PpboxMediaSink::CreateCapture(PCWSTR pszDest, JUST_CaptureConfigData & config, UINT64 uLayout)
+{
+    CW2A pszDestA(pszDest);
+
+    if (m_fCapturePool)
+    {
+        return PpboxCapturePool::Instance().Acquire(pszDestA, uLayout, config);
+    }
+
+    PP_handle hCapture = JUST_CaptureCreate("winrt", *pszDest ? (LPCSTR)pszDestA : NULL);
+    JUST_CaptureInit(hCapture, &config);
+
+    return hCapture;
+}
+
+//-------------------------------------------------------------------
+// ReleaseCapture
+// Gives a handle that never became a destination back to the pool.
+// Without the pool, handles are left as they always were. Destinations
+// give theirs back themselves, see PpboxCaptureDest.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::ReleaseCapture(PCWSTR pszDest, PP_handle hCapture, UINT64 uLayout)
+{
+    if (m_fCapturePool)
+    {
+        CW2A pszDestA(pszDest);
+        PpboxCapturePool::Instance().Release(pszDestA, uLayout, hCapture);
+    }
+}
+
+//-------------------------------------------------------------------
+// AddCapture
+// Makes a created handle a destination of the sink. Called with the
+// sink lock held.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::AddCapture(PCWSTR pszDest, PP_handle hCapture, UINT64 uLayout)
+{
+    if (m_cCaptures >= MAX_DESTINATIONS)
+    {
+        return E_INVALIDARG;
+    }
+
+    DWORD iDest = m_cCaptures;
+    PpboxCaptureDest * pDest = CreateCaptureDest(hCapture, uLayout);
+    if (pDest == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    PpboxCaptureDest & dest = *pDest;
+    if (m_fCapturePool)
+    {
+        CW2A pszDestA(pszDest);
+        dest.pPool = &PpboxCapturePool::Instance();
+        dest.dest = pszDestA;
+    }
+    dest.pExecutor = m_pExecutor;
+    if (m_pExecutor)
+    {
+        dest.pQueue = new (std::nothrow) PpboxDeliveryQueue(dest.hCapture, m_pExecutor, m_fPriority != FALSE);
+    }
+
+    ForEach(m_streams, [&dest](PpboxStreamSink * pStream){
+        JUST_StreamInfo info;
+        DWORD dwId = 0;
+        if (SUCCEEDED(pStream->GetStreamInfo(info)) && SUCCEEDED(pStream->GetIdentifier(&dwId)))
+        {
+            JUST_CaptureSetStream(dest.hCapture, dwId, &info);
+        }
+        return S_OK;
+    });
+
+    m_GopCache.Replay(pDest, iDest);
+
+    m_Captures[iDest] = pDest;
+    m_Destinations.push_back(pszDest);
+    ++m_cCaptures;
+
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// IMFMediaSink methods
+//-------------------------------------------------------------------
+
+//-------------------------------------------------------------------
+// GetCharacteristics
+// Returns capabilities flags.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::GetCharacteristics(DWORD* pdwCharacteristics)
+{
+    if (pdwCharacteristics == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = S_OK;
+
+    AutoLock lock(m_critSec);
+
+    hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+		*pdwCharacteristics = MEDIASINK_RATELESS;
+    }
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// AddStreamSink
+// Also while capturing, with "DynamicStreams": the capture handles learn
+// about the new track when its type is set, and it starts along with the
+// sink. The stream is set up before the sink lock is taken, so the other
+// streams only wait for it to be inserted. Added with a type while the
+// clock runs, the stream takes the type at once and starts.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink:: AddStreamSink(DWORD dwStreamSinkIdentifier, IMFMediaType *pMediaType, IMFStreamSink **ppStreamSink)
+{
+    PpboxStreamSink *pStream = nullptr;
+    ComPtr<IMFStreamSink> spMFStream;
+
+    // Tracks are indexed by identifier everywhere.
+    HRESULT hr = dwStreamSinkIdentifier < MAX_STREAMS ? S_OK : MF_E_INVALIDSTREAMNUMBER;
+
+    if (SUCCEEDED(hr))
+    {
+        pStream = new PpboxStreamSink(dwStreamSinkIdentifier);
+        if (pStream == nullptr)
+        {
+            hr = E_OUTOFMEMORY;
+        }
+        spMFStream.Attach(pStream);
+    }
+
+    // Initialize the stream.
+    if (SUCCEEDED(hr))
+    {
+        hr = pStream->Initialize(this, pMediaType);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        pStream->SetCopyOutThreshold(m_uCopyOutThreshold);
+    }
+
+    AutoLock lock(m_critSec);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = CheckShutdown();
+    }
+
+    // The capture handles were told a fixed number of streams.
+    if (SUCCEEDED(hr) && m_cCaptures > 0 && !m_fDynamicStreams)
+    {
+        hr = MF_E_INVALIDREQUEST;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ComPtr<PpboxStreamSink> spExisting;
+        if (SUCCEEDED(FindStream(dwStreamSinkIdentifier, &spExisting)))
+        {
+            hr = MF_E_STREAMSINK_EXISTS;
+        }
+    }
+
+    if (SUCCEEDED(hr) && pMediaType != nullptr)
+    {
+        TraceMediaType(dwStreamSinkIdentifier, pMediaType);
+    }
+
+    // The clock will not start it, see SetCurrentMediaType.
+    if (SUCCEEDED(hr) && pMediaType != nullptr && m_state == STATE_STARTED)
+    {
+        hr = pStream->SetCurrentMediaType(pMediaType);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_streams.InsertBack(pStream);
+    }
+
+    if (FAILED(hr) && pStream != nullptr)
+    {
+        pStream->Shutdown();
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *ppStreamSink = spMFStream.Detach();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// RemoveStreamSink
+// The track ends where it is: samples already created still go out, but
+// it is dropped from the GOP cache, so destinations attached later never
+// hear of it. The backend has no call to forget a track, its identifier
+// may be added again with another type.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink:: RemoveStreamSink(DWORD dwStreamSinkIdentifier)
+{
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    auto pos = m_streams.FrontPosition();
+    auto end = m_streams.EndPosition();
+    ComPtr<PpboxStreamSink> spStream;
+
+    if (SUCCEEDED(hr))
+    {
+
+        for (; pos != end; pos = m_streams.Next(pos))
+        {
+            hr = m_streams.GetItemByPosition(pos, &spStream);
+            if (FAILED(hr))
+            {
+                break;
+            }
+
+            DWORD dwId;
+            hr = spStream->GetIdentifier(&dwId);
+            if (FAILED(hr) || dwId == dwStreamSinkIdentifier)
+            {
+                break;
+            }
+        }
+
+        if (pos == end)
+        {
+            hr = MF_E_INVALIDSTREAMNUMBER;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_streams.RemoveItemByPosition(pos, nullptr);
+        spStream->Shutdown();
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_GopCache.RemoveStream(dwStreamSinkIdentifier);
+        for (DWORD i = 0; i < m_cCaptures; ++i)
+        {
+            m_Captures[i]->dwSkipStreams &= ~StreamBit(dwStreamSinkIdentifier);
+        }
+    }
+
+    TRACEHR_RET(hr);
+}
+
+HRESULT PpboxMediaSink:: GetStreamSinkCount(DWORD *pcStreamSinkCount)
+{
+    if (pcStreamSinkCount == NULL)
+    {
+        return E_POINTER;
+    }
+
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+        *pcStreamSinkCount = m_streams.GetCount();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+HRESULT PpboxMediaSink:: GetStreamSinkByIndex(DWORD dwIndex, IMFStreamSink **ppStreamSink)
+{
+    if (ppStreamSink == NULL)
+    {
+        return E_POINTER;
+    }
+
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    ComPtr<PpboxStreamSink> spStream;
+
+    if (SUCCEEDED(hr))
+    {
+        auto pos = m_streams.FrontPosition();
+        auto end = m_streams.EndPosition();
+        DWORD dwCurrent = 0;
+
+        for (;pos != end && dwCurrent < dwIndex; pos = m_streams.Next(pos), ++dwCurrent)
+        {
+            // Just move to proper position
+        }
 
         if (pos == end)
         {
-            hr = MF_E_INVALIDSTREAMNUMBER;
+            hr = MF_E_UNEXPECTED;
+        }
+        else
+        {
+            hr = m_streams.GetItemByPosition(pos, &spStream);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *ppStreamSink = spStream.Detach();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+HRESULT PpboxMediaSink:: GetStreamSinkById(DWORD dwStreamSinkIdentifier, IMFStreamSink **ppStreamSink)
+{
+    if (ppStreamSink == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    ComPtr<PpboxStreamSink> spResult;
+
+    if (SUCCEEDED(hr))
+    {
+        auto pos = m_streams.FrontPosition();
+        auto end = m_streams.EndPosition();
+
+        for (;pos != end; pos = m_streams.Next(pos))
+        {
+            ComPtr<PpboxStreamSink> spStream;
+            hr = m_streams.GetItemByPosition(pos, &spStream);
+            if (FAILED(hr))
+            {
+                break;
+            }
+
+            DWORD dwId;
+            hr = spStream->GetIdentifier(&dwId);
+            if (FAILED(hr))
+            {
+                break;
+            }
+            else if (dwId == dwStreamSinkIdentifier)
+            {
+                spResult = spStream;
+                break;
+            }
+        }
+
+        if (pos == end)
+        {
+            hr = MF_E_INVALIDSTREAMNUMBER;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        assert(spResult);
+        *ppStreamSink = spResult.Detach();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+HRESULT PpboxMediaSink:: SetPresentationClock(IMFPresentationClock *pPresentationClock)
+{
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    // If we already have a clock, remove ourselves from that clock's
+    // state notifications.
+    if (SUCCEEDED(hr))
+    {
+        if (m_spClock)
+        {
+            hr = m_spClock->RemoveClockStateSink(this);
+        }
+    }
+
+    // Register ourselves to get state notifications from the new clock.
+    if (SUCCEEDED(hr))
+    {
+        if (pPresentationClock)
+        {
+            hr = pPresentationClock->AddClockStateSink(this);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // Release the pointer to the old clock.
+        // Store the pointer to the new clock.
+        m_spClock = pPresentationClock;
+    }
+
+    TRACEHR_RET(hr);
+}
+
+HRESULT PpboxMediaSink:: GetPresentationClock(IMFPresentationClock **ppPresentationClock)
+{
+    if (ppPresentationClock == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+        if (m_spClock == NULL)
+        {
+            hr = MF_E_NO_CLOCK; // There is no presentation clock.
+        }
+        else
+        {
+            // Return the pointer to the caller.
+            *ppPresentationClock = m_spClock.Get();
+            (*ppPresentationClock)->AddRef();
+        }
+    }
+
+    TRACEHR_RET(hr);
+}
+
+
+//-------------------------------------------------------------------
+// Shutdown
+// Shuts down the Sinkand releases all reSinks.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::Shutdown()
+{
+    EnterCriticalSection(&m_critSec);
+
+    HRESULT hr = S_OK;
+
+    PpboxStreamSink *pStream = NULL;
+
+    hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+        // Shut down the stream objects.
+        // Set the state.
+        // Samples waiting for the capture handles go to those up by now,
+        // with the ones held back; the destinations are open.
+        if (!m_fCaptureReady)
+        {
+            SetCaptureReady(MF_E_SHUTDOWN);
+        }
+        FlushPacer();
+
+        m_state = STATE_SHUTDOWN;
+
+        // Whatever is still spilled is lost with the session.
+        m_SpillRing.Close();
+        m_GopCache.Clear();
+        m_KeyIndex.Close();
+        m_Trace.Close();
+
+        // Samples queued already are still delivered: the destinations,
+        // and their queues, live on with the samples put to them. A
+        // pooled handle goes back with the last of them.
+        for (DWORD i = 0; i < m_cCaptures; ++i)
+        {
+            m_Captures[i]->Release();
+            m_Captures[i] = NULL;
+        }
+        m_cCaptures = 0;
+        m_Destinations.clear();
+
+        if (m_spStatsTimer)
+        {
+            MFCancelWorkItem(m_StatsKey);
+            m_spStatsTimer.Reset();
+        }
+        m_spStatsSet.Reset();
+        m_spStatusSet.Reset();
+
+        if (m_spIndexTimer)
+        {
+            MFCancelWorkItem(m_IndexKey);
+            m_spIndexTimer.Reset();
+        }
+
+        if (m_spPacingTimer)
+        {
+            if (m_PacingKey)
+            {
+                MFCancelWorkItem(m_PacingKey);
+                m_PacingKey = 0;
+            }
+            m_spPacingTimer.Reset();
+        }
+
+        if (m_spSpillTimer)
+        {
+            if (m_SpillKey)
+            {
+                MFCancelWorkItem(m_SpillKey);
+                m_SpillKey = 0;
+            }
+            m_spSpillTimer.Reset();
+        }
+    }
+
+    LeaveCriticalSection(&m_critSec);
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// IMFMediaSink methods
+//-------------------------------------------------------------------
+
+//-------------------------------------------------------------------
+// OnClockStart
+// With "WarmRestart", a start after a stop opens a new segment: all
+// stays set up, the next sample of each stream is marked discontinuous
+// and carries its format again, and times count from the new start.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink:: OnClockStart(MFTIME hnsSystemTime, LONGLONG llClockStartOffset)
+{
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+        TRACE(TRACE_LEVEL_LOW, L"OnClockStart ts=%I64d\n", llClockStartOffset);
+        m_Trace.AddClock(PpboxTraceRecorder::Clock_Start, llClockStartOffset, 1.0f);
+        m_uClockStartTime = PpboxGetMicroseconds();
+        m_uStartLatency = 0;
+
+        if (m_fWarmRestart && m_state == STATE_STOPPED)
+        {
+            BOOL fFromSample = llClockStartOffset == PRESENTATION_CURRENT_POSITION;
+            m_pCore->BeginSegment(fFromSample ? 0 : (UINT64)llClockStartOffset, fFromSample != FALSE);
+            ForEach(m_streams, [](PpboxStreamSink * pStream){
+                pStream->GetCore()->m_fSegmentStart = true;
+                return S_OK;
+            });
+
+            // Destinations attached later start with the new segment.
+            m_GopCache.Clear();
+            m_KeyIndex.NewSegment();
+        }
+
+        ResumePacing();
+
+        // Start each stream.
+        //_llStartTime = llClockStartOffset;
+        hr = ForEach(m_streams, [llClockStartOffset](PpboxStreamSink * pStream){
+            return pStream->Start(llClockStartOffset);
+        });
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_state = STATE_STARTED;
+    }
+
+    TRACEHR_RET(hr);
+}
+
+
+HRESULT PpboxMediaSink:: OnClockStop(MFTIME hnsSystemTime)
+{
+    HRESULT hr = S_OK;
+
+    {
+        AutoLock lock(m_critSec);
+
+        hr = CheckShutdown();
+
+        if (SUCCEEDED(hr))
+        {
+            m_Trace.AddClock(PpboxTraceRecorder::Clock_Stop, 0, 1.0f);
+
+            // Stop each stream
+            hr = ForEach(m_streams, [](PpboxStreamSink * pStream){
+                return pStream->Stop();
+            });
+            m_state = STATE_STOPPED;
+
+            // The segment ends with everything taken so far. Replaying
+            // that stops getting anywhere gives up; what is left is
+            // dropped and counted, it must not open the next segment.
+            while (m_fWarmRestart && !m_SpillRing.IsEmpty())
+            {
+                ULONG cSpilled = m_SpillRing.GetCount();
+                if (FAILED(DrainSpill(TRUE)) || m_SpillRing.GetCount() >= cSpilled)
+                {
+                    break;
+                }
+            }
+            if (m_fWarmRestart && !m_SpillRing.IsEmpty())
+            {
+                TRACE(TRACE_LEVEL_LOW, L"PpboxMediaSink::OnClockStop dropped %u spilled samples\r\n", m_SpillRing.GetCount());
+                DropSpill();
+            }
+
+            // Nothing stays held back across a stop, the pacer measures anew.
+            FlushPacer();
+            m_Pacer.Reset();
+            m_fClockPaused = FALSE;
+
+            m_Trace.Flush();
+        }
+    }
+
+    // The index is complete up to the stop. Closed already after a
+    // shutdown, then there is nothing to write.
+    m_KeyIndex.Flush();
+
+    TRACEHR_RET(hr);
+}
+
+
+//-------------------------------------------------------------------
+// OnClockPause / OnClockRestart
+// The sink itself does not pause, but the clock stops all the same,
+// and with it pacing time, see GetPacingTime.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink:: OnClockPause(MFTIME hnsSystemTime)
+{
+    AutoLock lock(m_critSec);
+    m_Trace.AddClock(PpboxTraceRecorder::Clock_Pause, 0, 1.0f);
+    if (SUCCEEDED(CheckShutdown()))
+    {
+        m_fClockPaused = TRUE;
+    }
+    return MF_E_INVALID_STATE_TRANSITION;
+}
+
+
+HRESULT PpboxMediaSink:: OnClockRestart(MFTIME hnsSystemTime)
+{
+    AutoLock lock(m_critSec);
+    m_Trace.AddClock(PpboxTraceRecorder::Clock_Restart, 0, 1.0f);
+    if (SUCCEEDED(CheckShutdown()))
+    {
+        ResumePacing();
+
+        // Streams given their type while paused were left for now.
+        if (m_state == STATE_STARTED)
+        {
+            ForEach(m_streams, [](PpboxStreamSink * pStream){
+                if (pStream->IsReady())
+                {
+                    pStream->Start(PRESENTATION_CURRENT_POSITION);
+                }
+                return S_OK;
+            });
+        }
+    }
+    return MF_E_INVALID_STATE_TRANSITION;
+}
+
+
+HRESULT PpboxMediaSink:: OnClockSetRate(MFTIME hnsSystemTime, float flRate)
+{
+    AutoLock lock(m_critSec);
+    m_Trace.AddClock(PpboxTraceRecorder::Clock_SetRate, 0, flRate);
+    return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+// Public non-interface methods
+//-------------------------------------------------------------------
+
+//-------------------------------------------------------------------
+// SpillSample
+// Appends pSample to the spill ring if the backend is behind, if
+// earlier samples are still spilled (to keep the order), or if fForce.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::SpillSample(DWORD dwStream, IMFSample *pSample, BOOL fForce)
+{
+    if (!m_SpillRing.IsOpen())
+    {
+        return S_FALSE;
+    }
+
+    if (!fForce && m_SpillRing.IsEmpty() && (UINT32)m_pCore->m_cInFlight < m_uSpillLimit)
+    {
+        return S_FALSE;
+    }
+
+    JUST_Sample sample;
+    ComPtr<PpboxStreamSink> spStream;
+    HRESULT hr = FindStream(dwStream, &spStream);
+    BYTE * pPayload = NULL;
+
+    if (SUCCEEDED(hr))
+    {
+        hr = CreateSampleInfo(sample, pSample);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        sample.itrack = dwStream;
+
+        // When the ring is full, push the oldest samples to the backend
+        // regardless of the limit. Memory grows, but order is kept.
+        while ((pPayload = m_SpillRing.Reserve(sample.size)) == NULL)
+        {
+            if (m_SpillRing.IsEmpty())
+            {
+                // Too big for the ring at all.
+                return S_FALSE;
+            }
+            hr = DrainSpill(TRUE);
+            if (FAILED(hr))
+            {
+                break;
+            }
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        unsigned long cbCopied = 0;
+        hr = CopySampleBuffers(&MFSampleOps, pSample, pPayload, sample.size, &cbCopied) ? S_OK : E_FAIL;
+        if (SUCCEEDED(hr))
+        {
+            sample.size = cbCopied;
+            // Replayed later, the sample keeps the format it came in.
+            // Indexed when replayed, with the time it is recorded at.
+            m_SpillRing.Commit(sample, AdvanceFormat(sample, spStream->GetCore()));
+
+            // The source may go quiet, replaying must not wait for it.
+            ScheduleSpillDrain();
+        }
+    }
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// DrainSpill
+// Replays spilled samples while the backend is below the limit. With
+// fForce, replays the oldest sample unconditionally. A sample that
+// cannot be replayed is dropped, not retried, and does not fail the
+// caller.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::DrainSpill(BOOL fForce)
+{
+    JUST_Sample sample;
+    BYTE const * pPayload = NULL;
+    PpboxStreamFormat * pFormat = NULL;
+
+    while (m_SpillRing.Front(sample, &pPayload, &pFormat))
+    {
+        if (!fForce && ((UINT32)m_pCore->m_cInFlight >= m_uSpillLimit
+            || (m_MemoryPolicy == MemoryPolicy_Spill && m_pCore->IsOverBudget())))
+        {
+            break;
+        }
+
+        // Samples of a stream removed meanwhile are dropped.
+        ComPtr<PpboxStreamSink> spStream;
+        HRESULT hr = FindStream(sample.itrack, &spStream);
+        if (SUCCEEDED(hr))
+        {
+            hr = CreateSampleFromBuffer(sample, pPayload, sample.size, spStream->GetCore(), pFormat)
+                ? S_OK : E_OUTOFMEMORY;
+            if (SUCCEEDED(hr))
+            {
+                spStream->GetCore()->OnSampleQueued(sample.size);
+                IndexSample(sample, sample.size);
+                PutSample(sample);
+            }
+            else
+            {
+                PpboxInterlockedIncrement(&spStream->GetCore()->m_cDropped);
+                TRACE(TRACE_LEVEL_LOW, L"PpboxMediaSink::DrainSpill dropped a sample of stream %u, hr = %08x\r\n", sample.itrack, hr);
+            }
+        }
+
+        m_SpillRing.Pop();
+
+        if (fForce)
+        {
+            break;
+        }
+    }
+
+    return S_OK;
+}
+
+//-------------------------------------------------------------------
+// DropSpill
+// Empties the spill ring, counting the samples as dropped by their
+// streams.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::DropSpill()
+{
+    JUST_Sample sample;
+    BYTE const * pPayload = NULL;
+    PpboxStreamFormat * pFormat = NULL;
+
+    while (m_SpillRing.Front(sample, &pPayload, &pFormat))
+    {
+        ComPtr<PpboxStreamSink> spStream;
+        if (SUCCEEDED(FindStream(sample.itrack, &spStream)))
+        {
+            PpboxInterlockedIncrement(&spStream->GetCore()->m_cDropped);
+        }
+        m_SpillRing.Pop();
+    }
+}
+
+//-------------------------------------------------------------------
+// OnSpillTimer
+// Replays what the backend takes by now, and looks again later if
+// samples are still spilled.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::OnSpillTimer(IMFAsyncResult *pResult)
+{
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+        m_SpillKey = 0;
+        DrainSpill(FALSE);
+        hr = ScheduleSpillDrain();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// GetLatency
+// Summary of a stream's latency histogram for one stage, see
+// PpboxLatencyStage.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::GetLatency(DWORD dwStream, PpboxLatencyStage stage, PpboxLatencySummary & summary)
+{
+    if (stage >= Latency_Count)
+    {
+        return E_INVALIDARG;
+    }
+
+    AutoLock lock(m_critSec);
+
+    ComPtr<PpboxStreamSink> spStream;
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+        hr = FindStream(dwStream, &spStream);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        spStream->GetCore()->m_Latency[stage].GetSummary(summary);
+    }
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// GetStats
+// Snapshot of the counters. Rates are over the time since the
+// previous GetStats; the periodic snapshot keeps its own, so polling
+// does not skew the bitrate estimate.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::GetStats(PpboxSinkStats & stats)
+{
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+        TakeStats(stats, m_StatsPolled);
+    }
+
+    TRACEHR_RET(hr);
+}
+
+// Rates are over the time since prev, which becomes stats. Called with
+// the sink lock held.
+void PpboxMediaSink::TakeStats(PpboxSinkStats & stats, PpboxSinkStats & prev)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.uTime = PpboxGetMicroseconds();
+    stats.cInFlight = (unsigned long)m_pCore->m_cInFlight;
+    stats.cSpilled = m_SpillRing.GetCount();
+
+    ForEach(m_streams, [&stats](PpboxStreamSink * pStream){
+        if (stats.cStreams < MAX_STREAMS)
+        {
+            pStream->GetCore()->GetStats(stats.streams[stats.cStreams++]);
+        }
+        return S_OK;
+    });
+    for (DWORD i = 0; i < stats.cStreams; ++i)
+    {
+        stats.streams[i].cbSpilled = m_SpillRing.GetStreamPayload(stats.streams[i].dwIdentifier);
+    }
+
+    stats.uCaptureReadyTime = m_uCaptureReadyTime;
+    stats.uFirstSampleTime = m_uFirstSampleTime;
+    stats.uStartLatency = m_uStartLatency;
+
+    stats.cDests = m_cCaptures;
+    for (DWORD i = 0; i < m_cCaptures; ++i)
+    {
+        PpboxCaptureDest & dest = *m_Captures[i];
+        stats.dests[i].cInFlight = (unsigned long)dest.cInFlight;
+        stats.dests[i].cPut = (unsigned long)dest.cPut;
+        stats.dests[i].cSkipped = (unsigned long)dest.cSkipped;
+        stats.dests[i].fSkipping = dest.dwSkipStreams != 0;
+    }
+
+    UINT64 uElapsed = stats.uTime - prev.uTime;
+    for (DWORD i = 0; i < stats.cStreams && prev.uTime != 0 && uElapsed > 0; ++i)
+    {
+        PpboxStreamStats & stream = stats.streams[i];
+        for (DWORD j = 0; j < prev.cStreams; ++j)
+        {
+            PpboxStreamStats const & prevStream = prev.streams[j];
+            if (prevStream.dwIdentifier == stream.dwIdentifier)
+            {
+                stream.uSamplesPerSecond = (unsigned long)((stream.cSamples - prevStream.cSamples) * 1000000ULL / uElapsed);
+                stream.uBytesPerSecond = (stream.cbSamples - prevStream.cbSamples) * 1000000ULL / uElapsed;
+                break;
+            }
+        }
+    }
+
+    for (DWORD i = 0; i < stats.cStreams && m_fBitrateFeedback; ++i)
+    {
+        m_Bitrate.GetEstimate(stats.streams[i]);
+    }
+
+    prev = stats;
+}
+
+//-------------------------------------------------------------------
+// SetStatsCallback
+// pfnCallback gets every periodic snapshot ("StatsInterval"), on a work
+// queue thread without the sink lock. A snapshot taken before the
+// callback was changed may still go to the old one.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::SetStatsCallback(PpboxStatsCallback pfnCallback, void * pContext)
+{
+    AutoLock lock(m_critSec);
+
+    m_pfnStats = pfnCallback;
+    m_pStatsContext = pContext;
+}
+
+//-------------------------------------------------------------------
+// GetRecommendedBitrate
+// Last recommendation for the stream, 0 until the first estimate.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::GetRecommendedBitrate(DWORD dwStream, UINT32 *puBitrate)
+{
+    if (puBitrate == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr) && !m_fBitrateFeedback)
+    {
+        hr = MF_E_NOT_AVAILABLE;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *puBitrate = m_Bitrate.GetRecommendedBitrate(dwStream);
+    }
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// SetBitrateCallback
+// pfnCallback gets every recommendation that changed enough, on a work
+// queue thread without the sink lock, as SetStatsCallback.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::SetBitrateCallback(PpboxBitrateCallback pfnCallback, void * pContext)
+{
+    AutoLock lock(m_critSec);
+
+    m_pfnBitrate = pfnCallback;
+    m_pBitrateContext = pContext;
+}
+
+//-------------------------------------------------------------------
+// OnStatsTimer
+// Takes the periodic snapshot and schedules the next one. The snapshot
+// goes to the callbacks and the configuration set without the sink
+// lock, whatever they do cannot hold up samples.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::OnStatsTimer(IMFAsyncResult *pResult)
+{
+    PpboxSinkStats stats;
+    DWORD dwRaise = 0;
+    UINT32 bitrates[MAX_STREAMS] = {0};
+    PpboxStatsCallback pfnStats = NULL;
+    void * pStatsContext = NULL;
+    PpboxBitrateCallback pfnBitrate = NULL;
+    void * pBitrateContext = NULL;
+    ComPtr<ABI::Windows::Foundation::Collections::IPropertySet> spStatsSet;
+    HRESULT hr = S_OK;
+
+    {
+        AutoLock lock(m_critSec);
+
+        hr = CheckShutdown();
+
+        // A run that was due when the timer was stopped, or replaced by
+        // a new one, has nothing to do.
+        if (SUCCEEDED(hr))
+        {
+            ComPtr<IUnknown> spState;
+            ComPtr<IUnknown> spTimer;
+            pResult->GetState(&spState);
+            if (!m_spStatsTimer || FAILED(m_spStatsTimer.As(&spTimer)) || spState.Get() != spTimer.Get())
+            {
+                return S_OK;
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            TakeStats(stats, m_StatsPrev);
+        }
+
+        if (SUCCEEDED(hr) && m_fBitrateFeedback)
+        {
+            dwRaise = m_Bitrate.Update(stats);
+            for (DWORD i = 0; i < MAX_STREAMS; ++i)
+            {
+                if (dwRaise & (1UL << i))
+                {
+                    bitrates[i] = m_Bitrate.GetRecommendedBitrate(i);
+                }
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            pfnStats = m_pfnStats;
+            pStatsContext = m_pStatsContext;
+            pfnBitrate = m_pfnBitrate;
+            pBitrateContext = m_pBitrateContext;
+            spStatsSet = m_spStatsSet;
+            hr = ScheduleStatsTimer();
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        for (DWORD i = 0; i < MAX_STREAMS; ++i)
+        {
+            if ((dwRaise & (1UL << i)) == 0)
+            {
+                continue;
+            }
+            if (pfnBitrate)
+            {
+                pfnBitrate(pBitrateContext, i, bitrates[i]);
+            }
+            if (spStatsSet)
+            {
+                PublishBitrateToConfigurations(spStatsSet.Get(), i, bitrates[i]);
+            }
+        }
+
+        if (pfnStats)
+        {
+            pfnStats(pStatsContext, stats);
+        }
+        if (spStatsSet)
+        {
+            PublishStatsToConfigurations(spStatsSet.Get(), stats);
+        }
+    }
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// StartStatsTimer
+// Starts the periodic snapshot. A timer running already is kept, it
+// picks up a new interval with its next run.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::StartStatsTimer()
+{
+    HRESULT hr = S_OK;
+
+    if (m_spStatsTimer)
+    {
+        return S_OK;
+    }
+
+    m_spStatsTimer = Make<PpboxAsyncCallback<PpboxMediaSink>>(this, &PpboxMediaSink::OnStatsTimer);
+    if (!m_spStatsTimer)
+    {
+        hr = E_OUTOFMEMORY;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = ScheduleStatsTimer();
+    }
+
+    if (FAILED(hr))
+    {
+        m_spStatsTimer.Reset();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+// The timer is its own state, so OnStatsTimer can tell a stale run.
+HRESULT PpboxMediaSink::ScheduleStatsTimer()
+{
+    // Negative: a timeout, not a deadline.
+    HRESULT hr = MFScheduleWorkItem(m_spStatsTimer.Get(), m_spStatsTimer.Get(), -(INT64)m_uStatsInterval, &m_StatsKey);
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// OnIndexTimer
+// Writes the keyframe index entries added since the last write. The
+// write runs without the sink lock, samples go on meanwhile.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::OnIndexTimer(IMFAsyncResult *pResult)
+{
+    HRESULT hr = S_OK;
+
+    {
+        AutoLock lock(m_critSec);
+
+        hr = CheckShutdown();
+
+        if (SUCCEEDED(hr))
+        {
+            hr = StartIndexTimer();
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_KeyIndex.Flush();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+HRESULT PpboxMediaSink::StartIndexTimer()
+{
+    HRESULT hr = S_OK;
+
+    if (!m_spIndexTimer)
+    {
+        m_spIndexTimer = Make<PpboxAsyncCallback<PpboxMediaSink>>(this, &PpboxMediaSink::OnIndexTimer);
+        if (!m_spIndexTimer)
+        {
+            hr = E_OUTOFMEMORY;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = MFScheduleWorkItem(m_spIndexTimer.Get(), NULL, -(INT64)KEYINDEX_FLUSH_MS, &m_IndexKey);
+    }
+
+    TRACEHR_RET(hr);
+}
+
+//-------------------------------------------------------------------
+// GetCaptureStatus
+// S_FALSE while the capture handles come up, then how that went.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::GetCaptureStatus()
+{
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_fCaptureReady ? m_hrCapture : S_FALSE;
+    }
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// OnCaptureInit
+// Attaches the pending destinations one by one. Connecting is done
+// without the sink lock, the streams go on taking samples meanwhile.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::OnCaptureInit(IMFAsyncResult *pResult)
+{
+    HRESULT hr = S_OK;
+
+    for (;;)
+    {
+        std::wstring destination;
+        JUST_CaptureConfigData config;
+        UINT64 uLayout = 0;
+
+        {
+            AutoLock lock(m_critSec);
+
+            hr = CheckShutdown();
+            if (SUCCEEDED(hr) && m_PendingDestinations.empty())
+            {
+                SetCaptureReady(S_OK);
+                break;
+            }
+            if (SUCCEEDED(hr) && m_cCaptures >= MAX_DESTINATIONS)
+            {
+                hr = E_INVALIDARG;
+                SetCaptureReady(hr);
+            }
+            if (FAILED(hr))
+            {
+                break;
+            }
+
+            destination = m_PendingDestinations.front();
+            m_PendingDestinations.erase(m_PendingDestinations.begin());
+            uLayout = GetCaptureConfig(config);
+        }
+
+        PP_handle hCapture = CreateCapture(destination.c_str(), config, uLayout);
+
+        AutoLock lock(m_critSec);
+
+        hr = CheckShutdown();
+        if (SUCCEEDED(hr))
+        {
+            hr = AddCapture(destination.c_str(), hCapture, uLayout);
+        }
+        if (FAILED(hr))
+        {
+            // The handle never saw a sample. Unless the sink was shut
+            // down meanwhile, the samples waiting must not wait forever.
+            ReleaseCapture(destination.c_str(), hCapture, uLayout);
+            if (hr != MF_E_SHUTDOWN)
+            {
+                SetCaptureReady(hr);
+            }
+            break;
         }
     }
 
+    TRACEHR_RET(hr);
+}
+
+HRESULT PpboxMediaSink::StartCaptureInit()
+{
+    HRESULT hr = S_OK;
+
+    ComPtr<IMFAsyncCallback> spCallback = Make<PpboxAsyncCallback<PpboxMediaSink>>(this, &PpboxMediaSink::OnCaptureInit);
+    if (!spCallback)
+    {
+        hr = E_OUTOFMEMORY;
+    }
+
+    // Connecting blocks, which the long function queue is meant for.
     if (SUCCEEDED(hr))
     {
-        assert(spResult);
-        *ppStreamSink = spResult.Detach();
+        hr = MFPutWorkItem2(MFASYNC_CALLBACK_QUEUE_LONG_FUNCTION, 0, spCallback.Get(), NULL);
     }
 
     TRACEHR_RET(hr);
 }
 
-HRESULT PpboxMediaSink:: SetPresentationClock(IMFPresentationClock *pPresentationClock)
+//-------------------------------------------------------------------
+// SetCaptureReady
+// Lets the samples held meanwhile go, in order, and signals readiness.
+// Called with the sink lock held.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::SetCaptureReady(HRESULT hrStatus)
 {
-    AutoLock lock(m_critSec);
+    m_hrCapture = hrStatus;
+    m_fCaptureReady = TRUE;
+    m_uCaptureReadyTime = PpboxGetMicroseconds() - m_uActivateTime;
+    TRACE(TRACE_LEVEL_LOW, L"PpboxMediaSink: %u capture handles ready after %I64u us, hr = 0x%x\r\n", 
+        m_cCaptures, m_uCaptureReadyTime, hrStatus);
+
+    std::vector<JUST_Sample> samples;
+    samples.swap(m_StartupSamples);
+    m_cbStartup = 0;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        PutSample(samples[i]);
+    }
 
-    HRESULT hr = CheckShutdown();
+    if (m_spStatusSet)
+    {
+        PublishCaptureStatusToConfigurations(m_spStatusSet.Get(), hrStatus);
+    }
+    if (m_hCaptureReady)
+    {
+        SetEvent(m_hCaptureReady);
+    }
+}
 
-    // If we already have a clock, remove ourselves from that clock's
-    // state notifications.
-    if (SUCCEEDED(hr))
+//-------------------------------------------------------------------
+// HoldSample
+// Keeps a sample until the capture handles are ready. If the startup
+// buffer fills up, all of it goes and each stream starts again at its
+// next sync sample, the rest could not be decoded anyway.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::HoldSample(JUST_Sample & sample)
+{
+    PpboxSampleContext * pContext = (PpboxSampleContext *)sample.context;
+    DWORD dwStreamBit = StreamBit(sample.itrack);
+
+    if (m_cbStartup + pContext->cbData > m_cbStartupLimit)
     {
-        if (m_spClock)
+        DropStartupSamples();
+        m_dwStartupSkip = (DWORD)-1;
+    }
+
+    if ((m_dwStartupSkip & dwStreamBit) && (sample.flags & JUST_SampleFlag::sync)
+        && pContext->cbData <= m_cbStartupLimit)
+    {
+        m_dwStartupSkip &= ~dwStreamBit;
+    }
+
+    if (m_dwStartupSkip & dwStreamBit)
+    {
+        PpboxInterlockedIncrement(&pContext->pStream->m_cDropped);
+        if (InterlockedDecrement(&pContext->cRef) == 0)
         {
-            hr = m_spClock->RemoveClockStateSink(this);
+            ReleaseSample(pContext);
         }
+        return;
     }
 
-    // Register ourselves to get state notifications from the new clock.
-    if (SUCCEEDED(hr))
+    m_StartupSamples.push_back(sample);
+    m_cbStartup += pContext->cbData;
+}
+
+void PpboxMediaSink::DropStartupSamples()
+{
+    for (size_t i = 0; i < m_StartupSamples.size(); ++i)
     {
-        if (pPresentationClock)
+        PpboxSampleContext * pContext = (PpboxSampleContext *)m_StartupSamples[i].context;
+        PpboxInterlockedIncrement(&pContext->pStream->m_cDropped);
+        if (InterlockedDecrement(&pContext->cRef) == 0)
         {
-            hr = pPresentationClock->AddClockStateSink(this);
+            ReleaseSample(pContext);
         }
     }
+    m_StartupSamples.clear();
+    m_cbStartup = 0;
+}
+
+//-------------------------------------------------------------------
+// OnPacingTimer
+// Releases the held samples that are due, and schedules the next
+// release if some are still held.
+//-------------------------------------------------------------------
+
+HRESULT PpboxMediaSink::OnPacingTimer(IMFAsyncResult *pResult)
+{
+    AutoLock lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
 
     if (SUCCEEDED(hr))
     {
-        // Release the pointer to the old clock.
-        // Store the pointer to the new clock.
-        m_spClock = pPresentationClock;
+        m_PacingKey = 0;
+        hr = PumpPacer();
     }
 
     TRACEHR_RET(hr);
 }
 
-HRESULT PpboxMediaSink:: GetPresentationClock(IMFPresentationClock **ppPresentationClock)
+//-------------------------------------------------------------------
+// TraceMediaType
+// Records a stream's media type in the form the core consumes.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::TraceMediaType(DWORD dwStream, IMFMediaType *pMediaType)
 {
-    if (ppPresentationClock == NULL)
+    if (!m_Trace.IsOpen())
     {
-        return E_INVALIDARG;
+        return;
     }
 
-    AutoLock lock(m_critSec);
+    PpboxCoreMediaType type;
+    if (SUCCEEDED(ConvertMediaType(pMediaType, type)))
+    {
+        m_Trace.AddMediaType(dwStream, type);
+    }
+}
 
-    HRESULT hr = CheckShutdown();
+//-------------------------------------------------------------------
+// SetStream
+// Describes a stream to every capture handle.
+//-------------------------------------------------------------------
 
-    if (SUCCEEDED(hr))
+void PpboxMediaSink::SetStream(DWORD dwStream, JUST_StreamInfo & info)
+{
+    for (DWORD i = 0; i < m_cCaptures; ++i)
     {
-        if (m_spClock == NULL)
-        {
-            hr = MF_E_NO_CLOCK; // There is no presentation clock.
-        }
-        else
-        {
-            // Return the pointer to the caller.
-            *ppPresentationClock = m_spClock.Get();
-            (*ppPresentationClock)->AddRef();
-        }
+        JUST_CaptureSetStream(m_Captures[i]->hCapture, dwStream, &info);
+    }
+}
+
+//-------------------------------------------------------------------
+// PutSample
+// Hands a sample created by CreateSample to every capture handle, or
+// to the pacer first if delivery is paced.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::PutSample(JUST_Sample & sample)
+{
+    if (!m_fCaptureReady)
+    {
+        HoldSample(sample);
+        return;
     }
 
-    TRACEHR_RET(hr);
+    if (!m_fPacing)
+    {
+        DeliverSample(sample);
+        return;
+    }
+
+    // The pacer holds the reference CreateSample gave us, the sample
+    // stays in flight meanwhile and counts against the budgets.
+    m_Pacer.Push(sample, ((PpboxSampleContext *)sample.context)->pStream->m_Priority, GetPacingTime());
+    PumpPacer();
 }
 
+/* Private methods */
 
 //-------------------------------------------------------------------
-// Shutdown
-// Shuts down the Sinkand releases all reSinks.
+// DeliverSample
+// Puts a sample to every capture handle. The sample is shared, each
+// handle gets its own reference to free.
 //-------------------------------------------------------------------
 
-HRESULT PpboxMediaSink::Shutdown()
+void PpboxMediaSink::DeliverSample(JUST_Sample & sample)
 {
-    EnterCriticalSection(&m_critSec);
+    PpboxSampleContext * pContext = (PpboxSampleContext *)sample.context;
+    DWORD dwStreamBit = StreamBit(sample.itrack);
 
-    HRESULT hr = S_OK;
+    pContext->pExecutor = m_pExecutor;
+    BOOL fSync = (sample.flags & JUST_SampleFlag::sync) != 0;
+    BOOL fPut = FALSE;
 
-    PpboxStreamSink *pStream = NULL;
+    // Stamped before the first put: a backend may fetch the sample, and
+    // a synchronous one free it, before PutSample returns.
+    pContext->uPutTime = PpboxGetMicroseconds();
 
-    hr = CheckShutdown();
+    for (DWORD i = 0; i < m_cCaptures; ++i)
+    {
+        PpboxCaptureDest & dest = *m_Captures[i];
+        BOOL fOverrun = m_uDestinationLimit > 0 
+            && (UINT32)dest.cInFlight >= m_uDestinationLimit;
+        BOOL fResume = FALSE;
+
+        // A slow destination loses samples up to the next sync sample,
+        // rather than making the encoder wait for it.
+        if (fOverrun)
+        {
+            dest.dwSkipStreams |= dwStreamBit;
+        }
+        else if ((dest.dwSkipStreams & dwStreamBit) && fSync)
+        {
+            dest.dwSkipStreams &= ~dwStreamBit;
+            fResume = TRUE;
+        }
+        if (dest.dwSkipStreams & dwStreamBit)
+        {
+            PpboxInterlockedIncrement(&dest.cSkipped);
+            PpboxInterlockedIncrement(&pContext->pStream->m_cDropped);
+            continue;
+        }
 
-    if (SUCCEEDED(hr))
+        PpboxSampleRef & ref = pContext->refs[i];
+        ref.pContext = pContext;
+        ref.pDest = &dest;
+        dest.AddRef();
+        InterlockedIncrement(&pContext->cRef);
+        InterlockedIncrement(&dest.cInFlight);
+        InterlockedIncrement(&dest.cPut);
+
+        JUST_Sample destSample = sample;
+        destSample.context = &ref;
+        if (fResume)
+        {
+            // The skipped samples may have started a new format.
+            destSample.flags |= SampleFlag_FormatChange;
+        }
+        if (dest.pQueue)
+        {
+            dest.pQueue->Put(destSample, pContext->pStream->m_Priority);
+        }
+        else
+        {
+            PutCaptureSample(dest.hCapture, destSample);
+        }
+        fPut = TRUE;
+    }
+
+    if (fPut && m_uStartLatency == 0)
     {
-        // Shut down the stream objects.
-        // Set the state.
-        m_state = STATE_SHUTDOWN;
+        m_uStartLatency = pContext->uPutTime - m_uClockStartTime;
     }
 
-    LeaveCriticalSection(&m_critSec);
-    TRACEHR_RET(hr);
+    if (fPut && m_uFirstSampleTime == 0)
+    {
+        m_uFirstSampleTime = pContext->uPutTime - m_uActivateTime;
+        TRACE(TRACE_LEVEL_LOW, L"PpboxMediaSink: first sample out %I64u us after activation\r\n", m_uFirstSampleTime);
+    }
+
+    m_GopCache.Add(sample, pContext->pStream->m_fVideo);
+
+    // Drop the reference CreateSample gave us. If no destination took
+    // the sample, it goes back right here.
+    if (InterlockedDecrement(&pContext->cRef) == 0)
+    {
+        ReleaseSample(pContext);
+    }
 }
 
 //-------------------------------------------------------------------
-// IMFMediaSink methods
+// GetPacingTime
+// The presentation clock's time, 100ns units: it stands still while
+// the clock is paused, so a pause neither counts as output time nor
+// frees a burst. Without a time from the clock, the last one.
 //-------------------------------------------------------------------
 
-HRESULT PpboxMediaSink:: OnClockStart(MFTIME hnsSystemTime, LONGLONG llClockStartOffset)
+LONGLONG PpboxMediaSink::GetPacingTime()
 {
-    AutoLock lock(m_critSec);
+    MFTIME hnsTime = 0;
 
-    HRESULT hr = CheckShutdown();
+    if (m_spClock && SUCCEEDED(m_spClock->GetTime(&hnsTime)))
+    {
+        m_llPacingTime = hnsTime;
+    }
 
-    if (SUCCEEDED(hr))
+    return m_llPacingTime;
+}
+
+//-------------------------------------------------------------------
+// ResumePacing
+// Ends a pause of the clock, and releases what is due.
+//-------------------------------------------------------------------
+
+void PpboxMediaSink::ResumePacing()
+{
+    if (!m_fClockPaused)
     {
-        TRACE(TRACE_LEVEL_LOW, L"OnClockStart ts=%I64d\n", llClockStartOffset);
-        // Start each stream.
-        //_llStartTime = llClockStartOffset;
-        hr = ForEach(m_streams, [llClockStartOffset](PpboxStreamSink * pStream){
-            return pStream->Start(llClockStartOffset);
-        });
+        return;
     }
 
-    TRACEHR_RET(hr);
+    m_fClockPaused = FALSE;
+    if (m_fPacing)
+    {
+        PumpPacer();
+    }
 }
 
+//-------------------------------------------------------------------
+// PumpPacer
+// Delivers the held samples the bucket allows now. If some are left,
+// schedules OnPacingTimer for when the next one is due.
+//-------------------------------------------------------------------
 
-HRESULT PpboxMediaSink:: OnClockStop(MFTIME hnsSystemTime)
+HRESULT PpboxMediaSink::PumpPacer()
 {
-    AutoLock lock(m_critSec);
+    HRESULT hr = S_OK;
+    LONGLONG llNow = GetPacingTime();
+    JUST_Sample sample;
 
-    HRESULT hr = CheckShutdown();
+    while (m_Pacer.Pop(llNow, sample))
+    {
+        DeliverSample(sample);
+    }
+
+    // Paused, the rest waits for the restart.
+    if (m_Pacer.IsEmpty() || m_PacingKey != 0 || m_fClockPaused)
+    {
+        return S_OK;
+    }
+
+    if (!m_spPacingTimer)
+    {
+        m_spPacingTimer = Make<PpboxAsyncCallback<PpboxMediaSink>>(this, &PpboxMediaSink::OnPacingTimer);
+        if (!m_spPacingTimer)
+        {
+            hr = E_OUTOFMEMORY;
+        }
+    }
 
+    // Work queue timers have millisecond resolution, round up.
     if (SUCCEEDED(hr))
     {
-        // Stop each stream
-        hr = ForEach(m_streams, [](PpboxStreamSink * pStream){
-            return pStream->Stop();
-        });
+        LONGLONG llWait = (m_Pacer.GetNextTime() - llNow + 9999) / 10000;
+        if (llWait < 1)
+        {
+            llWait = 1;
+        }
+        hr = MFScheduleWorkItem(m_spPacingTimer.Get(), NULL, -llWait, &m_PacingKey);
     }
 
     TRACEHR_RET(hr);
 }
 
+//-------------------------------------------------------------------
+// FlushPacer
+// Delivers everything the pacer holds, at once.
+//-------------------------------------------------------------------
 
-HRESULT PpboxMediaSink:: OnClockPause(MFTIME hnsSystemTime)
+void PpboxMediaSink::FlushPacer()
 {
-    return MF_E_INVALID_STATE_TRANSITION;
+    JUST_Sample sample;
+
+    while (m_Pacer.PopAny(sample))
+    {
+        DeliverSample(sample);
+    }
 }
 
+//-------------------------------------------------------------------
+// ScheduleSpillDrain
+// Schedules OnSpillTimer if samples are spilled and none is scheduled.
+//-------------------------------------------------------------------
 
-HRESULT PpboxMediaSink:: OnClockRestart(MFTIME hnsSystemTime)
+HRESULT PpboxMediaSink::ScheduleSpillDrain()
 {
-    return MF_E_INVALID_STATE_TRANSITION;
-}
+    HRESULT hr = S_OK;
+
+    if (m_SpillRing.IsEmpty() || m_SpillKey != 0)
+    {
+        return S_OK;
+    }
 
+    if (!m_spSpillTimer)
+    {
+        m_spSpillTimer = Make<PpboxAsyncCallback<PpboxMediaSink>>(this, &PpboxMediaSink::OnSpillTimer);
+        if (!m_spSpillTimer)
+        {
+            hr = E_OUTOFMEMORY;
+        }
+    }
 
-HRESULT PpboxMediaSink:: OnClockSetRate(MFTIME hnsSystemTime, float flRate)
-{
-    return S_OK;
-}
+    if (SUCCEEDED(hr))
+    {
+        hr = MFScheduleWorkItem(m_spSpillTimer.Get(), NULL, -(INT64)SPILL_DRAIN_MS, &m_SpillKey);
+    }
 
+    TRACEHR_RET(hr);
+}
 
 //-------------------------------------------------------------------
-// Public non-interface methods
+// FindStream:
+// Same as GetStreamSinkById, without the interface round trip.
 //-------------------------------------------------------------------
 
-/* Private methods */
+HRESULT PpboxMediaSink::FindStream(DWORD dwStreamSinkIdentifier, PpboxStreamSink **ppStream)
+{
+    auto pos = m_streams.FrontPosition();
+    auto end = m_streams.EndPosition();
+
+    for (;pos != end; pos = m_streams.Next(pos))
+    {
+        ComPtr<PpboxStreamSink> spStream;
+        HRESULT hr = m_streams.GetItemByPosition(pos, &spStream);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        DWORD dwId;
+        hr = spStream->GetIdentifier(&dwId);
+        if (SUCCEEDED(hr) && dwId == dwStreamSinkIdentifier)
+        {
+            *ppStream = spStream.Detach();
+            return S_OK;
+        }
+    }
+
+    return MF_E_INVALIDSTREAMNUMBER;
+}
 
 //-------------------------------------------------------------------
 // IsInitialized:
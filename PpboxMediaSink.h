@@ -53,11 +53,21 @@ enum SinkState
     STATE_SHUTDOWN
 };
 
+#include "PpboxAsyncCallback.h"
+#include "PpboxAutoLock.h"
 #include "PpboxStreamSink.h"    // Ppbox stream
+#include "PpboxSpillRing.h"
+#include "PpboxMediaType.h"
 
 #include <vector>
+#include <algorithm>
 
-const UINT32 MAX_STREAMS = 32;
+#include "PpboxGopCache.h"
+#include "PpboxKeyIndex.h"
+#include "PpboxTrace.h"
+#include "PpboxPacer.h"
+#include "PpboxBitrate.h"
+#include "PpboxCapturePool.h"
 
 
 // Constants
@@ -65,6 +75,8 @@ const UINT32 MAX_STREAMS = 32;
 const DWORD INITIAL_BUFFER_SIZE = 4 * 1024; // Initial size of the read buffer. (The buffer expands dynamically.)
 const DWORD READ_SIZE = 4 * 1024;           // Size of each read request.
 const DWORD SAMPLE_QUEUE = 2;               // How many samples does each stream try to hold in its queue?
+const UINT32 STARTUP_DEFAULT_BUFFER = 16 * 1024 * 1024;    // Bytes of samples held until the capture handles are ready.
+const UINT32 SPILL_DRAIN_MS = 10;           // While samples are spilled, retry replaying them this often.
 
 #ifndef RUNTIMECLASS_GeometricSource_GeometricSchemeHandler_DEFINED
 #define RUNTIMECLASS_GeometricSource_GeometricSchemeHandler_DEFINED
@@ -88,10 +100,9 @@ public:
     IFACEMETHOD (SetProperties) (ABI::Windows::Foundation::Collections::IPropertySet *pConfiguration);
 
 public:
-    PP_handle GetPpboxCapture()
-    {
-        return m_PpboxCapture;
-    }
+    // Fan out to all capture handles (called by the streams).
+    void SetStream(DWORD dwStream, JUST_StreamInfo & info);
+    void PutSample(JUST_Sample & sample);
 
 public:
     // IMFMediaSink
@@ -118,6 +129,71 @@ public:
 
     HRESULT RequestSample();
 
+    // Spill mode (called by the streams, with the sink lock held):
+    // Once SpillLimit samples are in flight with the backend, new samples
+    // go to the spill ring, and are replayed in order as the backend
+    // frees samples: with each new sample, and every SPILL_DRAIN_MS while
+    // the source is quiet. SpillSample returns S_FALSE if spilling is not
+    // needed. Samples that cannot be replayed are dropped and counted.
+    HRESULT SpillSample(DWORD dwStream, IMFSample *pSample, BOOL fForce);
+    HRESULT DrainSpill(BOOL fForce);
+    void    DropSpill();
+    HRESULT OnSpillTimer(IMFAsyncResult *pResult);
+
+    // Adds an accepted sample to the keyframe index, if there is one.
+    // The index is written every KEYINDEX_FLUSH_MS and at Stop, without
+    // the sink lock.
+    void    IndexSample(JUST_Sample const & sample, DWORD cbSize) { m_KeyIndex.Add(sample, cbSize); }
+    HRESULT OnIndexTimer(IMFAsyncResult *pResult);
+
+    // Where a stream's samples spend their time, see PpboxLatency.h.
+    HRESULT GetLatency(DWORD dwStream, PpboxLatencyStage stage, PpboxLatencySummary & summary);
+
+    // Counters of the sink, its streams and capture handles, see
+    // PpboxSinkStats. Also published to the configuration set every
+    // "StatsInterval" milliseconds, as "Stats.*" values.
+    HRESULT GetStats(PpboxSinkStats & stats);
+    void    SetStatsCallback(PpboxStatsCallback pfnCallback, void * pContext);
+    HRESULT OnStatsTimer(IMFAsyncResult *pResult);
+
+    // Bitrate feedback ("BitrateFeedback"), estimated with each snapshot,
+    // see PpboxBitrateEstimator. Cheap to poll; changes are also raised
+    // to the callback and published as "RecommendedBitrate.Stream<id>".
+    HRESULT GetRecommendedBitrate(DWORD dwStream, UINT32 *puBitrate);
+    void    SetBitrateCallback(PpboxBitrateCallback pfnCallback, void * pContext);
+
+    // Paced delivery ("PacedDelivery"): releases the samples held by the
+    // pacer that are due, see PpboxPacer.
+    HRESULT OnPacingTimer(IMFAsyncResult *pResult);
+
+    // The capture handles are created and connected on a work queue once
+    // SetProperties returns; samples wait for them in the startup buffer
+    // ("StartupBufferSize" bytes). The event is set when they are ready,
+    // GetCaptureStatus then tells how that went (S_FALSE before). The
+    // status is also published as the Int32 "CaptureStatus".
+    HANDLE  GetCaptureReadyEvent() const { return m_hCaptureReady; }
+    HRESULT GetCaptureStatus();
+    HRESULT OnCaptureInit(IMFAsyncResult *pResult);
+
+    // Session recording, no-ops unless a trace file is configured.
+    // A sample's record is prepared (its payload copied) before the
+    // stream takes the sink lock, and added with it held.
+    BOOL    PrepareTraceSample(DWORD dwStream, IMFSample *pSample, std::vector<BYTE> & record) const { return m_Trace.PrepareSample(dwStream, &MFSampleOps, pSample, record); }
+    void    TraceSample(std::vector<BYTE> & record) { m_Trace.AddSample(record); }
+    void    TraceMediaType(DWORD dwStream, IMFMediaType *pMediaType);
+
+    // Sink-wide in-flight accounting, shared with the streams' cores.
+    PpboxCoreSink * GetCore() const { return m_pCore; }
+
+    // Process-wide memory budget, see PpboxMemoryGovernor.
+    BOOL    IsOverBudget() const { return m_pCore->IsOverBudget(); }
+    PpboxMemoryPolicy   GetMemoryPolicy() const { return m_MemoryPolicy; }
+
+    // Streams added while the clock runs start at once. The sink refuses
+    // to pause, its state stays STATE_STARTED while the clock is paused;
+    // such streams start when it restarts, see OnClockRestart.
+    BOOL    IsStarted() const { return m_state == STATE_STARTED && !m_fClockPaused; }
+
     // Lock/Unlock:
     // Holds and releases the Sink's critical section. Called by the streams.
     void    Lock() { EnterCriticalSection(&m_critSec); }
@@ -134,6 +210,32 @@ private:
 
     HRESULT     IsInitialized() const;
 
+    void        DiscardProperties();
+    HRESULT     AttachDestinations(ABI::Windows::Foundation::Collections::IPropertySet *pConfiguration);
+    HRESULT     AttachDestination(PCWSTR pszDest);
+    UINT64      GetCaptureConfig(JUST_CaptureConfigData & config);
+    PP_handle   CreateCapture(PCWSTR pszDest, JUST_CaptureConfigData & config, UINT64 uLayout);
+    void        ReleaseCapture(PCWSTR pszDest, PP_handle hCapture, UINT64 uLayout);
+    HRESULT     AddCapture(PCWSTR pszDest, PP_handle hCapture, UINT64 uLayout);
+    HRESULT     StartCaptureInit();
+    void        SetCaptureReady(HRESULT hrStatus);
+    void        HoldSample(JUST_Sample & sample);
+    void        DropStartupSamples();
+
+    HRESULT     FindStream(DWORD dwStreamSinkIdentifier, PpboxStreamSink **ppStream);
+
+    HRESULT     StartStatsTimer();
+    HRESULT     ScheduleStatsTimer();
+    void        TakeStats(PpboxSinkStats & stats, PpboxSinkStats & prev);
+    HRESULT     StartIndexTimer();
+
+    void        DeliverSample(JUST_Sample & sample);
+    LONGLONG    GetPacingTime();
+    void        ResumePacing();
+    HRESULT     PumpPacer();
+    void        FlushPacer();
+    HRESULT     ScheduleSpillDrain();
+
 private:
     long                        m_cRef;                     // reference count
 
@@ -151,7 +253,66 @@ private:
     UINT64                      m_uDuration;
     UINT64                      m_uTime;
 
-    PP_handle                   m_PpboxCapture;
+    PpboxCaptureDest *          m_Captures[MAX_DESTINATIONS];   // Referenced.
+    DWORD                       m_cCaptures;
+    UINT32                      m_uDestinationLimit;        // Samples a destination may hold, 0 = no limit.
+    std::vector<std::wstring>   m_Destinations;             // Same order as m_Captures.
+    std::vector<std::wstring>   m_PendingDestinations;      // Left to attach by OnCaptureInit.
+
+    HANDLE                      m_hCaptureReady;            // Manual reset, set by SetCaptureReady.
+    BOOL                        m_fCaptureReady;
+    HRESULT                     m_hrCapture;
+    ComPtr<ABI::Windows::Foundation::Collections::IPropertySet> m_spStatusSet;
+    std::vector<JUST_Sample>    m_StartupSamples;           // Each holds the reference CreateSample gave.
+    UINT32                      m_cbStartup;
+    UINT32                      m_cbStartupLimit;
+    DWORD                       m_dwStartupSkip;            // Streams waiting for a sync sample after an overflow.
+    UINT64                      m_uActivateTime;            // PpboxGetMicroseconds at SetProperties.
+    UINT64                      m_uCaptureReadyTime;        // Microseconds from activation, 0 = not yet.
+    UINT64                      m_uFirstSampleTime;         // Same, to the first sample a destination took.
+    UINT64                      m_uClockStartTime;          // PpboxGetMicroseconds at the last OnClockStart.
+    UINT64                      m_uStartLatency;            // From there to the first sample out, 0 = not yet.
+
+    PpboxGopCache               m_GopCache;
+    PpboxKeyIndex               m_KeyIndex;
+    ComPtr<IMFAsyncCallback>    m_spIndexTimer;
+    MFWORKITEM_KEY              m_IndexKey;
+    PpboxTraceRecorder          m_Trace;
+
+    UINT32                      m_uStatsInterval;           // Milliseconds, 0 = no periodic snapshot.
+    ComPtr<IMFAsyncCallback>    m_spStatsTimer;
+    MFWORKITEM_KEY              m_StatsKey;
+    ComPtr<ABI::Windows::Foundation::Collections::IPropertySet> m_spStatsSet;
+    PpboxStatsCallback          m_pfnStats;
+    void *                      m_pStatsContext;
+    PpboxSinkStats              m_StatsPrev;                // Of the periodic snapshot.
+    PpboxSinkStats              m_StatsPolled;              // Of the last GetStats.
+
+    BOOL                        m_fBitrateFeedback;
+    PpboxBitrateEstimator       m_Bitrate;
+    PpboxBitrateCallback        m_pfnBitrate;
+    void *                      m_pBitrateContext;
+
+    BOOL                        m_fPriority;                // Held samples go by stream class, see PpboxPriorityQueue.
+    BOOL                        m_fDynamicStreams;          // Streams come and go while capturing, see AddStreamSink.
+    BOOL                        m_fCapturePool;             // Handles come from and go back to PpboxCapturePool.
+    BOOL                        m_fWarmRestart;             // Start after Stop opens a new segment, see OnClockStart.
+    BOOL                        m_fPacing;
+    PpboxPacer                  m_Pacer;
+    ComPtr<IMFAsyncCallback>    m_spPacingTimer;
+    MFWORKITEM_KEY              m_PacingKey;                // 0 = no release scheduled.
+    LONGLONG                    m_llPacingTime;             // Last clock time pacing saw, see GetPacingTime.
+    BOOL                        m_fClockPaused;
+
+    UINT32                      m_uCopyOutThreshold;        // Applied to each stream, see PpboxStreamSink::SetCopyOutThreshold.
+
+    PpboxCoreSink *             m_pCore;
+    PpboxMemoryPolicy           m_MemoryPolicy;
+    PpboxExecutor *             m_pExecutor;                // Shared delivery pool, NULL = deliver inline.
+    UINT32                      m_uSpillLimit;
+    PpboxSpillRing              m_SpillRing;
+    ComPtr<IMFAsyncCallback>    m_spSpillTimer;
+    MFWORKITEM_KEY              m_SpillKey;                 // 0 = no drain scheduled.
 };
 
 
@@ -24,6 +24,10 @@
 #include "PropertySet.h"
 
 #include "PpboxMediaType.h"
+#include "PpboxAac.h"
+#include "PpboxConfig.h"
+
+#include <mutex>
 
 using namespace ABI::Windows::Foundation;
 using namespace ABI::Windows::Foundation::Collections;
@@ -337,52 +341,461 @@ HRESULT GetDestinationtFromConfigurations(
     return hr;
 }
 
-
 //-------------------------------------------------------------------
-// CreateVideoMediaType:
-// Create a media type from an Ppbox video sequence header.
+// GetDestinationsFromConfigurations:
+// "Destinations" is a list of strings, one capture handle each. A single
+// "Destination" string is still accepted, and without either the sink
+// has one handle with no destination, as it always had.
 //-------------------------------------------------------------------
 
-HRESULT CreateVideoMediaType(JUST_StreamInfo& info, IMFMediaType *pType)
+HRESULT GetDestinationsFromConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    std::vector<std::wstring> & destinations)
 {
     HRESULT hr = S_OK;
+    ComPtr<IPropertySet > spConfigurations(pConfigurations);
+    ComPtr<IIterable<HSTRING>> spIterable;
+    ComPtr<IIterator<HSTRING>> spIterator;
+
+    if (pConfigurations == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    destinations.clear();
+
+    if (FAILED(PropertySetFind(spConfigurations, L"Destinations", spIterable)))
+    {
+        HString dest;
+        if (SUCCEEDED(GetDestinationtFromConfigurations(pConfigurations, dest.GetAddressOf())))
+        {
+            destinations.push_back(WindowsGetStringRawBuffer(dest.Get(), NULL));
+        }
+        else
+        {
+            destinations.push_back(std::wstring());
+        }
+        return S_OK;
+    }
+
+    hr = spIterable->First(&spIterator);
 
+    boolean hasCurrent = false;
     if (SUCCEEDED(hr))
     {
-        GUID sub_type;
-        hr = pType->GetGUID(MF_MT_SUBTYPE, &sub_type);
-        if (SUCCEEDED(hr))
+        hr = spIterator->get_HasCurrent(&hasCurrent);
+    }
+
+    while (hasCurrent)
+    {
+        HString dest;
+        hr = spIterator->get_Current(dest.GetAddressOf());
+        if (FAILED(hr))
+        {
+            break;
+        }
+
+        destinations.push_back(WindowsGetStringRawBuffer(dest.Get(), NULL));
+
+        hr = spIterator->MoveNext(&hasCurrent);
+        if (FAILED(hr))
+        {
+            break;
+        }
+    }
+
+    // A list is given on purpose, it may not be empty.
+    if (SUCCEEDED(hr) && (destinations.empty() || destinations.size() > MAX_DESTINATIONS))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    return hr;
+}
+
+HRESULT GetStringFromConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    PCWSTR pszName, 
+    HSTRING * pValue)
+{
+    HRESULT hr = S_OK;
+    ComPtr<IPropertySet > spConfigurations(pConfigurations);
+    ComPtr<IPropertyValue> spValue;
+
+    if (pConfigurations == nullptr || pszName == nullptr || pValue == nullptr)
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = PropertySetFind(spConfigurations, pszName, spValue);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = spValue->GetString(pValue);
+    }
+    return hr;
+}
+
+HRESULT GetUInt32FromConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    PCWSTR pszName, 
+    UINT32 * pValue)
+{
+    HRESULT hr = S_OK;
+    ComPtr<IPropertySet > spConfigurations(pConfigurations);
+    ComPtr<IPropertyValue> spValue;
+    PropertyType type;
+
+    if (pConfigurations == nullptr || pszName == nullptr || pValue == nullptr)
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = PropertySetFind(spConfigurations, pszName, spValue);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = spValue->get_Type(&type);
+    }
+
+    // Script and .NET callers box numbers differently, accept any of them.
+    if (SUCCEEDED(hr))
+    {
+        switch (type)
         {
-            if (sub_type == MFVideoFormat_H264) {
-                info.sub_type = JUST_VideoSubType::AVC1;
-                info.format_type = JUST_FormatType::video_avc_byte_stream;
+        case PropertyType_UInt32:
+            hr = spValue->GetUInt32(pValue);
+            break;
+        case PropertyType_Int32:
+            {
+                INT32 value;
+                hr = spValue->GetInt32(&value);
                 if (SUCCEEDED(hr))
                 {
-                    // sequence header
-                    UINT8 * buf = new UINT8[256];
-                    UINT32 len = 0;
-                    hr = pType->GetBlob(
-                        MF_MT_MPEG_SEQUENCE_HEADER,
-                        buf,
-                        256, 
-                        &len);
-                    if (SUCCEEDED(hr)) {
-                        info.format_size = len;
-                        info.format_buffer = buf;
-                    } else {
-                        hr = S_OK;
-                        delete buf;
-                    }
+                    *pValue = (UINT32)value;
+                }
+            }
+            break;
+        case PropertyType_UInt64:
+            {
+                UINT64 value;
+                hr = spValue->GetUInt64(&value);
+                if (SUCCEEDED(hr))
+                {
+                    *pValue = (UINT32)value;
+                }
+            }
+            break;
+        case PropertyType_Int64:
+            {
+                INT64 value;
+                hr = spValue->GetInt64(&value);
+                if (SUCCEEDED(hr))
+                {
+                    *pValue = (UINT32)value;
+                }
+            }
+            break;
+        case PropertyType_Double:
+            {
+                DOUBLE value;
+                hr = spValue->GetDouble(&value);
+                if (SUCCEEDED(hr))
+                {
+                    *pValue = (UINT32)value;
                 }
-            } else if (sub_type == MFVideoFormat_WMV3) {
-                info.sub_type = JUST_VideoSubType::WMV3;
-                info.format_type = JUST_FormatType::none;
-            } else {
-                hr = MF_E_INVALIDTYPE;
             }
+            break;
+        default:
+            hr = TYPE_E_TYPEMISMATCH;
+            break;
+        }
+    }
+
+    return hr;
+}
+
+
+//-------------------------------------------------------------------
+// PublishStatsToConfigurations:
+// Apps watch the set's MapChanged event to pick up the values.
+//-------------------------------------------------------------------
+
+static HRESULT SetUInt64InConfigurations(
+    IMap<HSTRING, IInspectable *> *pMap, 
+    IPropertyValueStatics *pStatics, 
+    PCWSTR pszName, 
+    UINT64 value)
+{
+    ComPtr<IInspectable> spValue;
+    boolean replaced = false;
+
+    HRESULT hr = pStatics->CreateUInt64(value, &spValue);
+    if (SUCCEEDED(hr))
+    {
+        hr = pMap->Insert(HStringReference(pszName).Get(), spValue.Get(), &replaced);
+    }
+    return hr;
+}
+
+static HRESULT SetInt64InConfigurations(
+    IMap<HSTRING, IInspectable *> *pMap, 
+    IPropertyValueStatics *pStatics, 
+    PCWSTR pszName, 
+    INT64 value)
+{
+    ComPtr<IInspectable> spValue;
+    boolean replaced = false;
+
+    HRESULT hr = pStatics->CreateInt64(value, &spValue);
+    if (SUCCEEDED(hr))
+    {
+        hr = pMap->Insert(HStringReference(pszName).Get(), spValue.Get(), &replaced);
+    }
+    return hr;
+}
+
+HRESULT PublishStatsToConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    PpboxSinkStats const & stats)
+{
+    HRESULT hr = S_OK;
+    ComPtr<IPropertySet> spConfigurations(pConfigurations);
+    ComPtr<IMap<HSTRING, IInspectable *>> spMap;
+    ComPtr<IPropertyValueStatics> spStatics;
+    WCHAR szName[64];
+
+    if (pConfigurations == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    hr = spConfigurations.As(&spMap);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = ::Windows::Foundation::GetActivationFactory(
+            HStringReference(RuntimeClass_Windows_Foundation_PropertyValue).Get(), &spStatics);
+    }
+
+#define SET_STAT(name, value) \
+    if (SUCCEEDED(hr)) \
+    { \
+        hr = SetUInt64InConfigurations(spMap.Get(), spStatics.Get(), name, value); \
+    }
+
+    SET_STAT(L"Stats.InFlight", stats.cInFlight);
+    SET_STAT(L"Stats.Spilled", stats.cSpilled);
+    SET_STAT(L"Stats.CaptureReadyTime", stats.uCaptureReadyTime);
+    SET_STAT(L"Stats.FirstSampleTime", stats.uFirstSampleTime);
+    SET_STAT(L"Stats.StartLatency", stats.uStartLatency);
+
+    for (DWORD i = 0; i < stats.cStreams; ++i)
+    {
+        PpboxStreamStats const & stream = stats.streams[i];
+#define SET_STREAM_STAT(name, value) \
+        swprintf_s(szName, L"Stats.Stream%u." name, stream.dwIdentifier); \
+        SET_STAT(szName, value)
+
+        SET_STREAM_STAT(L"Samples", stream.cSamples);
+        SET_STREAM_STAT(L"Bytes", stream.cbSamples);
+        SET_STREAM_STAT(L"SamplesPerSecond", stream.uSamplesPerSecond);
+        SET_STREAM_STAT(L"BytesPerSecond", stream.uBytesPerSecond);
+        SET_STREAM_STAT(L"InFlight", stream.cInFlight);
+        SET_STREAM_STAT(L"InFlightBytes", stream.cbInFlight);
+        SET_STREAM_STAT(L"SpilledBytes", stream.cbSpilled);
+        SET_STREAM_STAT(L"Dropped", stream.cDropped);
+        SET_STREAM_STAT(L"Requests", stream.cRequests);
+        SET_STREAM_STAT(L"StateChanges", stream.cStateChanges);
+        SET_STREAM_STAT(L"FormatChanges", stream.cFormatChanges);
+        SET_STREAM_STAT(L"Freed", stream.cbFreed);
+        SET_STREAM_STAT(L"DrainBytesPerSecond", stream.uDrainBytesPerSecond);
+        SET_STREAM_STAT(L"Throughput", stream.uThroughput);
+        SET_STREAM_STAT(L"RecommendedBitrate", stream.uRecommendedBitrate);
+        swprintf_s(szName, L"Stats.Stream%u.QueueGrowth", stream.dwIdentifier);
+        if (SUCCEEDED(hr))
+        {
+            hr = SetInt64InConfigurations(spMap.Get(), spStatics.Get(), szName, stream.llQueueGrowth);
+        }
+#undef SET_STREAM_STAT
+    }
+
+    for (DWORD i = 0; i < stats.cDests; ++i)
+    {
+        PpboxDestStats const & dest = stats.dests[i];
+#define SET_DEST_STAT(name, value) \
+        swprintf_s(szName, L"Stats.Dest%u." name, i); \
+        SET_STAT(szName, value)
+
+        SET_DEST_STAT(L"InFlight", dest.cInFlight);
+        SET_DEST_STAT(L"Put", dest.cPut);
+        SET_DEST_STAT(L"Skipped", dest.cSkipped);
+        SET_DEST_STAT(L"Skipping", dest.fSkipping ? 1 : 0);
+#undef SET_DEST_STAT
+    }
+
+#undef SET_STAT
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// ConvertMediaType:
+// Reads what the core needs to know out of an IMFMediaType.
+//-------------------------------------------------------------------
+
+// Not in older SDKs, same values as MFVideoFormat_HEVC, MFVideoFormat_VP90
+// and MFAudioFormat_Opus (WAVE_FORMAT_OPUS).
+DEFINE_MEDIATYPE_GUID(PpboxVideoFormat_HEVC, FCC('HEVC'));
+DEFINE_MEDIATYPE_GUID(PpboxVideoFormat_VP90, FCC('VP90'));
+DEFINE_MEDIATYPE_GUID(PpboxAudioFormat_Opus, 0x704F);
+
+// Reads an optional blob of at most MAX_FORMAT_BLOB bytes; a longer one
+// fails the type, cut short it would not decode.
+static HRESULT GetFormatBlob(IMFMediaType *pType, REFGUID guidKey, unsigned char * pBuf, unsigned long * pcbBlob)
+{
+    UINT32 len = 0;
+    HRESULT hr = pType->GetBlobSize(guidKey, &len);
+    if (hr == MF_E_ATTRIBUTENOTFOUND)
+    {
+        *pcbBlob = 0;
+        return S_OK;
+    }
+    if (SUCCEEDED(hr) && len > MAX_FORMAT_BLOB)
+    {
+        hr = MF_E_INVALIDTYPE;
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pType->GetBlob(guidKey, pBuf, MAX_FORMAT_BLOB, &len);
+    }
+    if (SUCCEEDED(hr))
+    {
+        *pcbBlob = len;
+    }
+    return hr;
+}
+
+// Codec config blob of the type, besides MF_MT_USER_DATA.
+typedef HRESULT (*MFCodecConfigFn)(IMFMediaType *pType, PpboxCoreMediaType & type);
+
+static HRESULT GetSequenceHeader(IMFMediaType *pType, PpboxCoreMediaType & type)
+{
+    // Optional, the backend finds the parameter sets in band otherwise.
+    return GetFormatBlob(pType, MF_MT_MPEG_SEQUENCE_HEADER, type.sequenceHeader, &type.cbSequenceHeader);
+}
+
+static HRESULT GetAacPayloadType(IMFMediaType *pType, PpboxCoreMediaType & type)
+{
+    // ADTS is stripped to raw AAC; ADIF and LOAS/LATM carry their config
+    // in band, the backend cannot take them.
+    type.aacPayloadType = MFGetAttributeUINT32(pType, MF_MT_AAC_PAYLOAD_TYPE, AacPayload_Raw);
+    if (type.aacPayloadType != AacPayload_Raw && type.aacPayloadType != AacPayload_ADTS)
+    {
+        return MF_E_INVALIDTYPE;
+    }
+    return S_OK;
+}
+
+struct MFCodecEntry
+{
+    GUID const *    pSubtype;
+    bool            fVideo;
+    PpboxCoreCodec  codec;
+    MFCodecConfigFn pfnConfig;      // NULL = nothing besides the user data.
+};
+
+static MFCodecEntry const s_MFCodecs[] = 
+{
+    { &MFVideoFormat_H264,      true,  PpboxCodec_H264, GetSequenceHeader },
+#ifdef PPBOX_JUST_HEVC
+    { &PpboxVideoFormat_HEVC,   true,  PpboxCodec_HEVC, GetSequenceHeader },
+#endif
+#ifdef PPBOX_JUST_VP9
+    { &PpboxVideoFormat_VP90,   true,  PpboxCodec_VP9,  NULL },
+#endif
+    { &MFVideoFormat_WMV3,      true,  PpboxCodec_WMV3, NULL },
+    { &MFAudioFormat_AAC,       false, PpboxCodec_AAC,  GetAacPayloadType },
+    { &MFAudioFormat_MP3,       false, PpboxCodec_MP3,  NULL },
+    { &MFAudioFormat_WMAudioV8, false, PpboxCodec_WMA2, NULL },
+#ifdef PPBOX_JUST_OPUS
+    { &PpboxAudioFormat_Opus,   false, PpboxCodec_Opus, NULL },
+#endif
+};
+
+// Media subtypes are a FOURCC or format tag in Data1 over a shared base.
+// Data1 is unique in the table and serves as the hash: one compare per
+// entry, the whole GUID only on a hit. Too few entries for a bucket array
+// to pay off.
+static MFCodecEntry const * FindMFCodec(REFGUID subtype, bool fVideo)
+{
+    for (size_t i = 0; i < ARRAYSIZE(s_MFCodecs); ++i)
+    {
+        MFCodecEntry const & entry = s_MFCodecs[i];
+        if (entry.pSubtype->Data1 == subtype.Data1
+            && *entry.pSubtype == subtype)
+        {
+            return entry.fVideo == fVideo ? &entry : NULL;
+        }
+    }
+    return NULL;
+}
+
+static GUID const * FindMFSubtype(PpboxCoreCodec codec)
+{
+    for (size_t i = 0; i < ARRAYSIZE(s_MFCodecs); ++i)
+    {
+        if (s_MFCodecs[i].codec == codec)
+        {
+            return s_MFCodecs[i].pSubtype;
+        }
+    }
+    return NULL;
+}
+
+static HRESULT ConvertCodec(IMFMediaType *pType, PpboxCoreMediaType & type, bool fVideo)
+{
+    GUID sub_type;
+    MFCodecEntry const * pEntry = NULL;
+
+    HRESULT hr = pType->GetGUID(MF_MT_SUBTYPE, &sub_type);
+
+    if (SUCCEEDED(hr))
+    {
+        pEntry = FindMFCodec(sub_type, fVideo);
+        if (pEntry == NULL)
+        {
+            hr = MF_E_INVALIDTYPE;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        type.codec = pEntry->codec;
+        if (pEntry->pfnConfig)
+        {
+            hr = pEntry->pfnConfig(pType, type);
         }
     }
 
+    return hr;
+}
+
+static HRESULT ConvertVideoMediaType(IMFMediaType *pType, PpboxCoreMediaType & type)
+{
+    HRESULT hr = S_OK;
+
+    if (SUCCEEDED(hr))
+    {
+        hr = ConvertCodec(pType, type, true);
+    }
+
     // Format details.
     if (SUCCEEDED(hr))
     {
@@ -397,8 +810,8 @@ HRESULT CreateVideoMediaType(JUST_StreamInfo& info, IMFMediaType *pType)
             );
         if (SUCCEEDED(hr))
         {
-            info.format.video.width = width;
-            info.format.video.height = height;
+            type.width = width;
+            type.height = height;
         }
     }
 
@@ -416,99 +829,64 @@ HRESULT CreateVideoMediaType(JUST_StreamInfo& info, IMFMediaType *pType)
             );
         if (SUCCEEDED(hr))
         {
-            info.format.video.frame_rate_num = N;
-            info.format.video.frame_rate_den = D;
+            type.frame_rate_num = N;
+            type.frame_rate_den = D;
         }
     }
 
     return hr;
 }
 
-//*
-HRESULT CreateAudioMediaType(JUST_StreamInfo& info, IMFMediaType *pType)
+static HRESULT ConvertAudioMediaType(IMFMediaType *pType, PpboxCoreMediaType & type)
 {
     HRESULT hr = S_OK;
 
-    // Subtype = Ppbox payload
     if (SUCCEEDED(hr))
     {
-        GUID sub_type;
-        hr = pType->GetGUID(MF_MT_SUBTYPE, &sub_type);
-        if (SUCCEEDED(hr))
-        {
-            if (sub_type == MFAudioFormat_AAC) {
-                info.sub_type = JUST_AudioSubType::MP4A;
-                info.format_type = JUST_FormatType::audio_raw;
-                if (info.format_size > sizeof(HEAACWAVEINFO) - sizeof(WAVEFORMATEX))
-                {
-                    info.format_size -= sizeof(HEAACWAVEINFO) - sizeof(WAVEFORMATEX);
-                    info.format_buffer += sizeof(HEAACWAVEINFO) - sizeof(WAVEFORMATEX);
-                }
-            } else if (sub_type == MFAudioFormat_MP3) {
-                info.sub_type = JUST_AudioSubType::MP3;
-                info.format_type = JUST_FormatType::audio_raw;
-            } else if (sub_type == MFAudioFormat_WMAudioV8) {
-                info.sub_type = JUST_AudioSubType::WMA2;
-                info.format_type = JUST_FormatType::none;
-            } else {
-                hr = MF_E_INVALIDTYPE;
-            }
-        }
+        hr = ConvertCodec(pType, type, false);
     }
 
     // Format details.
     if (SUCCEEDED(hr))
     {
         // Sample size
-
         UINT32 N;
-        hr = pType->GetUINT32(
-            MF_MT_AUDIO_BITS_PER_SAMPLE,
-            &N
-            );
+        hr = pType->GetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, &N);
         if (SUCCEEDED(hr))
         {
-            info.format.audio.sample_size = N;
+            type.bits_per_sample = N;
         }
     }
 
     if (SUCCEEDED(hr))
     {
         // Channel count
-
         UINT32 N;
-        hr = pType->GetUINT32(
-            MF_MT_AUDIO_NUM_CHANNELS,
-            &N
-            );
+        hr = pType->GetUINT32(MF_MT_AUDIO_NUM_CHANNELS, &N);
         if (SUCCEEDED(hr))
         {
-            info.format.audio.channel_count = N;
+            type.channel_count = N;
         }
     }
 
     if (SUCCEEDED(hr))
     {
         // Sample rate
-
         UINT32 N;
-        hr = pType->GetUINT32(
-            MF_MT_AUDIO_SAMPLES_PER_SECOND,
-            &N
-            );
+        hr = pType->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, &N);
         if (SUCCEEDED(hr))
         {
-            info.format.audio.sample_rate = N;
+            type.sample_rate = N;
         }
     }
 
     return hr;
 }
 
-HRESULT CreateMediaType(JUST_StreamInfo& info, IMFMediaType *pType)
+HRESULT ConvertMediaType(IMFMediaType *pType, PpboxCoreMediaType & type)
 {
     HRESULT hr = S_OK;
-    memset(&info, 0, sizeof(info));
+    memset(&type, 0, sizeof(type));
 
     if (SUCCEEDED(hr))
     {
@@ -516,51 +894,308 @@ HRESULT CreateMediaType(JUST_StreamInfo& info, IMFMediaType *pType)
         hr = pType->GetGUID(MF_MT_MAJOR_TYPE, &major);
         if (SUCCEEDED(hr)) {
             if (major == MFMediaType_Video) {
-                info.type = JUST_StreamType::VIDE;
+                type.fVideo = true;
             } else if (major == MFMediaType_Audio) {
-                info.type = JUST_StreamType::AUDI;
+                type.fAudio = true;
             } else {
                 hr = MF_E_INVALIDTYPE;
             }
-            info.time_scale = 10 * 1000 * 1000;
         }
     }
 
     if (SUCCEEDED(hr))
     {
         // foramt data
-        UINT8 * buf = new UINT8[256];
-        UINT32 len = 0;
-        hr = pType->GetBlob(
-            MF_MT_USER_DATA,
-            buf,
-            256, 
-            &len);
-        if (SUCCEEDED(hr)) {
-            info.format_size = len;
-            info.format_buffer = buf;
-        } else {
-            hr = S_OK;
-            delete buf;
-        }
+        hr = GetFormatBlob(pType, MF_MT_USER_DATA, type.userData, &type.cbUserData);
     }
 
-    // Subtype = Ppbox payload
     if (SUCCEEDED(hr))
     {
-        if (info.type == JUST_StreamType::VIDE)
-            hr = CreateVideoMediaType(info, pType);
-        else if (info.type == JUST_StreamType::AUDI)
-            hr = CreateAudioMediaType(info, pType);
+        if (type.fVideo)
+            hr = ConvertVideoMediaType(pType, type);
+        else
+            hr = ConvertAudioMediaType(pType, type);
     }
 
     return hr;
 }
 
-static DWORD SampleCount = 0;
-static DWORD LockSampleCount = 0;
+BOOL IsAdtsMediaType(IMFMediaType *pType)
+{
+    GUID subtype;
+    return SUCCEEDED(pType->GetGUID(MF_MT_SUBTYPE, &subtype))
+        && subtype == MFAudioFormat_AAC
+        && MFGetAttributeUINT32(pType, MF_MT_AAC_PAYLOAD_TYPE, AacPayload_Raw) == AacPayload_ADTS;
+}
+
+HRESULT CreateMediaType(JUST_StreamInfo& info, IMFMediaType *pType)
+{
+    PpboxCoreMediaType type;
+
+    HRESULT hr = ConvertMediaType(pType, type);
+
+    if (SUCCEEDED(hr) && !CreateStreamInfo(info, type))
+    {
+        hr = MF_E_INVALIDTYPE;
+    }
+
+    return hr;
+}
+
+HRESULT CreateStreamFormat(IMFMediaType *pType, PpboxStreamFormat ** ppFormat)
+{
+    PpboxCoreMediaType type;
+
+    HRESULT hr = ConvertMediaType(pType, type);
+
+    if (SUCCEEDED(hr))
+    {
+        *ppFormat = CreateStreamFormat(type);
+        if (*ppFormat == NULL)
+        {
+            hr = MF_E_INVALIDTYPE;
+        }
+    }
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// CreatePreferredMediaTypes:
+// Every codec the backend takes as is, see GetPreferredCodecs, as media
+// types with pType's frame or audio format.
+//-------------------------------------------------------------------
+
+// Attributes that belong to one codec, not carried over to another.
+static GUID const * const s_CodecAttributes[] = 
+{
+    &MF_MT_USER_DATA,
+    &MF_MT_MPEG_SEQUENCE_HEADER,
+    &MF_MT_MPEG2_PROFILE,
+    &MF_MT_MPEG2_LEVEL,
+    &MF_MT_AAC_AUDIO_PROFILE_LEVEL_INDICATION,
+    &MF_MT_AAC_PAYLOAD_TYPE,
+    &MF_MT_AUDIO_BLOCK_ALIGNMENT,
+};
+
+HRESULT CreatePreferredMediaTypes(
+    IMFMediaType *pType, 
+    ComPtrList<IMFMediaType> * pList)
+{
+    HRESULT hr = S_OK;
+    GUID major = GUID_NULL;
+    GUID subtype = GUID_NULL;
+
+    if (pType == nullptr || pList == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    pList->Clear();
+
+    hr = pType->GetGUID(MF_MT_MAJOR_TYPE, &major);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pType->GetGUID(MF_MT_SUBTYPE, &subtype);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pList->InsertBack(pType);
+    }
+
+    bool fVideo = major == MFMediaType_Video;
+    REFGUID guidProfile = fVideo ? MF_MT_MPEG2_PROFILE : MF_MT_AAC_AUDIO_PROFILE_LEVEL_INDICATION;
+    UINT32 uProfile = MFGetAttributeUINT32(pType, guidProfile, 0);
+    MFCodecEntry const * pEntry = FindMFCodec(subtype, fVideo);
+
+    PpboxPreferredCodec codecs[MAX_PREFERRED_CODECS];
+    DWORD cCodecs = 0;
+    if (SUCCEEDED(hr) && (fVideo || major == MFMediaType_Audio))
+    {
+        cCodecs = GetPreferredCodecs(fVideo, pEntry ? pEntry->codec : PpboxCodec_Unknown, uProfile, 
+            codecs, ARRAYSIZE(codecs));
+    }
+
+    // pType itself is first already.
+    for (DWORD i = 1; SUCCEEDED(hr) && i < cCodecs; ++i)
+    {
+        PpboxPreferredCodec const & cap = codecs[i];
+        GUID const * pSubtype = FindMFSubtype(cap.codec);
+        if (pSubtype == NULL)
+        {
+            continue;
+        }
+
+        ComPtr<IMFMediaType> spMT;
+        hr = MFCreateMediaType(&spMT);
+        if (SUCCEEDED(hr))
+        {
+            hr = pType->CopyAllItems(spMT.Get());
+        }
+        for (size_t j = 0; SUCCEEDED(hr) && j < ARRAYSIZE(s_CodecAttributes); ++j)
+        {
+            spMT->DeleteItem(*s_CodecAttributes[j]);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = spMT->SetGUID(MF_MT_SUBTYPE, *pSubtype);
+        }
+        if (SUCCEEDED(hr) && cap.uProfile != 0)
+        {
+            hr = spMT->SetUINT32(guidProfile, cap.uProfile);
+        }
+        if (SUCCEEDED(hr) && cap.codec == PpboxCodec_AAC)
+        {
+            // Raw AAC, what the backend takes.
+            hr = spMT->SetUINT32(MF_MT_AAC_PAYLOAD_TYPE, 0);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = pList->InsertBack(spMT.Get());
+        }
+    }
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// GetMediaTypeFingerprint:
+// FNV-1a over the attribute values, a missing attribute hashes as a
+// marker so that it differs from a zero value.
+//-------------------------------------------------------------------
+
+static void HashGUID(UINT64 & uHash, IMFMediaType *pType, REFGUID guidKey)
+{
+    GUID value;
+    if (SUCCEEDED(pType->GetGUID(guidKey, &value)))
+    {
+        HashFingerprint(uHash, &value, sizeof(value));
+    }
+    else
+    {
+        HashFingerprint(uHash, "-", 1);
+    }
+}
+
+static void HashUINT32(UINT64 & uHash, IMFMediaType *pType, REFGUID guidKey)
+{
+    UINT32 value;
+    if (SUCCEEDED(pType->GetUINT32(guidKey, &value)))
+    {
+        HashFingerprint(uHash, &value, sizeof(value));
+    }
+    else
+    {
+        HashFingerprint(uHash, "-", 1);
+    }
+}
+
+static void HashUINT64(UINT64 & uHash, IMFMediaType *pType, REFGUID guidKey)
+{
+    UINT64 value;
+    if (SUCCEEDED(pType->GetUINT64(guidKey, &value)))
+    {
+        HashFingerprint(uHash, &value, sizeof(value));
+    }
+    else
+    {
+        HashFingerprint(uHash, "-", 1);
+    }
+}
+
+UINT64 GetMediaTypeFingerprint(IMFMediaType *pType)
+{
+    UINT64 uHash = FINGERPRINT_BASIS;
+
+    HashGUID(uHash, pType, MF_MT_MAJOR_TYPE);
+    HashGUID(uHash, pType, MF_MT_SUBTYPE);
+    HashUINT64(uHash, pType, MF_MT_FRAME_SIZE);
+    HashUINT64(uHash, pType, MF_MT_FRAME_RATE);
+    HashUINT32(uHash, pType, MF_MT_AUDIO_NUM_CHANNELS);
+    HashUINT32(uHash, pType, MF_MT_AUDIO_SAMPLES_PER_SECOND);
+    HashUINT32(uHash, pType, MF_MT_AUDIO_BITS_PER_SAMPLE);
+
+    return uHash;
+}
+
+//-------------------------------------------------------------------
+// MFSampleOps:
+// Lets the core reach into an IMFSample.
+//-------------------------------------------------------------------
+
+static void MFSampleAddRef(void * sample)
+{
+    ((IMFSample *)sample)->AddRef();
+}
+
+static void MFSampleRelease(void * sample)
+{
+    ((IMFSample *)sample)->Release();
+}
+
+static bool MFSampleGetInfo(void * sample, JUST_Sample & info)
+{
+    return SUCCEEDED(CreateSampleInfo(info, (IMFSample *)sample));
+}
+
+static unsigned long MFSampleGetBufferCount(void * sample)
+{
+    DWORD dwBufferCount = 0;
+    if (FAILED(((IMFSample *)sample)->GetBufferCount(&dwBufferCount)))
+    {
+        dwBufferCount = 0;
+    }
+    return dwBufferCount;
+}
+
+static bool MFSampleLockBuffer(void * sample, unsigned long index, unsigned char ** ppData, unsigned long * pcbData)
+{
+    IMFMediaBuffer *pBuffer = NULL;
+    DWORD dwSize = 0;
+    HRESULT hr = ((IMFSample *)sample)->GetBufferByIndex(index, &pBuffer);
+    if (SUCCEEDED(hr))
+    {
+        hr = pBuffer->Lock(ppData, NULL, &dwSize);
+    }
+    if (SUCCEEDED(hr))
+    {
+        *pcbData = dwSize;
+    }
+    SafeRelease(&pBuffer);
+    TraceError(__FILE__, __LINE__, __FUNCTION__, NULL, hr);
+    return SUCCEEDED(hr);
+}
+
+static void MFSampleUnlockBuffer(void * sample, unsigned long index)
+{
+    IMFMediaBuffer *pBuffer = NULL;
+    HRESULT hr = ((IMFSample *)sample)->GetBufferByIndex(index, &pBuffer);
+    if (SUCCEEDED(hr))
+    {
+        hr = pBuffer->Unlock();
+    }
+    SafeRelease(&pBuffer);
+    TraceError(__FILE__, __LINE__, __FUNCTION__, NULL, hr);
+}
+
+PpboxSampleOps const MFSampleOps =
+{
+    MFSampleAddRef,
+    MFSampleRelease,
+    MFSampleGetInfo,
+    MFSampleGetBufferCount,
+    MFSampleLockBuffer,
+    MFSampleUnlockBuffer,
+};
 
-HRESULT CreateSample(JUST_Sample& sample, IMFSample *pSample)
+//-------------------------------------------------------------------
+// CreateSampleInfo:
+// Fills in flags, timestamps and size, leaves buffer and context alone.
+//-------------------------------------------------------------------
+
+HRESULT CreateSampleInfo(JUST_Sample& sample, IMFSample *pSample)
 {
     HRESULT hr = S_OK;
 
@@ -636,128 +1271,442 @@ HRESULT CreateSample(JUST_Sample& sample, IMFSample *pSample)
         }
     }
 
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// PublishBitrateToConfigurations:
+// Only called when the recommendation changed enough, apps may react to
+// every MapChanged event of the key.
+//-------------------------------------------------------------------
+
+HRESULT PublishBitrateToConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    DWORD dwStream,
+    UINT32 uBitrate)
+{
+    HRESULT hr = S_OK;
+    ComPtr<IPropertySet> spConfigurations(pConfigurations);
+    ComPtr<IMap<HSTRING, IInspectable *>> spMap;
+    ComPtr<IPropertyValueStatics> spStatics;
+    ComPtr<IInspectable> spValue;
+    boolean replaced = false;
+    WCHAR szName[64];
+
+    if (pConfigurations == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    hr = spConfigurations.As(&spMap);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = ::Windows::Foundation::GetActivationFactory(
+            HStringReference(RuntimeClass_Windows_Foundation_PropertyValue).Get(), &spStatics);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = spStatics->CreateUInt32(uBitrate, &spValue);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        swprintf_s(szName, L"RecommendedBitrate.Stream%u", dwStream);
+        hr = spMap->Insert(HStringReference(szName).Get(), spValue.Get(), &replaced);
+    }
+
+    return hr;
+}
+
+HRESULT PublishCaptureStatusToConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    HRESULT hrStatus)
+{
+    HRESULT hr = S_OK;
+    ComPtr<IPropertySet> spConfigurations(pConfigurations);
+    ComPtr<IMap<HSTRING, IInspectable *>> spMap;
+    ComPtr<IPropertyValueStatics> spStatics;
+    ComPtr<IInspectable> spValue;
+    boolean replaced = false;
+
+    if (pConfigurations == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    hr = spConfigurations.As(&spMap);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = ::Windows::Foundation::GetActivationFactory(
+            HStringReference(RuntimeClass_Windows_Foundation_PropertyValue).Get(), &spStatics);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = spStatics->CreateInt32(hrStatus, &spValue);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = spMap->Insert(HStringReference(L"CaptureStatus").Get(), spValue.Get(), &replaced);
+    }
+
+    return hr;
+}
+
+HRESULT GetUInt8ArrayFromConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    PCWSTR pszName, 
+    UINT32 * pcbValue,
+    BYTE ** ppValue)
+{
+    HRESULT hr = S_OK;
+    ComPtr<IPropertySet > spConfigurations(pConfigurations);
+    ComPtr<IPropertyValue> spValue;
+
+    if (pConfigurations == nullptr || pszName == nullptr || pcbValue == nullptr || ppValue == nullptr)
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = PropertySetFind(spConfigurations, pszName, spValue);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = spValue->GetUInt8Array(pcbValue, ppValue);
+    }
+    return hr;
+}
+
+HRESULT PublishCompiledConfigurationToConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    std::vector<BYTE> const & blob)
+{
+    HRESULT hr = S_OK;
+    ComPtr<IPropertySet> spConfigurations(pConfigurations);
+    ComPtr<IMap<HSTRING, IInspectable *>> spMap;
+    ComPtr<IPropertyValueStatics> spStatics;
+    ComPtr<IInspectable> spValue;
+    boolean replaced = false;
+
+    if (pConfigurations == nullptr || blob.empty())
+    {
+        return E_INVALIDARG;
+    }
+
+    hr = spConfigurations.As(&spMap);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = ::Windows::Foundation::GetActivationFactory(
+            HStringReference(RuntimeClass_Windows_Foundation_PropertyValue).Get(), &spStatics);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = spStatics->CreateUInt8Array((UINT32)blob.size(), const_cast<BYTE *>(&blob[0]), &spValue);
+    }
+
     if (SUCCEEDED(hr))
     {
-        // cbuf
-        DWORD dwBufferCount = 0;
-        hr = pSample->GetBufferCount(&dwBufferCount);
+        hr = spMap->Insert(HStringReference(L"CompiledConfigurationOutput").Get(), spValue.Get(), &replaced);
+    }
+
+    return hr;
+}
+
+//-------------------------------------------------------------------
+// CompileConfiguration:
+// Attribute values are stored as MF holds them. IUnknown attributes
+// cannot be stored, a type with one is not compiled.
+//-------------------------------------------------------------------
+
+static HRESULT AddConfigAttribute(PpboxConfigWriter & writer, REFGUID guidKey, PROPVARIANT const & var)
+{
+    unsigned char const * pKey = (unsigned char const *)&guidKey;
+
+    switch (var.vt)
+    {
+    case VT_UI4:
+        writer.AddAttribute(pKey, ConfigType_UInt32, &var.ulVal, sizeof(var.ulVal));
+        break;
+    case VT_UI8:
+        writer.AddAttribute(pKey, ConfigType_UInt64, &var.uhVal.QuadPart, sizeof(var.uhVal.QuadPart));
+        break;
+    case VT_R8:
+        writer.AddAttribute(pKey, ConfigType_Double, &var.dblVal, sizeof(var.dblVal));
+        break;
+    case VT_CLSID:
+        writer.AddAttribute(pKey, ConfigType_Guid, var.puuid, sizeof(GUID));
+        break;
+    case VT_LPWSTR:
+        writer.AddAttribute(pKey, ConfigType_String, var.pwszVal, (unsigned long)(wcslen(var.pwszVal) * sizeof(WCHAR)));
+        break;
+    case VT_VECTOR | VT_UI1:
+        writer.AddAttribute(pKey, ConfigType_Blob, var.caub.pElems, var.caub.cElems);
+        break;
+    default:
+        return MF_E_INVALIDTYPE;
+    }
+    return S_OK;
+}
+
+HRESULT CompileConfiguration(
+    ComPtrList<IMFMediaType> * pListMT,
+    std::vector<std::wstring> const & destinations,
+    std::vector<BYTE> & blob)
+{
+    HRESULT hr = S_OK;
+    PpboxConfigWriter writer;
+
+    if (pListMT == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    auto pos = pListMT->FrontPosition();
+    for (DWORD i = 0; SUCCEEDED(hr) && i < pListMT->GetCount(); ++i)
+    {
+        ComPtr<IMFMediaType> spMT;
+        UINT32 cItems = 0;
+
+        hr = pListMT->GetItemByPosition(pos, &spMT);
         if (SUCCEEDED(hr))
         {
-            if (dwBufferCount == 1) {
-                IMFMediaBuffer *pBuffer = NULL;
-                BYTE *pData = NULL;      // Pointer to the IMFMediaBuffer data.
-                DWORD dwSize = 0;
-                hr = pSample->GetBufferByIndex(0, &pBuffer);
-                if (SUCCEEDED(hr))
-                {
-                    hr = pBuffer->Lock(&pData, NULL, &dwSize);
-                }
-                if (SUCCEEDED(hr))
-                {
-                    assert(dwSize == sample.size);
-                    sample.buffer = pData;
-                }
-                SafeRelease(&pBuffer);
-            } else {
-                sample.size = dwBufferCount;
-                sample.buffer = NULL;
+            hr = spMT->GetCount(&cItems);
+        }
+        if (SUCCEEDED(hr))
+        {
+            writer.BeginStream();
+        }
+
+        for (UINT32 j = 0; SUCCEEDED(hr) && j < cItems; ++j)
+        {
+            GUID guidKey;
+            PROPVARIANT var;
+            PropVariantInit(&var);
+
+            hr = spMT->GetItemByIndex(j, &guidKey, &var);
+            if (SUCCEEDED(hr))
+            {
+                hr = AddConfigAttribute(writer, guidKey, var);
             }
+            PropVariantClear(&var);
         }
+
+        pos = pListMT->Next(pos);
     }
 
-    sample.context = pSample;
-    pSample->AddRef();
+    if (SUCCEEDED(hr))
+    {
+        for (size_t i = 0; i < destinations.size(); ++i)
+        {
+            writer.AddDestination((unsigned short const *)destinations[i].c_str(), (unsigned long)destinations[i].size());
+        }
+        if (!writer.Finish(blob))
+        {
+            hr = E_INVALIDARG;
+        }
+    }
 
-    ++SampleCount;
-    ++LockSampleCount;
+    return hr;
+}
 
-    if (SampleCount % 10 == 0)
-        TRACE(0, L"SampleCount = %u - %u\r\n", SampleCount, LockSampleCount);
+//-------------------------------------------------------------------
+// ConvertCompiledConfiguration:
+// Parsed configurations are kept by the hash of their blob, the oldest
+// entry makes room. A hit is confirmed on the whole blob, then only the
+// types are copied. The cache is process-wide, sinks share it.
+//-------------------------------------------------------------------
 
-    TRACEHR_RET(hr);
+const DWORD CONFIG_CACHE_ENTRIES = 8;
+
+struct CompiledConfigEntry
+{
+    UINT64                              uHash;
+    std::vector<BYTE>                   blob;
+    std::vector<ComPtr<IMFMediaType>>   types;
+    std::vector<std::wstring>           destinations;
+};
+
+static std::mutex s_CompiledConfigMutex;
+static CompiledConfigEntry s_CompiledConfigs[CONFIG_CACHE_ENTRIES];
+static DWORD s_iNextCompiledConfig = 0;
+
+static HRESULT SetConfigAttribute(IMFAttributes *pAttr, PpboxConfigAttribute const & attribute)
+{
+    GUID guidKey;
+    memcpy(&guidKey, attribute.pKey, sizeof(guidKey));
+
+    switch (attribute.type)
+    {
+    case ConfigType_UInt32:
+        {
+            UINT32 value;
+            memcpy(&value, attribute.pValue, sizeof(value));
+            return pAttr->SetUINT32(guidKey, value);
+        }
+    case ConfigType_UInt64:
+        {
+            UINT64 value;
+            memcpy(&value, attribute.pValue, sizeof(value));
+            return pAttr->SetUINT64(guidKey, value);
+        }
+    case ConfigType_Double:
+        {
+            DOUBLE value;
+            memcpy(&value, attribute.pValue, sizeof(value));
+            return pAttr->SetDouble(guidKey, value);
+        }
+    case ConfigType_Guid:
+        {
+            GUID value;
+            memcpy(&value, attribute.pValue, sizeof(value));
+            return pAttr->SetGUID(guidKey, value);
+        }
+    case ConfigType_String:
+        {
+            std::wstring value((WCHAR const *)attribute.pValue, attribute.cbValue / sizeof(WCHAR));
+            return pAttr->SetString(guidKey, value.c_str());
+        }
+    case ConfigType_Blob:
+        return pAttr->SetBlob(guidKey, attribute.pValue, attribute.cbValue);
+    }
+    return MF_E_INVALIDTYPE;
 }
 
-bool GetSampleBuffers(void const *context, JUST_ConstBuffer * buffers)
+static HRESULT ParseCompiledConfiguration(
+    BYTE const * pBlob, 
+    UINT32 cbBlob, 
+    std::vector<ComPtr<IMFMediaType>> & types,
+    std::vector<std::wstring> & destinations)
 {
     HRESULT hr = S_OK;
-    IMFMediaBuffer      *pBuffer = NULL;
-    IMFSample           *pSample = (IMFSample *)context;
-    DWORD               dwBufferCount = 0;
-    BYTE                *pData = NULL;      // Pointer to the IMFMediaBuffer data.
-    DWORD               dwSize = 0;
-    DWORD               dwTotalSize = 0;
-
-    hr = pSample->GetBufferCount(&dwBufferCount);
+    PpboxConfigReader reader;
 
-    if (FAILED(hr))
+    if (!reader.Open(pBlob, cbBlob))
     {
-        return false;
+        return E_INVALIDARG;
     }
 
-    for (DWORD i = 0; i < dwBufferCount; ++i)
+    for (unsigned long i = 0; SUCCEEDED(hr) && i < reader.GetStreamCount(); ++i)
     {
-        hr = pSample->GetBufferByIndex(i, &pBuffer);
-        if (FAILED(hr))
+        ComPtr<IMFMediaType> spMT;
+        GUID guidMajorType;
+
+        hr = MFCreateMediaType(&spMT);
+        for (unsigned long j = 0; SUCCEEDED(hr) && j < reader.GetAttributeCount(i); ++j)
         {
-            break;
+            PpboxConfigAttribute attribute;
+            reader.GetAttribute(i, j, attribute);
+            hr = SetConfigAttribute(spMT.Get(), attribute);
         }
-        hr = pBuffer->Lock(&pData, NULL, &dwSize);
-        if (FAILED(hr))
+
+        // As ConvertPropertiesToMediaType.
+        if (SUCCEEDED(hr))
         {
-            SafeRelease(&pBuffer);
-            break;
+            hr = spMT->GetGUID(MF_MT_MAJOR_TYPE, &guidMajorType);
+        }
+        if (SUCCEEDED(hr))
+        {
+            if (guidMajorType != MFMediaType_Video && guidMajorType != MFMediaType_Audio)
+            {
+                hr = E_UNEXPECTED;
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            PrintMediaType(spMT.Get());
+            types.push_back(spMT);
         }
-        buffers[i].data = pData;
-        buffers[i].len = dwSize;
-        dwTotalSize += dwSize;
-        SafeRelease(&pBuffer);
     }
 
-    if (SUCCEEDED(hr)) {
-        DWORD size = 0;
-        hr = pSample->GetTotalLength(&size);
-        assert(dwTotalSize == size);
+    for (unsigned long i = 0; SUCCEEDED(hr) && i < reader.GetDestinationCount(); ++i)
+    {
+        unsigned short const * pszDest = NULL;
+        unsigned long cchDest = 0;
+        reader.GetDestination(i, &pszDest, &cchDest);
+        destinations.push_back(std::wstring((WCHAR const *)pszDest, cchDest));
     }
 
-    TraceError(__FILE__, __LINE__, __FUNCTION__, NULL, hr);
-    return SUCCEEDED(hr);
+    return hr;
 }
 
-bool FreeSample(void const *context)
+HRESULT ConvertCompiledConfiguration(
+    BYTE const * pBlob, 
+    UINT32 cbBlob, 
+    ComPtrList<IMFMediaType> * pListMT,
+    std::vector<std::wstring> & destinations)
 {
     HRESULT hr = S_OK;
-    IMFMediaBuffer      *pBuffer = NULL;
-    IMFSample           *pSample = (IMFSample *)context;
-    DWORD               dwBufferCount = 0;
-
-    hr = pSample->GetBufferCount(&dwBufferCount);
+    std::vector<ComPtr<IMFMediaType>> types;
+    BOOL fCached = FALSE;
 
-    if (FAILED(hr))
+    if (pBlob == nullptr || cbBlob == 0 || pListMT == nullptr)
     {
-        TraceError(__FILE__, __LINE__, __FUNCTION__, NULL, hr);
-        return false;
+        return E_INVALIDARG;
     }
 
-    for (DWORD i = 0; i < dwBufferCount; ++i)
+    pListMT->Clear();
+    destinations.clear();
+
+    UINT64 uHash = GetConfigHash(pBlob, cbBlob);
+
     {
-        hr = pSample->GetBufferByIndex(i, &pBuffer);
-        if (FAILED(hr))
+        std::lock_guard<std::mutex> lock(s_CompiledConfigMutex);
+        for (DWORD i = 0; i < CONFIG_CACHE_ENTRIES; ++i)
         {
-            break;
+            CompiledConfigEntry const & entry = s_CompiledConfigs[i];
+            if (entry.uHash == uHash 
+                && entry.blob.size() == cbBlob 
+                && memcmp(&entry.blob[0], pBlob, cbBlob) == 0)
+            {
+                types = entry.types;
+                destinations = entry.destinations;
+                fCached = TRUE;
+                break;
+            }
         }
-        hr = pBuffer->Unlock();
-        if (FAILED(hr))
+    }
+
+    if (!fCached)
+    {
+        hr = ParseCompiledConfiguration(pBlob, cbBlob, types, destinations);
+
+        if (SUCCEEDED(hr))
         {
-            SafeRelease(&pBuffer);
-            break;
+            std::lock_guard<std::mutex> lock(s_CompiledConfigMutex);
+            CompiledConfigEntry & entry = s_CompiledConfigs[s_iNextCompiledConfig];
+            entry.uHash = uHash;
+            entry.blob.assign(pBlob, pBlob + cbBlob);
+            entry.types = types;
+            entry.destinations = destinations;
+            s_iNextCompiledConfig = (s_iNextCompiledConfig + 1) % CONFIG_CACHE_ENTRIES;
         }
-        SafeRelease(&pBuffer);
     }
 
-    SafeRelease(&pSample);
+    // The cached types are shared, each sink gets copies of its own.
+    for (size_t i = 0; SUCCEEDED(hr) && i < types.size(); ++i)
+    {
+        ComPtr<IMFMediaType> spMT;
 
-    --LockSampleCount;
+        hr = MFCreateMediaType(&spMT);
+        if (SUCCEEDED(hr))
+        {
+            hr = types[i]->CopyAllItems(spMT.Get());
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = pListMT->InsertBack(spMT.Get());
+        }
+    }
 
-    TraceError(__FILE__, __LINE__, __FUNCTION__, NULL, hr);
-    return SUCCEEDED(hr);
+    return hr;
 }
@@ -12,6 +12,8 @@
 //
 //////////////////////////////////////////////////////////////////////////
 
+#pragma once
+
 #include <windows.h>
 #include <mfapi.h>
 
@@ -19,6 +21,11 @@
 
 #include "ComPtrList.h"
 
+#include "PpboxCore.h"
+
+#include <vector>
+#include <string>
+
 HRESULT ConvertPropertiesToMediaType(
     _In_ ABI::Windows::Media::MediaProperties::IMediaEncodingProperties *pMEP, 
     _Outptr_ IMFMediaType **ppMT);
@@ -31,11 +38,97 @@ HRESULT GetDestinationtFromConfigurations(
     ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
     HSTRING * pDestinationt);
 
-HRESULT CreateVideoMediaType(JUST_StreamInfo& info, IMFMediaType *pType);
-HRESULT CreateAudioMediaType(JUST_StreamInfo& info, IMFMediaType *pType);
+HRESULT GetDestinationsFromConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    std::vector<std::wstring> & destinations);
+
+HRESULT ConvertMediaType(IMFMediaType *pType, PpboxCoreMediaType & type);
 HRESULT CreateMediaType(JUST_StreamInfo& info, IMFMediaType *pType);
 
-HRESULT CreateSample(JUST_Sample& sample, IMFSample *pSample);
+// As CreateMediaType, in a format object the samples can reference.
+HRESULT CreateStreamFormat(IMFMediaType *pType, PpboxStreamFormat ** ppFormat);
+
+// AAC in ADTS frames, whose headers the core strips from the samples.
+BOOL IsAdtsMediaType(IMFMediaType *pType);
+
+// Fills pList with the types a stream configured with pType takes
+// directly, best first: pType itself, then the other codecs of its major
+// type (see GetPreferredCodecs), with pType's frame or audio format.
+HRESULT CreatePreferredMediaTypes(
+    IMFMediaType *pType, 
+    ComPtrList<IMFMediaType> * pList);
+
+// Hash of the attributes that decide whether a type is accepted: major
+// type, subtype, frame size and rate, audio channels, rate and sample size.
+// Types with equal fingerprints get the same answer, see
+// PpboxNegotiationCache.
+UINT64 GetMediaTypeFingerprint(IMFMediaType *pType);
+
+HRESULT GetStringFromConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    PCWSTR pszName, 
+    HSTRING * pValue);
+
+HRESULT GetUInt32FromConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    PCWSTR pszName, 
+    UINT32 * pValue);
+
+// Writes a statistics snapshot to the set as "Stats.*" UInt64 values:
+// Stats.InFlight, Stats.Spilled, Stats.CaptureReadyTime,
+// Stats.FirstSampleTime, Stats.StartLatency, Stats.Stream<id>.<counter> and
+// Stats.Dest<index>.<counter>, counters named as in PpboxCore.h.
+// Stats.Stream<id>.QueueGrowth is signed, an Int64.
+HRESULT PublishStatsToConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    PpboxSinkStats const & stats);
+
+// Writes a stream's recommended bitrate, bits per second, to the set as
+// the UInt32 "RecommendedBitrate.Stream<id>".
+HRESULT PublishBitrateToConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    DWORD dwStream,
+    UINT32 uBitrate);
+
+// Writes how the capture handles came up, an HRESULT, to the set as the
+// Int32 "CaptureStatus".
+HRESULT PublishCaptureStatusToConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    HRESULT hrStatus);
+
+// Reads a byte array value, to be freed with CoTaskMemFree.
+HRESULT GetUInt8ArrayFromConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    PCWSTR pszName, 
+    UINT32 * pcbValue,
+    BYTE ** ppValue);
+
+// Compiled configuration (see PpboxConfig.h): the stream types and
+// destinations SetProperties reads from a set, in one blob. With
+// "CompileConfiguration" set the sink writes it to the set as
+// "CompiledConfigurationOutput"; apps keep the blob and pass it back as
+// "CompiledConfiguration", the sink then skips the property set walk and
+// conversion.
+HRESULT CompileConfiguration(
+    ComPtrList<IMFMediaType> * pListMT,
+    std::vector<std::wstring> const & destinations,
+    std::vector<BYTE> & blob);
+
+// Blobs seen before are not parsed again, they are cached by content hash.
+HRESULT ConvertCompiledConfiguration(
+    BYTE const * pBlob, 
+    UINT32 cbBlob, 
+    ComPtrList<IMFMediaType> * pListMT,
+    std::vector<std::wstring> & destinations);
+
+// Writes a compiled configuration to the set as the UInt8Array
+// "CompiledConfigurationOutput". The sink never reads that key, the
+// blob is only used once the app passes it as "CompiledConfiguration".
+HRESULT PublishCompiledConfigurationToConfigurations(
+    ABI::Windows::Foundation::Collections::IPropertySet *pConfigurations, 
+    std::vector<BYTE> const & blob);
+
+// Sample access for the core (see PpboxCore.h), the host sample is an IMFSample.
+extern PpboxSampleOps const MFSampleOps;
 
-bool GetSampleBuffers(void const *context, JUST_ConstBuffer * buffers);
-bool FreeSample(void const *context);
+HRESULT CreateSampleInfo(JUST_Sample& sample, IMFSample *pSample);
@@ -0,0 +1,54 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxNegotiation.cpp
+// Remembers which media types a stream accepts, by fingerprint, so that
+// topology resolution does not check the same type over and over.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+
+void HashFingerprint(unsigned long long & uHash, void const * pData, size_t cbData)
+{
+    unsigned char const * p = (unsigned char const *)pData;
+    for (size_t i = 0; i < cbData; ++i)
+    {
+        uHash ^= p[i];
+        uHash *= 0x100000001b3ULL;
+    }
+}
+
+bool PpboxNegotiationCache::Lookup(unsigned long long uFingerprint, long * plResult)
+{
+    for (unsigned long i = 0; i < m_cEntries; ++i)
+    {
+        if (m_Entries[i].uFingerprint == uFingerprint)
+        {
+            *plResult = m_Entries[i].lResult;
+            ++m_cHits;
+            return true;
+        }
+    }
+    ++m_cMisses;
+    return false;
+}
+
+void PpboxNegotiationCache::Add(unsigned long long uFingerprint, long lResult)
+{
+    m_Entries[m_iNext].uFingerprint = uFingerprint;
+    m_Entries[m_iNext].lResult = lResult;
+    m_iNext = (m_iNext + 1) % NEGOTIATION_CACHE_ENTRIES;
+    if (m_cEntries < NEGOTIATION_CACHE_ENTRIES)
+    {
+        ++m_cEntries;
+    }
+}
@@ -0,0 +1,65 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxNegotiation.h
+// Remembers which media types a stream accepts, by fingerprint, so that
+// topology resolution does not check the same type over and over.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+#include <stddef.h>
+
+// Fingerprints are FNV-1a: start from FINGERPRINT_BASIS and hash each
+// attribute in turn.
+const unsigned long long FINGERPRINT_BASIS = 0xcbf29ce484222325ULL;
+
+void HashFingerprint(unsigned long long & uHash, void const * pData, size_t cbData);
+
+// Topology resolution offers every candidate of every upstream node, and
+// then asks about some of them again: room for all of a large topology's
+// candidates, so that the second pass does not find the first evicted.
+const unsigned long NEGOTIATION_CACHE_ENTRIES = 64;
+
+// PpboxNegotiationCache:
+// Answers of IsMediaTypeSupported by fingerprint, so that the types
+// topology resolution probes again and again are not checked (and
+// printed) again. The oldest entry makes room. Cleared whenever the
+// answers may change, i.e. when the current type changes. Answers are
+// HRESULTs on Windows. Not thread safe, the owner locks it.
+class PpboxNegotiationCache
+{
+public:
+    PpboxNegotiationCache() : m_cEntries(0), m_iNext(0), m_cHits(0), m_cMisses(0) {}
+
+public:
+    bool    Lookup(unsigned long long uFingerprint, long * plResult);
+    void    Add(unsigned long long uFingerprint, long lResult);
+    void    Clear() { m_cEntries = 0; m_iNext = 0; }
+
+    // Lookups since construction.
+    unsigned long   GetHits() const { return m_cHits; }
+    unsigned long   GetMisses() const { return m_cMisses; }
+
+private:
+    struct Entry
+    {
+        unsigned long long  uFingerprint;
+        long                lResult;
+    };
+
+    Entry           m_Entries[NEGOTIATION_CACHE_ENTRIES];
+    unsigned long   m_cEntries;
+    unsigned long   m_iNext;
+    unsigned long   m_cHits;
+    unsigned long   m_cMisses;
+};
@@ -0,0 +1,133 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxPacer.cpp
+// Token bucket that smooths the sink's output to its measured bitrate.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+#include "PpboxPacer.h"
+
+PpboxPacer::PpboxPacer() :
+    m_uBurstMs(PACING_DEFAULT_BURST),
+    m_uHeadroomPercent(PACING_DEFAULT_HEADROOM)
+{
+    Reset();
+}
+
+void PpboxPacer::Configure(unsigned long uBurstMs, unsigned long uHeadroomPercent)
+{
+    m_uBurstMs = uBurstMs;
+    m_uHeadroomPercent = uHeadroomPercent < 100 ? 100 : uHeadroomPercent;
+}
+
+void PpboxPacer::Push(JUST_Sample const & sample, PpboxPriority priority, long long llNow)
+{
+    m_Samples.Push(sample, priority);
+
+    if (!m_fWindow || llNow < m_llWindowStart)
+    {
+        m_fWindow = true;
+        m_llWindowStart = llNow;
+        m_cbWindow = 0;
+    }
+
+    m_cbWindow += sample.size;
+
+    // Smoothed over a few windows, one keyframe does not swing it.
+    long long llElapsed = llNow - m_llWindowStart;
+    if (llElapsed >= PACING_WINDOW)
+    {
+        double dMeasured = (double)m_cbWindow * 10000000.0 / (double)llElapsed
+            * m_uHeadroomPercent / 100.0;
+        if (m_dRate == 0)
+        {
+            m_dRate = dMeasured;
+            m_dTokens = 0;
+            m_llLastRefill = llNow;
+        }
+        else
+        {
+            m_dRate = m_dRate * 0.75 + dMeasured * 0.25;
+        }
+        m_llWindowStart = llNow;
+        m_cbWindow = 0;
+    }
+}
+
+bool PpboxPacer::Pop(long long llNow, JUST_Sample & sample)
+{
+    if (!m_Samples.Front(sample))
+    {
+        return false;
+    }
+
+    if (m_dRate > 0)
+    {
+        Refill(llNow);
+        if (m_dTokens <= 0)
+        {
+            return false;
+        }
+        m_dTokens -= sample.size;
+    }
+
+    return m_Samples.Pop(sample);
+}
+
+bool PpboxPacer::PopAny(JUST_Sample & sample)
+{
+    return m_Samples.Pop(sample);
+}
+
+long long PpboxPacer::GetNextTime() const
+{
+    if (m_dRate == 0 || m_dTokens > 0)
+    {
+        return m_llLastRefill;
+    }
+
+    // Time to bring the bucket back above zero.
+    return m_llLastRefill + (long long)(-m_dTokens * 10000000.0 / m_dRate) + 1;
+}
+
+void PpboxPacer::Reset()
+{
+    m_Samples.Clear();
+    m_dRate = 0;
+    m_dTokens = 0;
+    m_llLastRefill = 0;
+    m_cbWindow = 0;
+    m_llWindowStart = 0;
+    m_fWindow = false;
+}
+
+/* Private methods */
+
+void PpboxPacer::Refill(long long llNow)
+{
+    if (llNow < m_llLastRefill)
+    {
+        // Clock went back (seek, restart): start over from a full bucket.
+        m_llLastRefill = llNow;
+        m_dTokens = m_dRate * m_uBurstMs / 1000.0;
+        return;
+    }
+
+    double dBurst = m_dRate * m_uBurstMs / 1000.0;
+    m_dTokens += m_dRate * (double)(llNow - m_llLastRefill) / 10000000.0;
+    if (m_dTokens > dBurst)
+    {
+        m_dTokens = dBurst;
+    }
+    m_llLastRefill = llNow;
+}
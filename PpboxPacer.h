@@ -0,0 +1,71 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxPacer.h
+// Token bucket that smooths the sink's output to its measured bitrate.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+const unsigned long PACING_DEFAULT_BURST = 200;         // Milliseconds of output the bucket holds.
+const unsigned long PACING_DEFAULT_HEADROOM = 125;      // Output rate, percent of the measured input rate.
+const long long PACING_WINDOW = 10000000;               // Input rate measured over this, 100ns units.
+
+// PpboxPacer:
+// Samples go in as the encoder produces them and come out no faster than
+// the measured input rate (plus headroom, so a backlog drains), with
+// bursts up to the bucket size. A sample may go as soon as the bucket is
+// not empty and drives it negative, so samples bigger than the bucket
+// (keyframes) are not stuck. Until a first rate is measured, nothing is
+// held back. Times are the caller's, 100ns units; a clock that goes back
+// restarts the measurement. Held samples leave in PpboxPriorityQueue
+// order. Not thread safe, the sink lock protects it.
+class PpboxPacer
+{
+public:
+    PpboxPacer();
+
+public:
+    void    Configure(unsigned long uBurstMs, unsigned long uHeadroomPercent);
+    void    EnablePriority(bool fEnable) { m_Samples.EnablePriority(fEnable); }
+
+    bool    IsEmpty() const { return m_Samples.IsEmpty(); }
+
+    void    Push(JUST_Sample const & sample, PpboxPriority priority, long long llNow);
+
+    // Next sample, if it may go at llNow.
+    bool    Pop(long long llNow, JUST_Sample & sample);
+    // Next sample regardless of the bucket, to flush.
+    bool    PopAny(JUST_Sample & sample);
+
+    // When the next sample may go, if there is one.
+    long long   GetNextTime() const;
+
+    void    Reset();
+
+private:
+    void    Refill(long long llNow);
+
+private:
+    PpboxPriorityQueue  m_Samples;
+
+    unsigned long   m_uBurstMs;
+    unsigned long   m_uHeadroomPercent;
+
+    double          m_dRate;            // Output bytes per second, 0 = not measured yet.
+    double          m_dTokens;          // Bytes that may go now, may be negative.
+    long long       m_llLastRefill;
+
+    unsigned long long  m_cbWindow;     // Input since m_llWindowStart.
+    long long       m_llWindowStart;
+    bool            m_fWindow;          // m_llWindowStart is set; a clock may start at 0.
+};
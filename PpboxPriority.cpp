@@ -0,0 +1,163 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxPriority.cpp
+// Orders held samples by stream priority class, so that audio is not
+// stuck behind video when the backend falls behind.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+
+PpboxPriorityQueue::PpboxPriorityQueue() :
+    m_cSamples(0),
+    m_uSequence(0),
+    m_iNext(-1),
+    m_fPriority(false)
+{
+    for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+    {
+        m_Streams[i].cBypassed = 0;
+    }
+}
+
+void PpboxPriorityQueue::Push(JUST_Sample const & sample, PpboxPriority priority)
+{
+    // Identifiers past the table share its last slot, still in order.
+    unsigned long iStream = sample.itrack < MAX_STREAMS ? sample.itrack : MAX_STREAMS - 1;
+
+    Entry entry;
+    entry.sample = sample;
+    entry.uSequence = m_uSequence++;
+    if (!m_fPriority)
+    {
+        entry.uRank = 0;
+    }
+    else if (priority == Priority_Audio)
+    {
+        entry.uRank = 0;
+    }
+    else
+    {
+        entry.uRank = (sample.flags & JUST_SampleFlag::sync) ? 1 : 2;
+    }
+
+    m_Streams[iStream].entries.push_back(entry);
+    ++m_cSamples;
+    m_iNext = -1;
+}
+
+bool PpboxPriorityQueue::Front(JUST_Sample & sample)
+{
+    if (m_iNext < 0)
+    {
+        m_iNext = Select();
+    }
+    if (m_iNext < 0)
+    {
+        return false;
+    }
+
+    sample = m_Streams[m_iNext].entries.front().sample;
+    return true;
+}
+
+bool PpboxPriorityQueue::Pop(JUST_Sample & sample)
+{
+    if (!Front(sample))
+    {
+        return false;
+    }
+
+    // Everyone else that waited was passed over once more.
+    for (unsigned long i = 0; i < MAX_STREAMS && m_fPriority; ++i)
+    {
+        if (!m_Streams[i].entries.empty())
+        {
+            ++m_Streams[i].cBypassed;
+        }
+    }
+
+    Stream & stream = m_Streams[m_iNext];
+    stream.entries.pop_front();
+    stream.cBypassed = 0;
+    --m_cSamples;
+    m_iNext = -1;
+    return true;
+}
+
+void PpboxPriorityQueue::Clear()
+{
+    for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+    {
+        m_Streams[i].entries.clear();
+        m_Streams[i].cBypassed = 0;
+    }
+    m_cSamples = 0;
+    m_iNext = -1;
+}
+
+/* Private methods */
+
+long PpboxPriorityQueue::Select()
+{
+    long iBest = -1;
+    bool fBestStarved = false;
+
+    if (m_cSamples == 0)
+    {
+        return -1;
+    }
+
+    for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+    {
+        Stream const & stream = m_Streams[i];
+        if (stream.entries.empty())
+        {
+            continue;
+        }
+
+        // Without priorities, the oldest head; nothing is passed over.
+        Entry const & head = stream.entries.front();
+        bool fStarved = m_fPriority && stream.cBypassed >= PRIORITY_MAX_BYPASS;
+
+        if (iBest < 0)
+        {
+            iBest = (long)i;
+            fBestStarved = fStarved;
+            continue;
+        }
+
+        Entry const & best = m_Streams[iBest].entries.front();
+        bool fBetter;
+        if (fStarved != fBestStarved)
+        {
+            fBetter = fStarved;
+        }
+        else if (m_fPriority && !fStarved && head.uRank != best.uRank)
+        {
+            fBetter = head.uRank < best.uRank;
+        }
+        else
+        {
+            // Sequence numbers wrap, compare by difference.
+            fBetter = (long)(head.uSequence - best.uSequence) < 0;
+        }
+
+        if (fBetter)
+        {
+            iBest = (long)i;
+            fBestStarved = fStarved;
+        }
+    }
+
+    return iBest;
+}
@@ -0,0 +1,82 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxPriority.h
+// Orders held samples by stream priority class, so that audio is not
+// stuck behind video when the backend falls behind.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h.
+
+#include <deque>
+
+const unsigned long PRIORITY_MAX_BYPASS = 16;   // Samples that may go ahead of a waiting stream.
+
+// PpboxPriority: Class of a stream, lower goes first.
+enum PpboxPriority
+{
+    Priority_Audio = 0,
+    Priority_Video,
+    Priority_Count
+};
+
+// PpboxPriorityQueue:
+// One FIFO per stream, so a stream's samples always leave in the order
+// they came. Among the streams, the next sample is the head that ranks
+// best: audio, then video sync samples, then other video samples; equal
+// ranks go in arrival order. A stream passed over PRIORITY_MAX_BYPASS
+// times in a row goes next whatever its rank, so video still flows while
+// audio is plentiful. Without priorities, it is a plain FIFO.
+// Not thread safe, the owner locks it.
+class PpboxPriorityQueue
+{
+public:
+    PpboxPriorityQueue();
+
+public:
+    // Set while the queue is empty.
+    void    EnablePriority(bool fEnable) { m_fPriority = fEnable; }
+
+    bool    IsEmpty() const { return m_cSamples == 0; }
+    unsigned long   GetCount() const { return m_cSamples; }
+
+    void    Push(JUST_Sample const & sample, PpboxPriority priority);
+
+    // The next sample; Front and Pop agree until the next Push.
+    bool    Front(JUST_Sample & sample);
+    bool    Pop(JUST_Sample & sample);
+
+    void    Clear();
+
+private:
+    struct Entry
+    {
+        JUST_Sample     sample;
+        unsigned long   uSequence;      // Arrival order.
+        unsigned long   uRank;
+    };
+
+    struct Stream
+    {
+        std::deque<Entry>   entries;
+        unsigned long       cBypassed;
+    };
+
+    long    Select();
+
+private:
+    Stream          m_Streams[MAX_STREAMS];
+    unsigned long   m_cSamples;
+    unsigned long   m_uSequence;
+    long            m_iNext;            // Cached Select, -1 = none.
+    bool            m_fPriority;
+};
@@ -0,0 +1,167 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxSlabPool.cpp
+// Size-class buffer pool for samples copied out of upstream buffers.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "PpboxSlabPool.h"
+
+static PpboxSlabPool s_SlabPool;
+
+PpboxSlabPool & PpboxSlabPool::Instance()
+{
+    return s_SlabPool;
+}
+
+PpboxSlabPool::PpboxSlabPool()
+{
+    static_assert(sizeof(Block) <= SLAB_ALIGNMENT, "slab block header must fit in one cache line");
+
+#ifdef _WIN32
+    for (unsigned long i = 0; i <= SLAB_MAX_CLASS; ++i)
+    {
+        InitializeSListHead(&m_FreeLists[i]);
+    }
+#endif
+}
+
+PpboxSlabPool::~PpboxSlabPool()
+{
+    Trim();
+}
+
+void * PpboxSlabPool::Alloc(unsigned long cbSize)
+{
+    unsigned long dwClass = SizeToClass(cbSize);
+    Block * pBlock = NULL;
+
+    if (dwClass <= SLAB_MAX_CLASS)
+    {
+        pBlock = PopFree(dwClass);
+        if (pBlock == NULL)
+        {
+            pBlock = AllocBlock(1UL << dwClass);
+        }
+    }
+    else
+    {
+        pBlock = AllocBlock(cbSize);
+    }
+
+    if (pBlock == NULL)
+    {
+        return NULL;
+    }
+
+    pBlock->dwClass = dwClass;
+    return (unsigned char *)pBlock + SLAB_ALIGNMENT;
+}
+
+void PpboxSlabPool::Free(void * pData)
+{
+    if (pData == NULL)
+    {
+        return;
+    }
+
+    Block * pBlock = (Block *)((unsigned char *)pData - SLAB_ALIGNMENT);
+
+    if (pBlock->dwClass > SLAB_MAX_CLASS || !PushFree(pBlock))
+    {
+        FreeBlock(pBlock);
+    }
+}
+
+void PpboxSlabPool::Trim()
+{
+    for (unsigned long i = 0; i <= SLAB_MAX_CLASS; ++i)
+    {
+        Block * pBlock = NULL;
+        while ((pBlock = PopFree(i)) != NULL)
+        {
+            FreeBlock(pBlock);
+        }
+    }
+}
+
+// Returns the smallest class whose blocks hold cbSize bytes, or a class
+// above SLAB_MAX_CLASS for blocks that are too big to be cached.
+unsigned long PpboxSlabPool::SizeToClass(unsigned long cbSize)
+{
+    unsigned long dwClass = SLAB_MIN_CLASS;
+    while (dwClass <= SLAB_MAX_CLASS && (1UL << dwClass) < cbSize)
+    {
+        ++dwClass;
+    }
+    return dwClass;
+}
+
+PpboxSlabPool::Block * PpboxSlabPool::AllocBlock(unsigned long cbData)
+{
+#ifdef _WIN32
+    return (Block *)_aligned_malloc(SLAB_ALIGNMENT + cbData, SLAB_ALIGNMENT);
+#else
+    void * p = NULL;
+    return posix_memalign(&p, SLAB_ALIGNMENT, SLAB_ALIGNMENT + cbData) == 0 ? (Block *)p : NULL;
+#endif
+}
+
+void PpboxSlabPool::FreeBlock(Block * pBlock)
+{
+#ifdef _WIN32
+    _aligned_free(pBlock);
+#else
+    free(pBlock);
+#endif
+}
+
+PpboxSlabPool::Block * PpboxSlabPool::PopFree(unsigned long dwClass)
+{
+#ifdef _WIN32
+    return (Block *)InterlockedPopEntrySList(&m_FreeLists[dwClass]);
+#else
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_FreeLists[dwClass].empty())
+    {
+        return NULL;
+    }
+    Block * pBlock = m_FreeLists[dwClass].back();
+    m_FreeLists[dwClass].pop_back();
+    return pBlock;
+#endif
+}
+
+bool PpboxSlabPool::PushFree(Block * pBlock)
+{
+#ifdef _WIN32
+    if (QueryDepthSList(&m_FreeLists[pBlock->dwClass]) >= SLAB_MAX_CACHED)
+    {
+        return false;
+    }
+    InterlockedPushEntrySList(&m_FreeLists[pBlock->dwClass], &pBlock->entry);
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_FreeLists[pBlock->dwClass].size() >= SLAB_MAX_CACHED)
+    {
+        return false;
+    }
+    m_FreeLists[pBlock->dwClass].push_back(pBlock);
+    return true;
+#endif
+}
@@ -0,0 +1,78 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxSlabPool.h
+// Size-class buffer pool for samples copied out of upstream buffers.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <mutex>
+#include <vector>
+#endif
+
+// Blocks are handed out in power-of-two size classes. The block header is
+// one cache line, so the payload that follows it is cache-aligned too.
+
+const unsigned long SLAB_ALIGNMENT = 64;        // Cache line size.
+const unsigned long SLAB_MIN_CLASS = 8;         // Smallest class: 256 bytes.
+const unsigned long SLAB_MAX_CLASS = 24;        // Largest class: 16 MB. Bigger blocks are not cached.
+const unsigned long SLAB_MAX_CACHED = 32;       // How many free blocks each class keeps around.
+
+class PpboxSlabPool
+{
+public:
+    PpboxSlabPool();
+    ~PpboxSlabPool();
+
+public:
+    // Process-wide pool. Blocks may be freed by the capture backend after
+    // the sink that allocated them is gone, so the pool outlives all sinks.
+    static PpboxSlabPool & Instance();
+
+public:
+    // Alloc/Free:
+    // Free can be called from any thread (the backend calls FreeSample on
+    // its own threads), so the free lists are lock-free SLISTs (a locked
+    // vector where there are no SLISTs).
+    void *  Alloc(unsigned long cbSize);
+    void    Free(void * pData);
+
+    // Drops all cached free blocks.
+    void    Trim();
+
+private:
+    struct Block
+    {
+#ifdef _WIN32
+        SLIST_ENTRY     entry;
+#endif
+        unsigned long   dwClass;
+    };
+
+    static unsigned long    SizeToClass(unsigned long cbSize);
+
+    static Block *  AllocBlock(unsigned long cbData);
+    static void     FreeBlock(Block * pBlock);
+
+    Block *         PopFree(unsigned long dwClass);
+    bool            PushFree(Block * pBlock);
+
+private:
+#ifdef _WIN32
+    SLIST_HEADER            m_FreeLists[SLAB_MAX_CLASS + 1];
+#else
+    std::mutex              m_Mutex;
+    std::vector<Block *>    m_FreeLists[SLAB_MAX_CLASS + 1];
+#endif
+};
@@ -0,0 +1,310 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxSpillRing.cpp
+// Memory-mapped ring file that holds samples while the capture backend
+// is behind.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxCore.h"
+#include "PpboxSpillRing.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+const unsigned int SPILL_MAGIC_SAMPLE = 'SMPL';
+const unsigned int SPILL_MAGIC_PAD = 'PAD ';
+
+PpboxSpillRing::PpboxSpillRing() :
+#ifdef _WIN32
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hMapping(NULL),
+#else
+    m_fd(-1),
+#endif
+    m_pView(NULL),
+    m_cbSize(0),
+    m_uHead(0),
+    m_uTail(0),
+    m_cbUsed(0),
+    m_cRecords(0),
+    m_cbPending(0),
+    m_cbUnflushed(0)
+{
+    memset(m_cbStreams, 0, sizeof(m_cbStreams));
+}
+
+PpboxSpillRing::~PpboxSpillRing()
+{
+    Close();
+}
+
+bool PpboxSpillRing::Open(PpboxPathChar const * pszPath, unsigned long long cbSize)
+{
+    if (pszPath == NULL || cbSize < SPILL_FLUSH_BYTES)
+    {
+        return false;
+    }
+
+    Close();
+
+    bool fOk = true;
+
+#ifdef _WIN32
+    // The ring only lives as long as the session.
+    CREATEFILE2_EXTENDED_PARAMETERS params = {0};
+    params.dwSize = sizeof(params);
+    params.dwFileAttributes = FILE_ATTRIBUTE_TEMPORARY;
+    params.dwFileFlags = FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN;
+
+    m_hFile = CreateFile2(pszPath, GENERIC_READ | GENERIC_WRITE, 0, CREATE_ALWAYS, &params);
+    fOk = m_hFile != INVALID_HANDLE_VALUE;
+
+    if (fOk)
+    {
+        // Sizes the file as well.
+        m_hMapping = CreateFileMappingFromApp(m_hFile, NULL, PAGE_READWRITE, cbSize, NULL);
+        fOk = m_hMapping != NULL;
+    }
+
+    if (fOk)
+    {
+        m_pView = (unsigned char *)MapViewOfFileFromApp(m_hMapping, FILE_MAP_WRITE, 0, (SIZE_T)cbSize);
+        fOk = m_pView != NULL;
+    }
+#else
+    // The ring only lives as long as the session, the name goes at once.
+    m_fd = open(pszPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    fOk = m_fd >= 0;
+
+    if (fOk)
+    {
+        unlink(pszPath);
+        fOk = ftruncate(m_fd, (off_t)cbSize) == 0;
+    }
+
+    if (fOk)
+    {
+        void * pView = mmap(NULL, (size_t)cbSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        fOk = pView != MAP_FAILED;
+        if (fOk)
+        {
+            m_pView = (unsigned char *)pView;
+            madvise(m_pView, (size_t)cbSize, MADV_SEQUENTIAL);
+        }
+    }
+#endif
+
+    if (fOk)
+    {
+        m_cbSize = cbSize & ~7ULL;
+    }
+    else
+    {
+        // Keep the reason for the caller.
+#ifdef _WIN32
+        DWORD dwError = GetLastError();
+        Close();
+        SetLastError(dwError);
+#else
+        int iError = errno;
+        Close();
+        errno = iError;
+#endif
+    }
+
+    return fOk;
+}
+
+void PpboxSpillRing::Close()
+{
+    // Lets go of the formats the records hold.
+    while (m_cRecords)
+    {
+        Pop();
+    }
+
+#ifdef _WIN32
+    if (m_pView)
+    {
+        UnmapViewOfFile(m_pView);
+        m_pView = NULL;
+    }
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_pView)
+    {
+        munmap(m_pView, (size_t)m_cbSize);
+        m_pView = NULL;
+    }
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+#endif
+    m_cbSize = 0;
+    m_uHead = m_uTail = m_cbUsed = 0;
+    m_cRecords = 0;
+    memset(m_cbStreams, 0, sizeof(m_cbStreams));
+    m_cbPending = 0;
+    m_cbUnflushed = 0;
+}
+
+unsigned char * PpboxSpillRing::Reserve(unsigned long cbPayload)
+{
+    if (m_pView == NULL)
+    {
+        return NULL;
+    }
+
+    unsigned int cbRecord = RecordSize(cbPayload);
+    unsigned long long cbWaste = 0;
+
+    if (m_uTail + cbRecord > m_cbSize)
+    {
+        cbWaste = m_cbSize - m_uTail;
+    }
+
+    if (m_cbUsed + cbWaste + cbRecord > m_cbSize)
+    {
+        return NULL;
+    }
+
+    if (cbWaste)
+    {
+        Record * pPad = (Record *)(m_pView + m_uTail);
+        pPad->uMagic = SPILL_MAGIC_PAD;
+        pPad->cbRecord = (unsigned int)cbWaste;
+        m_cbUsed += cbWaste;
+        m_uTail = 0;
+    }
+    else if (m_uTail == m_cbSize)
+    {
+        m_uTail = 0;
+    }
+
+    m_cbPending = cbRecord;
+    return m_pView + m_uTail + sizeof(Record);
+}
+
+void PpboxSpillRing::Commit(JUST_Sample const & sample, PpboxStreamFormat * pFormat)
+{
+    assert(m_cbPending);
+
+    Record * pRecord = (Record *)(m_pView + m_uTail);
+    pRecord->uMagic = SPILL_MAGIC_SAMPLE;
+    pRecord->cbRecord = m_cbPending;
+    pRecord->sample = sample;
+    pRecord->sample.buffer = NULL;
+    pRecord->sample.context = NULL;
+    pRecord->pFormat = pFormat;
+    if (pFormat)
+    {
+        pFormat->AddRef();
+    }
+
+    m_uTail += m_cbPending;
+    m_cbUsed += m_cbPending;
+    ++m_cRecords;
+    m_cbStreams[StreamSlot(sample.itrack)] += sample.size;
+
+    // Let the system write back in big sequential batches rather than
+    // accumulate the whole ring as dirty pages.
+    m_cbUnflushed += m_cbPending;
+    if (m_cbUnflushed >= SPILL_FLUSH_BYTES)
+    {
+        Flush();
+        m_cbUnflushed = 0;
+    }
+
+    m_cbPending = 0;
+}
+
+bool PpboxSpillRing::Front(JUST_Sample & sample, unsigned char const ** ppPayload, PpboxStreamFormat ** ppFormat)
+{
+    if (m_cRecords == 0)
+    {
+        return false;
+    }
+
+    SkipPad();
+
+    Record const * pRecord = (Record const *)(m_pView + m_uHead);
+    assert(pRecord->uMagic == SPILL_MAGIC_SAMPLE);
+
+    sample = pRecord->sample;
+    *ppPayload = (unsigned char const *)(pRecord + 1);
+    *ppFormat = pRecord->pFormat;
+    return true;
+}
+
+void PpboxSpillRing::Pop()
+{
+    assert(m_cRecords);
+
+    SkipPad();
+
+    Record const * pRecord = (Record const *)(m_pView + m_uHead);
+    m_uHead += pRecord->cbRecord;
+    m_cbUsed -= pRecord->cbRecord;
+    --m_cRecords;
+    m_cbStreams[StreamSlot(pRecord->sample.itrack)] -= pRecord->sample.size;
+    if (pRecord->pFormat)
+    {
+        pRecord->pFormat->Release();
+    }
+
+    if (m_cRecords == 0)
+    {
+        // Start over at the front, keeps the file access sequential.
+        m_uHead = m_uTail = m_cbUsed = 0;
+    }
+}
+
+void PpboxSpillRing::SkipPad()
+{
+    if (m_uHead == m_cbSize)
+    {
+        m_uHead = 0;
+    }
+
+    Record const * pRecord = (Record const *)(m_pView + m_uHead);
+    if (pRecord->uMagic == SPILL_MAGIC_PAD)
+    {
+        m_cbUsed -= pRecord->cbRecord;
+        m_uHead = 0;
+    }
+}
+
+// Starts writing back, without waiting for it.
+void PpboxSpillRing::Flush()
+{
+#ifdef _WIN32
+    FlushViewOfFile(m_pView, 0);
+#else
+    msync(m_pView, (size_t)m_cbSize, MS_ASYNC);
+#endif
+}
@@ -0,0 +1,109 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxSpillRing.h
+// Memory-mapped ring file that holds samples while the capture backend
+// is behind.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h. The ring is a file mapping
+// on Windows and an mmap'd file elsewhere.
+
+#include "PpboxCore.h"
+
+#ifdef _WIN32
+typedef wchar_t PpboxPathChar;
+#else
+typedef char PpboxPathChar;
+#endif
+
+const unsigned long long SPILL_DEFAULT_SIZE = 64 * 1024 * 1024;    // Default ring file size.
+const unsigned long SPILL_DEFAULT_LIMIT = 64;                       // Default in-flight samples before spilling.
+const unsigned long SPILL_FLUSH_BYTES = 1024 * 1024;                // Flush the view after this many appended bytes.
+
+// Records are written back to back and wrap at the end of the file. A
+// record that does not fit before the end is preceded by a pad record
+// covering the rest of the file. Not thread safe, the sink lock protects it.
+class PpboxSpillRing
+{
+public:
+    PpboxSpillRing();
+    ~PpboxSpillRing();
+
+public:
+    // False if the file cannot be created or mapped, GetLastError (errno)
+    // tells why. The file is deleted when the ring is closed.
+    bool    Open(PpboxPathChar const * pszPath, unsigned long long cbSize);
+    void    Close();
+
+    bool    IsOpen() const { return m_pView != NULL; }
+    bool    IsEmpty() const { return m_cRecords == 0; }
+    unsigned long   GetCount() const { return m_cRecords; }
+    unsigned long long  GetUsed() const { return m_cbUsed; }
+    // Payload bytes of a stream's records.
+    unsigned long long  GetStreamPayload(unsigned long dwStream) const { return m_cbStreams[StreamSlot(dwStream)]; }
+
+public:
+    // Append:
+    // Reserve returns where cbPayload bytes of payload go, or NULL if the
+    // ring is full. Commit then writes the record header, with the format
+    // the sample is in (see AdvanceFormat), which the record references.
+    unsigned char * Reserve(unsigned long cbPayload);
+    void    Commit(JUST_Sample const & sample, PpboxStreamFormat * pFormat);
+
+    // Replay, oldest first. The payload and format pointers stay valid
+    // until Pop.
+    bool    Front(JUST_Sample & sample, unsigned char const ** ppPayload, PpboxStreamFormat ** ppFormat);
+    void    Pop();
+
+private:
+    struct Record
+    {
+        unsigned int    uMagic;
+        unsigned int    cbRecord;       // Header and payload, 8-byte aligned.
+        JUST_Sample     sample;         // buffer and context are not valid.
+        PpboxStreamFormat * pFormat;    // Referenced, or NULL. The file is this process's own.
+    };
+
+    static unsigned int RecordSize(unsigned long cbPayload)
+    {
+        return (unsigned int)((sizeof(Record) + cbPayload + 7) & ~7);
+    }
+
+    // Identifiers past the table share its last slot.
+    static unsigned long StreamSlot(unsigned long dwStream)
+    {
+        return dwStream < MAX_STREAMS ? dwStream : MAX_STREAMS - 1;
+    }
+
+    void    SkipPad();
+    void    Flush();
+
+private:
+#ifdef _WIN32
+    HANDLE          m_hFile;
+    HANDLE          m_hMapping;
+#else
+    int             m_fd;
+#endif
+    unsigned char * m_pView;
+    unsigned long long  m_cbSize;
+
+    unsigned long long  m_uHead;        // Read offset.
+    unsigned long long  m_uTail;        // Write offset.
+    unsigned long long  m_cbUsed;       // Bytes between head and tail, pads included.
+    unsigned long   m_cRecords;
+    unsigned long long  m_cbStreams[MAX_STREAMS];
+
+    unsigned int    m_cbPending;        // Size of the reserved record.
+    unsigned long   m_cbUnflushed;
+};
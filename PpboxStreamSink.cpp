@@ -68,7 +68,12 @@ PpboxStreamSink::PpboxStreamSink(DWORD dwIdentifier) :
     m_state(State_TypeNotSet),
     m_IsShutdown(FALSE),
     m_bActive(FALSE),
-    m_bEOS(FALSE)
+    m_bEOS(FALSE),
+    m_pCore(NULL),
+    m_fDropping(FALSE),
+    m_fThrottled(FALSE),
+    m_ThrottleKey(0),
+    m_uCopyOutThreshold(0)
 {
     //assert(pSD != NULL);
 
@@ -84,6 +89,11 @@ PpboxStreamSink::~PpboxStreamSink()
     assert(m_state == STATE_SHUTDOWN);
     m_pSink.Reset();
 
+    if (m_pCore)
+    {
+        m_pCore->Release();
+    }
+
     auto module = ::Microsoft::WRL::GetModuleBase();
     if (module != nullptr)
     {
@@ -100,19 +110,37 @@ HRESULT PpboxStreamSink::Initialize(PpboxMediaSink *pParent, IMFMediaType *pMedi
 
 	m_pSink = pParent;
 
-    SinkLock lock(m_pSink);
+    // Not in the sink's list yet, no one else sees the stream; the sink
+    // lock is not needed.
 
     // Create the media event queue.
     hr = MFCreateEventQueue(&m_pEventQueue);
 
+    if (SUCCEEDED(hr))
+    {
+        m_pCore = new PpboxCoreStream(m_pSink->GetCore(), m_dwIdentifier);
+        if (m_pCore == nullptr)
+        {
+            hr = E_OUTOFMEMORY;
+        }
+    }
+
     if (SUCCEEDED(hr) && pMediaType != nullptr)
     {
         m_pMediaType = pMediaType;
         hr = m_pMediaType->GetMajorType(&m_guiType);
+        m_pCore->m_fVideo = IsVideo() != FALSE;
+        // Audio goes first when samples are held, a late audio frame is heard.
+        m_pCore->m_Priority = m_guiType == MFMediaType_Audio ? Priority_Audio : Priority_Video;
         if (SUCCEEDED(hr))
         {
             hr = m_pMediaType->GetGUID(MF_MT_SUBTYPE, &m_guiSubtype);
         }
+        if (SUCCEEDED(hr))
+        {
+            hr = CreatePreferredMediaTypes(m_pMediaType.Get(), &m_PreferredTypes);
+        }
+        m_pCore->m_fStripAdts = IsAdtsMediaType(m_pMediaType.Get()) != FALSE;
     }
 
     TRACEHR_RET(hr);
@@ -139,6 +167,7 @@ HRESULT PpboxStreamSink::Start(MFTIME start)
             m_fGetStartTimeFromSample = true;
         }
         m_state = State_Started;
+        PpboxInterlockedIncrement(&m_pCore->m_cStateChanges);
         //_fWaitingForFirstSample = _fIsVideo;
 
         // Send MEStreamSinkStarted.
@@ -147,7 +176,7 @@ HRESULT PpboxStreamSink::Start(MFTIME start)
         // There might be samples queue from earlier (ie, while paused).
         if (SUCCEEDED(hr))
         {
-            hr = QueueEvent(MEStreamSinkRequestSample, GUID_NULL, hr, NULL);
+            hr = RequestSample();
         }
     }
 
@@ -166,6 +195,9 @@ HRESULT PpboxStreamSink::Stop()
     if (SUCCEEDED(hr))
     {
         m_state = State_Stopped;
+        PpboxInterlockedIncrement(&m_pCore->m_cStateChanges);
+        // The pipeline drops requests not answered by now.
+        m_pCore->m_cRequests = 0;
         hr = QueueEvent(MEStreamSinkStopped, GUID_NULL, hr, NULL);
     }
 
@@ -184,6 +216,7 @@ HRESULT PpboxStreamSink::Pause()
     if (SUCCEEDED(hr))
     {
         m_state = State_Paused;
+        PpboxInterlockedIncrement(&m_pCore->m_cStateChanges);
         hr = QueueEvent(MEStreamSinkPaused, GUID_NULL, hr, NULL);
     }
 
@@ -202,6 +235,7 @@ HRESULT PpboxStreamSink::Restart()
     if (SUCCEEDED(hr))
     {
         m_state = State_Started;
+        PpboxInterlockedIncrement(&m_pCore->m_cStateChanges);
 
         // Send MEStreamSinkStarted.
         hr = QueueEvent(MEStreamSinkStarted, GUID_NULL, hr, NULL);
@@ -209,7 +243,7 @@ HRESULT PpboxStreamSink::Restart()
         // There might be samples queue from earlier (ie, while paused).
         if (SUCCEEDED(hr))
         {
-            hr = QueueEvent(MEStreamSinkRequestSample, GUID_NULL, hr, NULL);
+            hr = RequestSample();
         }
     }
 
@@ -233,6 +267,13 @@ HRESULT PpboxStreamSink::Shutdown()
     {
         m_IsShutdown = TRUE;
 
+        if (m_fThrottled)
+        {
+            MFCancelWorkItem(m_ThrottleKey);
+            m_fThrottled = FALSE;
+        }
+        m_spThrottleTimer.Reset();
+
         // Shut down the event queue.
         if (m_pEventQueue)
         {
@@ -241,6 +282,7 @@ HRESULT PpboxStreamSink::Shutdown()
 
         // Release objects.
         m_pMediaType.Reset();
+        m_PreferredTypes.Clear();
         m_pEventQueue.Reset();
         //m_pSink.Reset();
 
@@ -477,6 +519,10 @@ HRESULT PpboxStreamSink::ProcessSample(IMFSample *pSample)
     }
 
     HRESULT hr = S_OK;
+    unsigned long long uEnterTime = PpboxGetMicroseconds();
+
+    // A traced payload is copied before the sink lock is taken.
+    BOOL fTrace = m_pSink->PrepareTraceSample(m_dwIdentifier, pSample, m_TraceRecord);
 
     SinkLock lock(m_pSink);
 
@@ -490,23 +536,126 @@ HRESULT PpboxStreamSink::ProcessSample(IMFSample *pSample)
 
     if (SUCCEEDED(hr))
     {
+        PpboxInterlockedDecrement(&m_pCore->m_cRequests);
+        if (fTrace)
+        {
+            m_pSink->TraceSample(m_TraceRecord);
+        }
+
         if (m_dwIdentifier == 1)
         {
             //TRACE(0, L"PpboxStreamSink::ProcessSample id = %u\r\n", m_dwIdentifier);
             //PrintSampleInfo(pSample);
         }
 
+        // Let the backend catch up on spilled samples first. Samples it
+        // cannot replay are dropped there, this one still goes on.
+        m_pSink->DrainSpill(FALSE);
+    }
+
+    BOOL fOverBudget = m_pSink->IsOverBudget();
+    PpboxMemoryPolicy policy = m_pSink->GetMemoryPolicy();
+    BOOL fDrop = FALSE;
+
+    if (SUCCEEDED(hr) && policy == MemoryPolicy_Drop && IsVideo())
+    {
+        // Once a non-sync sample comes in over budget, everything up to
+        // the next sync sample goes, the decoder could not use it anyway.
+        BOOL fSync = MFGetAttributeUINT32(pSample, MFSampleExtension_CleanPoint, FALSE);
+        if (fSync)
+        {
+            m_fDropping = FALSE;
+        }
+        else if (fOverBudget)
+        {
+            m_fDropping = TRUE;
+        }
+        if (m_fDropping)
+        {
+            PpboxInterlockedIncrement(&m_pCore->m_cDropped);
+            fDrop = TRUE;
+        }
+    }
+
+    if (SUCCEEDED(hr) && !fDrop)
+    {
+        hr = m_pSink->SpillSample(m_dwIdentifier, pSample, 
+            fOverBudget && policy == MemoryPolicy_Spill);
+    }
+
+    if (hr == S_FALSE)
+    {
+        // Over budget without a spill ring, at least let go of the
+        // upstream sample at once.
+        BOOL fCopyOut = (m_uCopyOutThreshold > 0 
+            && (UINT32)m_pCore->m_cInFlight >= m_uCopyOutThreshold)
+            || (fOverBudget && policy == MemoryPolicy_Spill);
+
         JUST_Sample sample;
-        CreateSample(sample, pSample);
-        sample.itrack = m_dwIdentifier;
-        JUST_CapturePutSample(m_pSink->GetPpboxCapture(), &sample);
+        hr = CreateSample(sample, &MFSampleOps, pSample, m_pCore, fCopyOut != FALSE) ? S_OK : E_FAIL;
+        if (SUCCEEDED(hr))
+        {
+            m_pCore->OnSampleQueued(((PpboxSampleContext *)sample.context)->cbData);
+            ((PpboxSampleContext *)sample.context)->uEnterTime = uEnterTime;
+            sample.itrack = m_dwIdentifier;
+            m_pSink->IndexSample(sample, ((PpboxSampleContext *)sample.context)->cbData);
+            m_pSink->PutSample(sample);
+        }
     }
 
     if (SUCCEEDED(hr))
     {
-        hr = QueueEvent(MEStreamSinkRequestSample, GUID_NULL, hr, NULL);
+        hr = RequestSample();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+
+// Asks the pipeline for the next sample, counted for the statistics.
+// With the throttle policy, a sink over its memory budget asks later
+// instead, see OnThrottleTimer.
+HRESULT PpboxStreamSink::RequestSample()
+{
+    HRESULT hr = S_OK;
+
+    if (m_pSink->GetMemoryPolicy() == MemoryPolicy_Throttle && m_pSink->IsOverBudget())
+    {
+        if (!m_spThrottleTimer)
+        {
+            m_spThrottleTimer = Make<PpboxAsyncCallback<PpboxStreamSink>>(this, &PpboxStreamSink::OnThrottleTimer);
+            if (!m_spThrottleTimer)
+            {
+                hr = E_OUTOFMEMORY;
+            }
+        }
+        if (SUCCEEDED(hr) && !m_fThrottled)
+        {
+            hr = MFScheduleWorkItem(m_spThrottleTimer.Get(), NULL, -(INT64)THROTTLE_RETRY_MS, &m_ThrottleKey);
+            m_fThrottled = SUCCEEDED(hr);
+        }
+        return hr;
+    }
+
+    PpboxInterlockedIncrement(&m_pCore->m_cRequests);
+    return QueueEvent(MEStreamSinkRequestSample, GUID_NULL, S_OK, NULL);
+}
+
+
+HRESULT PpboxStreamSink::OnThrottleTimer(IMFAsyncResult *pResult)
+{
+    SinkLock lock(m_pSink);
+
+    m_fThrottled = FALSE;
+
+    // Stopped meanwhile: the next Start asks again.
+    if (FAILED(CheckShutdown()) || m_state != State_Started)
+    {
+        return S_OK;
     }
 
+    HRESULT hr = RequestSample();
+
     TRACEHR_RET(hr);
 }
 
@@ -532,6 +681,9 @@ HRESULT PpboxStreamSink::PlaceMarker(MFSTREAMSINK_MARKER_TYPE eMarkerType, const
             m_bEOS = true;
         }
 
+        // No more samples may come to push the spill ring along.
+        m_pSink->DrainSpill(FALSE);
+
         if (m_state != State_Paused)
         {
             hr = QueueEvent(MEStreamSinkMarker, GUID_NULL, S_OK, pvarContextValue);
@@ -567,9 +719,7 @@ IFACEMETHODIMP PpboxStreamSink::IsMediaTypeSupported(
         return E_INVALIDARG;
     }
 
-    Trace(0, L"[PpboxStreamSink::IsMediaTypeSupported] id = %u\r\n", m_dwIdentifier);
-
-    PrintMediaType(pMediaType);
+    UINT64 uFingerprint = GetMediaTypeFingerprint(pMediaType);
 
     SinkLock lock(m_pSink);
 
@@ -578,6 +728,18 @@ IFACEMETHODIMP PpboxStreamSink::IsMediaTypeSupported(
 
     HRESULT hr = CheckShutdown();
 
+    // Topology resolution asks about the same types many times.
+    if (SUCCEEDED(hr) && m_NegotiationCache.Lookup(uFingerprint, &hr))
+    {
+        return hr;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        Trace(0, L"[PpboxStreamSink::IsMediaTypeSupported] id = %u\r\n", m_dwIdentifier);
+        PrintMediaType(pMediaType);
+    }
+
     if (SUCCEEDED(hr))
     {
         hr = pMediaType->GetGUID(MF_MT_MAJOR_TYPE, &majorType);
@@ -592,16 +754,24 @@ IFACEMETHODIMP PpboxStreamSink::IsMediaTypeSupported(
         }
     }
 
+    // Any of the preferred types' codecs, the backend takes them all.
     if (SUCCEEDED(hr) && m_pMediaType != nullptr)
     {
         GUID guiNewSubtype;
-        if (FAILED(pMediaType->GetGUID(MF_MT_SUBTYPE, &guiNewSubtype)) || 
-            guiNewSubtype != m_guiSubtype)
+        if (majorType != m_guiType
+            || FAILED(pMediaType->GetGUID(MF_MT_SUBTYPE, &guiNewSubtype))
+            || !IsPreferredSubtype(guiNewSubtype))
         {
             hr = MF_E_INVALIDTYPE;
         }
     }
 
+    // Only answers about the type itself are kept, not failures to read it.
+    if (SUCCEEDED(hr) || hr == MF_E_INVALIDTYPE)
+    {
+        m_NegotiationCache.Add(uFingerprint, hr);
+    }
+
     // We don't return any "close match" types.
     if (ppMediaType)
     {
@@ -627,8 +797,7 @@ IFACEMETHODIMP PpboxStreamSink::GetMediaTypeCount(DWORD *pdwTypeCount)
 
     if (SUCCEEDED(hr))
     {
-        // We've got only one media type
-        *pdwTypeCount = 1;
+        *pdwTypeCount = m_PreferredTypes.GetCount();
     }
 
     TRACEHR_RET(hr);
@@ -649,17 +818,19 @@ IFACEMETHODIMP PpboxStreamSink::GetMediaTypeByIndex(
 
     HRESULT hr = CheckShutdown();
 
-    if ( dwIndex > 0 )
+    if (SUCCEEDED(hr) && dwIndex >= m_PreferredTypes.GetCount())
     {
         hr = MF_E_NO_MORE_TYPES;
     }
-    else
+
+    if (SUCCEEDED(hr))
     {
-        *ppType = m_pMediaType.Get();
-        if (*ppType != nullptr)
+        auto pos = m_PreferredTypes.FrontPosition();
+        for (DWORD i = 0; i < dwIndex; ++i)
         {
-            (*ppType)->AddRef();
+            pos = m_PreferredTypes.Next(pos);
         }
+        hr = m_PreferredTypes.GetItemByPosition(pos, ppType);
     }
 
     TRACEHR_RET(hr);
@@ -676,6 +847,7 @@ IFACEMETHODIMP PpboxStreamSink::SetCurrentMediaType(IMFMediaType *pMediaType)
     SinkLock lock(m_pSink);
 
     HRESULT hr = CheckShutdown();
+    BOOL fStart = FALSE;
 
     // We don't allow format changes after streaming starts.
     if (SUCCEEDED(hr))
@@ -683,46 +855,90 @@ IFACEMETHODIMP PpboxStreamSink::SetCurrentMediaType(IMFMediaType *pMediaType)
         hr = ValidateOperation(OpSetMediaType);
     }
 
-    // We set media type already
-    if (m_state >= State_Ready)
+    // Checked against the type set already, if any.
+    if (SUCCEEDED(hr))
     {
-        if (SUCCEEDED(hr))
-        {
-            hr = IsMediaTypeSupported(pMediaType, NULL);
-        }
+        hr = IsMediaTypeSupported(pMediaType, NULL);
     }
 
+    // The new type is taken only once it converts; until then the stream
+    // stays in the type it had.
+    ComPtr<IMFMediaType> spMediaType;
+    GUID guiSubtype = GUID_NULL;
+    PpboxStreamFormat * pFormat = NULL;
+
     if (SUCCEEDED(hr))
     {
-        hr = IsMediaTypeSupported(pMediaType, NULL);
+        hr = MFCreateMediaType(&spMediaType);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pMediaType->CopyAllItems(spMediaType.Get());
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = spMediaType->GetGUID(MF_MT_SUBTYPE, &guiSubtype);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = CreateStreamFormat(spMediaType.Get(), &pFormat);
+    }
+    if (SUCCEEDED(hr))
+    {
+        // Offered by GetMediaTypeByIndex, derived from the new type.
+        hr = CreatePreferredMediaTypes(spMediaType.Get(), &m_PreferredTypes);
+        if (FAILED(hr))
+        {
+            pFormat->Release();
+            if (m_pMediaType)
+            {
+                CreatePreferredMediaTypes(m_pMediaType.Get(), &m_PreferredTypes);
+            }
+        }
     }
 
     if (SUCCEEDED(hr))
     {
-        GUID guiMajorType;
-        pMediaType->GetMajorType(&guiMajorType);
+        m_pMediaType = spMediaType;
+        m_guiSubtype = guiSubtype;
 
-        m_pMediaType.ReleaseAndGetAddressOf();
-        hr = MFCreateMediaType(&m_pMediaType);
-        if (SUCCEEDED(hr))
+        // Answers given for the previous type no longer hold.
+        m_NegotiationCache.Clear();
+        m_pCore->m_fStripAdts = IsAdtsMediaType(m_pMediaType.Get()) != FALSE;
+
+        if (m_state == State_TypeNotSet)
         {
-            hr = pMediaType->CopyAllItems(m_pMediaType.Get());
+            m_state = State_Ready;
+            PpboxInterlockedIncrement(&m_pCore->m_cStateChanges);
+            fStart = m_pSink->IsStarted();
         }
-        if (SUCCEEDED(hr))
+        else
         {
-            hr = m_pMediaType->GetGUID(MF_MT_SUBTYPE, &m_guiSubtype);
+            PpboxInterlockedIncrement(&m_pCore->m_cFormatChanges);
         }
-        if (SUCCEEDED(hr))
-        {
-            if (m_state == State_TypeNotSet)
-                m_state = State_Ready;
 
-            JUST_StreamInfo stream;
-            CreateMediaType(stream, m_pMediaType.Get());
-            JUST_CaptureSetStream(m_pSink->GetPpboxCapture(), m_dwIdentifier, &stream);
+        m_pSink->TraceMediaType(m_dwIdentifier, m_pMediaType.Get());
+
+        // Once samples went out, the new format waits for the next
+        // sync sample; the samples before it still decode with the
+        // old one, which they keep alive.
+        if (m_pCore->m_pFormat && m_pCore->m_cSamples > 0)
+        {
+            m_pCore->SetFormat(pFormat, true);
+        }
+        else
+        {
+            m_pCore->SetFormat(pFormat, false);
+            m_pSink->SetStream(m_dwIdentifier, pFormat->info);
         }
     }
 
+    // Added while the sink runs, the clock will not start it.
+    if (SUCCEEDED(hr) && fStart)
+    {
+        hr = Start(PRESENTATION_CURRENT_POSITION);
+    }
+
     TRACEHR_RET(hr);
 }
 
@@ -756,6 +972,38 @@ IFACEMETHODIMP PpboxStreamSink::GetCurrentMediaType(IMFMediaType **ppMediaType)
 }
 
 
+HRESULT PpboxStreamSink::GetStreamInfo(JUST_StreamInfo & info)
+{
+    SinkLock lock(m_pSink);
+
+    HRESULT hr = CheckShutdown();
+
+    if (SUCCEEDED(hr) && m_state == State_TypeNotSet)
+    {
+        hr = MF_E_NOT_INITIALIZED;
+    }
+
+    // The format of the latest samples; the buffers stay with it. If it
+    // could not be made when the type was set, it becomes the stream's
+    // format now, so the buffers are owned either way.
+    if (SUCCEEDED(hr) && m_pCore->m_pFormat == NULL)
+    {
+        PpboxStreamFormat * pFormat = NULL;
+        hr = CreateStreamFormat(m_pMediaType.Get(), &pFormat);
+        if (SUCCEEDED(hr))
+        {
+            m_pCore->SetFormat(pFormat, false);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        info = m_pCore->m_pFormat->info;
+    }
+
+    TRACEHR_RET(hr);
+}
+
 // Return the major type GUID.
 IFACEMETHODIMP PpboxStreamSink::GetMajorType(GUID *pguidMajorType)
 {
@@ -777,22 +1025,6 @@ IFACEMETHODIMP PpboxStreamSink::GetMajorType(GUID *pguidMajorType)
 
 /* Private methods */
 
-BOOL PpboxStreamSink::ValidStateMatrix[PpboxStreamSink::State_Count][PpboxStreamSink::Op_Count] =
-{
-// States:    Operations:
-//            SetType   Start     Restart   Pause     Stop      Sample    Marker   
-/* NotSet */  TRUE,     FALSE,    FALSE,    FALSE,    FALSE,    FALSE,    FALSE,   
-
-/* Ready */   TRUE,     TRUE,     FALSE,    TRUE,     TRUE,     FALSE,    TRUE,    
-
-/* Start */   TRUE,    TRUE,     FALSE,    TRUE,     TRUE,     TRUE,     TRUE,    
-
-/* Pause */   FALSE,    TRUE,     TRUE,     TRUE,     TRUE,     TRUE,     TRUE,    
-
-/* Stop */    FALSE,    TRUE,     FALSE,    FALSE,    TRUE,     FALSE,    TRUE,    
-
-};
-
 // Checks if an operation is valid in the current state.
 HRESULT PpboxStreamSink::ValidateOperation(StreamOperation op)
 {
@@ -800,7 +1032,7 @@ HRESULT PpboxStreamSink::ValidateOperation(StreamOperation op)
 
     HRESULT hr = S_OK;
 
-    if (ValidStateMatrix[m_state][op])
+    if (IsValidOperation(m_state, op))
     {
         return S_OK;
     }
@@ -814,4 +1046,25 @@ HRESULT PpboxStreamSink::ValidateOperation(StreamOperation op)
     }
 }
 
+// Checks if one of the preferred types has this subtype.
+BOOL PpboxStreamSink::IsPreferredSubtype(REFGUID guidSubtype)
+{
+    auto pos = m_PreferredTypes.FrontPosition();
+    auto end = m_PreferredTypes.EndPosition();
+
+    for (; pos != end; pos = m_PreferredTypes.Next(pos))
+    {
+        ComPtr<IMFMediaType> spMT;
+        GUID subtype;
+        if (SUCCEEDED(m_PreferredTypes.GetItemByPosition(pos, &spMT))
+            && SUCCEEDED(spMT->GetGUID(MF_MT_SUBTYPE, &subtype))
+            && subtype == guidSubtype)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 #pragma warning( pop )
@@ -14,8 +14,15 @@
 
 #pragma once
 
+#include "PpboxCore.h"
+#include "PpboxMediaType.h"
+
+#include <vector>
+
 class PpboxMediaSink;
 
+const DWORD THROTTLE_RETRY_MS = 10;     // Over budget with the throttle policy: ask for samples this much later.
+
 
 typedef ComPtrList<IMFSample>       SampleList;
 typedef ComPtrList<IUnknown, true>  TokenList;    // List of tokens for IMFMediaStream::RequestSample
@@ -24,30 +31,9 @@ typedef ComPtrList<IUnknown, true>  TokenList;    // List of tokens for IMFMedia
 class PpboxStreamSink : public IMFStreamSink, public IMFMediaTypeHandler
 {
 public:
-    // State enum: Defines the current state of the stream.
-    enum State
-    {
-        State_TypeNotSet = 0,    // No media type is set
-        State_Ready,             // Media type is set, Start has never been called.
-        State_Started,
-        State_Stopped,
-        State_Paused,
-        State_Count              // Number of states
-    };
-
-    // StreamOperation: Defines various operations that can be performed on the stream.
-    enum StreamOperation
-    {
-        OpSetMediaType = 0,
-        OpStart,
-        OpRestart,
-        OpPause,
-        OpStop,
-        OpProcessSample,
-        OpPlaceMarker,
-
-        Op_Count                // Number of operations
-    };
+    // States and operations live in the core (see PpboxCore.h).
+    typedef PpboxCoreState      State;
+    typedef PpboxCoreOperation  StreamOperation;
 
 public:
     PpboxStreamSink(DWORD dwIdentifier);
@@ -90,20 +76,36 @@ public:
     IFACEMETHOD (GetMajorType) (GUID *pguidMajorType);
 
     BOOL        IsActive() const { return m_bActive; }
+    BOOL        IsVideo() const { return m_guiType == MFMediaType_Video; }
+    // Has a type, not started yet.
+    BOOL        IsReady() const { return m_state == State_Ready; }
+
+    // In-flight accounting shared with the samples, see PpboxCoreStream.
+    PpboxCoreStream * GetCore() const { return m_pCore; }
+
+    // Describes the current media type to the backend, fails if the type
+    // was not set yet.
+    HRESULT     GetStreamInfo(JUST_StreamInfo & info);
     BOOL        NeedsData();
 
     HRESULT     DeliverPayload(IMFSample *pSample);
 
+    // Copy-out policy: once uThreshold or more samples of this stream are
+    // held by the capture backend, new samples are copied into the slab
+    // pool and the upstream sample is released at once. 0 = always zero-copy.
+    void        SetCopyOutThreshold(UINT32 uThreshold) { m_uCopyOutThreshold = uThreshold; }
+
     // Callbacks
     HRESULT     OnDispatchSamples(IMFAsyncResult *pResult);
 
 private:
-    static BOOL ValidStateMatrix[State_Count][Op_Count];
-
     HRESULT     ValidateOperation(StreamOperation op);
+    HRESULT     RequestSample();
+    HRESULT     OnThrottleTimer(IMFAsyncResult *pResult);
 
 private:
     HRESULT     PrepareSample(IMFSample *pSample);
+    BOOL        IsPreferredSubtype(REFGUID guidSubtype);
 
 private:
 
@@ -133,6 +135,8 @@ private:
     DWORD                           m_dwIdentifier;
     ComPtr<PpboxMediaSink>          m_pSink;             // Parent media Sink
     ComPtr<IMFMediaType>            m_pMediaType;
+    ComPtrList<IMFMediaType>        m_PreferredTypes;      // Best first, see CreatePreferredMediaTypes.
+    PpboxNegotiationCache           m_NegotiationCache;    // Answers of IsMediaTypeSupported for m_pMediaType.
     ComPtr<IMFMediaEventQueue>      m_pEventQueue;         // Event generator helper
 
     State   m_state;
@@ -141,6 +145,14 @@ private:
     BOOL    m_bEOS;         // Did the Sink reach the end of the stream?
     MFTIME  m_StartTime;    // Presentation time when the clock started.
     BOOL    m_fGetStartTimeFromSample;
+
+    PpboxCoreStream *   m_pCore;
+    BOOL    m_fDropping;            // Memory policy Drop: skipping to the next sync sample.
+    BOOL    m_fThrottled;           // Memory policy Throttle: a request is scheduled.
+    MFWORKITEM_KEY              m_ThrottleKey;
+    ComPtr<IMFAsyncCallback>    m_spThrottleTimer;
+    UINT32  m_uCopyOutThreshold;
+    std::vector<BYTE>   m_TraceRecord;  // Prepared by ProcessSample, see PpboxMediaSink::PrepareTraceSample.
 };
 
 
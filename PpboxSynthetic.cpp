@@ -0,0 +1,301 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxSynthetic.cpp
+// Synthetic sample streams for driving the core without an encoder.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, see PpboxCore.cpp.
+
+#include "PpboxSynthetic.h"
+
+#include <new>
+
+// Relative frame sizes, in units of a B-frame.
+const unsigned long SYNTHETIC_WEIGHT_I = 8;
+const unsigned long SYNTHETIC_WEIGHT_P = 2;
+const unsigned long SYNTHETIC_WEIGHT_B = 1;
+
+// Video frames, by position in the GOP in display order.
+static bool IsReferenceFrame(PpboxSyntheticConfig const & config, unsigned long uDisplay)
+{
+    return uDisplay % (config.b_frames + 1) == 0 || uDisplay + 1 == config.gop_size;
+}
+
+static unsigned long GetFrameWeight(PpboxSyntheticConfig const & config, unsigned long uDisplay)
+{
+    if (uDisplay == 0)
+        return SYNTHETIC_WEIGHT_I;
+    if (IsReferenceFrame(config, uDisplay))
+        return SYNTHETIC_WEIGHT_P;
+    return SYNTHETIC_WEIGHT_B;
+}
+
+//-------------------------------------------------------------------
+// MemorySampleOps
+//-------------------------------------------------------------------
+
+static void MemorySampleAddRef(void * sample)
+{
+    PpboxInterlockedIncrement(&((PpboxMemorySample *)sample)->cRef);
+}
+
+static void MemorySampleRelease(void * sample)
+{
+    if (PpboxInterlockedDecrement(&((PpboxMemorySample *)sample)->cRef) == 0)
+    {
+        delete (PpboxMemorySample *)sample;
+    }
+}
+
+static bool MemorySampleGetInfo(void * sample, JUST_Sample & info)
+{
+    info = ((PpboxMemorySample *)sample)->info;
+    return true;
+}
+
+static unsigned long MemorySampleGetBufferCount(void * sample)
+{
+    return ((PpboxMemorySample *)sample)->cBuffers;
+}
+
+static bool MemorySampleLockBuffer(void * sample, unsigned long index, unsigned char ** ppData, unsigned long * pcbData)
+{
+    PpboxMemorySample * pSample = (PpboxMemorySample *)sample;
+    if (index >= pSample->cBuffers)
+    {
+        return false;
+    }
+    *ppData = pSample->buffers[index];
+    *pcbData = pSample->lengths[index];
+    return true;
+}
+
+static void MemorySampleUnlockBuffer(void * sample, unsigned long index)
+{
+}
+
+PpboxSampleOps const MemorySampleOps =
+{
+    MemorySampleAddRef,
+    MemorySampleRelease,
+    MemorySampleGetInfo,
+    MemorySampleGetBufferCount,
+    MemorySampleLockBuffer,
+    MemorySampleUnlockBuffer,
+};
+
+//-------------------------------------------------------------------
+// Defaults
+//-------------------------------------------------------------------
+
+void GetSyntheticVideoDefaults(PpboxSyntheticConfig & config)
+{
+    memset(&config, 0, sizeof(config));
+    config.fVideo = true;
+    config.codec = PpboxCodec_H264;
+    config.width = 3840;
+    config.height = 2160;
+    config.frame_rate_num = 60;
+    config.frame_rate_den = 1;
+    config.gop_size = 60;
+    config.b_frames = 2;
+    config.bitrate = 40 * 1000 * 1000;
+    config.buffer_count = 1;
+}
+
+void GetSyntheticAudioDefaults(PpboxSyntheticConfig & config)
+{
+    memset(&config, 0, sizeof(config));
+    config.fVideo = false;
+    config.codec = PpboxCodec_AAC;
+    config.channel_count = 6;
+    config.sample_rate = 48000;
+    config.frame_samples = 1024;
+    config.bitrate = 384 * 1000;
+    config.buffer_count = 1;
+}
+
+//-------------------------------------------------------------------
+// PpboxSyntheticStream
+//-------------------------------------------------------------------
+
+PpboxSyntheticStream::PpboxSyntheticStream() :
+    m_pPattern(NULL),
+    m_cbPattern(0),
+    m_cbUnit(0),
+    m_uDuration(0),
+    m_uTime(0),
+    m_uGopTime(0),
+    m_uFrame(0)
+{
+    memset(&m_Config, 0, sizeof(m_Config));
+}
+
+PpboxSyntheticStream::~PpboxSyntheticStream()
+{
+    delete [] m_pPattern;
+}
+
+bool PpboxSyntheticStream::Initialize(PpboxSyntheticConfig const & config)
+{
+    if (config.buffer_count == 0 || config.buffer_count > MAX_SYNTHETIC_BUFFERS)
+    {
+        return false;
+    }
+
+    unsigned long long uBytesPerSecond = config.bitrate / 8;
+    unsigned long long uUnits = 0;
+    unsigned long long uSeconds = 0;    // Per GOP, scaled by frame_rate_num.
+    std::vector<unsigned long> order;
+
+    if (config.fVideo)
+    {
+        if (config.frame_rate_num == 0 || config.frame_rate_den == 0 || config.gop_size == 0)
+        {
+            return false;
+        }
+        m_uDuration = (unsigned long)(10000000ULL * config.frame_rate_den / config.frame_rate_num);
+
+        // Units in one GOP: one I-frame, then groups of b_frames B-frames
+        // closed by a P-frame. In decode order, each reference frame
+        // comes before the B-frames ahead of it.
+        unsigned long uPrevious = 0;
+        for (unsigned long i = 0; i < config.gop_size; ++i)
+        {
+            uUnits += GetFrameWeight(config, i);
+            if (IsReferenceFrame(config, i))
+            {
+                order.push_back(i);
+                for (unsigned long j = uPrevious + 1; j < i; ++j)
+                {
+                    order.push_back(j);
+                }
+                uPrevious = i;
+            }
+        }
+        uSeconds = (unsigned long long)config.gop_size * config.frame_rate_den;
+        m_cbUnit = (unsigned long)(uBytesPerSecond * uSeconds / config.frame_rate_num / uUnits);
+        m_cbPattern = m_cbUnit * SYNTHETIC_WEIGHT_I;
+    }
+    else
+    {
+        if (config.sample_rate == 0 || config.frame_samples == 0)
+        {
+            return false;
+        }
+        m_uDuration = (unsigned long)(10000000ULL * config.frame_samples / config.sample_rate);
+        m_cbUnit = (unsigned long)(uBytesPerSecond * config.frame_samples / config.sample_rate);
+        m_cbPattern = m_cbUnit;
+    }
+
+    if (m_cbUnit < config.buffer_count)
+    {
+        return false;
+    }
+
+    delete [] m_pPattern;
+    m_pPattern = new (std::nothrow) unsigned char[m_cbPattern];
+    if (m_pPattern == NULL)
+    {
+        return false;
+    }
+
+    // Not compressible, not all zero, cheap to make.
+    unsigned long x = 0x9e3779b9;
+    for (unsigned long i = 0; i < m_cbPattern; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        m_pPattern[i] = (unsigned char)x;
+    }
+
+    m_Config = config;
+    m_Order.swap(order);
+    m_uTime = 0;
+    m_uGopTime = 0;
+    m_uFrame = 0;
+
+    return true;
+}
+
+void PpboxSyntheticStream::GetMediaType(PpboxCoreMediaType & type) const
+{
+    memset(&type, 0, sizeof(type));
+    type.fVideo = m_Config.fVideo;
+    type.fAudio = !m_Config.fVideo;
+    type.codec = m_Config.codec;
+    type.width = m_Config.width;
+    type.height = m_Config.height;
+    type.frame_rate_num = m_Config.frame_rate_num;
+    type.frame_rate_den = m_Config.frame_rate_den;
+    type.bits_per_sample = m_Config.fVideo ? 0 : 16;
+    type.channel_count = m_Config.channel_count;
+    type.sample_rate = m_Config.sample_rate;
+}
+
+bool PpboxSyntheticStream::NextSample(PpboxMemorySample ** ppSample)
+{
+    if (m_pPattern == NULL)
+    {
+        return false;
+    }
+
+    PpboxMemorySample * pSample = new (std::nothrow) PpboxMemorySample;
+    if (pSample == NULL)
+    {
+        return false;
+    }
+    memset(pSample, 0, sizeof(*pSample));
+
+    bool fSync = !m_Config.fVideo || m_uFrame == 0;
+    unsigned long cbFrame = m_cbUnit;
+    unsigned long long uTime = m_uTime;
+
+    if (m_Config.fVideo)
+    {
+        // Presented in display order, delayed by one frame if that is
+        // not decode order.
+        unsigned long uDisplay = m_Order[m_uFrame];
+        cbFrame = m_cbUnit * GetFrameWeight(m_Config, uDisplay);
+        uTime = m_uGopTime + (unsigned long long)uDisplay * m_uDuration
+            + (m_Config.b_frames > 0 ? m_uDuration : 0);
+    }
+
+    pSample->cRef = 1;
+    pSample->info.flags = fSync ? JUST_SampleFlag::sync : 0;
+    pSample->info.time = uTime;
+    pSample->info.decode_time = m_uTime;
+    pSample->info.composite_time_delta = (PP_uint)(uTime - m_uTime);
+    pSample->info.duration = m_uDuration;
+    pSample->info.size = cbFrame;
+
+    // Split evenly, the last buffer takes the rest.
+    unsigned long cbBuffer = cbFrame / m_Config.buffer_count;
+    unsigned long cbOffset = 0;
+    pSample->cBuffers = m_Config.buffer_count;
+    for (unsigned long i = 0; i < pSample->cBuffers; ++i)
+    {
+        pSample->buffers[i] = m_pPattern + cbOffset;
+        pSample->lengths[i] = (i + 1 == pSample->cBuffers) ? cbFrame - cbOffset : cbBuffer;
+        cbOffset += cbBuffer;
+    }
+
+    m_uTime += m_uDuration;
+    if (m_Config.fVideo && ++m_uFrame == m_Config.gop_size)
+    {
+        m_uFrame = 0;
+        m_uGopTime = m_uTime;
+    }
+
+    *ppSample = pSample;
+    return true;
+}
@@ -0,0 +1,104 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxSynthetic.h
+// Synthetic sample streams for driving the core without an encoder.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Like PpboxCore, this builds without WRL or Media Foundation.
+
+#include "PpboxCore.h"
+
+#include <vector>
+
+const unsigned long MAX_SYNTHETIC_BUFFERS = 8;
+
+// PpboxMemorySample: A host sample in plain memory, see MemorySampleOps.
+// The buffers point into memory owned by whoever made the sample.
+struct PpboxMemorySample
+{
+    long                    cRef;
+    JUST_Sample             info;       // flags, times and total size
+    unsigned long           cBuffers;
+    unsigned char *         buffers[MAX_SYNTHETIC_BUFFERS];
+    unsigned long           lengths[MAX_SYNTHETIC_BUFFERS];
+};
+
+extern PpboxSampleOps const MemorySampleOps;
+
+// PpboxSyntheticConfig: Shape of a synthetic stream.
+struct PpboxSyntheticConfig
+{
+    bool            fVideo;
+    PpboxCoreCodec  codec;
+
+    // video
+    unsigned long   width;
+    unsigned long   height;
+    unsigned long   frame_rate_num;
+    unsigned long   frame_rate_den;
+    unsigned long   gop_size;           // Frames from one sync sample to the next.
+    unsigned long   b_frames;           // Non-reference frames between reference frames; closed GOPs.
+
+    // audio
+    unsigned long   channel_count;
+    unsigned long   sample_rate;
+    unsigned long   frame_samples;      // Samples per channel in a frame, 1024 for AAC.
+
+    unsigned long   bitrate;            // Bits per second.
+    unsigned long   buffer_count;       // Buffers per sample, 1 to MAX_SYNTHETIC_BUFFERS.
+};
+
+// Fills in 4K60 H.264 at 40 Mbps, one-second GOPs with two B-frames.
+void GetSyntheticVideoDefaults(PpboxSyntheticConfig & config);
+// Fills in 5.1 AAC at 48 kHz and 384 kbps.
+void GetSyntheticAudioDefaults(PpboxSyntheticConfig & config);
+
+// PpboxSyntheticStream:
+// Produces samples in decode order: I P B B P B B ... for two B-frames,
+// each reference frame ahead of the B-frames shown before it. time is
+// the presentation time, one frame after decode_time's start when there
+// are B-frames, and composite_time_delta the difference. The last frame
+// of a GOP is always a reference frame, so GOPs are closed. Frame sizes
+// follow the GOP structure (I-frames about four times P-frames, B-frames
+// half of P-frames) and add up to the configured bitrate. Payloads are
+// slices of one pattern buffer, so a sample costs no more than its
+// PpboxMemorySample.
+class PpboxSyntheticStream
+{
+public:
+    PpboxSyntheticStream();
+    ~PpboxSyntheticStream();
+
+public:
+    bool    Initialize(PpboxSyntheticConfig const & config);
+
+    void    GetMediaType(PpboxCoreMediaType & type) const;
+
+    // The sample comes with one reference, give it back with
+    // MemorySampleOps.Release.
+    bool    NextSample(PpboxMemorySample ** ppSample);
+
+    // Decode time of the next sample, 100ns units.
+    unsigned long long  GetTime() const { return m_uTime; }
+
+private:
+    PpboxSyntheticConfig    m_Config;
+    unsigned char *         m_pPattern;
+    unsigned long           m_cbPattern;
+    unsigned long           m_cbUnit;       // Size of a B-frame, or of an audio frame.
+    unsigned long           m_uDuration;    // Of one sample, 100ns units.
+    unsigned long long      m_uTime;        // Decode time of the next sample.
+    unsigned long long      m_uGopTime;     // Decode time of the current GOP's I-frame.
+    unsigned long           m_uFrame;       // Position in the GOP, in decode order.
+    std::vector<unsigned long>  m_Order;    // Display position of each decode position.
+};
@@ -0,0 +1,221 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxTrace.cpp
+// Records what reaches the sink (samples, media types, clock events) to
+// a binary trace file, to reproduce sessions offline.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "StdAfx.h"
+
+#include "Trace.h"
+
+#include "PpboxCore.h"
+#include "PpboxTrace.h"
+
+PpboxTraceRecorder::PpboxTraceRecorder() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_fPayload(FALSE),
+    m_cbRecords(0)
+{
+    m_liFrequency.QuadPart = 0;
+    m_liStart.QuadPart = 0;
+}
+
+PpboxTraceRecorder::~PpboxTraceRecorder()
+{
+    Close();
+}
+
+HRESULT PpboxTraceRecorder::Open(PCWSTR pszPath, BOOL fPayload)
+{
+    HRESULT hr = S_OK;
+
+    if (pszPath == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    Close();
+
+    m_hFile = CreateFile2(pszPath, GENERIC_WRITE, FILE_SHARE_READ, CREATE_ALWAYS, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        Header header;
+        InitTraceHeader(header);
+        hr = Write((BYTE const *)&header, sizeof(header));
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_fPayload = fPayload;
+        QueryPerformanceFrequency(&m_liFrequency);
+        QueryPerformanceCounter(&m_liStart);
+        m_Staging.reserve(TRACE_WRITE_BYTES);
+    }
+    else
+    {
+        Close();
+    }
+
+    TRACEHR_RET(hr);
+}
+
+void PpboxTraceRecorder::Close()
+{
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        Flush();
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+    m_Records.clear();
+    m_cbRecords = 0;
+}
+
+//-------------------------------------------------------------------
+// PrepareSample
+// Builds the record of a sample as it reached ProcessSample, see
+// BuildTraceSample. Reads only what Open set, so it runs without the
+// sink lock; a record built while the trace closes is dropped by
+// AddSample.
+//-------------------------------------------------------------------
+
+BOOL PpboxTraceRecorder::PrepareSample(DWORD dwStream, PpboxSampleOps const * pOps, void * pSample, std::vector<BYTE> & record) const
+{
+    return IsOpen() && BuildTraceSample(record, dwStream, pOps, pSample, m_fPayload != FALSE);
+}
+
+void PpboxTraceRecorder::AddSample(std::vector<BYTE> & record)
+{
+    if (!IsOpen() || record.empty())
+    {
+        record.clear();
+        return;
+    }
+
+    QueueRecord(record);
+}
+
+void PpboxTraceRecorder::AddMediaType(DWORD dwStream, PpboxCoreMediaType const & type)
+{
+    if (!IsOpen())
+    {
+        return;
+    }
+
+    std::vector<BYTE> record;
+    BYTE * p = BeginTraceRecord(record, Type_MediaType, dwStream, sizeof(type));
+    memcpy(p, &type, sizeof(type));
+    QueueRecord(record);
+}
+
+void PpboxTraceRecorder::AddClock(ClockEvent event, LONGLONG llOffset, float flRate)
+{
+    if (!IsOpen())
+    {
+        return;
+    }
+
+    std::vector<BYTE> record;
+    ClockRecord * pRecord = (ClockRecord *)BeginTraceRecord(record, Type_Clock, 0, sizeof(ClockRecord));
+    pRecord->uEvent = event;
+    pRecord->flRate = flRate;
+    pRecord->llOffset = llOffset;
+    QueueRecord(record);
+}
+
+//-------------------------------------------------------------------
+// Flush
+// Writes the queued records in order; small ones go out together.
+//-------------------------------------------------------------------
+
+HRESULT PpboxTraceRecorder::Flush()
+{
+    HRESULT hr = S_OK;
+
+    if (!IsOpen() || m_Records.empty())
+    {
+        return S_OK;
+    }
+
+    for (size_t i = 0; i < m_Records.size() && SUCCEEDED(hr); ++i)
+    {
+        std::vector<BYTE> const & record = m_Records[i];
+
+        if (!m_Staging.empty() && m_Staging.size() + record.size() > TRACE_WRITE_BYTES)
+        {
+            hr = Write(&m_Staging[0], (DWORD)m_Staging.size());
+            m_Staging.clear();
+        }
+
+        if (SUCCEEDED(hr) && record.size() > TRACE_WRITE_BYTES)
+        {
+            hr = Write(&record[0], (DWORD)record.size());
+        }
+        else if (SUCCEEDED(hr))
+        {
+            m_Staging.insert(m_Staging.end(), record.begin(), record.end());
+        }
+    }
+
+    if (SUCCEEDED(hr) && !m_Staging.empty())
+    {
+        hr = Write(&m_Staging[0], (DWORD)m_Staging.size());
+    }
+
+    m_Staging.clear();
+    m_Records.clear();
+    m_cbRecords = 0;
+
+    TRACEHR_RET(hr);
+}
+
+/* Private methods */
+
+// Stamps the record and takes it over, its bytes are not copied.
+void PpboxTraceRecorder::QueueRecord(std::vector<BYTE> & record)
+{
+    ((Record *)&record[0])->uTime = GetTime();
+
+    m_cbRecords += record.size();
+    m_Records.push_back(std::vector<BYTE>());
+    m_Records.back().swap(record);
+
+    if (m_cbRecords >= TRACE_FLUSH_BYTES)
+    {
+        Flush();
+    }
+}
+
+HRESULT PpboxTraceRecorder::Write(BYTE const * pData, DWORD cbData)
+{
+    DWORD cbWritten = 0;
+    if (!WriteFile(m_hFile, pData, cbData, &cbWritten, NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+UINT64 PpboxTraceRecorder::GetTime() const
+{
+    LARGE_INTEGER liNow;
+    QueryPerformanceCounter(&liNow);
+    UINT64 uTicks = liNow.QuadPart - m_liStart.QuadPart;
+    // Split to avoid overflowing on long sessions.
+    return (uTicks / m_liFrequency.QuadPart) * 10000000
+        + (uTicks % m_liFrequency.QuadPart) * 10000000 / m_liFrequency.QuadPart;
+}
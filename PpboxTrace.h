@@ -0,0 +1,62 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxTrace.h
+// Records what reaches the sink (samples, media types, clock events) to
+// a binary trace file, to reproduce sessions offline.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <vector>
+
+#include "PpboxTraceFormat.h"
+
+const DWORD TRACE_FLUSH_BYTES = 256 * 1024;         // Bytes queued before a write.
+const DWORD TRACE_WRITE_BYTES = 64 * 1024;          // Smaller records are written together.
+
+// Records in the layout of PpboxTraceFormat. Samples are recorded in two
+// steps: PrepareSample builds the record and copies the payload, without
+// the sink lock; AddSample stamps and queues it with the sink lock held,
+// without copying. Everything else is called with the sink lock held.
+class PpboxTraceRecorder : public PpboxTraceFormat
+{
+public:
+    PpboxTraceRecorder();
+    ~PpboxTraceRecorder();
+
+public:
+    HRESULT Open(PCWSTR pszPath, BOOL fPayload);
+    void    Close();
+
+    BOOL    IsOpen() const { return m_hFile != INVALID_HANDLE_VALUE; }
+
+    // FALSE if there is nothing to record. AddSample takes over record.
+    BOOL    PrepareSample(DWORD dwStream, PpboxSampleOps const * pOps, void * pSample, std::vector<BYTE> & record) const;
+    void    AddSample(std::vector<BYTE> & record);
+    void    AddMediaType(DWORD dwStream, PpboxCoreMediaType const & type);
+    void    AddClock(ClockEvent event, LONGLONG llOffset, float flRate);
+
+    HRESULT Flush();
+
+private:
+    void    QueueRecord(std::vector<BYTE> & record);
+    HRESULT Write(BYTE const * pData, DWORD cbData);
+    UINT64  GetTime() const;
+
+private:
+    HANDLE              m_hFile;
+    BOOL                m_fPayload;
+    LARGE_INTEGER       m_liFrequency;
+    LARGE_INTEGER       m_liStart;
+    std::vector< std::vector<BYTE> >    m_Records;  // Queued, oldest first.
+    size_t              m_cbRecords;
+    std::vector<BYTE>   m_Staging;                  // Small records on their way to the file.
+};
@@ -0,0 +1,155 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxTraceFormat.cpp
+// Layout of the session trace files, and how their records are built and
+// read. The recorder is PpboxTraceRecorder.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Built without the precompiled header, part of the portable core.
+
+#include "PpboxTraceFormat.h"
+
+#include <stddef.h>
+
+void InitTraceHeader(PpboxTraceFormat::Header & header)
+{
+    memset(&header, 0, sizeof(header));
+    header.uMagic = TRACE_MAGIC;
+    header.uVersion = TRACE_VERSION;
+    header.uTimeScale = 10 * 1000 * 1000;
+    header.cbMediaType = sizeof(PpboxCoreMediaType);
+}
+
+unsigned char * BeginTraceRecord(std::vector<unsigned char> & record, PpboxTraceFormat::RecordType type, unsigned long dwStream, unsigned long cbBody)
+{
+    PpboxTraceFormat::Record header;
+    header.uType = (unsigned short)type;
+    header.uStream = (unsigned short)dwStream;
+    header.cbRecord = (unsigned int)(sizeof(header) + cbBody);
+    header.uTime = 0;
+
+    record.resize(sizeof(header) + cbBody);
+    memcpy(&record[0], &header, sizeof(header));
+    return &record[0] + sizeof(header);
+}
+
+//-------------------------------------------------------------------
+// BuildTraceSample
+// Records a sample as it reached ProcessSample, before the sink
+// decides to spill, copy out or put it.
+//-------------------------------------------------------------------
+
+bool BuildTraceSample(std::vector<unsigned char> & record, unsigned long dwStream, PpboxSampleOps const * pOps, void * pSample, bool fPayload)
+{
+    JUST_Sample info;
+    memset(&info, 0, sizeof(info));
+    if (!pOps->GetInfo(pSample, info))
+    {
+        return false;
+    }
+
+    unsigned long cBuffers = pOps->GetBufferCount(pSample);
+    unsigned long cbPayload = fPayload ? info.size : 0;
+
+    unsigned char * p = BeginTraceRecord(record, PpboxTraceFormat::Type_Sample, dwStream,
+        sizeof(PpboxTraceFormat::SampleRecord) + cBuffers * sizeof(unsigned int) + cbPayload);
+
+    unsigned char * pLengths = p + sizeof(PpboxTraceFormat::SampleRecord);
+    unsigned char * pPayload = pLengths + cBuffers * sizeof(unsigned int);
+    unsigned long cbCopied = 0;
+
+    for (unsigned long i = 0; i < cBuffers; ++i)
+    {
+        unsigned char * pData = NULL;
+        unsigned long cbData = 0;
+        if (pOps->LockBuffer(pSample, i, &pData, &cbData))
+        {
+            if (cbCopied + cbData <= cbPayload)
+            {
+                memcpy(pPayload + cbCopied, pData, cbData);
+                cbCopied += cbData;
+            }
+            pOps->UnlockBuffer(pSample, i);
+        }
+        unsigned int uLength = cbData;
+        memcpy(pLengths + i * sizeof(uLength), &uLength, sizeof(uLength));
+    }
+
+    // Payloads are all or nothing, a sample that did not fit its own
+    // size is recorded without one.
+    if (cbCopied != cbPayload)
+    {
+        cbCopied = 0;
+    }
+
+    PpboxTraceFormat::SampleRecord sampleRecord;
+    sampleRecord.uFlags = info.flags;
+    sampleRecord.cBuffers = cBuffers;
+    sampleRecord.uDecodeTime = info.decode_time;
+    sampleRecord.uDuration = info.duration;
+    sampleRecord.cbSize = info.size;
+    sampleRecord.cbPayload = cbCopied;
+    memcpy(p, &sampleRecord, sizeof(sampleRecord));
+
+    record.resize(record.size() - (cbPayload - cbCopied));
+    unsigned int cbRecord = (unsigned int)record.size();
+    memcpy(&record[0] + offsetof(PpboxTraceFormat::Record, cbRecord), &cbRecord, sizeof(cbRecord));
+
+    return true;
+}
+
+/* PpboxTraceReader */
+
+PpboxTraceReader::PpboxTraceReader() :
+    m_pData(NULL),
+    m_cbData(0),
+    m_oNext(0)
+{
+}
+
+bool PpboxTraceReader::Open(unsigned char const * pData, size_t cbData)
+{
+    Header header;
+    if (pData == NULL || cbData < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, pData, sizeof(header));
+    if (header.uMagic != TRACE_MAGIC
+        || header.uVersion != TRACE_VERSION
+        || header.cbMediaType != sizeof(PpboxCoreMediaType))
+    {
+        return false;
+    }
+
+    m_pData = pData;
+    m_cbData = cbData;
+    m_oNext = sizeof(header);
+    return true;
+}
+
+bool PpboxTraceReader::Next(Record & record, unsigned char const ** ppBody, unsigned long * pcbBody)
+{
+    if (m_pData == NULL || m_cbData - m_oNext < sizeof(record))
+    {
+        return false;
+    }
+    memcpy(&record, m_pData + m_oNext, sizeof(record));
+    if (record.cbRecord < sizeof(record) || record.cbRecord > m_cbData - m_oNext)
+    {
+        return false;
+    }
+
+    *ppBody = m_pData + m_oNext + sizeof(record);
+    *pcbBody = record.cbRecord - sizeof(record);
+    m_oNext += record.cbRecord;
+    return true;
+}
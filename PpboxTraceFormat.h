@@ -0,0 +1,123 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxTraceFormat.h
+// Layout of the session trace files, and how their records are built and
+// read. The recorder is PpboxTraceRecorder.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Part of the portable core, see PpboxCore.h, so that traces replay
+// anywhere.
+
+#include "PpboxCore.h"
+
+#include <vector>
+
+const unsigned int TRACE_MAGIC = 'PPTR';
+const unsigned short TRACE_VERSION = 1;
+
+// Trace file layout, little endian:
+//   Header, then records until the end of the file. Each record starts
+//   with a Record and is cbRecord bytes long in total, readers skip
+//   record types they don't know.
+//   Type_Sample:     SampleRecord, cBuffers UINT32 buffer lengths, then
+//                    cbPayload bytes of payload (0 unless payloads are on).
+//   Type_MediaType:  PpboxCoreMediaType as the core sees it.
+//   Type_Clock:      ClockRecord.
+// uTime is the wall clock since the trace was opened, so a replay can run
+// at the recorded speed. Media types are recorded in the form the core
+// consumes, so a replay does not need Media Foundation.
+struct PpboxTraceFormat
+{
+    enum RecordType
+    {
+        Type_Sample = 1,
+        Type_MediaType,
+        Type_Clock,
+    };
+
+    enum ClockEvent
+    {
+        Clock_Start = 1,
+        Clock_Stop,
+        Clock_Pause,
+        Clock_Restart,
+        Clock_SetRate,
+    };
+
+#pragma pack(push, 1)
+    struct Header
+    {
+        unsigned int        uMagic;         // 'PPTR'
+        unsigned short      uVersion;
+        unsigned short      uReserved;
+        unsigned int        uTimeScale;     // Of all times, 100ns units.
+        unsigned int        cbMediaType;    // sizeof(PpboxCoreMediaType) of the writer.
+    };
+
+    struct Record
+    {
+        unsigned short      uType;
+        unsigned short      uStream;
+        unsigned int        cbRecord;
+        unsigned long long  uTime;
+    };
+
+    struct SampleRecord
+    {
+        unsigned int        uFlags;         // JUST_SampleFlag
+        unsigned int        cBuffers;
+        unsigned long long  uDecodeTime;
+        unsigned long long  uDuration;
+        unsigned int        cbSize;
+        unsigned int        cbPayload;
+    };
+
+    struct ClockRecord
+    {
+        unsigned int        uEvent;
+        float               flRate;
+        long long           llOffset;
+    };
+#pragma pack(pop)
+};
+
+// Fills in the file header.
+void InitTraceHeader(PpboxTraceFormat::Header & header);
+
+// Sizes record to a Record and cbBody bytes, and returns the body. The
+// time is left 0, the recorder stamps it when it queues the record.
+unsigned char * BeginTraceRecord(std::vector<unsigned char> & record, PpboxTraceFormat::RecordType type, unsigned long dwStream, unsigned long cbBody);
+
+// Builds the record of a host sample, with its payload if fPayload. A
+// payload that does not add up to the sample's size is left out.
+bool BuildTraceSample(std::vector<unsigned char> & record, unsigned long dwStream, PpboxSampleOps const * pOps, void * pSample, bool fPayload);
+
+// PpboxTraceReader: Walks the records of a trace held in memory. Record
+// bodies are not aligned, read them with memcpy.
+class PpboxTraceReader : public PpboxTraceFormat
+{
+public:
+    PpboxTraceReader();
+
+public:
+    // False unless the header is one this build wrote.
+    bool    Open(unsigned char const * pData, size_t cbData);
+
+    // False at the end, or at a record that runs past it.
+    bool    Next(Record & record, unsigned char const ** ppBody, unsigned long * pcbBody);
+
+private:
+    unsigned char const *   m_pData;
+    size_t                  m_cbData;
+    size_t                  m_oNext;
+};
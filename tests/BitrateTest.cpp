@@ -0,0 +1,164 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// BitrateTest.cpp
+// PpboxBitrateEstimator against a scripted backend whose throughput
+// steps, with an encoder that follows the recommendations.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxCore.h"
+#include "PpboxBitrate.h"
+#include "PpboxTest.h"
+
+#include <algorithm>
+#include <deque>
+
+const unsigned long long STEP = 10000;          // Microseconds of simulated time per step.
+
+// ScriptedBackend: Frees queued samples at a set byte rate, in order.
+struct ScriptedBackend
+{
+    PpboxCoreStream *               pStream;
+    std::deque<unsigned long>       queued;
+    unsigned long                   uRate;      // Bytes per second.
+    double                          dCredit;
+
+    explicit ScriptedBackend(PpboxCoreStream * pStreamIn) : pStream(pStreamIn), uRate(0), dCredit(0) {}
+
+    void Put(unsigned long cbSample)
+    {
+        pStream->OnSampleQueued(cbSample);
+        queued.push_back(cbSample);
+    }
+
+    void Step()
+    {
+        dCredit += (double)uRate * STEP / 1000000;
+        while (!queued.empty() && queued.front() <= dCredit)
+        {
+            dCredit -= queued.front();
+            pStream->OnSampleFreed(queued.front());
+            queued.pop_front();
+        }
+        // Idle time is not saved up.
+        if (queued.empty() && dCredit > (double)uRate * STEP / 1000000)
+        {
+            dCredit = (double)uRate * STEP / 1000000;
+        }
+    }
+};
+
+static void TakeSnapshot(PpboxCoreStream * pStream, unsigned long long uTime, unsigned long long cbSpilled, PpboxSinkStats & stats)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.uTime = uTime;
+    stats.cStreams = 1;
+    pStream->GetStats(stats.streams[0]);
+    stats.streams[0].cbSpilled = cbSpilled;
+}
+
+// The encoder follows the backend down from 1 MB/s to 300 KB/s and back
+// up to 800 KB/s, without the backlog running away.
+static void TestFollowsBackend()
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    ScriptedBackend backend(pStream);
+    PpboxBitrateEstimator estimator;
+
+    unsigned long const rates[3] = { 1000000, 300000, 800000 };
+    unsigned long uBitrate = 4000000;
+    unsigned long long uTime = 1;
+
+    for (int iPhase = 0; iPhase < 3; ++iPhase)
+    {
+        backend.uRate = rates[iPhase];
+        unsigned long long cbEncoded = 0;
+        unsigned long long cbMaxBacklog = 0;
+
+        // 20 seconds a phase; the last 5 have to be on target.
+        for (unsigned long n = 0; n < 2000; ++n)
+        {
+            unsigned long cbSample = (unsigned long)((unsigned long long)uBitrate / 8 * STEP / 1000000);
+            backend.Put(cbSample);
+            backend.Step();
+            uTime += STEP;
+
+            if (n >= 1500)
+            {
+                cbEncoded += cbSample;
+                cbMaxBacklog = std::max(cbMaxBacklog, (unsigned long long)pStream->m_cbInFlight);
+            }
+
+            if (uTime % (BITRATE_DEFAULT_INTERVAL * 1000ULL) < STEP)
+            {
+                PpboxSinkStats stats;
+                TakeSnapshot(pStream, uTime, 0, stats);
+                if (estimator.Update(stats) & 1)
+                {
+                    uBitrate = estimator.GetRecommendedBitrate(0);
+                }
+            }
+        }
+
+        double dEncoded = (double)cbEncoded / 5;
+        CHECK(dEncoded > rates[iPhase] * 0.6);
+        CHECK(dEncoded < rates[iPhase] * 1.1);
+        CHECK(cbMaxBacklog < rates[iPhase] * 2);
+    }
+
+    pStream->Release();
+    pSink->Release();
+}
+
+// A backend that keeps up with the samples put to it, while the spill
+// ring in front of it fills, is saturated all the same.
+static void TestSpillIsBacklog()
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    ScriptedBackend backend(pStream);
+    PpboxBitrateEstimator estimator;
+
+    // 500 KB/s replayed and drained, 200 KB/s more spilled.
+    backend.uRate = 500000;
+    unsigned long long cbSpilled = 0;
+    unsigned long long uTime = 1;
+    PpboxSinkStats stats;
+
+    for (unsigned long n = 0; n < 500; ++n)
+    {
+        backend.Put(5000);
+        backend.Step();
+        cbSpilled += 2000;
+        uTime += STEP;
+
+        if (uTime % (BITRATE_DEFAULT_INTERVAL * 1000ULL) < STEP)
+        {
+            TakeSnapshot(pStream, uTime, cbSpilled, stats);
+            estimator.Update(stats);
+        }
+    }
+
+    // Below what goes in, rather than probing above it.
+    CHECK(stats.streams[0].uRecommendedBitrate > 0);
+    CHECK(stats.streams[0].uRecommendedBitrate < 500000 * 8);
+    CHECK(stats.streams[0].llQueueGrowth > 100000);
+
+    pStream->Release();
+    pSink->Release();
+}
+
+int main()
+{
+    RUN_TEST(TestFollowsBackend);
+    RUN_TEST(TestSpillIsBacklog);
+    return TEST_RESULT();
+}
@@ -0,0 +1,140 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// CopyOutTest.cpp
+// The slab pool, and the copy-out policy while the backend stalls: how
+// many encoder samples stay pinned, and what the copies cost.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxSynthetic.h"
+#include "PpboxSlabPool.h"
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+#include <stdint.h>
+
+static void TestSlabPool()
+{
+    PpboxSlabPool pool;
+
+    void * p1 = pool.Alloc(1);
+    void * p2 = pool.Alloc(300);
+    CHECK(p1 != NULL && p2 != NULL);
+    CHECK(((uintptr_t)p1 % SLAB_ALIGNMENT) == 0);
+    CHECK(((uintptr_t)p2 % SLAB_ALIGNMENT) == 0);
+
+    // Freed blocks are reused within their class.
+    pool.Free(p2);
+    CHECK(pool.Alloc(512) == p2);
+    pool.Free(p2);
+
+    // Too big to be cached, but still served.
+    void * pBig = pool.Alloc((1UL << SLAB_MAX_CLASS) + 1);
+    CHECK(pBig != NULL);
+    pool.Free(pBig);
+
+    pool.Free(p1);
+    pool.Free(NULL);
+}
+
+// Feeds cSamples 4K60 frames to a backend that holds all of them, as the
+// sink does with the given CopyOutThreshold. Returns the host samples
+// still pinned at the end and the time spent in CreateSample.
+static unsigned long RunStall(unsigned long uThreshold, unsigned long cSamples, unsigned long long * puMicroseconds, unsigned long long * pcbCopied)
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    StubDestination dest("stalled");
+    StubDestination * pDest = &dest;
+
+    PpboxSyntheticConfig config;
+    GetSyntheticVideoDefaults(config);
+    PpboxSyntheticStream synthetic;
+    CHECK(synthetic.Initialize(config));
+
+    std::vector<PpboxMemorySample *> hosts;
+    unsigned long long uTime = 0;
+    *pcbCopied = 0;
+
+    for (unsigned long i = 0; i < cSamples; ++i)
+    {
+        PpboxMemorySample * pHost = NULL;
+        CHECK(synthetic.NextSample(&pHost));
+        hosts.push_back(pHost);
+
+        bool fCopyOut = uThreshold > 0 && (unsigned long)pStream->m_cInFlight >= uThreshold;
+
+        unsigned long long uStart = PpboxGetMicroseconds();
+        JUST_Sample sample;
+        CHECK(CreateSample(sample, &MemorySampleOps, pHost, pStream, fCopyOut));
+        uTime += PpboxGetMicroseconds() - uStart;
+        if (fCopyOut)
+        {
+            *pcbCopied += pHost->info.size;
+        }
+
+        pStream->OnSampleQueued(pHost->info.size);
+        StubDeliver(sample, &pDest, 1);
+    }
+
+    unsigned long cPinned = 0;
+    for (size_t i = 0; i < hosts.size(); ++i)
+    {
+        cPinned += hosts[i]->cRef > 1 ? 1 : 0;
+    }
+
+    // The backend catches up, everything goes back.
+    CHECK(StubCaptureFree(dest.pDest->hCapture, cSamples) == cSamples);
+    CHECK(pStream->m_cInFlight == 0);
+    for (size_t i = 0; i < hosts.size(); ++i)
+    {
+        CHECK(hosts[i]->cRef == 1);
+        MemorySampleOps.Release(hosts[i]);
+    }
+
+    pStream->Release();
+    pSink->Release();
+
+    *puMicroseconds = uTime;
+    return cPinned;
+}
+
+static void TestCopyOutStall()
+{
+    const unsigned long cSamples = 240;     // Four seconds of 4K60.
+    unsigned long long uZeroCopy = 0;
+    unsigned long long uCopyOut = 0;
+    unsigned long long cbCopied = 0;
+
+    // Zero-copy pins every frame the backend holds. With a threshold, the
+    // encoder never has more than that many frames pinned.
+    CHECK(RunStall(0, cSamples, &uZeroCopy, &cbCopied) == cSamples);
+    CHECK(cbCopied == 0);
+    CHECK(RunStall(8, cSamples, &uCopyOut, &cbCopied) == 8);
+    CHECK(cbCopied > 0);
+
+    printf("  zero-copy: %lu frames pinned, %llu us in CreateSample\n", cSamples, uZeroCopy);
+    printf("  copy-out at 8: 8 frames pinned, %llu us in CreateSample, %.1f MB copied",
+        uCopyOut, cbCopied / 1e6);
+    if (uCopyOut > uZeroCopy)
+    {
+        printf(", %.2f GB/s", cbCopied / 1e3 / (double)(uCopyOut - uZeroCopy));
+    }
+    printf("\n");
+}
+
+int main()
+{
+    RUN_TEST(TestSlabPool);
+    RUN_TEST(TestCopyOutStall);
+
+    CHECK(StubCaptureLiveCount() == 0);
+    return TEST_RESULT();
+}
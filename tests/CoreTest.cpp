@@ -0,0 +1,1142 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// CoreTest.cpp
+// The state matrix, stream formats and the sample path from CreateSample
+// through the backend to FreeSample.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxSynthetic.h"
+#include "PpboxCapturePool.h"
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+static void TestStateMatrix()
+{
+    CHECK(IsValidOperation(State_TypeNotSet, OpSetMediaType));
+    CHECK(!IsValidOperation(State_TypeNotSet, OpStart));
+    CHECK(!IsValidOperation(State_TypeNotSet, OpProcessSample));
+    CHECK(IsValidOperation(State_Ready, OpStart));
+    CHECK(!IsValidOperation(State_Ready, OpProcessSample));
+    CHECK(IsValidOperation(State_Started, OpProcessSample));
+    CHECK(IsValidOperation(State_Stopped, OpStart));
+    CHECK(IsValidOperation(State_Paused, OpStop));
+}
+
+static void TestStreamFormat()
+{
+    PpboxSyntheticConfig config;
+    GetSyntheticVideoDefaults(config);
+    PpboxSyntheticStream stream;
+    CHECK(stream.Initialize(config));
+
+    PpboxCoreMediaType type;
+    stream.GetMediaType(type);
+    PpboxStreamFormat * pFormat = CreateStreamFormat(type);
+    CHECK(pFormat != NULL);
+    if (pFormat)
+    {
+        CHECK(pFormat->info.type == JUST_StreamType::VIDE);
+        CHECK(pFormat->info.sub_type == JUST_VideoSubType::AVC1);
+        CHECK(pFormat->info.time_scale == 10000000);
+        CHECK(pFormat->info.format.video.width == 3840);
+        CHECK(pFormat->info.format.video.height == 2160);
+        pFormat->Release();
+    }
+
+    type.codec = PpboxCodec_Unknown;
+    CHECK(CreateStreamFormat(type) == NULL);
+}
+
+// Replays a sample through a stream, as after a warm restart, and
+// returns its rebased decode time.
+static unsigned long long RebaseTime(PpboxCoreStream * pStream, StubDestination * pDest, unsigned long long uTime)
+{
+    unsigned char payload[16] = {0};
+    JUST_Sample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.itrack = pStream->m_dwIdentifier;
+    sample.decode_time = uTime;
+    sample.time = uTime;
+    sample.flags = JUST_SampleFlag::sync;
+    CHECK(CreateSampleFromBuffer(sample, payload, sizeof(payload), pStream, NULL));
+    pStream->OnSampleQueued(sizeof(payload));
+    StubDeliver(sample, &pDest, 1);
+    return sample.decode_time;
+}
+
+// Segments based on the first sample keep the streams in step, and a
+// stream that starts earlier is not clamped.
+static void TestSegmentBase()
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStreams[3];
+    StubDestination dest("dest", 3);
+    dest.Get()->fFreeOnPut = true;
+    for (unsigned long i = 0; i < 3; ++i)
+    {
+        pStreams[i] = new PpboxCoreStream(pSink, i);
+        pStreams[i]->m_fSegmentStart = true;
+    }
+
+    pSink->BeginSegment(0, true);
+    CHECK(RebaseTime(pStreams[0], &dest, 1000) == 0);
+    CHECK(RebaseTime(pStreams[1], &dest, 1050) == 50);
+    CHECK(RebaseTime(pStreams[2], &dest, 900) == 0);
+    CHECK(RebaseTime(pStreams[2], &dest, 950) == 50);
+    CHECK(RebaseTime(pStreams[0], &dest, 1100) == 100);
+
+    // A given base is the same for all.
+    for (unsigned long i = 0; i < 3; ++i)
+    {
+        pStreams[i]->m_fSegmentStart = true;
+    }
+    pSink->BeginSegment(2000, false);
+    CHECK(RebaseTime(pStreams[0], &dest, 2100) == 100);
+    CHECK(RebaseTime(pStreams[2], &dest, 1900) == 0);
+    CHECK(RebaseTime(pStreams[1], &dest, 2050) == 50);
+
+    for (unsigned long i = 0; i < 3; ++i)
+    {
+        pStreams[i]->Release();
+    }
+    pSink->Release();
+}
+
+static bool OtherFreeSample(void const * context)
+{
+    return true;
+}
+
+// A handle taken back from the pool is initialized again with the new
+// session's config, and goes only when trimmed.
+static void TestCapturePool()
+{
+    PpboxCapturePool pool;
+    pool.Configure(2, 60000);
+
+    JUST_CaptureConfigData config;
+    memset(&config, 0, sizeof(config));
+    config.stream_count = 2;
+    config.get_sample_buffers = GetSampleBuffers;
+    config.free_sample = FreeSample;
+    PpboxCaptureLayout layout(config);
+    layout.AddStream(0, true);
+
+    PP_handle hCapture = pool.Acquire("pool", layout.GetValue(), config);
+    CHECK(StubCaptureFromHandle(hCapture)->cInit == 1);
+    JUST_StreamInfo info;
+    memset(&info, 0, sizeof(info));
+    JUST_CaptureSetStream(hCapture, 0, &info);
+    pool.Release("pool", layout.GetValue(), hCapture);
+    CHECK(pool.GetIdleCount() == 1);
+
+    config.free_sample = OtherFreeSample;
+    CHECK(pool.Acquire("pool", layout.GetValue(), config) == hCapture);
+    StubCapture * pCapture = StubCaptureFromHandle(hCapture);
+    CHECK(pCapture->cInit == 2);
+    CHECK(pCapture->config.free_sample == OtherFreeSample);
+    CHECK(pCapture->streams.empty());
+    CHECK(pool.GetIdleCount() == 0);
+
+    long cLive = StubCaptureLiveCount();
+    pool.Release("pool", layout.GetValue(), hCapture);
+    pool.Trim();
+    CHECK(StubCaptureLiveCount() == cLive - 1);
+}
+
+// Sessions of one destination through a pool: each puts a sample, shuts
+// down before the backend frees it, and the handle goes back with it.
+// Returns the microseconds taken.
+static unsigned long long RunPoolSessions(PpboxCapturePool & pool, unsigned long cSessions)
+{
+    JUST_CaptureConfigData config;
+    memset(&config, 0, sizeof(config));
+    config.stream_count = 1;
+    config.get_sample_buffers = GetSampleBuffers;
+    config.free_sample = FreeSample;
+    PpboxCaptureLayout layout(config);
+    layout.AddStream(0, true);
+
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    unsigned char payload[16] = {0};
+    unsigned long long uStart = PpboxGetMicroseconds();
+
+    for (unsigned long i = 0; i < cSessions; ++i)
+    {
+        PpboxCaptureDest * pDest = CreateCaptureDest(pool.Acquire("sessions", layout.GetValue(), config), layout.GetValue());
+        pDest->pPool = &pool;
+        pDest->dest = "sessions";
+        PP_handle hCapture = pDest->hCapture;
+
+        JUST_Sample sample;
+        memset(&sample, 0, sizeof(sample));
+        sample.flags = JUST_SampleFlag::sync;
+        CHECK(CreateSampleFromBuffer(sample, payload, sizeof(payload), pStream, NULL));
+        pStream->OnSampleQueued(sizeof(payload));
+        PpboxSampleContext * pContext = (PpboxSampleContext *)sample.context;
+        PpboxSampleRef & ref = pContext->refs[0];
+        ref.pContext = pContext;
+        ref.pDest = pDest;
+        pDest->AddRef();
+        PpboxInterlockedIncrement(&pDest->cInFlight);
+        JUST_Sample destSample = sample;
+        destSample.context = &ref;
+        PutCaptureSample(hCapture, destSample);
+
+        // Shutdown, the handle is not the pool's while the sample is out.
+        unsigned long cIdle = pool.GetIdleCount();
+        pDest->Release();
+        CHECK(pool.GetIdleCount() == cIdle);
+        CHECK(StubCaptureFree(hCapture, 1) == 1);
+    }
+
+    unsigned long long uTime = PpboxGetMicroseconds() - uStart;
+    pStream->Release();
+    pSink->Release();
+    return uTime;
+}
+
+// A handle of a shut down sink goes back with its last sample, and the
+// next session takes it instead of connecting again.
+static void TestCapturePoolSessions()
+{
+    const unsigned long cSessions = 1000;
+    StubCaptureSetConnectDelay(100);
+
+    PpboxCapturePool pooled;
+    pooled.Configure(CAPTURE_POOL_DEFAULT_SIZE, 60000);
+    long cCreated = StubCaptureCreateCount();
+    unsigned long long uPooled = RunPoolSessions(pooled, cSessions);
+    long cPooledCreates = StubCaptureCreateCount() - cCreated;
+    CHECK(cPooledCreates == 1);
+    CHECK(pooled.GetIdleCount() == 1);
+    pooled.Trim();
+
+    PpboxCapturePool unpooled;
+    unpooled.Configure(0, 0);
+    cCreated = StubCaptureCreateCount();
+    unsigned long long uUnpooled = RunPoolSessions(unpooled, cSessions);
+    long cUnpooledCreates = StubCaptureCreateCount() - cCreated;
+    CHECK(cUnpooledCreates == (long)cSessions);
+    CHECK(unpooled.GetIdleCount() == 0);
+
+    StubCaptureSetConnectDelay(0);
+    printf("  %lu sessions, 100 us connect: pooled %ld creates %.1f ms, unpooled %ld creates %.1f ms\n", 
+        cSessions, cPooledCreates, uPooled / 1000.0, cUnpooledCreates, uUnpooled / 1000.0);
+}
+
+const unsigned long STARTUP_DESTS = 2;
+const unsigned long STARTUP_CONNECT_US = 20000;     // To connect one destination.
+
+// StartupHost: A sink coming up with STARTUP_DESTS destinations. They
+// are connected on the activation thread, or on a worker while samples
+// wait in a startup buffer, as PpboxMediaSink::OnCaptureInit does.
+struct StartupHost
+{
+    StubDestination *   dests[STARTUP_DESTS];
+    std::atomic<bool>   fReady;
+
+    StartupHost() : fReady(false) {}
+
+    static void Connect(void * pContext)
+    {
+        StartupHost * pHost = (StartupHost *)pContext;
+        for (unsigned long i = 0; i < STARTUP_DESTS; ++i)
+        {
+            pHost->dests[i] = new StubDestination("startup");
+            pHost->dests[i]->Get()->fFreeOnPut = true;
+        }
+        pHost->fReady = true;
+    }
+};
+
+// Activation to the first sample the sink accepts and to the first one a
+// destination gets, in microseconds.
+static void MeasureStartup(bool fAsync, unsigned long long * puAccepted, unsigned long long * puOut)
+{
+    PpboxWorkStealingExecutor * pExecutor = new PpboxWorkStealingExecutor(1);
+    StartupHost host;
+    unsigned long long uStart = PpboxGetMicroseconds();
+
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    if (!fAsync || !pExecutor->Submit(StartupHost::Connect, &host))
+    {
+        StartupHost::Connect(&host);
+    }
+
+    // The first sample comes as soon as the stream exists.
+    unsigned char payload[1024] = {0};
+    JUST_Sample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.flags = JUST_SampleFlag::sync;
+    CHECK(CreateSampleFromBuffer(sample, payload, sizeof(payload), pStream, NULL));
+    pStream->OnSampleQueued(sizeof(payload));
+    std::vector<JUST_Sample> startup;
+    if (host.fReady)
+    {
+        StubDeliver(sample, host.dests, STARTUP_DESTS);
+    }
+    else
+    {
+        startup.push_back(sample);
+    }
+    *puAccepted = PpboxGetMicroseconds() - uStart;
+
+    while (!host.fReady)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    for (size_t i = 0; i < startup.size(); ++i)
+    {
+        StubDeliver(startup[i], host.dests, STARTUP_DESTS);
+    }
+    *puOut = host.dests[0]->Get()->times.front() - uStart;
+    CHECK(pStream->m_cInFlight == 0);
+
+    for (unsigned long i = 0; i < STARTUP_DESTS; ++i)
+    {
+        delete host.dests[i];
+    }
+    pStream->Release();
+    pSink->Release();
+    delete pExecutor;
+}
+
+// Connecting on the activation thread holds up the first sample for every
+// destination; connecting on a worker takes it at once, and it goes out
+// when they are ready, no later than before.
+static void TestStartupLatency()
+{
+    StubCaptureSetConnectDelay(STARTUP_CONNECT_US);
+    unsigned long long uSyncAccepted = 0;
+    unsigned long long uSyncOut = 0;
+    unsigned long long uAsyncAccepted = 0;
+    unsigned long long uAsyncOut = 0;
+    MeasureStartup(false, &uSyncAccepted, &uSyncOut);
+    MeasureStartup(true, &uAsyncAccepted, &uAsyncOut);
+    StubCaptureSetConnectDelay(0);
+
+    CHECK(uSyncAccepted >= STARTUP_DESTS * STARTUP_CONNECT_US);
+    CHECK(uAsyncAccepted < STARTUP_CONNECT_US);
+    CHECK(uAsyncOut >= STARTUP_DESTS * STARTUP_CONNECT_US);
+    printf("  activation to first sample, %lu destinations at %lu ms: "
+        "synchronous accepted %.1f ms, out %.1f ms; asynchronous accepted %.2f ms, out %.1f ms\n",
+        STARTUP_DESTS, STARTUP_CONNECT_US / 1000, uSyncAccepted / 1000.0, uSyncOut / 1000.0, 
+        uAsyncAccepted / 1000.0, uAsyncOut / 1000.0);
+}
+
+// RestartHost: A sink with a video and an audio stream and one
+// destination, set up from nothing as when the app re-creates it.
+struct RestartHost
+{
+    PpboxCoreSink *         pSink;
+    PpboxCoreStream *       streams[2];
+    PpboxSyntheticStream    synthetic[2];
+    StubDestination *       pDest;
+
+    RestartHost() : pSink(new PpboxCoreSink)
+    {
+        PpboxSyntheticConfig config;
+        GetSyntheticVideoDefaults(config);
+        config.gop_size = 30;
+        CHECK(synthetic[0].Initialize(config));
+        GetSyntheticAudioDefaults(config);
+        CHECK(synthetic[1].Initialize(config));
+
+        pDest = new StubDestination("restart");
+        pDest->Get()->fFreeOnPut = true;
+        for (unsigned long i = 0; i < 2; ++i)
+        {
+            PpboxCoreMediaType type;
+            synthetic[i].GetMediaType(type);
+            PpboxStreamFormat * pFormat = CreateStreamFormat(type);
+            CHECK(pFormat != NULL);
+            streams[i] = new PpboxCoreStream(pSink, i);
+            streams[i]->m_fVideo = i == 0;
+            streams[i]->SetFormat(pFormat, false);
+            if (pFormat)
+            {
+                JUST_CaptureSetStream(pDest->pDest->hCapture, i, &pFormat->info);
+            }
+        }
+    }
+
+    ~RestartHost()
+    {
+        delete pDest;
+        for (unsigned long i = 0; i < 2; ++i)
+        {
+            streams[i]->Release();
+        }
+        pSink->Release();
+    }
+
+    // Puts the next video sample.
+    void Put()
+    {
+        PpboxMemorySample * pHost = NULL;
+        JUST_Sample sample;
+        CHECK(synthetic[0].NextSample(&pHost));
+        CHECK(CreateSample(sample, &MemorySampleOps, pHost, streams[0], false));
+        streams[0]->OnSampleQueued(pHost->info.size);
+        sample.itrack = 0;
+        StubDeliver(sample, &pDest, 1);
+        MemorySampleOps.Release(pHost);
+    }
+};
+
+// Start to first sample out after a stop: a warm restart opens a new
+// segment on the sink as it is, against re-creating the sink, its
+// streams and its destination, which connects again.
+static void TestWarmRestart()
+{
+    StubCaptureSetConnectDelay(STARTUP_CONNECT_US);
+    unsigned long long uStart = PpboxGetMicroseconds();
+    RestartHost * pHost = new RestartHost;
+    pHost->Put();
+    unsigned long long uCold = pHost->pDest->Get()->times.back() - uStart;
+    StubCaptureSetConnectDelay(0);
+
+    // Two GOPs, a stop, then the start on the next keyframe.
+    for (unsigned long i = 1; i < 60; ++i)
+    {
+        pHost->Put();
+    }
+    StubCapture * pCapture = pHost->pDest->Get();
+    unsigned long cSetStream = pCapture->cSetStream;
+    uStart = PpboxGetMicroseconds();
+    pHost->pSink->BeginSegment(0, true);
+    for (unsigned long i = 0; i < 2; ++i)
+    {
+        pHost->streams[i]->m_fSegmentStart = true;
+    }
+    pHost->Put();
+    unsigned long long uWarm = pCapture->times.back() - uStart;
+
+    // The new segment starts at 0, with its format given again.
+    JUST_Sample const & first = pCapture->log.back();
+    CHECK(first.decode_time == 0);
+    CHECK((first.flags & JUST_SampleFlag::sync) != 0);
+    CHECK((first.flags & JUST_SampleFlag::discontinuity) != 0);
+    CHECK(pCapture->cSetStream == cSetStream + 1);
+    CHECK(uWarm < uCold);
+    delete pHost;
+
+    printf("  start to first sample: warm restart %.1f us, re-created with a %lu ms connect %.1f ms\n",
+        (double)uWarm, STARTUP_CONNECT_US / 1000, uCold / 1000.0);
+}
+
+static PpboxCoreMediaType MakeType(PpboxCoreCodec codec, bool fVideo)
+{
+    PpboxCoreMediaType type;
+    memset(&type, 0, sizeof(type));
+    type.codec = codec;
+    type.fVideo = fVideo;
+    type.fAudio = !fVideo;
+    type.width = 1280;
+    type.height = 720;
+    type.frame_rate_num = 30;
+    type.frame_rate_den = 1;
+    type.bits_per_sample = 16;
+    type.channel_count = 2;
+    type.sample_rate = 48000;
+    return type;
+}
+
+// Every codec maps to its backend sub type and format type, blobs are
+// carried over whole, and what does not fit is refused.
+static void TestCodecConversion()
+{
+    struct
+    {
+        PpboxCoreCodec  codec;
+        bool            fVideo;
+        PP_uint         sub_type;
+        PP_uint         format_type;
+    } const expected[] = 
+    {
+        { PpboxCodec_H264, true,  JUST_VideoSubType::AVC1, JUST_FormatType::video_avc_byte_stream },
+        { PpboxCodec_WMV3, true,  JUST_VideoSubType::WMV3, JUST_FormatType::none },
+        { PpboxCodec_AAC,  false, JUST_AudioSubType::MP4A, JUST_FormatType::audio_raw },
+        { PpboxCodec_MP3,  false, JUST_AudioSubType::MP3,  JUST_FormatType::audio_raw },
+        { PpboxCodec_WMA2, false, JUST_AudioSubType::WMA2, JUST_FormatType::none },
+#ifdef PPBOX_JUST_HEVC
+        { PpboxCodec_HEVC, true,  JUST_VideoSubType::HVC1, JUST_FormatType::video_hevc_byte_stream },
+#endif
+#ifdef PPBOX_JUST_VP9
+        { PpboxCodec_VP9,  true,  JUST_VideoSubType::VP09, JUST_FormatType::none },
+#endif
+#ifdef PPBOX_JUST_OPUS
+        { PpboxCodec_Opus, false, JUST_AudioSubType::OPUS, JUST_FormatType::audio_raw },
+#endif
+    };
+
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i)
+    {
+        PpboxCoreMediaType type = MakeType(expected[i].codec, expected[i].fVideo);
+        PpboxStreamFormat * pFormat = CreateStreamFormat(type);
+        CHECK(pFormat != NULL);
+        if (pFormat)
+        {
+            CHECK(pFormat->info.type == (expected[i].fVideo ? JUST_StreamType::VIDE : JUST_StreamType::AUDI));
+            CHECK(pFormat->info.sub_type == expected[i].sub_type);
+            CHECK(pFormat->info.format_type == expected[i].format_type);
+            pFormat->Release();
+        }
+
+        // A video codec on an audio stream, or the other way round.
+        type = MakeType(expected[i].codec, !expected[i].fVideo);
+        CHECK(CreateStreamFormat(type) == NULL);
+    }
+
+    // User data as is, up to MAX_FORMAT_BLOB bytes.
+    PpboxCoreMediaType type = MakeType(PpboxCodec_WMV3, true);
+    for (unsigned long i = 0; i < MAX_FORMAT_BLOB; ++i)
+    {
+        type.userData[i] = (unsigned char)i;
+    }
+    type.cbUserData = MAX_FORMAT_BLOB;
+    PpboxStreamFormat * pFormat = CreateStreamFormat(type);
+    CHECK(pFormat != NULL);
+    if (pFormat)
+    {
+        CHECK(pFormat->info.format_size == MAX_FORMAT_BLOB);
+        CHECK(memcmp(pFormat->info.format_buffer, type.userData, MAX_FORMAT_BLOB) == 0);
+        pFormat->Release();
+    }
+    type.cbUserData = MAX_FORMAT_BLOB + 1;
+    CHECK(CreateStreamFormat(type) == NULL);
+
+    // The sequence header stands in for the user data.
+    type = MakeType(PpboxCodec_H264, true);
+    unsigned char const sps[] = { 0, 0, 0, 1, 0x67, 0x64, 0x00, 0x1F };
+    type.cbUserData = 4;
+    memcpy(type.sequenceHeader, sps, sizeof(sps));
+    type.cbSequenceHeader = sizeof(sps);
+    pFormat = CreateStreamFormat(type);
+    CHECK(pFormat != NULL);
+    if (pFormat)
+    {
+        CHECK(pFormat->info.format_size == sizeof(sps));
+        CHECK(memcmp(pFormat->info.format_buffer, sps, sizeof(sps)) == 0);
+        pFormat->Release();
+    }
+    type.cbSequenceHeader = MAX_FORMAT_BLOB + 1;
+    CHECK(CreateStreamFormat(type) == NULL);
+
+    // AAC is given its AudioSpecificConfig: AAC LC, 48 kHz, stereo.
+    type = MakeType(PpboxCodec_AAC, false);
+    pFormat = CreateStreamFormat(type);
+    CHECK(pFormat != NULL);
+    if (pFormat)
+    {
+        CHECK(pFormat->info.format_size == 2);
+        CHECK(pFormat->info.format_buffer[0] == 0x11 && pFormat->info.format_buffer[1] == 0x90);
+        pFormat->Release();
+    }
+
+    // 7.1 is channel configuration 7; 7 channels have none.
+    type.channel_count = 8;
+    pFormat = CreateStreamFormat(type);
+    CHECK(pFormat != NULL);
+    if (pFormat)
+    {
+        CHECK(pFormat->info.format_buffer[1] == 0xB8);
+        pFormat->Release();
+    }
+    type.channel_count = 7;
+    CHECK(CreateStreamFormat(type) == NULL);
+}
+
+// Appends an ADTS frame, without CRC, around cbPayload bytes of fill.
+static void AppendAdtsFrame(std::vector<unsigned char> & data, unsigned long cbPayload, unsigned char fill)
+{
+    unsigned long cbFrame = 7 + cbPayload;
+    unsigned char const header[7] = 
+    {
+        0xFF, 0xF1, 0x4C, (unsigned char)(0x80 | (cbFrame >> 11)),
+        (unsigned char)(cbFrame >> 3), (unsigned char)((cbFrame << 5) | 0x1F), 0xFC,
+    };
+    data.insert(data.end(), header, header + 7);
+    data.insert(data.end(), cbPayload, fill);
+}
+
+// ADTS headers are gone from what the backend reads. A zero-copy sample
+// is stripped in the host's buffer, a copied-out one in its copy.
+static void TestAdtsStrip(bool fCopyOut)
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    pStream->m_fStripAdts = true;
+    StubDestination dest("dest");
+    StubDestination * pDest = &dest;
+
+    std::vector<unsigned char> data;
+    AppendAdtsFrame(data, 100, 0xA1);
+    AppendAdtsFrame(data, 50, 0xA2);
+    std::vector<unsigned char> const original = data;
+
+    PpboxMemorySample * pHost = new PpboxMemorySample;
+    memset(pHost, 0, sizeof(*pHost));
+    pHost->cRef = 1;
+    pHost->info.size = (PP_uint)data.size();
+    pHost->info.flags = JUST_SampleFlag::sync;
+    pHost->cBuffers = 1;
+    pHost->buffers[0] = &data[0];
+    pHost->lengths[0] = (unsigned long)data.size();
+
+    JUST_Sample sample;
+    CHECK(CreateSample(sample, &MemorySampleOps, pHost, pStream, fCopyOut));
+    pStream->OnSampleQueued((unsigned long)data.size());
+    CHECK(sample.size == 150);
+    CHECK((((PpboxSampleContext *)sample.context)->pCopy != NULL) == fCopyOut);
+    CHECK(fCopyOut ? data == original : (data[0] == 0xA1 && data[149] == 0xA2));
+
+    StubDeliver(sample, &pDest, 1);
+    CHECK(StubCaptureFree(dest.pDest->hCapture, 1) == 1);
+    std::vector<unsigned char> const & payload = dest.Get()->lastPayload;
+    CHECK(payload.size() == 150);
+    if (payload.size() == 150)
+    {
+        CHECK(payload[0] == 0xA1 && payload[99] == 0xA1);
+        CHECK(payload[100] == 0xA2 && payload[149] == 0xA2);
+    }
+    CHECK(pStream->m_cbInFlight == 0);
+
+    MemorySampleOps.Release(pHost);
+    pStream->Release();
+    pSink->Release();
+}
+
+static void TestAdtsStripZeroCopy()
+{
+    TestAdtsStrip(false);
+}
+
+static void TestAdtsStripCopyOut()
+{
+    TestAdtsStrip(true);
+}
+
+// Samples of ten 400-byte ADTS frames, created and freed as the sink
+// does; returns MB/s of ADTS in.
+static double MeasureAdtsThroughput(bool fCopyOut, unsigned long cSamples)
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    pStream->m_fStripAdts = true;
+    StubDestination dest("dest");
+    StubDestination * pDest = &dest;
+    dest.Get()->fFreeOnPut = true;
+    dest.Get()->fLog = false;
+
+    std::vector<unsigned char> frames;
+    for (int i = 0; i < 10; ++i)
+    {
+        AppendAdtsFrame(frames, 400, (unsigned char)i);
+    }
+    std::vector<unsigned char> data(frames.size());
+
+    PpboxMemorySample host;
+    memset(&host, 0, sizeof(host));
+    host.cRef = 1;
+    host.info.size = (PP_uint)data.size();
+    host.cBuffers = 1;
+    host.buffers[0] = &data[0];
+    host.lengths[0] = (unsigned long)data.size();
+
+    unsigned long long uStart = PpboxGetMicroseconds();
+    for (unsigned long i = 0; i < cSamples; ++i)
+    {
+        // The encoder writes each sample anew.
+        memcpy(&data[0], &frames[0], frames.size());
+        JUST_Sample sample;
+        CHECK(CreateSample(sample, &MemorySampleOps, &host, pStream, fCopyOut));
+        pStream->OnSampleQueued((unsigned long)data.size());
+        StubDeliver(sample, &pDest, 1);
+    }
+    unsigned long long uTime = PpboxGetMicroseconds() - uStart;
+
+    CHECK(host.cRef == 1);
+    pStream->Release();
+    pSink->Release();
+    return (double)data.size() * cSamples / (uTime ? uTime : 1);
+}
+
+static void TestAdtsThroughput()
+{
+    const unsigned long cSamples = 200000;
+    double dInPlace = MeasureAdtsThroughput(false, cSamples);
+    double dCopyOut = MeasureAdtsThroughput(true, cSamples);
+    printf("  ADTS strip, %lu samples of 10 frames: in place %.0f MB/s, copied out %.0f MB/s\n", 
+        cSamples, dInPlace, dCopyOut);
+}
+
+static bool CheckPreferred(bool fVideo, PpboxCoreCodec codec, unsigned long uProfile, 
+    PpboxPreferredCodec const * pExpected, unsigned long cExpected)
+{
+    PpboxPreferredCodec codecs[MAX_PREFERRED_CODECS];
+    unsigned long cCodecs = GetPreferredCodecs(fVideo, codec, uProfile, codecs, MAX_PREFERRED_CODECS);
+    if (cCodecs != cExpected)
+    {
+        return false;
+    }
+    for (unsigned long i = 0; i < cCodecs; ++i)
+    {
+        if (codecs[i].codec != pExpected[i].codec || codecs[i].uProfile != pExpected[i].uProfile)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The configured codec and profile first, then the rest of its kind in
+// table order. WMV3 and WMA only as configured, they need their user
+// data; audio is not offered for video or the other way round.
+static void TestPreferredCodecs()
+{
+    PpboxPreferredCodec const high[] = 
+    {
+        { PpboxCodec_H264, 100 }, { PpboxCodec_H264, 77 }, { PpboxCodec_H264, 66 },
+        { PpboxCodec_HEVC, 0 }, { PpboxCodec_VP9, 0 },
+    };
+    CHECK(CheckPreferred(true, PpboxCodec_H264, 100, high, 5));
+
+    PpboxPreferredCodec const main[] = 
+    {
+        { PpboxCodec_H264, 77 }, { PpboxCodec_H264, 100 }, { PpboxCodec_H264, 66 },
+        { PpboxCodec_HEVC, 0 }, { PpboxCodec_VP9, 0 },
+    };
+    CHECK(CheckPreferred(true, PpboxCodec_H264, 77, main, 5));
+
+    PpboxPreferredCodec const wmv3[] = 
+    {
+        { PpboxCodec_WMV3, 0 }, { PpboxCodec_H264, 100 }, { PpboxCodec_H264, 77 }, { PpboxCodec_H264, 66 },
+        { PpboxCodec_HEVC, 0 }, { PpboxCodec_VP9, 0 },
+    };
+    CHECK(CheckPreferred(true, PpboxCodec_WMV3, 0, wmv3, 6));
+
+    PpboxPreferredCodec const hevc[] = 
+    {
+        { PpboxCodec_HEVC, 0 }, { PpboxCodec_H264, 100 }, { PpboxCodec_H264, 77 }, { PpboxCodec_H264, 66 },
+        { PpboxCodec_VP9, 0 },
+    };
+    CHECK(CheckPreferred(true, PpboxCodec_HEVC, 0, hevc, 5));
+
+    PpboxPreferredCodec const aac[] = 
+    {
+        { PpboxCodec_AAC, 0x29 }, { PpboxCodec_AAC, 0x2C }, { PpboxCodec_MP3, 0 }, { PpboxCodec_Opus, 0 },
+    };
+    CHECK(CheckPreferred(false, PpboxCodec_AAC, 0x29, aac, 4));
+
+    // No profile set: both AAC profiles are offered after it.
+    PpboxPreferredCodec const aacAny[] = 
+    {
+        { PpboxCodec_AAC, 0 }, { PpboxCodec_AAC, 0x29 }, { PpboxCodec_AAC, 0x2C }, 
+        { PpboxCodec_MP3, 0 }, { PpboxCodec_Opus, 0 },
+    };
+    CHECK(CheckPreferred(false, PpboxCodec_AAC, 0, aacAny, 5));
+
+    PpboxPreferredCodec const wma[] = 
+    {
+        { PpboxCodec_WMA2, 0 }, { PpboxCodec_AAC, 0x29 }, { PpboxCodec_AAC, 0x2C }, 
+        { PpboxCodec_MP3, 0 }, { PpboxCodec_Opus, 0 },
+    };
+    CHECK(CheckPreferred(false, PpboxCodec_WMA2, 0, wma, 5));
+
+    // Every entry converts to the backend.
+    PpboxPreferredCodec codecs[MAX_PREFERRED_CODECS];
+    for (int fVideo = 0; fVideo <= 1; ++fVideo)
+    {
+        unsigned long cCodecs = GetPreferredCodecs(fVideo != 0, PpboxCodec_Unknown, 0, codecs, MAX_PREFERRED_CODECS);
+        CHECK(cCodecs == (fVideo ? 6UL : 5UL));
+        for (unsigned long i = 1; i < cCodecs; ++i)
+        {
+            PpboxStreamFormat * pFormat = CreateStreamFormat(MakeType(codecs[i].codec, fVideo != 0));
+            CHECK(pFormat != NULL);
+            if (pFormat)
+            {
+                pFormat->Release();
+            }
+        }
+    }
+
+    // Cut short at cMax, the configured codec first.
+    CHECK(GetPreferredCodecs(true, PpboxCodec_H264, 100, codecs, 2) == 2);
+    CHECK(codecs[0].codec == PpboxCodec_H264 && codecs[0].uProfile == 100);
+}
+
+// The attributes GetMediaTypeFingerprint hashes, from the core's view.
+static unsigned long long GetFingerprint(PpboxCoreMediaType const & type)
+{
+    unsigned long long uHash = FINGERPRINT_BASIS;
+    HashFingerprint(uHash, &type.fVideo, sizeof(type.fVideo));
+    HashFingerprint(uHash, &type.codec, sizeof(type.codec));
+    HashFingerprint(uHash, &type.width, sizeof(type.width));
+    HashFingerprint(uHash, &type.height, sizeof(type.height));
+    HashFingerprint(uHash, &type.frame_rate_num, sizeof(type.frame_rate_num));
+    HashFingerprint(uHash, &type.frame_rate_den, sizeof(type.frame_rate_den));
+    HashFingerprint(uHash, &type.channel_count, sizeof(type.channel_count));
+    HashFingerprint(uHash, &type.sample_rate, sizeof(type.sample_rate));
+    HashFingerprint(uHash, &type.bits_per_sample, sizeof(type.bits_per_sample));
+    return uHash;
+}
+
+// The check behind a cache miss on an H.264 stream: the type is traced
+// in full, then the backend has to take it as a video codec.
+static long CheckCandidate(PpboxCoreMediaType const & type)
+{
+    char szTrace[256];
+    snprintf(szTrace, sizeof(szTrace), "video %d codec %d %lux%lu %lu/%lu audio %lu ch %lu Hz %lu bits\n",
+        type.fVideo, type.codec, type.width, type.height, type.frame_rate_num, type.frame_rate_den,
+        type.channel_count, type.sample_rate, type.bits_per_sample);
+    PpboxStreamFormat * pFormat = type.fVideo ? CreateStreamFormat(type) : NULL;
+    if (pFormat == NULL || szTrace[0] == 0)
+    {
+        return -1;
+    }
+    pFormat->Release();
+    return type.codec == PpboxCodec_WMV3 ? -1 : 0;
+}
+
+// Topology builds over 50 candidate types: 48 video (H.264, HEVC, VP9
+// and WMV3 at four sizes and three rates) and 2 audio. Each build offers
+// every candidate on each of four passes, then sets the chosen one, which
+// asks twice more. Without the cache every question is a check.
+static void TestNegotiationCache()
+{
+    PpboxCoreCodec const codecs[] = { PpboxCodec_H264, PpboxCodec_HEVC, PpboxCodec_VP9, PpboxCodec_WMV3 };
+    unsigned long const sizes[][2] = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+    unsigned long const rates[] = { 25, 30, 60 };
+    std::vector<PpboxCoreMediaType> candidates;
+    for (size_t c = 0; c < 4; ++c)
+    {
+        for (size_t s = 0; s < 4; ++s)
+        {
+            for (size_t r = 0; r < 3; ++r)
+            {
+                PpboxCoreMediaType type = MakeType(codecs[c], true);
+                type.width = sizes[s][0];
+                type.height = sizes[s][1];
+                type.frame_rate_num = rates[r];
+                candidates.push_back(type);
+            }
+        }
+    }
+    candidates.push_back(MakeType(PpboxCodec_AAC, false));
+    candidates.push_back(MakeType(PpboxCodec_MP3, false));
+    CHECK(candidates.size() == 50);
+
+    const unsigned long BUILDS = 200;
+    const unsigned long PASSES = 4;
+    unsigned long cAccepted[2] = { 0, 0 };
+    unsigned long long uTime[2] = { 0, 0 };
+    PpboxNegotiationCache cache;
+
+    for (int fCached = 0; fCached <= 1; ++fCached)
+    {
+        unsigned long long uStart = PpboxGetMicroseconds();
+        for (unsigned long b = 0; b < BUILDS; ++b)
+        {
+            // A new stream per build: its cache starts empty.
+            cache.Clear();
+            for (unsigned long i = 0; i < PASSES * candidates.size() + 2; ++i)
+            {
+                PpboxCoreMediaType const & type = candidates[i < PASSES * candidates.size() ? i % candidates.size() : 0];
+                long lResult = 0;
+                if (!fCached)
+                {
+                    lResult = CheckCandidate(type);
+                }
+                else
+                {
+                    unsigned long long uFingerprint = GetFingerprint(type);
+                    if (!cache.Lookup(uFingerprint, &lResult))
+                    {
+                        lResult = CheckCandidate(type);
+                        cache.Add(uFingerprint, lResult);
+                    }
+                }
+                cAccepted[fCached] += lResult == 0;
+            }
+        }
+        uTime[fCached] = PpboxGetMicroseconds() - uStart;
+    }
+
+    // Same answers; the first pass of each build misses, the rest hit.
+    CHECK(cAccepted[0] == cAccepted[1]);
+    CHECK(cache.GetMisses() == BUILDS * candidates.size());
+    CHECK(cache.GetHits() == BUILDS * ((PASSES - 1) * candidates.size() + 2));
+    printf("  topology build, %lu candidates: uncached %.1f us, cached %.1f us (%lu hits, %lu misses)\n",
+        (unsigned long)candidates.size(), (double)uTime[0] / BUILDS, (double)uTime[1] / BUILDS,
+        cache.GetHits(), cache.GetMisses());
+}
+
+static void TestSamplePath(bool fCopyOut)
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    StubDestination dest("dest");
+    StubDestination * pDest = &dest;
+
+    PpboxSyntheticConfig config;
+    GetSyntheticVideoDefaults(config);
+    config.buffer_count = 3;
+    PpboxSyntheticStream synthetic;
+    CHECK(synthetic.Initialize(config));
+
+    PpboxMemorySample * pHost = NULL;
+    CHECK(synthetic.NextSample(&pHost));
+    unsigned long cbSample = pHost->info.size;
+
+    JUST_Sample sample;
+    CHECK(CreateSample(sample, &MemorySampleOps, pHost, pStream, fCopyOut));
+    pStream->OnSampleQueued(cbSample);
+
+    // Zero-copy keeps the host sample until the backend frees it.
+    CHECK(pHost->cRef == (fCopyOut ? 1 : 2));
+    CHECK((sample.flags & JUST_SampleFlag::sync) != 0);
+
+    StubDeliver(sample, &pDest, 1);
+    CHECK(dest.Get()->held.size() == 1);
+    CHECK(dest.pDest->cInFlight == 1);
+    CHECK(pStream->m_cInFlight == 1);
+    CHECK(pSink->m_cInFlight == 1);
+
+    CHECK(StubCaptureFree(dest.pDest->hCapture, 1) == 1);
+    CHECK(dest.Get()->cbFetched == cbSample);
+    CHECK(dest.Get()->lastPayload.size() == cbSample);
+    CHECK(dest.pDest->cInFlight == 0);
+    CHECK(pStream->m_cInFlight == 0);
+    CHECK(pStream->m_cbInFlight == 0);
+    CHECK(pSink->m_cbHeld == 0);
+    CHECK(pHost->cRef == 1);
+
+    MemorySampleOps.Release(pHost);
+    pStream->Release();
+    pSink->Release();
+}
+
+static void TestZeroCopy()
+{
+    TestSamplePath(false);
+}
+
+static void TestCopyOut()
+{
+    TestSamplePath(true);
+}
+
+static void PushQueued(PpboxPriorityQueue & queue, unsigned long itrack, unsigned long long uTime, bool fSync, PpboxPriority priority)
+{
+    JUST_Sample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.itrack = itrack;
+    sample.decode_time = uTime;
+    sample.flags = fSync ? JUST_SampleFlag::sync : 0;
+    queue.Push(sample, priority);
+}
+
+// Without priorities, samples leave in arrival order, however long a
+// stream waited behind older ones.
+static void TestPriorityQueueFifo()
+{
+    PpboxPriorityQueue queue;
+    unsigned long long uTime = 0;
+    for (unsigned long i = 0; i < 40; ++i)
+    {
+        PushQueued(queue, i == 20 ? 0 : 1, uTime++, i == 0, i == 20 ? Priority_Audio : Priority_Video);
+    }
+
+    JUST_Sample sample;
+    for (unsigned long long i = 0; i < 40; ++i)
+    {
+        CHECK(queue.Pop(sample));
+        CHECK(sample.decode_time == i);
+    }
+    CHECK(queue.IsEmpty());
+}
+
+// With priorities, audio goes first, but video passed over
+// PRIORITY_MAX_BYPASS times goes next.
+static void TestPriorityQueueRanks()
+{
+    PpboxPriorityQueue queue;
+    queue.EnablePriority(true);
+    PushQueued(queue, 1, 0, true, Priority_Video);
+    for (unsigned long i = 0; i < 40; ++i)
+    {
+        PushQueued(queue, 0, 1 + i, true, Priority_Audio);
+    }
+
+    JUST_Sample sample;
+    for (unsigned long i = 0; i < PRIORITY_MAX_BYPASS; ++i)
+    {
+        CHECK(queue.Pop(sample));
+        CHECK(sample.itrack == 0);
+    }
+    CHECK(queue.Pop(sample));
+    CHECK(sample.itrack == 1);
+    CHECK(queue.Pop(sample));
+    CHECK(sample.itrack == 0 && sample.decode_time == 1 + PRIORITY_MAX_BYPASS);
+}
+
+const unsigned long JITTER_SPEED = 2;       // Media seconds per wall second.
+
+// Two media seconds of 1080p30 at 8 Mbps and audio, produced on time at
+// JITTER_SPEED through a delivery queue to a backend that writes 1.5
+// times the media rate: each keyframe holds up what comes after it.
+// Fills uLatency with the time from production to put of each audio
+// frame, in microseconds, sorted; returns the jitter as RFC 3550 has it,
+// the mean change in latency from one frame to the next.
+static double MeasureAudioJitter(bool fPriority, std::vector<unsigned long long> & uLatency)
+{
+    PpboxWorkStealingExecutor * pExecutor = new PpboxWorkStealingExecutor(1);
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * streams[2];
+    PpboxSyntheticStream synthetic[2];
+    PpboxSyntheticConfig config;
+    GetSyntheticVideoDefaults(config);
+    config.width = 1920;
+    config.height = 1080;
+    config.frame_rate_num = 30;
+    config.frame_rate_den = 1;
+    config.gop_size = 30;
+    config.bitrate = 8000000;
+    CHECK(synthetic[0].Initialize(config));
+    GetSyntheticAudioDefaults(config);
+    CHECK(synthetic[1].Initialize(config));
+    for (unsigned long i = 0; i < 2; ++i)
+    {
+        streams[i] = new PpboxCoreStream(pSink, i);
+        streams[i]->m_fVideo = i == 0;
+        streams[i]->m_Priority = i == 0 ? Priority_Video : Priority_Audio;
+    }
+
+    StubDestination * pDest = new StubDestination("jitter");
+    StubCapture * pCapture = pDest->Get();
+    pCapture->fFreeOnPut = true;
+    pCapture->cbPerSecond = (8000000 + 384000) / 8 * 11 / 10 * JITTER_SPEED;
+    pDest->pDest->pQueue = new PpboxDeliveryQueue(pDest->pDest->hCapture, pExecutor, fPriority);
+    pDest->pDest->pExecutor = pExecutor;
+
+    unsigned long long uStart = PpboxGetMicroseconds();
+    for (;;)
+    {
+        unsigned long iStream = synthetic[1].GetTime() < synthetic[0].GetTime() ? 1 : 0;
+        unsigned long long uDue = uStart + synthetic[iStream].GetTime() / 10 / JITTER_SPEED;
+        if (synthetic[iStream].GetTime() >= 20000000)
+        {
+            break;
+        }
+        unsigned long long uNow = PpboxGetMicroseconds();
+        if (uDue > uNow)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(uDue - uNow));
+        }
+
+        PpboxMemorySample * pHost = NULL;
+        JUST_Sample sample;
+        CHECK(synthetic[iStream].NextSample(&pHost));
+        CHECK(CreateSample(sample, &MemorySampleOps, pHost, streams[iStream], false));
+        streams[iStream]->OnSampleQueued(pHost->info.size);
+        sample.itrack = iStream;
+        ((PpboxSampleContext *)sample.context)->pExecutor = pExecutor;
+        StubDeliver(sample, &pDest, 1);
+        MemorySampleOps.Release(pHost);
+    }
+    while (pSink->m_cInFlight > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    for (size_t i = 0; i < pCapture->log.size(); ++i)
+    {
+        if (pCapture->log[i].itrack == 1)
+        {
+            uLatency.push_back(pCapture->times[i] - (uStart + pCapture->log[i].decode_time / 10 / JITTER_SPEED));
+        }
+    }
+    double dJitter = 0;
+    for (size_t i = 1; i < uLatency.size(); ++i)
+    {
+        dJitter += uLatency[i] > uLatency[i - 1] ? uLatency[i] - uLatency[i - 1] : uLatency[i - 1] - uLatency[i];
+    }
+    dJitter = uLatency.size() > 1 ? dJitter / (uLatency.size() - 1) : 0;
+    std::sort(uLatency.begin(), uLatency.end());
+
+    delete pDest;
+    for (unsigned long i = 0; i < 2; ++i)
+    {
+        streams[i]->Release();
+    }
+    pSink->Release();
+    delete pExecutor;
+    return dJitter;
+}
+
+// Audio behind keyframes, in arrival order and audio first. Either way
+// a frame that comes during a keyframe waits for that put, which bounds
+// the worst case; with priorities it waits for nothing else. That makes
+// the typical frame much earlier, but not the jitter smaller: FIFO is
+// late all the time, priorities are late only behind a keyframe.
+static void TestAudioJitter()
+{
+    std::vector<unsigned long long> fifo;
+    std::vector<unsigned long long> priority;
+    double dFifo = MeasureAudioJitter(false, fifo);
+    double dPriority = MeasureAudioJitter(true, priority);
+    CHECK(!fifo.empty() && fifo.size() == priority.size());
+    if (fifo.empty() || fifo.size() != priority.size())
+    {
+        return;
+    }
+    CHECK(priority[priority.size() / 2] < fifo[fifo.size() / 2]);
+
+    size_t i99 = fifo.size() * 99 / 100;
+    printf("  audio, %lu frames at %lux: FIFO jitter %.0f us, latency p50 %llu us, p99 %llu us\n",
+        (unsigned long)fifo.size(), JITTER_SPEED, dFifo, fifo[fifo.size() / 2], fifo[i99]);
+    printf("  audio, %lu frames at %lux: priority jitter %.0f us, latency p50 %llu us, p99 %llu us\n",
+        (unsigned long)priority.size(), JITTER_SPEED, dPriority, priority[priority.size() / 2], priority[i99]);
+}
+
+int main()
+{
+    RUN_TEST(TestStateMatrix);
+    RUN_TEST(TestStreamFormat);
+    RUN_TEST(TestCodecConversion);
+    RUN_TEST(TestPreferredCodecs);
+    RUN_TEST(TestNegotiationCache);
+    RUN_TEST(TestAdtsStripZeroCopy);
+    RUN_TEST(TestAdtsStripCopyOut);
+    RUN_TEST(TestAdtsThroughput);
+    RUN_TEST(TestZeroCopy);
+    RUN_TEST(TestCopyOut);
+    RUN_TEST(TestPriorityQueueFifo);
+    RUN_TEST(TestPriorityQueueRanks);
+    RUN_TEST(TestAudioJitter);
+    RUN_TEST(TestCapturePool);
+    RUN_TEST(TestCapturePoolSessions);
+    RUN_TEST(TestStartupLatency);
+    RUN_TEST(TestWarmRestart);
+    RUN_TEST(TestSegmentBase);
+
+    CHECK(StubCaptureLiveCount() == 0);
+    return TEST_RESULT();
+}
@@ -0,0 +1,232 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// ExecutorTest.cpp
+// PpboxWorkStealingExecutor and PpboxDeliveryQueue against the stub
+// backend.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+static bool WaitFor(std::function<bool()> fnDone)
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!fnDone())
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+        {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+static std::atomic<long> s_cRun(0);
+
+static void CountTask(void * pContext)
+{
+    ++s_cRun;
+}
+
+// Submits more tasks from a worker, as a draining queue does.
+static void FanTask(void * pContext)
+{
+    PpboxExecutor * pExecutor = (PpboxExecutor *)pContext;
+    for (int i = 0; i < 10; ++i)
+    {
+        if (!pExecutor->Submit(CountTask, NULL))
+        {
+            CountTask(NULL);
+        }
+    }
+    ++s_cRun;
+}
+
+// Every task runs, submitted from outside the pool or from a worker.
+static void TestSubmit()
+{
+    s_cRun = 0;
+    PpboxWorkStealingExecutor * pExecutor = new PpboxWorkStealingExecutor(4);
+    for (int i = 0; i < 1000; ++i)
+    {
+        CHECK(pExecutor->Submit(FanTask, pExecutor));
+    }
+    CHECK(WaitFor([]() { return s_cRun == 1000 * 11; }));
+    delete pExecutor;
+}
+
+struct StopContext
+{
+    PpboxExecutor *     pExecutor;
+    std::atomic<bool>   fStarted;
+    bool                fRefused;
+};
+
+// Runs while the pool is destroyed, until it refuses new tasks.
+static void StopTask(void * pContext)
+{
+    StopContext * pStop = (StopContext *)pContext;
+    pStop->fStarted = true;
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        if (!pStop->pExecutor->Submit(CountTask, NULL))
+        {
+            pStop->fRefused = true;
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// A pool being destroyed takes no more tasks, the caller runs them.
+static void TestSubmitAfterStop()
+{
+    StopContext stop;
+    stop.pExecutor = new PpboxWorkStealingExecutor(1);
+    stop.fStarted = false;
+    stop.fRefused = false;
+
+    CHECK(stop.pExecutor->Submit(StopTask, &stop));
+    CHECK(WaitFor([&stop]() { return (bool)stop.fStarted; }));
+    delete stop.pExecutor;
+    CHECK(stop.fRefused);
+}
+
+// Puts a sample through a queue, as PpboxMediaSink::DeliverSample does
+// with "AsyncDelivery".
+static void QueueSample(JUST_Sample & sample, StubDestination & dest, PpboxDeliveryQueue * pQueue)
+{
+    PpboxSampleContext * pContext = (PpboxSampleContext *)sample.context;
+    PpboxSampleRef & ref = pContext->refs[0];
+    ref.pContext = pContext;
+    ref.pDest = dest.pDest;
+    dest.pDest->AddRef();
+    PpboxInterlockedIncrement(&pContext->cRef);
+    PpboxInterlockedIncrement(&dest.pDest->cInFlight);
+    PpboxInterlockedIncrement(&dest.pDest->cPut);
+
+    JUST_Sample destSample = sample;
+    destSample.context = &ref;
+    pQueue->Put(destSample, Priority_Video);
+
+    if (PpboxInterlockedDecrement(&pContext->cRef) == 0)
+    {
+        ReleaseSample(pContext);
+    }
+}
+
+static void GateTask(void * pContext)
+{
+    std::atomic<bool> * pfOpen = (std::atomic<bool> *)pContext;
+    while (!*pfOpen)
+    {
+        std::this_thread::yield();
+    }
+}
+
+// Tasks still queued when the pool is destroyed run before the workers
+// exit, none is left behind with its samples.
+static void TestStopRunsQueued()
+{
+    s_cRun = 0;
+    PpboxWorkStealingExecutor * pExecutor = new PpboxWorkStealingExecutor(2);
+    std::atomic<bool> fOpen(false);
+    CHECK(pExecutor->Submit(GateTask, &fOpen));
+    CHECK(pExecutor->Submit(GateTask, &fOpen));
+    for (int i = 0; i < 100; ++i)
+    {
+        CHECK(pExecutor->Submit(CountTask, NULL));
+    }
+
+    std::thread opener([&fOpen]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        fOpen = true;
+    });
+    delete pExecutor;
+    opener.join();
+    CHECK(s_cRun == 100);
+}
+
+// Two queues on one worker take turns, a batch each, rather than the
+// newer one running dry first.
+static void TestQueuesTakeTurns()
+{
+    const unsigned long cSamples = 64;
+    PpboxWorkStealingExecutor * pExecutor = new PpboxWorkStealingExecutor(1);
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    StubDestination destA("a", 1);
+    StubDestination destB("b", 1);
+    StubDestination * dests[2] = { &destA, &destB };
+    PpboxDeliveryQueue * pQueues[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        dests[i]->Get()->fFreeOnPut = true;
+        pQueues[i] = new PpboxDeliveryQueue(dests[i]->pDest->hCapture, pExecutor, false);
+    }
+
+    // Both queues are scheduled while the worker is busy.
+    std::atomic<bool> fOpen(false);
+    CHECK(pExecutor->Submit(GateTask, &fOpen));
+    unsigned char payload[64] = {0};
+    for (unsigned long n = 0; n < cSamples; ++n)
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            JUST_Sample sample;
+            CHECK(CreateSampleFromBuffer(sample, payload, sizeof(payload), pStream, NULL));
+            pStream->OnSampleQueued(sizeof(payload));
+            QueueSample(sample, *dests[i], pQueues[i]);
+        }
+    }
+    fOpen = true;
+
+    CHECK(WaitFor([&destA, &destB, cSamples]() {
+        return destA.Get()->cbFetched == cSamples * 64 && destB.Get()->cbFetched == cSamples * 64;
+    }));
+
+    // Neither queue finished before the other started.
+    std::vector<unsigned long> const & a = destA.Get()->sequence;
+    std::vector<unsigned long> const & b = destB.Get()->sequence;
+    CHECK(a.size() == cSamples && b.size() == cSamples);
+    if (a.size() == cSamples && b.size() == cSamples)
+    {
+        CHECK(a.back() > b.front());
+        CHECK(b.back() > a.front());
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+        pQueues[i]->Release();
+    }
+    delete pExecutor;
+    CHECK(pStream->m_cInFlight == 0);
+    pStream->Release();
+    pSink->Release();
+}
+
+int main()
+{
+    RUN_TEST(TestSubmit);
+    RUN_TEST(TestSubmitAfterStop);
+    RUN_TEST(TestStopRunsQueued);
+    RUN_TEST(TestQueuesTakeTurns);
+    CHECK(StubCaptureLiveCount() == 0);
+    return TEST_RESULT();
+}
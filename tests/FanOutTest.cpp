@@ -0,0 +1,291 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// FanOutTest.cpp
+// One sample shared by several capture destinations: locked once, freed
+// with the last destination, and the cost per sample with 1, 2 and 4
+// destinations.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxSynthetic.h"
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+#include <time.h>
+
+// Memory samples with their buffer locks counted, and a buffer that
+// fails to lock on request.
+static long s_cLocks = 0;
+static unsigned long s_iFailLock = (unsigned long)-1;
+
+static bool CountingLockBuffer(void * sample, unsigned long index, unsigned char ** ppData, unsigned long * pcbData)
+{
+    if (index == s_iFailLock)
+    {
+        return false;
+    }
+    ++s_cLocks;
+    return MemorySampleOps.LockBuffer(sample, index, ppData, pcbData);
+}
+
+static void CountingUnlockBuffer(void * sample, unsigned long index)
+{
+    --s_cLocks;
+    MemorySampleOps.UnlockBuffer(sample, index);
+}
+
+static PpboxSampleOps const CountingSampleOps =
+{
+    MemorySampleOps.AddRef,
+    MemorySampleOps.Release,
+    MemorySampleOps.GetInfo,
+    MemorySampleOps.GetBufferCount,
+    CountingLockBuffer,
+    CountingUnlockBuffer,
+};
+
+struct FanOut
+{
+    PpboxCoreSink *     pSink;
+    PpboxCoreStream *   pStream;
+    PpboxSyntheticStream synthetic;
+    StubDestination *   dests[MAX_DESTINATIONS];
+    unsigned long       cDests;
+
+    FanOut(unsigned long cDests, unsigned long cBuffers) : cDests(cDests)
+    {
+        pSink = new PpboxCoreSink;
+        pStream = new PpboxCoreStream(pSink, 0);
+        for (unsigned long i = 0; i < cDests; ++i)
+        {
+            dests[i] = new StubDestination("dest");
+        }
+
+        PpboxSyntheticConfig config;
+        GetSyntheticVideoDefaults(config);
+        config.buffer_count = cBuffers;
+        CHECK(synthetic.Initialize(config));
+    }
+
+    ~FanOut()
+    {
+        for (unsigned long i = 0; i < cDests; ++i)
+        {
+            delete dests[i];
+        }
+        pStream->Release();
+        pSink->Release();
+    }
+
+    PpboxMemorySample * Put()
+    {
+        PpboxMemorySample * pHost = NULL;
+        CHECK(synthetic.NextSample(&pHost));
+        JUST_Sample sample;
+        CHECK(CreateSample(sample, &CountingSampleOps, pHost, pStream, false));
+        pStream->OnSampleQueued(pHost->info.size);
+        StubDeliver(sample, dests, cDests);
+        return pHost;
+    }
+};
+
+static void TestSharedSample()
+{
+    FanOut fanOut(4, 3);
+
+    PpboxMemorySample * pHost = fanOut.Put();
+
+    // Locked once for all four, every destination has it.
+    CHECK(s_cLocks == 3);
+    CHECK(pHost->cRef == 2);
+    for (unsigned long i = 0; i < 4; ++i)
+    {
+        CHECK(fanOut.dests[i]->Get()->held.size() == 1);
+    }
+
+    // Released with the last destination, in any order.
+    CHECK(StubCaptureFree(fanOut.dests[2]->pDest->hCapture, 1) == 1);
+    CHECK(StubCaptureFree(fanOut.dests[0]->pDest->hCapture, 1) == 1);
+    CHECK(StubCaptureFree(fanOut.dests[3]->pDest->hCapture, 1) == 1);
+    CHECK(pHost->cRef == 2);
+    CHECK(s_cLocks == 3);
+    CHECK(fanOut.pStream->m_cInFlight == 1);
+    CHECK(StubCaptureFree(fanOut.dests[1]->pDest->hCapture, 1) == 1);
+    CHECK(pHost->cRef == 1);
+    CHECK(s_cLocks == 0);
+    CHECK(fanOut.pStream->m_cInFlight == 0);
+
+    MemorySampleOps.Release(pHost);
+}
+
+static void TestSlowDestination()
+{
+    FanOut fanOut(2, 1);
+
+    // Destination 1 holds on to everything, destination 0 keeps up.
+    fanOut.dests[0]->Get()->fFreeOnPut = true;
+    for (int i = 0; i < 100; ++i)
+    {
+        MemorySampleOps.Release(fanOut.Put());
+    }
+
+    CHECK(fanOut.dests[0]->Get()->log.size() == 100);
+    CHECK(fanOut.dests[0]->Get()->held.empty());
+    CHECK(fanOut.dests[0]->pDest->cInFlight == 0);
+    CHECK(fanOut.dests[1]->pDest->cInFlight == 100);
+    CHECK(fanOut.pStream->m_cInFlight == 100);
+
+    CHECK(StubCaptureFree(fanOut.dests[1]->pDest->hCapture, 100) == 100);
+    CHECK(fanOut.pStream->m_cInFlight == 0);
+    CHECK(s_cLocks == 0);
+}
+
+// The sink lets go of a destination at Shutdown with samples still in
+// flight; the samples keep it, the backend frees them later.
+static void TestDestinationOutlivesSink()
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    PpboxSyntheticConfig config;
+    GetSyntheticVideoDefaults(config);
+    config.buffer_count = 3;
+    PpboxSyntheticStream synthetic;
+    CHECK(synthetic.Initialize(config));
+
+    JUST_CaptureConfigData captureConfig;
+    memset(&captureConfig, 0, sizeof(captureConfig));
+    captureConfig.stream_count = 1;
+    captureConfig.get_sample_buffers = GetSampleBuffers;
+    captureConfig.free_sample = FreeSample;
+    PP_handle hCapture = JUST_CaptureCreate("stub", "outlived");
+    JUST_CaptureInit(hCapture, &captureConfig);
+    PpboxCaptureDest * pDest = CreateCaptureDest(hCapture, 0);
+
+    PpboxMemorySample * hosts[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        JUST_Sample sample;
+        CHECK(synthetic.NextSample(&hosts[i]));
+        CHECK(CreateSample(sample, &MemorySampleOps, hosts[i], pStream, false));
+        pStream->OnSampleQueued(hosts[i]->info.size);
+
+        PpboxSampleContext * pContext = (PpboxSampleContext *)sample.context;
+        PpboxSampleRef & ref = pContext->refs[0];
+        ref.pContext = pContext;
+        ref.pDest = pDest;
+        pDest->AddRef();
+        PpboxInterlockedIncrement(&pContext->cRef);
+        PpboxInterlockedIncrement(&pDest->cInFlight);
+        JUST_Sample destSample = sample;
+        destSample.context = &ref;
+        PutCaptureSample(hCapture, destSample);
+        if (PpboxInterlockedDecrement(&pContext->cRef) == 0)
+        {
+            ReleaseSample(pContext);
+        }
+    }
+    CHECK(pDest->cRef == 4);
+
+    // As Shutdown, and the host objects go.
+    pDest->Release();
+    pStream->Release();
+    pSink->Release();
+    CHECK(pDest->cRef == 3);
+    CHECK(pDest->cInFlight == 3);
+
+    CHECK(StubCaptureFree(hCapture, 2) == 2);
+    CHECK(pDest->cRef == 1);
+    CHECK(pDest->cInFlight == 1);
+    CHECK(StubCaptureFree(hCapture, 1) == 1);
+    for (int i = 0; i < 3; ++i)
+    {
+        CHECK(hosts[i]->cRef == 1);
+        MemorySampleOps.Release(hosts[i]);
+    }
+    JUST_CaptureDestroy(hCapture);
+}
+
+static void TestPartialLock()
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+
+    PpboxSyntheticConfig config;
+    GetSyntheticVideoDefaults(config);
+    config.buffer_count = 4;
+    PpboxSyntheticStream synthetic;
+    CHECK(synthetic.Initialize(config));
+
+    PpboxMemorySample * pHost = NULL;
+    CHECK(synthetic.NextSample(&pHost));
+
+    // The third buffer fails, the two locked before are given back.
+    s_iFailLock = 2;
+    JUST_Sample sample;
+    CHECK(!CreateSample(sample, &CountingSampleOps, pHost, pStream, false));
+    CHECK(!CreateSample(sample, &CountingSampleOps, pHost, pStream, true));
+    s_iFailLock = (unsigned long)-1;
+    CHECK(s_cLocks == 0);
+    CHECK(pHost->cRef == 1);
+    CHECK(pStream->m_cInFlight == 0);
+
+    MemorySampleOps.Release(pHost);
+    pStream->Release();
+    pSink->Release();
+}
+
+static double GetCpuSeconds()
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void TestFanOutCost()
+{
+    const unsigned long cSamples = 20000;
+    double fPerDest[3] = { 0 };
+    unsigned long counts[3] = { 1, 2, 4 };
+
+    for (int i = 0; i < 3; ++i)
+    {
+        FanOut fanOut(counts[i], 1);
+        for (unsigned long j = 0; j < counts[i]; ++j)
+        {
+            fanOut.dests[j]->Get()->fFreeOnPut = true;
+        }
+
+        double fStart = GetCpuSeconds();
+        for (unsigned long j = 0; j < cSamples; ++j)
+        {
+            MemorySampleOps.Release(fanOut.Put());
+        }
+        double fSeconds = GetCpuSeconds() - fStart;
+        fPerDest[i] = fSeconds * 1e9 / cSamples / counts[i];
+
+        CHECK(fanOut.pStream->m_cInFlight == 0);
+        printf("  %lu destinations: %.0f ns CPU per sample, %.0f ns per destination\n",
+            counts[i], fSeconds * 1e9 / cSamples, fPerDest[i]);
+    }
+
+    // The sample is prepared once, each destination only adds its put
+    // and free; per destination, 4 must not cost more than 1 by much.
+    CHECK(fPerDest[2] < fPerDest[0] * 2);
+}
+
+int main()
+{
+    RUN_TEST(TestSharedSample);
+    RUN_TEST(TestSlowDestination);
+    RUN_TEST(TestDestinationOutlivesSink);
+    RUN_TEST(TestPartialLock);
+    RUN_TEST(TestFanOutCost);
+
+    CHECK(StubCaptureLiveCount() == 0);
+    return TEST_RESULT();
+}
@@ -0,0 +1,221 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// GopCacheTest.cpp
+// Destinations attached in the middle of a GOP, with and without the GOP
+// cache (see PpboxGopCache), and the time to their first decodable frame.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxSynthetic.h"
+#include "PpboxGopCache.h"
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+const unsigned long GOP_SIZE = 30;
+
+// GopHost: A 1080p30 video stream and an audio stream, delivered in decode
+// order as the sink does, through the cache if it has a limit.
+struct GopHost
+{
+    PpboxCoreSink *         pSink;
+    PpboxCoreStream *       streams[2];
+    PpboxSyntheticStream    synthetic[2];
+    PpboxGopCache           cache;
+    StubDestination *       dests[2];
+    unsigned long           cDests;
+
+    GopHost(unsigned long cbCache) : pSink(new PpboxCoreSink), cDests(1)
+    {
+        PpboxSyntheticConfig config;
+        GetSyntheticVideoDefaults(config);
+        config.width = 1920;
+        config.height = 1080;
+        config.frame_rate_num = 30;
+        config.frame_rate_den = 1;
+        config.gop_size = GOP_SIZE;
+        config.bitrate = 8000000;
+        CHECK(synthetic[0].Initialize(config));
+        GetSyntheticAudioDefaults(config);
+        CHECK(synthetic[1].Initialize(config));
+
+        for (unsigned long i = 0; i < 2; ++i)
+        {
+            streams[i] = new PpboxCoreStream(pSink, i);
+            streams[i]->m_fVideo = i == 0;
+            dests[i] = new StubDestination(i == 0 ? "live" : "late");
+            dests[i]->Get()->fFreeOnPut = true;
+        }
+
+        cache.SetLimit(cbCache);
+    }
+
+    ~GopHost()
+    {
+        cache.Clear();
+        for (unsigned long i = 0; i < 2; ++i)
+        {
+            delete dests[i];
+            streams[i]->Release();
+        }
+        pSink->Release();
+    }
+
+    // Puts the next sample of either stream, whichever is earlier; returns
+    // its track.
+    unsigned long Put()
+    {
+        unsigned long iStream = synthetic[1].GetTime() < synthetic[0].GetTime() ? 1 : 0;
+        PpboxMemorySample * pHost = NULL;
+        CHECK(synthetic[iStream].NextSample(&pHost));
+
+        JUST_Sample sample;
+        CHECK(CreateSample(sample, &MemorySampleOps, pHost, streams[iStream], false));
+        streams[iStream]->OnSampleQueued(pHost->info.size);
+        sample.itrack = iStream;
+
+        cache.Add(sample, iStream == 0);
+        StubDeliver(sample, dests, cDests);
+        MemorySampleOps.Release(pHost);
+        return iStream;
+    }
+
+    // Puts samples until cFrames video frames went.
+    void PutFrames(unsigned long cFrames)
+    {
+        while (cFrames > 0)
+        {
+            if (Put() == 0)
+            {
+                --cFrames;
+            }
+        }
+    }
+
+    // Makes the second destination live, as PpboxMediaSink::AddCapture.
+    void Attach()
+    {
+        cache.Replay(dests[1]->pDest, 1);
+        cDests = 2;
+    }
+};
+
+// A destination attached mid-GOP gets the cached keyframe first, then the
+// rest of the GOP and the audio along with it, in decode order. Cached
+// samples are references, counted in flight until the cache lets go.
+static void TestLateDestination()
+{
+    GopHost host(16 * 1024 * 1024);
+    host.PutFrames(10);
+
+    // Frames the first destination freed are still in flight, cached.
+    CHECK(host.streams[0]->m_cInFlight == 10);
+    CHECK(host.streams[1]->m_cInFlight > 0);
+
+    host.Attach();
+    std::vector<JUST_Sample> const & log = host.dests[1]->Get()->log;
+    CHECK(log.size() == (size_t)(host.streams[0]->m_cInFlight + host.streams[1]->m_cInFlight));
+    CHECK(!log.empty() && log[0].itrack == 0 && (log[0].flags & JUST_SampleFlag::sync) != 0);
+    unsigned long cVideo = 0;
+    for (size_t i = 0; i < log.size(); ++i)
+    {
+        cVideo += log[i].itrack == 0;
+        CHECK(log[i].decode_time >= log[0].decode_time);
+        CHECK(i == 0 || log[i].decode_time >= log[i - 1].decode_time);
+    }
+    CHECK(cVideo == 10);
+
+    // Live from here on, and the next keyframe starts the cache over.
+    size_t cReplayed = log.size();
+    host.PutFrames(GOP_SIZE);
+    CHECK(log.size() > cReplayed);
+    CHECK(host.streams[0]->m_cInFlight == 10);
+
+    host.cache.Clear();
+    CHECK(host.streams[0]->m_cInFlight == 0);
+    CHECK(host.streams[1]->m_cInFlight == 0);
+}
+
+// Over the limit, the cache empties and waits for the next keyframe.
+static void TestCacheLimit()
+{
+    GopHost host(64 * 1024);
+    host.PutFrames(GOP_SIZE / 2);
+    CHECK(host.streams[0]->m_cInFlight < (long)GOP_SIZE / 2);
+
+    host.Attach();
+    std::vector<JUST_Sample> const & log = host.dests[1]->Get()->log;
+    CHECK(log.empty() || (log[0].itrack == 0 && (log[0].flags & JUST_SampleFlag::sync) != 0));
+}
+
+// Time to first frame of a destination attached at every fifth frame of a
+// GOP: with the cache, the time Replay takes; without, the media time to
+// the next keyframe, which is wall time in a live session.
+static void TestTimeToFirstFrame()
+{
+    unsigned long long uReplay = 0;
+    unsigned long long uWait = 0;
+    unsigned long cAttach = 0;
+
+    for (unsigned long uFrame = 1; uFrame < GOP_SIZE; uFrame += 5)
+    {
+        for (int fCached = 1; fCached >= 0; --fCached)
+        {
+            GopHost host(fCached ? 16 * 1024 * 1024 : 0);
+            host.PutFrames(GOP_SIZE + uFrame);
+
+            unsigned long long uStart = PpboxGetMicroseconds();
+            unsigned long long uMediaStart = host.synthetic[0].GetTime();
+            host.Attach();
+            unsigned long long uAttached = PpboxGetMicroseconds() - uStart;
+
+            // Whatever comes before a keyframe is of no use to a decoder.
+            std::vector<JUST_Sample> const & log = host.dests[1]->Get()->log;
+            size_t iFirst = 0;
+            for (;;)
+            {
+                while (iFirst < log.size() && (log[iFirst].itrack != 0 || !(log[iFirst].flags & JUST_SampleFlag::sync)))
+                {
+                    ++iFirst;
+                }
+                if (iFirst < log.size())
+                {
+                    break;
+                }
+                host.Put();
+            }
+
+            if (fCached)
+            {
+                CHECK(iFirst == 0);
+                CHECK(log[iFirst].decode_time < uMediaStart);
+                uReplay += uAttached;
+            }
+            else
+            {
+                CHECK(log[iFirst].decode_time >= uMediaStart);
+                uWait += (log[iFirst].decode_time - uMediaStart) / 10;
+            }
+        }
+        ++cAttach;
+    }
+
+    printf("  TTFF over %lu attach points: cached %.1f us (replay), uncached %.1f ms (next keyframe)\n",
+        cAttach, (double)uReplay / cAttach, uWait / 1000.0 / cAttach);
+}
+
+int main()
+{
+    RUN_TEST(TestLateDestination);
+    RUN_TEST(TestCacheLimit);
+    RUN_TEST(TestTimeToFirstFrame);
+
+    CHECK(StubCaptureLiveCount() == 0);
+    return TEST_RESULT();
+}
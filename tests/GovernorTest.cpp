@@ -0,0 +1,267 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// GovernorTest.cpp
+// PpboxMemoryGovernor with many sinks on many threads: stalled sinks
+// are held to their share, the others never see the budget.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxSynthetic.h"
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+const unsigned long long BUDGET = 4 * 1024 * 1024;
+
+// GovernedSink: One video stream into a stub destination, stalled (the
+// backend frees nothing until the test says so) or writing samples out
+// as soon as they are put.
+struct GovernedSink
+{
+    PpboxCoreSink *         pSink;
+    PpboxCoreStream *       pStream;
+    PpboxSyntheticStream    synthetic;
+    StubDestination         dest;
+    unsigned long           cSamples;
+    unsigned long           cThrottled;     // Over budget before a sample.
+    unsigned long           cbMaxSample;
+
+    GovernedSink(long lWeight, bool fStalled)
+        : pSink(new PpboxCoreSink), pStream(NULL), dest("governed", 1), cSamples(0), cThrottled(0), cbMaxSample(0)
+    {
+        pSink->SetWeight(lWeight);
+        dest.Get()->fFreeOnPut = !fStalled;
+        dest.Get()->fLog = false;
+
+        PpboxSyntheticConfig config;
+        GetSyntheticVideoDefaults(config);
+        config.width = 1280;
+        config.height = 720;
+        config.frame_rate_num = 30;
+        config.gop_size = 30;
+        config.bitrate = 8 * 1000 * 1000;
+        synthetic.Initialize(config);
+
+        PpboxCoreMediaType type;
+        synthetic.GetMediaType(type);
+        PpboxStreamFormat * pFormat = CreateStreamFormat(type);
+        pStream = new PpboxCoreStream(pSink, 0);
+        pStream->m_fVideo = true;
+        pStream->SetFormat(pFormat, false);
+        JUST_CaptureSetStream(dest.pDest->hCapture, 0, &pFormat->info);
+    }
+
+    ~GovernedSink()
+    {
+        // dest frees what it still holds afterwards; the samples keep the
+        // stream and sink alive until then.
+        pStream->Release();
+        pSink->Release();
+    }
+
+    long long GetHeld() const { return PpboxInterlockedRead64(&pSink->m_cbHeld); }
+
+    // Puts up to cMax samples. Over budget, a stalled sink stops, as
+    // Throttle would leave it waiting; any other keeps trying.
+    void Run(unsigned long cMax, bool fStopWhenOver);
+};
+
+void GovernedSink::Run(unsigned long cMax, bool fStopWhenOver)
+{
+    StubDestination * pDest = &dest;
+
+    while (cSamples < cMax)
+    {
+        if (pSink->IsOverBudget())
+        {
+            ++cThrottled;
+            if (fStopWhenOver)
+            {
+                break;
+            }
+            std::this_thread::yield();
+            continue;
+        }
+
+        PpboxMemorySample * pHost = NULL;
+        JUST_Sample sample;
+        if (!synthetic.NextSample(&pHost))
+        {
+            break;
+        }
+        if (CreateSample(sample, &MemorySampleOps, pHost, pStream, false))
+        {
+            pStream->OnSampleQueued(pHost->info.size);
+            StubDeliver(sample, &pDest, 1);
+            cbMaxSample = std::max(cbMaxSample, (unsigned long)pHost->info.size);
+            ++cSamples;
+        }
+        MemorySampleOps.Release(pHost);
+    }
+}
+
+// A stalled sink stops at the budget; sinks that keep up never notice.
+static void TestStalledSink()
+{
+    PpboxMemoryGovernor::Instance().SetBudget(BUDGET);
+    {
+        GovernedSink stalled(1, true);
+        GovernedSink * pHealthy[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            pHealthy[i] = new GovernedSink(1, false);
+        }
+
+        std::thread threads[4];
+        threads[0] = std::thread(&GovernedSink::Run, &stalled, 100000, true);
+        for (int i = 0; i < 3; ++i)
+        {
+            threads[i + 1] = std::thread(&GovernedSink::Run, pHealthy[i], 600, false);
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            threads[i].join();
+        }
+
+        CHECK(stalled.cThrottled == 1);
+        CHECK((unsigned long long)stalled.GetHeld() >= BUDGET / 4);
+        CHECK((unsigned long long)stalled.GetHeld() < BUDGET + 4 * stalled.cbMaxSample);
+        for (int i = 0; i < 3; ++i)
+        {
+            CHECK(pHealthy[i]->cSamples == 600);
+            CHECK(pHealthy[i]->cThrottled == 0);
+            CHECK(pHealthy[i]->GetHeld() == 0);
+            delete pHealthy[i];
+        }
+
+        // Written out, the stalled sink is under budget again.
+        StubCaptureFree(stalled.dest.pDest->hCapture, (unsigned long)-1);
+        CHECK(stalled.GetHeld() == 0);
+        CHECK(!stalled.pSink->IsOverBudget());
+    }
+    CHECK(PpboxMemoryGovernor::Instance().GetHeld() == 0);
+    PpboxMemoryGovernor::Instance().SetBudget(0);
+}
+
+// A sink that took more than its share does not take the others'.
+static void TestWeightedShares()
+{
+    PpboxMemoryGovernor::Instance().SetBudget(BUDGET);
+    {
+        GovernedSink heavy(3, true);
+        GovernedSink light(1, true);
+
+        heavy.Run(100000, true);
+        CHECK((unsigned long long)heavy.GetHeld() >= BUDGET);
+
+        light.Run(100000, true);
+        CHECK((unsigned long long)light.GetHeld() >= BUDGET / 4);
+        CHECK((unsigned long long)light.GetHeld() < BUDGET / 4 + light.cbMaxSample);
+
+        // Down to its share, the heavy sink may go on again.
+        while ((unsigned long long)heavy.GetHeld() >= BUDGET / 4 * 3)
+        {
+            StubCaptureFree(heavy.dest.pDest->hCapture, 1);
+        }
+        CHECK(!heavy.pSink->IsOverBudget());
+    }
+    CHECK(PpboxMemoryGovernor::Instance().GetHeld() == 0);
+    PpboxMemoryGovernor::Instance().SetBudget(0);
+}
+
+// Slow backends freeing on their own threads while sinks put: the total
+// stays near the budget, and every byte comes back.
+static void TestStress()
+{
+    PpboxMemoryGovernor::Instance().SetBudget(BUDGET);
+    {
+        const int cSlow = 3;
+        const int cFast = 5;
+        GovernedSink * pSinks[cSlow + cFast];
+        for (int i = 0; i < cSlow + cFast; ++i)
+        {
+            pSinks[i] = new GovernedSink(1 + i % 2, i < cSlow);
+        }
+
+        std::atomic<bool> fDone(false);
+        std::atomic<long long> cbPeak(0);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < cSlow; ++i)
+        {
+            threads.push_back(std::thread([&fDone, pSinks, i]() {
+                while (!fDone)
+                {
+                    StubCaptureFree(pSinks[i]->dest.pDest->hCapture, 1);
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                }
+            }));
+        }
+        threads.push_back(std::thread([&fDone, &cbPeak]() {
+            while (!fDone)
+            {
+                long long cbHeld = (long long)PpboxMemoryGovernor::Instance().GetHeld();
+                if (cbHeld > cbPeak)
+                {
+                    cbPeak = cbHeld;
+                }
+                std::this_thread::yield();
+            }
+        }));
+
+        std::vector<std::thread> senders;
+        for (int i = 0; i < cSlow + cFast; ++i)
+        {
+            senders.push_back(std::thread(&GovernedSink::Run, pSinks[i], 300, false));
+        }
+        for (size_t i = 0; i < senders.size(); ++i)
+        {
+            senders[i].join();
+        }
+        fDone = true;
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i].join();
+        }
+
+        // Each sink may be one sample past the check.
+        unsigned long cbMaxSample = 0;
+        for (int i = 0; i < cSlow + cFast; ++i)
+        {
+            CHECK(pSinks[i]->cSamples == 300);
+            cbMaxSample = std::max(cbMaxSample, pSinks[i]->cbMaxSample);
+        }
+        CHECK((unsigned long long)cbPeak < BUDGET + (cSlow + cFast) * cbMaxSample);
+        for (int i = cSlow; i < cSlow + cFast; ++i)
+        {
+            CHECK(pSinks[i]->cThrottled == 0);
+        }
+
+        for (int i = 0; i < cSlow + cFast; ++i)
+        {
+            delete pSinks[i];
+        }
+    }
+    CHECK(PpboxMemoryGovernor::Instance().GetHeld() == 0);
+    PpboxMemoryGovernor::Instance().SetBudget(0);
+}
+
+int main()
+{
+    RUN_TEST(TestStalledSink);
+    RUN_TEST(TestWeightedShares);
+    RUN_TEST(TestStress);
+    CHECK(StubCaptureLiveCount() == 0);
+    return TEST_RESULT();
+}
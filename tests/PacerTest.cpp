@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PacerTest.cpp
+// The pacer (see PpboxPacer) on presentation clock time, as the sink
+// drives it: a bursty encoder in, the peak-to-average ratio out, and a
+// clock that pauses.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxCore.h"
+#include "PpboxPacer.h"
+#include "PpboxTest.h"
+
+#include <vector>
+
+const long long TICK = 10000;           // 1 ms, 100ns units.
+const unsigned long BIN_TICKS = 50;     // Ratios over 50 ms bins.
+
+// BurstyEncoder: 30 fps at about 4 Mbps, a keyframe every 30 frames, and
+// the frames of each 500 ms handed over at once, more than the default
+// bucket holds.
+struct BurstyEncoder
+{
+    unsigned long   uFrame;
+
+    BurstyEncoder() : uFrame(0) {}
+
+    // Appends the frames due by llClock.
+    void Produce(long long llClock, std::vector<JUST_Sample> & samples)
+    {
+        while ((long long)(uFrame / 15) * 5000000 <= llClock)
+        {
+            JUST_Sample sample;
+            memset(&sample, 0, sizeof(sample));
+            sample.itrack = 0;
+            sample.decode_time = (unsigned long long)uFrame * 333333;
+            sample.size = uFrame % 30 == 0 ? 60000 : 15000;
+            sample.flags = uFrame % 30 == 0 ? JUST_SampleFlag::sync : 0;
+            samples.push_back(sample);
+            ++uFrame;
+        }
+    }
+};
+
+static double PeakToAverage(std::vector<unsigned long long> const & bins, size_t iFirst)
+{
+    unsigned long long cbPeak = 0;
+    unsigned long long cbTotal = 0;
+    for (size_t i = iFirst; i < bins.size(); ++i)
+    {
+        cbPeak = bins[i] > cbPeak ? bins[i] : cbPeak;
+        cbTotal += bins[i];
+    }
+    return cbTotal ? (double)cbPeak * (bins.size() - iFirst) / cbTotal : 0;
+}
+
+// Ten seconds of the clock, starting at 0 as presentation time does. The
+// pacer measures the input over its first window, then smooths the
+// output; everything that goes in comes out. Returns the peak-to-average
+// ratio of the output, and of the input in *pdIn.
+static double MeasurePacing(unsigned long uBurstMs, double * pdIn)
+{
+    PpboxPacer pacer;
+    pacer.Configure(uBurstMs, PACING_DEFAULT_HEADROOM);
+    BurstyEncoder encoder;
+    std::vector<unsigned long long> in(10000 / BIN_TICKS, 0);
+    std::vector<unsigned long long> out(10000 / BIN_TICKS, 0);
+    unsigned long long cbIn = 0;
+    unsigned long long cbOut = 0;
+
+    for (unsigned long uTick = 0; uTick < 10000; ++uTick)
+    {
+        long long llClock = uTick * TICK;
+        std::vector<JUST_Sample> samples;
+        encoder.Produce(llClock, samples);
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            pacer.Push(samples[i], Priority_Video, llClock);
+            in[uTick / BIN_TICKS] += samples[i].size;
+            cbIn += samples[i].size;
+        }
+
+        JUST_Sample sample;
+        while (pacer.Pop(llClock, sample))
+        {
+            out[uTick / BIN_TICKS] += sample.size;
+            cbOut += sample.size;
+        }
+    }
+
+    JUST_Sample sample;
+    while (pacer.PopAny(sample))
+    {
+        cbOut += sample.size;
+    }
+    CHECK(cbOut == cbIn);
+
+    // From the second window on, once a rate is measured.
+    *pdIn = PeakToAverage(in, 1000 / BIN_TICKS);
+    return PeakToAverage(out, 1000 / BIN_TICKS);
+}
+
+static void TestPeakToAverage()
+{
+    double dIn = 0;
+    double dDefault = MeasurePacing(PACING_DEFAULT_BURST, &dIn);
+    double dLive = MeasurePacing(50, &dIn);
+    CHECK(dDefault < dIn);
+    CHECK(dLive < dIn / 2);
+    printf("  peak-to-average over 50 ms: encoder %.1f, paced %.1f (%lu ms bucket), %.1f (50 ms bucket)\n", 
+        dIn, dDefault, PACING_DEFAULT_BURST, dLive);
+}
+
+// The clock stands still while paused: nothing is released however long
+// the pause, and no burst is saved up for the restart.
+static void TestClockPause()
+{
+    PpboxPacer pacer;
+    BurstyEncoder encoder;
+    long long llClock = 0;
+
+    // Two seconds to measure a rate.
+    for (; llClock < 20000000; llClock += TICK)
+    {
+        std::vector<JUST_Sample> samples;
+        encoder.Produce(llClock, samples);
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            pacer.Push(samples[i], Priority_Video, llClock);
+        }
+        JUST_Sample sample;
+        while (pacer.Pop(llClock, sample))
+        {
+        }
+    }
+
+    // A burst the bucket cannot take at once, then the pause.
+    std::vector<JUST_Sample> samples;
+    encoder.Produce(llClock + 4000000, samples);
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        pacer.Push(samples[i], Priority_Video, llClock);
+    }
+    unsigned long long cbFirst = 0;
+    JUST_Sample sample;
+    while (pacer.Pop(llClock, sample))
+    {
+        cbFirst += sample.size;
+    }
+    CHECK(cbFirst > 0);
+    CHECK(!pacer.IsEmpty());
+
+    // Five seconds of wall time at the same clock time.
+    for (int i = 0; i < 5000; ++i)
+    {
+        CHECK(!pacer.Pop(llClock, sample));
+    }
+
+    // Running again, one tick later only one tick's worth goes.
+    unsigned long long cbResumed = 0;
+    while (pacer.Pop(llClock + TICK, sample))
+    {
+        cbResumed += sample.size;
+    }
+    CHECK(cbResumed <= 60000);
+    CHECK(!pacer.IsEmpty());
+}
+
+int main()
+{
+    RUN_TEST(TestPeakToAverage);
+    RUN_TEST(TestClockPause);
+
+    return TEST_RESULT();
+}
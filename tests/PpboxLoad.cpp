@@ -0,0 +1,761 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxLoad.cpp
+// Load generator: N sinks in parallel, each with a synthetic video and
+// audio stream, through CreateSample, JUST_CapturePutSample and
+// FreeSample against the stub backend. Reports throughput per core and
+// tail latency.
+//
+//   PpboxLoad [name=value ...]
+//
+//   sinks=N         Sinks, one thread each (default: one per core).
+//   seconds=S       Media seconds per sink (10).
+//   realtime=1      Pace each sink at the media rate, as a live source.
+//   executor=N      Deliver through one PpboxWorkStealingExecutor of N
+//                   workers, a PpboxDeliveryQueue per sink, and release
+//                   samples on it (0: put inline, the default).
+//   sweep=1         Runs 1, 2, 4 ... 64 sinks, one line each.
+//   switch=N        Switches video between 1080p and 720p N times a
+//                   second, at a sync sample; the GOP is cut to match.
+//   hotplug=N       Adds an audio track to each sink and removes it again
+//                   N times a second, under the sink lock that delivery
+//                   takes, as AddStreamSink and RemoveStreamSink do.
+//   width=, height=, fps=, bitrate=, gop=, bframes=, buffers=
+//                   Video, see PpboxSyntheticConfig (4K60, 40 Mbps).
+//   audio=aac|mp3|none, channels=, abitrate=
+//                   Audio (5.1 AAC, 384 kbps).
+//
+// MB/s counts payload handed to the backend; the stub does not read it,
+// so this is the cost of the sink, not of a real writer. Context switches
+// are the process's, where the platform counts them.
+//
+// Without arguments, checks the synthetic streams and runs a short load.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxSynthetic.h"
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+struct LoadConfig
+{
+    unsigned long           cSinks;
+    double                  fSeconds;
+    bool                    fRealtime;
+    unsigned long           cWorkers;       // 0 = inline delivery.
+    bool                    fSweep;
+    unsigned long           uSwitchHz;      // 0 = no format switches.
+    unsigned long           uHotplugHz;     // 0 = no streams added or removed.
+    PpboxSyntheticConfig    video;
+    PpboxSyntheticConfig    audio;
+    bool                    fAudio;
+};
+
+static void GetLoadDefaults(LoadConfig & config)
+{
+    config.cSinks = std::thread::hardware_concurrency();
+    if (config.cSinks == 0)
+    {
+        config.cSinks = 1;
+    }
+    config.fSeconds = 10;
+    config.fRealtime = false;
+    config.cWorkers = 0;
+    config.fSweep = false;
+    config.uSwitchHz = 0;
+    config.uHotplugHz = 0;
+    GetSyntheticVideoDefaults(config.video);
+    GetSyntheticAudioDefaults(config.audio);
+    config.fAudio = true;
+}
+
+static bool ParseArgument(LoadConfig & config, char const * pszArg)
+{
+    char const * pszValue = strchr(pszArg, '=');
+    if (pszValue == NULL)
+    {
+        return false;
+    }
+    std::string name(pszArg, pszValue - pszArg);
+    ++pszValue;
+    unsigned long uValue = strtoul(pszValue, NULL, 10);
+
+    if (name == "sinks")            config.cSinks = uValue;
+    else if (name == "seconds")     config.fSeconds = atof(pszValue);
+    else if (name == "realtime")    config.fRealtime = uValue != 0;
+    else if (name == "executor")    config.cWorkers = uValue;
+    else if (name == "sweep")       config.fSweep = uValue != 0;
+    else if (name == "switch")      config.uSwitchHz = uValue;
+    else if (name == "hotplug")     config.uHotplugHz = uValue;
+    else if (name == "width")       config.video.width = uValue;
+    else if (name == "height")      config.video.height = uValue;
+    else if (name == "fps")         config.video.frame_rate_num = uValue;
+    else if (name == "bitrate")     config.video.bitrate = uValue;
+    else if (name == "gop")         config.video.gop_size = uValue;
+    else if (name == "bframes")     config.video.b_frames = uValue;
+    else if (name == "buffers")     config.video.buffer_count = config.audio.buffer_count = uValue;
+    else if (name == "channels")    config.audio.channel_count = uValue;
+    else if (name == "abitrate")    config.audio.bitrate = uValue;
+    else if (name == "audio")
+    {
+        std::string codec(pszValue);
+        config.fAudio = codec != "none";
+        if (codec == "mp3")
+        {
+            config.audio.codec = PpboxCodec_MP3;
+            config.audio.frame_samples = 1152;
+        }
+        else if (codec != "aac" && codec != "none")
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+    return config.cSinks > 0;
+}
+
+// LoadSink: One sink with its streams and a stub destination that writes
+// samples out as soon as they are put. With an executor, the destination
+// has a queue on it, as the sink's with "AsyncDelivery".
+struct LoadSink
+{
+    PpboxCoreSink *         pSink;
+    PpboxCoreStream *       pStreams[2];
+    PpboxSyntheticStream    synthetic[2];
+    unsigned long           cStreams;
+    StubDestination         dest;
+    PpboxExecutor *         pExecutor;
+    PpboxCoreMediaType      video;          // As last set, for switches.
+    PpboxCoreMediaType      audio;          // Of hot-plugged tracks.
+    unsigned long           cFormatSwitches;
+    std::mutex              lock;           // The sink lock, with hotplug.
+    std::atomic<bool>       fDone;
+    unsigned long           cHotplugs;
+    unsigned long long      uMaxWait;       // For the lock to deliver, microseconds.
+    unsigned long long      uMaxHold;       // By an add or remove, microseconds.
+    unsigned long           cSamples;
+    unsigned long long      cbSamples;
+    bool                    fOk;
+
+    LoadSink(PpboxExecutor * pExecutor) 
+        : pSink(new PpboxCoreSink), cStreams(0), dest("load"), pExecutor(pExecutor), cFormatSwitches(0), 
+          fDone(false), cHotplugs(0), uMaxWait(0), uMaxHold(0), cSamples(0), cbSamples(0), fOk(true)
+    {
+        dest.Get()->fFreeOnPut = true;
+        dest.Get()->fLog = false;
+        if (pExecutor)
+        {
+            dest.pDest->pQueue = new PpboxDeliveryQueue(dest.pDest->hCapture, pExecutor, false);
+            dest.pDest->pExecutor = pExecutor;
+        }
+    }
+
+    ~LoadSink()
+    {
+        for (unsigned long i = 0; i < cStreams; ++i)
+        {
+            pStreams[i]->Release();
+        }
+        pSink->Release();
+    }
+
+    bool    AddStream(PpboxSyntheticConfig const & config);
+    void    Run(LoadConfig const & config);
+    void    Hotplug(LoadConfig const & config);
+};
+
+bool LoadSink::AddStream(PpboxSyntheticConfig const & config)
+{
+    PpboxSyntheticStream & stream = synthetic[cStreams];
+    if (!stream.Initialize(config))
+    {
+        return false;
+    }
+
+    PpboxCoreMediaType type;
+    stream.GetMediaType(type);
+    PpboxStreamFormat * pFormat = CreateStreamFormat(type);
+    if (pFormat == NULL)
+    {
+        return false;
+    }
+    if (config.fVideo)
+    {
+        video = type;
+    }
+    else
+    {
+        audio = type;
+    }
+
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, cStreams);
+    pStream->m_fVideo = config.fVideo;
+    pStream->m_Priority = config.fVideo ? Priority_Video : Priority_Audio;
+    pStream->SetFormat(pFormat, false);
+    JUST_CaptureSetStream(dest.pDest->hCapture, cStreams, &pFormat->info);
+    pStreams[cStreams++] = pStream;
+    return true;
+}
+
+void LoadSink::Run(LoadConfig const & config)
+{
+    unsigned long long uEnd = (unsigned long long)(config.fSeconds * 1e7);
+    unsigned long long uSwitch = config.uSwitchHz ? 10000000 / config.uSwitchHz : 0;
+    unsigned long long uNextSwitch = uSwitch;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    StubDestination * pDest = &dest;
+
+    for (;;)
+    {
+        // Interleaved by decode time, as a muxing source delivers.
+        unsigned long i = 0;
+        for (unsigned long j = 1; j < cStreams; ++j)
+        {
+            if (synthetic[j].GetTime() < synthetic[i].GetTime())
+            {
+                i = j;
+            }
+        }
+        unsigned long long uTime = synthetic[i].GetTime();
+        if (uTime >= uEnd)
+        {
+            break;
+        }
+        if (config.fRealtime)
+        {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(uTime / 10));
+        }
+
+        // The new type arrives as from SetCurrentMediaType, right before
+        // the sync sample the encoder starts it with.
+        if (uSwitch && i == 0 && uTime >= uNextSwitch)
+        {
+            bool f1080 = video.height != 1080;
+            video.width = f1080 ? 1920 : 1280;
+            video.height = f1080 ? 1080 : 720;
+            PpboxStreamFormat * pFormat = CreateStreamFormat(video);
+            if (pFormat == NULL)
+            {
+                fOk = false;
+                break;
+            }
+            PpboxInterlockedIncrement(&pStreams[0]->m_cFormatChanges);
+            pStreams[0]->SetFormat(pFormat, true);
+            uNextSwitch += uSwitch;
+            ++cFormatSwitches;
+        }
+
+        // ProcessSample holds the sink lock from here to the put.
+        std::unique_lock<std::mutex> sinkLock(lock, std::defer_lock);
+        if (config.uHotplugHz)
+        {
+            unsigned long long uStart = PpboxGetMicroseconds();
+            sinkLock.lock();
+            uMaxWait = std::max(uMaxWait, PpboxGetMicroseconds() - uStart);
+        }
+
+        PpboxMemorySample * pHost = NULL;
+        JUST_Sample sample;
+        if (!synthetic[i].NextSample(&pHost)
+            || !CreateSample(sample, &MemorySampleOps, pHost, pStreams[i], false))
+        {
+            fOk = false;
+            if (pHost)
+            {
+                MemorySampleOps.Release(pHost);
+            }
+            break;
+        }
+
+        pStreams[i]->OnSampleQueued(pHost->info.size);
+        ((PpboxSampleContext *)sample.context)->pExecutor = pExecutor;
+        StubDeliver(sample, &pDest, 1);
+        ++cSamples;
+        cbSamples += pHost->info.size;
+        MemorySampleOps.Release(pHost);
+    }
+    fDone = true;
+}
+
+// Until Run is done: an audio track after the sink's own, set up and
+// told to the backend as AddStreamSink does on a running sink, then
+// taken out again as RemoveStreamSink. The track carries no samples;
+// what the other streams wait for is its setup and teardown.
+void LoadSink::Hotplug(LoadConfig const & config)
+{
+    std::chrono::microseconds period(1000000 / config.uHotplugHz);
+    while (!fDone)
+    {
+        std::this_thread::sleep_for(period / 2);
+        PpboxCoreStream * pStream = NULL;
+        {
+            std::lock_guard<std::mutex> sinkLock(lock);
+            unsigned long long uStart = PpboxGetMicroseconds();
+            PpboxStreamFormat * pFormat = CreateStreamFormat(audio);
+            if (pFormat)
+            {
+                pStream = new PpboxCoreStream(pSink, cStreams);
+                pStream->m_Priority = Priority_Audio;
+                pStream->SetFormat(pFormat, false);
+                JUST_CaptureSetStream(dest.pDest->hCapture, cStreams, &pFormat->info);
+            }
+            uMaxHold = std::max(uMaxHold, PpboxGetMicroseconds() - uStart);
+        }
+        fOk &= pStream != NULL;
+
+        std::this_thread::sleep_for(period / 2);
+        {
+            std::lock_guard<std::mutex> sinkLock(lock);
+            unsigned long long uStart = PpboxGetMicroseconds();
+            if (pStream)
+            {
+                pStream->Release();
+            }
+            uMaxHold = std::max(uMaxHold, PpboxGetMicroseconds() - uStart);
+        }
+        ++cHotplugs;
+    }
+}
+
+struct LoadResult
+{
+    unsigned long       cSamples;
+    unsigned long long  cbSamples;
+    unsigned long long  cbFetched;
+    unsigned long       cFormatSwitches;
+    unsigned long       cSetStream;     // By the backend, on format switches and adds.
+    unsigned long       cHotplugs;
+    unsigned long long  uMaxWait;       // Of any sink, see LoadSink.
+    unsigned long long  uMaxHold;
+    long                cInFlight;
+    double              fWallSeconds;
+    double              fCpuSeconds;
+    long                cSwitches;      // -1 = not counted.
+    bool                fOk;
+};
+
+static double GetCpuSeconds()
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static long GetContextSwitches()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        return usage.ru_nvcsw + usage.ru_nivcsw;
+    }
+#endif
+    return -1;
+}
+
+// Worst sink for each percentile.
+static void GetTail(std::vector<LoadSink *> const & sinks, unsigned long iStream, PpboxLatencyStage stage, PpboxLatencySummary & worst)
+{
+    memset(&worst, 0, sizeof(worst));
+    for (size_t i = 0; i < sinks.size(); ++i)
+    {
+        PpboxLatencySummary summary;
+        sinks[i]->pStreams[iStream]->m_Latency[stage].GetSummary(summary);
+        worst.cSamples += summary.cSamples;
+        worst.uP50 = std::max(worst.uP50, summary.uP50);
+        worst.uP99 = std::max(worst.uP99, summary.uP99);
+        worst.uP999 = std::max(worst.uP999, summary.uP999);
+        worst.uMax = std::max(worst.uMax, summary.uMax);
+    }
+}
+
+static void PrintTail(char const * pszName, std::vector<LoadSink *> const & sinks, unsigned long iStream, PpboxLatencyStage stage)
+{
+    PpboxLatencySummary worst;
+    GetTail(sinks, iStream, stage, worst);
+    printf("  %-12s us: p50 %lu, p99 %lu, p99.9 %lu, max %lu (worst sink)\n",
+        pszName, worst.uP50, worst.uP99, worst.uP999, worst.uMax);
+}
+
+static bool RunLoad(LoadConfig const & config, LoadResult & result)
+{
+    memset(&result, 0, sizeof(result));
+    result.fOk = true;
+
+    // A switch starts a GOP, as an encoder does on a new resolution.
+    PpboxSyntheticConfig video = config.video;
+    if (config.uSwitchHz)
+    {
+        video.gop_size = std::max(1UL, video.frame_rate_num / video.frame_rate_den / config.uSwitchHz);
+    }
+
+    PpboxWorkStealingExecutor * pExecutor = config.cWorkers ? new PpboxWorkStealingExecutor(config.cWorkers) : NULL;
+    std::vector<LoadSink *> sinks;
+    for (unsigned long i = 0; i < config.cSinks; ++i)
+    {
+        LoadSink * pSink = new LoadSink(pExecutor);
+        sinks.push_back(pSink);
+        if (!pSink->AddStream(video) || (config.fAudio && !pSink->AddStream(config.audio)))
+        {
+            fprintf(stderr, "stream configuration not supported\n");
+            result.fOk = false;
+        }
+    }
+
+    if (result.fOk)
+    {
+        double fCpuStart = GetCpuSeconds();
+        long cSwitchStart = GetContextSwitches();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < sinks.size(); ++i)
+        {
+            threads.push_back(std::thread(&LoadSink::Run, sinks[i], std::cref(config)));
+            if (config.uHotplugHz)
+            {
+                threads.push_back(std::thread(&LoadSink::Hotplug, sinks[i], std::cref(config)));
+            }
+        }
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i].join();
+        }
+
+        // Queued samples are part of the run.
+        for (size_t i = 0; i < sinks.size(); ++i)
+        {
+            while (sinks[i]->pSink->m_cInFlight > 0)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+
+        result.fWallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.fCpuSeconds = GetCpuSeconds() - fCpuStart;
+        result.cSwitches = cSwitchStart < 0 ? -1 : GetContextSwitches() - cSwitchStart;
+
+        for (size_t i = 0; i < sinks.size(); ++i)
+        {
+            result.cSamples += sinks[i]->cSamples;
+            result.cbSamples += sinks[i]->cbSamples;
+            result.cbFetched += sinks[i]->dest.Get()->cbFetched;
+            result.cFormatSwitches += sinks[i]->cFormatSwitches;
+            result.cSetStream += sinks[i]->dest.Get()->cSetStream - sinks[i]->cStreams;
+            result.cHotplugs += sinks[i]->cHotplugs;
+            result.uMaxWait = std::max(result.uMaxWait, sinks[i]->uMaxWait);
+            result.uMaxHold = std::max(result.uMaxHold, sinks[i]->uMaxHold);
+            result.cInFlight += sinks[i]->pSink->m_cInFlight;
+            result.fOk &= sinks[i]->fOk;
+        }
+
+        double fMediaSeconds = config.fSeconds * config.cSinks;
+        double fCpu = result.fCpuSeconds > 0 ? result.fCpuSeconds : 1e-6;
+        if (config.fSweep)
+        {
+            PpboxLatencySummary video;
+            PpboxLatencySummary total;
+            GetTail(sinks, 0, Latency_Put, video);
+            GetTail(sinks, config.fAudio ? 1 : 0, Latency_Total, total);
+            printf("  %2lu sinks: %8.0f samples/s, %7.1f MB/s, %7ld context switches, video put p99 %lu us, %s total p99.9 %lu us\n",
+                config.cSinks, result.cSamples / result.fWallSeconds, result.cbSamples / result.fWallSeconds / 1e6,
+                result.cSwitches, video.uP99, config.fAudio ? "audio" : "video", total.uP999);
+        }
+        else
+        {
+            printf("%lu sinks, %u cores, %s, %.1f media seconds each\n",
+                config.cSinks, std::thread::hardware_concurrency(),
+                config.fRealtime ? "real time" : "as fast as possible", config.fSeconds);
+            printf("  %.3f s wall, %.3f s CPU: %.0f samples/s, %.1f MB/s\n",
+                result.fWallSeconds, result.fCpuSeconds,
+                result.cSamples / result.fWallSeconds, result.cbSamples / result.fWallSeconds / 1e6);
+            printf("  per core: %.0f samples/s, %.1f MB/s, %.1f real-time sinks\n",
+                result.cSamples / fCpu, result.cbSamples / fCpu / 1e6, fMediaSeconds / fCpu);
+            PrintTail("video put", sinks, 0, Latency_Put);
+            PrintTail("video total", sinks, 0, Latency_Total);
+            if (config.fAudio)
+            {
+                PrintTail("audio put", sinks, 1, Latency_Put);
+                PrintTail("audio total", sinks, 1, Latency_Total);
+            }
+            if (config.uSwitchHz)
+            {
+                printf("  %lu format switches, %lu given to the backend\n", result.cFormatSwitches, result.cSetStream);
+            }
+            if (config.uHotplugHz)
+            {
+                printf("  %lu tracks added and removed: held the sink lock up to %llu us, streams waited up to %llu us\n",
+                    result.cHotplugs, result.uMaxHold, result.uMaxWait);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < sinks.size(); ++i)
+    {
+        delete sinks[i];
+    }
+    delete pExecutor;
+    return result.fOk;
+}
+
+// 1, 2, 4 ... 64 sinks with the rest of the configuration as given.
+static bool RunSweep(LoadConfig config, unsigned long cMaxSinks)
+{
+    printf("%u cores, %s, %s, %.1f media seconds each\n", std::thread::hardware_concurrency(),
+        config.fRealtime ? "real time" : "as fast as possible", 
+        config.cWorkers ? "executor" : "inline", config.fSeconds);
+    config.fSweep = true;
+    bool fOk = true;
+    for (config.cSinks = 1; config.cSinks <= cMaxSinks; config.cSinks *= 2)
+    {
+        LoadResult result;
+        fOk &= RunLoad(config, result) && result.cInFlight == 0;
+    }
+    return fOk;
+}
+
+//-------------------------------------------------------------------
+// Self test
+//-------------------------------------------------------------------
+
+// I P B B ... in decode order, shown in display order one frame later.
+static void TestDecodeOrder()
+{
+    PpboxSyntheticConfig config;
+    GetSyntheticVideoDefaults(config);
+    config.gop_size = 12;
+    PpboxSyntheticStream stream;
+    CHECK(stream.Initialize(config));
+
+    unsigned long const order[12] = { 0, 3, 1, 2, 6, 4, 5, 9, 7, 8, 11, 10 };
+    unsigned long long const uDuration = 10000000 / 60;
+    unsigned long cbUnit = 0;
+
+    for (unsigned long n = 0; n < 24; ++n)
+    {
+        PpboxMemorySample * pSample = NULL;
+        CHECK(stream.NextSample(&pSample));
+        if (pSample == NULL)
+        {
+            return;
+        }
+
+        unsigned long uGop = n / 12;
+        unsigned long uDisplay = order[n % 12];
+        JUST_Sample const & info = pSample->info;
+        CHECK(info.decode_time == n * uDuration);
+        CHECK(info.time == (uGop * 12 + uDisplay + 1) * uDuration);
+        CHECK(info.time >= info.decode_time);
+        CHECK(info.composite_time_delta == info.time - info.decode_time);
+        CHECK(((info.flags & JUST_SampleFlag::sync) != 0) == (uDisplay == 0));
+
+        // B-frames are one unit, P-frames two, I-frames eight.
+        if (n == 2)
+        {
+            cbUnit = info.size;
+        }
+        bool fB = uDisplay % 3 != 0 && uDisplay != 11;
+        CHECK(info.size == cbUnit * (uDisplay == 0 ? 8 : fB ? 1 : 2) || n < 2);
+        MemorySampleOps.Release(pSample);
+    }
+
+    // Without B-frames, decode order is display order.
+    config.b_frames = 0;
+    CHECK(stream.Initialize(config));
+    for (unsigned long n = 0; n < 12; ++n)
+    {
+        PpboxMemorySample * pSample = NULL;
+        CHECK(stream.NextSample(&pSample));
+        CHECK(pSample->info.time == pSample->info.decode_time);
+        CHECK(pSample->info.composite_time_delta == 0);
+        MemorySampleOps.Release(pSample);
+    }
+}
+
+// A second of samples adds up to the bitrate.
+static void TestBitrate()
+{
+    PpboxSyntheticConfig configs[2];
+    GetSyntheticVideoDefaults(configs[0]);
+    GetSyntheticAudioDefaults(configs[1]);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        PpboxSyntheticStream stream;
+        CHECK(stream.Initialize(configs[i]));
+        // A whole GOP, or about a second of audio.
+        unsigned long cSamples = configs[i].fVideo
+            ? configs[i].gop_size : configs[i].sample_rate / configs[i].frame_samples;
+        unsigned long long cbTotal = 0;
+        unsigned long long uDuration = 0;
+        for (unsigned long n = 0; n < cSamples; ++n)
+        {
+            PpboxMemorySample * pSample = NULL;
+            CHECK(stream.NextSample(&pSample));
+            cbTotal += pSample->info.size;
+            uDuration += pSample->info.duration;
+            MemorySampleOps.Release(pSample);
+        }
+        double fRatio = cbTotal * 8.0 / configs[i].bitrate * 10000000 / uDuration;
+        CHECK(fRatio > 0.98 && fRatio < 1.02);
+    }
+}
+
+// Every sample that starts before the end, 60 fps video and audio frames
+// of 1024 samples at 48 kHz.
+static unsigned long GetSamplesPerSink(LoadConfig const & config)
+{
+    unsigned long long uEnd = (unsigned long long)(config.fSeconds * 1e7);
+    unsigned long long uVideo = 10000000 / 60;
+    unsigned long long uAudio = 10000000ULL * 1024 / 48000;
+    return (unsigned long)((uEnd + uVideo - 1) / uVideo + (uEnd + uAudio - 1) / uAudio);
+}
+
+static void TestLoad(bool fRealtime, unsigned long cWorkers)
+{
+    LoadConfig config;
+    GetLoadDefaults(config);
+    config.cSinks = 4;
+    config.fSeconds = fRealtime ? 0.5 : 2;
+    config.fRealtime = fRealtime;
+    config.cWorkers = cWorkers;
+    config.video.buffer_count = 2;
+
+    LoadResult result;
+    CHECK(RunLoad(config, result));
+
+    CHECK(!fRealtime || result.fWallSeconds >= 0.45);
+    CHECK(result.cSamples == config.cSinks * GetSamplesPerSink(config));
+    CHECK(result.cbFetched == result.cbSamples);
+    CHECK(result.cInFlight == 0);
+}
+
+static void TestLoadFast()
+{
+    TestLoad(false, 0);
+}
+
+static void TestLoadRealtime()
+{
+    TestLoad(true, 0);
+}
+
+// The same samples through a delivery queue per sink on shared workers,
+// all of them put and released by the time the run ends.
+static void TestLoadExecutor()
+{
+    TestLoad(false, 2);
+}
+
+// 1080p and 720p in turn at 10 Hz on every sink, inline and through the
+// executor: each switch reaches the backend with its sync sample, none
+// is lost to the next, and every sample and format is let go.
+static void TestFormatSwitch()
+{
+    for (unsigned long cWorkers = 0; cWorkers <= 2; cWorkers += 2)
+    {
+        LoadConfig config;
+        GetLoadDefaults(config);
+        config.cSinks = 4;
+        config.fSeconds = 2;
+        config.cWorkers = cWorkers;
+        config.uSwitchHz = 10;
+
+        LoadResult result;
+        CHECK(RunLoad(config, result));
+        CHECK(result.cFormatSwitches == config.cSinks * 19);
+        CHECK(result.cSetStream == result.cFormatSwitches);
+        CHECK(result.cbFetched == result.cbSamples);
+        CHECK(result.cInFlight == 0);
+    }
+}
+
+// Tracks added and removed 20 times a second while 4 sinks run in real
+// time: the others go on unharmed, every sample is put, and the pause
+// they see is the time an add or remove holds the sink lock.
+static void TestHotplug()
+{
+    LoadConfig config;
+    GetLoadDefaults(config);
+    config.cSinks = 4;
+    config.fSeconds = 1;
+    config.fRealtime = true;
+    config.uHotplugHz = 20;
+
+    LoadResult result;
+    CHECK(RunLoad(config, result));
+    CHECK(result.cHotplugs >= config.cSinks * 10);
+    CHECK(result.cSetStream == result.cHotplugs);
+    CHECK(result.cSamples == config.cSinks * GetSamplesPerSink(config));
+    CHECK(result.cbFetched == result.cbSamples);
+    CHECK(result.cInFlight == 0);
+}
+
+// A short sweep to 8 sinks, inline and on the executor.
+static void TestSweep()
+{
+    LoadConfig config;
+    GetLoadDefaults(config);
+    config.fSeconds = 0.25;
+    CHECK(RunSweep(config, 8));
+    config.cWorkers = 2;
+    CHECK(RunSweep(config, 8));
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 2)
+    {
+        RUN_TEST(TestDecodeOrder);
+        RUN_TEST(TestBitrate);
+        RUN_TEST(TestLoadFast);
+        RUN_TEST(TestLoadRealtime);
+        RUN_TEST(TestLoadExecutor);
+        RUN_TEST(TestFormatSwitch);
+        RUN_TEST(TestHotplug);
+        RUN_TEST(TestSweep);
+        CHECK(StubCaptureLiveCount() == 0);
+        return TEST_RESULT();
+    }
+
+    LoadConfig config;
+    GetLoadDefaults(config);
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!ParseArgument(config, argv[i]))
+        {
+            fprintf(stderr, "unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (config.fSweep)
+    {
+        return RunSweep(config, 64) ? 0 : 1;
+    }
+
+    LoadResult result;
+    return RunLoad(config, result) && result.cInFlight == 0 ? 0 : 1;
+}
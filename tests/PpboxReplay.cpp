@@ -0,0 +1,468 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxReplay.cpp
+// Replays a session trace (see PpboxTraceFormat.h) through the portable
+// core against the stub backend, and reports throughput, latency
+// percentiles and allocations.
+//
+//   PpboxReplay <trace> [-fast]
+//
+// At the recorded speed, unless -fast. Without arguments, records a
+// synthetic session and checks that both speeds replay it whole.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxTraceFormat.h"
+#include "PpboxSynthetic.h"
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+
+// Every allocation in the process, the core's and the stub's alike.
+static std::atomic<unsigned long long> s_cAllocs(0);
+
+void * operator new(size_t cb)
+{
+    ++s_cAllocs;
+    void * p = malloc(cb ? cb : 1);
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void * operator new(size_t cb, std::nothrow_t const &) noexcept
+{
+    ++s_cAllocs;
+    return malloc(cb ? cb : 1);
+}
+
+void * operator new[](size_t cb)
+{
+    return operator new(cb);
+}
+
+void * operator new[](size_t cb, std::nothrow_t const & nt) noexcept
+{
+    return operator new(cb, nt);
+}
+
+void operator delete(void * p) noexcept { free(p); }
+void operator delete(void * p, std::nothrow_t const &) noexcept { free(p); }
+void operator delete[](void * p) noexcept { free(p); }
+void operator delete[](void * p, std::nothrow_t const &) noexcept { free(p); }
+
+struct ReplayResult
+{
+    unsigned long       cSamples;
+    unsigned long long  cbSamples;
+    unsigned long       cMediaTypes;
+    unsigned long       cClocks;
+    unsigned long       cSkipped;       // Sample records the core did not take.
+    unsigned long long  cbFetched;      // By the stub backend.
+    unsigned long long  cAllocs;
+    double              fSeconds;
+    double              fRecordedSeconds;
+};
+
+// Replayer: One core sink with a stream per traced stream, put to one
+// stub destination that writes samples out as soon as they are put.
+class Replayer
+{
+public:
+    Replayer() : m_pSink(new PpboxCoreSink), m_dest("replay")
+    {
+        memset(m_pStreams, 0, sizeof(m_pStreams));
+        m_dest.Get()->fFreeOnPut = true;
+        m_dest.Get()->fLog = false;
+    }
+
+    ~Replayer()
+    {
+        for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+        {
+            if (m_pStreams[i])
+            {
+                m_pStreams[i]->Release();
+            }
+        }
+        m_pSink->Release();
+    }
+
+    bool    Run(PpboxTraceReader & reader, bool fFast, ReplayResult & result);
+    void    Report(ReplayResult const & result) const;
+    long    GetInFlight() const { return m_pSink->m_cInFlight; }
+
+private:
+    PpboxCoreStream *   GetStream(unsigned long dwStream);
+    bool    AddMediaType(unsigned long dwStream, unsigned char const * pBody, unsigned long cbBody);
+    bool    AddSample(unsigned long dwStream, unsigned char const * pBody, unsigned long cbBody);
+
+private:
+    PpboxCoreSink *             m_pSink;
+    PpboxCoreStream *           m_pStreams[MAX_STREAMS];
+    StubDestination             m_dest;
+    std::vector<unsigned char>  m_Scratch;      // Payload of samples traced without one.
+};
+
+bool Replayer::Run(PpboxTraceReader & reader, bool fFast, ReplayResult & result)
+{
+    memset(&result, 0, sizeof(result));
+
+    PpboxTraceFormat::Record record;
+    unsigned char const * pBody = NULL;
+    unsigned long cbBody = 0;
+
+    unsigned long long cAllocsBefore = s_cAllocs;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    while (reader.Next(record, &pBody, &cbBody))
+    {
+        if (!fFast)
+        {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(record.uTime / 10));
+        }
+        result.fRecordedSeconds = record.uTime / 1e7;
+
+        switch (record.uType)
+        {
+        case PpboxTraceFormat::Type_MediaType:
+            result.cMediaTypes += AddMediaType(record.uStream, pBody, cbBody);
+            break;
+        case PpboxTraceFormat::Type_Sample:
+            if (AddSample(record.uStream, pBody, cbBody))
+            {
+                PpboxTraceFormat::SampleRecord sample;
+                memcpy(&sample, pBody, sizeof(sample));
+                ++result.cSamples;
+                result.cbSamples += sample.cbSize;
+            }
+            else
+            {
+                ++result.cSkipped;
+            }
+            break;
+        case PpboxTraceFormat::Type_Clock:
+            ++result.cClocks;
+            break;
+        }
+    }
+
+    result.fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.cAllocs = s_cAllocs - cAllocsBefore;
+    result.cbFetched = m_dest.Get()->cbFetched;
+    return true;
+}
+
+void Replayer::Report(ReplayResult const & result) const
+{
+    printf("  %lu samples, %llu bytes, %lu media types, %lu clock events, %lu skipped\n",
+        result.cSamples, result.cbSamples, result.cMediaTypes, result.cClocks, result.cSkipped);
+    printf("  %.3f s for %.3f s recorded: %.0f samples/s, %.1f MB/s\n",
+        result.fSeconds, result.fRecordedSeconds,
+        result.cSamples / result.fSeconds, result.cbSamples / result.fSeconds / 1e6);
+    printf("  %.2f allocations per sample, the replay's own host sample included\n",
+        result.cSamples ? (double)result.cAllocs / result.cSamples : 0.0);
+
+    static char const * const s_Stages[Latency_Count] = { "put", "fetch", "write", "total" };
+    for (unsigned long i = 0; i < MAX_STREAMS; ++i)
+    {
+        if (m_pStreams[i] == NULL)
+        {
+            continue;
+        }
+        for (unsigned long j = 0; j < Latency_Count; ++j)
+        {
+            PpboxLatencySummary summary;
+            m_pStreams[i]->m_Latency[j].GetSummary(summary);
+            printf("  stream %lu %-5s us: p50 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+                i, s_Stages[j], summary.uP50, summary.uP99, summary.uP999, summary.uMax);
+        }
+    }
+}
+
+PpboxCoreStream * Replayer::GetStream(unsigned long dwStream)
+{
+    if (dwStream >= MAX_STREAMS)
+    {
+        return NULL;
+    }
+    if (m_pStreams[dwStream] == NULL)
+    {
+        m_pStreams[dwStream] = new PpboxCoreStream(m_pSink, dwStream);
+    }
+    return m_pStreams[dwStream];
+}
+
+// As PpboxStreamSink::SetCurrentMediaType: a new format waits for the
+// next sync sample once samples went out.
+bool Replayer::AddMediaType(unsigned long dwStream, unsigned char const * pBody, unsigned long cbBody)
+{
+    PpboxCoreStream * pStream = GetStream(dwStream);
+    PpboxCoreMediaType type;
+    if (pStream == NULL || cbBody != sizeof(type))
+    {
+        return false;
+    }
+    memcpy(&type, pBody, sizeof(type));
+
+    PpboxStreamFormat * pFormat = CreateStreamFormat(type);
+    if (pFormat == NULL)
+    {
+        return false;
+    }
+
+    pStream->m_fVideo = type.fVideo;
+    if (pStream->m_pFormat && pStream->m_cSamples > 0)
+    {
+        pStream->SetFormat(pFormat, true);
+    }
+    else
+    {
+        pStream->SetFormat(pFormat, false);
+        JUST_CaptureSetStream(m_dest.pDest->hCapture, dwStream, &pFormat->info);
+    }
+    return true;
+}
+
+bool Replayer::AddSample(unsigned long dwStream, unsigned char const * pBody, unsigned long cbBody)
+{
+    PpboxCoreStream * pStream = GetStream(dwStream);
+    PpboxTraceFormat::SampleRecord record;
+    if (pStream == NULL || cbBody < sizeof(record))
+    {
+        return false;
+    }
+    memcpy(&record, pBody, sizeof(record));
+
+    unsigned char const * pLengths = pBody + sizeof(record);
+    unsigned long cbLengths = record.cBuffers * sizeof(unsigned int);
+    if (record.cBuffers == 0 || cbBody - sizeof(record) < cbLengths
+        || cbBody - sizeof(record) - cbLengths != record.cbPayload)
+    {
+        return false;
+    }
+
+    // Traced without the payload: the same number of bytes, zeroed.
+    unsigned char * pPayload = (unsigned char *)pLengths + cbLengths;
+    if (record.cbPayload != record.cbSize)
+    {
+        if (m_Scratch.size() < record.cbSize)
+        {
+            m_Scratch.resize(record.cbSize);
+        }
+        pPayload = m_Scratch.empty() ? NULL : &m_Scratch[0];
+    }
+
+    PpboxMemorySample * pHost = new PpboxMemorySample;
+    memset(pHost, 0, sizeof(*pHost));
+    pHost->cRef = 1;
+    pHost->info.flags = record.uFlags;
+    pHost->info.decode_time = record.uDecodeTime;
+    pHost->info.time = record.uDecodeTime;
+    pHost->info.duration = record.uDuration;
+    pHost->info.size = record.cbSize;
+
+    // The recorded buffer layout, unless it does not add up or does not
+    // fit a memory sample; then in one buffer.
+    unsigned long long cbTotal = 0;
+    for (unsigned long i = 0; i < record.cBuffers && i < MAX_SYNTHETIC_BUFFERS; ++i)
+    {
+        unsigned int cbBuffer = 0;
+        memcpy(&cbBuffer, pLengths + i * sizeof(cbBuffer), sizeof(cbBuffer));
+        pHost->buffers[i] = pPayload + cbTotal;
+        pHost->lengths[i] = cbBuffer;
+        cbTotal += cbBuffer;
+    }
+    pHost->cBuffers = record.cBuffers;
+    if (record.cBuffers > MAX_SYNTHETIC_BUFFERS || cbTotal != record.cbSize)
+    {
+        pHost->cBuffers = 1;
+        pHost->buffers[0] = pPayload;
+        pHost->lengths[0] = record.cbSize;
+    }
+
+    JUST_Sample sample;
+    bool fOk = CreateSample(sample, &MemorySampleOps, pHost, pStream, false);
+    if (fOk)
+    {
+        StubDestination * pDest = &m_dest;
+        pStream->OnSampleQueued(record.cbSize);
+        StubDeliver(sample, &pDest, 1);
+    }
+    MemorySampleOps.Release(pHost);
+    return fOk;
+}
+
+static bool ReadFile(char const * pszPath, std::vector<unsigned char> & data)
+{
+    FILE * pFile = fopen(pszPath, "rb");
+    if (pFile == NULL)
+    {
+        return false;
+    }
+
+    unsigned char buffer[64 * 1024];
+    size_t cbRead = 0;
+    while ((cbRead = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+    {
+        data.insert(data.end(), buffer, buffer + cbRead);
+    }
+    fclose(pFile);
+    return true;
+}
+
+static bool Replay(std::vector<unsigned char> const & trace, bool fFast, ReplayResult & result)
+{
+    PpboxTraceReader reader;
+    if (trace.empty() || !reader.Open(&trace[0], trace.size()))
+    {
+        fprintf(stderr, "not a trace of this build\n");
+        return false;
+    }
+
+    Replayer replayer;
+    printf("replay %s:\n", fFast ? "as fast as possible" : "at the recorded speed");
+    replayer.Run(reader, fFast, result);
+    replayer.Report(result);
+    return replayer.GetInFlight() == 0;
+}
+
+//-------------------------------------------------------------------
+// Self test: one second of 4K60 video and 5.1 audio, as it would have
+// reached ProcessSample, recorded with payloads.
+//-------------------------------------------------------------------
+
+static void AppendRecord(std::vector<unsigned char> & trace, std::vector<unsigned char> & record, unsigned long long uTime)
+{
+    memcpy(&record[0] + offsetof(PpboxTraceFormat::Record, uTime), &uTime, sizeof(uTime));
+    trace.insert(trace.end(), record.begin(), record.end());
+}
+
+static unsigned long RecordSynthetic(std::vector<unsigned char> & trace, unsigned long long * pcbSamples)
+{
+    PpboxTraceFormat::Header header;
+    InitTraceHeader(header);
+    trace.assign((unsigned char const *)&header, (unsigned char const *)(&header + 1));
+
+    PpboxSyntheticConfig configs[2];
+    GetSyntheticVideoDefaults(configs[0]);
+    configs[0].buffer_count = 2;
+    GetSyntheticAudioDefaults(configs[1]);
+
+    PpboxSyntheticStream streams[2];
+    std::vector<unsigned char> record;
+    for (unsigned long i = 0; i < 2; ++i)
+    {
+        CHECK(streams[i].Initialize(configs[i]));
+        PpboxCoreMediaType type;
+        streams[i].GetMediaType(type);
+        memcpy(BeginTraceRecord(record, PpboxTraceFormat::Type_MediaType, i, sizeof(type)), &type, sizeof(type));
+        AppendRecord(trace, record, 0);
+    }
+
+    PpboxTraceFormat::ClockRecord clock = { PpboxTraceFormat::Clock_Start, 1.0f, 0 };
+    memcpy(BeginTraceRecord(record, PpboxTraceFormat::Type_Clock, 0, sizeof(clock)), &clock, sizeof(clock));
+    AppendRecord(trace, record, 0);
+
+    unsigned long cSamples = 0;
+    *pcbSamples = 0;
+    for (;;)
+    {
+        unsigned long i = streams[0].GetTime() <= streams[1].GetTime() ? 0 : 1;
+        unsigned long long uTime = streams[i].GetTime();
+        if (uTime >= 10000000)
+        {
+            break;
+        }
+
+        PpboxMemorySample * pSample = NULL;
+        CHECK(streams[i].NextSample(&pSample));
+        CHECK(BuildTraceSample(record, i, &MemorySampleOps, pSample, true));
+        AppendRecord(trace, record, uTime);
+        *pcbSamples += pSample->info.size;
+        ++cSamples;
+        MemorySampleOps.Release(pSample);
+    }
+
+    return cSamples;
+}
+
+static void TestSynthetic()
+{
+    std::vector<unsigned char> trace;
+    unsigned long long cbSamples = 0;
+    unsigned long cSamples = RecordSynthetic(trace, &cbSamples);
+
+    // Through a file, as a recorded trace comes.
+    char const * pszPath = "PpboxReplay.trace";
+    FILE * pFile = fopen(pszPath, "wb");
+    CHECK(pFile != NULL);
+    if (pFile)
+    {
+        CHECK(fwrite(&trace[0], 1, trace.size(), pFile) == trace.size());
+        fclose(pFile);
+    }
+    std::vector<unsigned char> data;
+    CHECK(ReadFile(pszPath, data));
+    CHECK(data == trace);
+    remove(pszPath);
+
+    for (int fFast = 1; fFast >= 0; --fFast)
+    {
+        ReplayResult result;
+        CHECK(Replay(data, fFast != 0, result));
+        CHECK(result.cSamples == cSamples);
+        CHECK(result.cbSamples == cbSamples);
+        CHECK(result.cbFetched == cbSamples);
+        CHECK(result.cMediaTypes == 2);
+        CHECK(result.cClocks == 1);
+        CHECK(result.cSkipped == 0);
+        if (!fFast)
+        {
+            // The last sample was recorded just short of one second in.
+            CHECK(result.fSeconds >= 0.9);
+        }
+    }
+
+    // A truncated trace replays up to the cut.
+    data.resize(data.size() / 2);
+    ReplayResult result;
+    CHECK(Replay(data, true, result));
+    CHECK(result.cSamples > 0 && result.cSamples < cSamples);
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 2)
+    {
+        RUN_TEST(TestSynthetic);
+        CHECK(StubCaptureLiveCount() == 0);
+        return TEST_RESULT();
+    }
+
+    std::vector<unsigned char> trace;
+    if (!ReadFile(argv[1], trace))
+    {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    bool fFast = argc > 2 && strcmp(argv[2], "-fast") == 0;
+    ReplayResult result;
+    return Replay(trace, fFast, result) ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// PpboxTest.h
+// Checks for the portable core tests. A test is an executable that
+// returns non-zero if any check failed.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stdio.h>
+
+static int s_cTestFailures = 0;
+
+#define CHECK(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #x); \
+            ++s_cTestFailures; \
+        } \
+    } while (0)
+
+#define RUN_TEST(f) \
+    do { \
+        int cBefore = s_cTestFailures; \
+        f(); \
+        printf("%s %s\n", s_cTestFailures == cBefore ? "PASS" : "FAIL", #f); \
+    } while (0)
+
+#define TEST_RESULT()   (s_cTestFailures == 0 ? 0 : 1)
@@ -0,0 +1,364 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// SpillTest.cpp
+// Soak test of the spill ring: a backend that stalls for minutes of
+// media, with the sink's spill policy (see PpboxMediaSink::SpillSample
+// and DrainSpill) in front of it. PPBOX_SOAK_SECONDS sets the length of
+// the stall, 180 seconds of media by default.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "PpboxSynthetic.h"
+#include "PpboxSpillRing.h"
+#include "StubCapture.h"
+#include "PpboxTest.h"
+
+#include <stdlib.h>
+
+// SpillHost: The sink's spill policy over one destination.
+struct SpillHost
+{
+    PpboxCoreSink *     pSink;
+    PpboxCoreStream *   streams[2];
+    PpboxSpillRing      ring;
+    unsigned long       uLimit;
+    StubDestination *   pDest;
+    unsigned long       cSpilled;
+    unsigned long       cForced;        // Replayed because the ring was full.
+    unsigned long       cMaxInFlight;
+
+    SpillHost(StubDestination * pDest, unsigned long uLimit)
+        : pSink(new PpboxCoreSink), uLimit(uLimit), pDest(pDest), cSpilled(0), cForced(0), cMaxInFlight(0)
+    {
+        streams[0] = new PpboxCoreStream(pSink, 0);
+        streams[1] = new PpboxCoreStream(pSink, 1);
+    }
+
+    ~SpillHost()
+    {
+        ring.Close();
+        streams[0]->Release();
+        streams[1]->Release();
+        pSink->Release();
+    }
+
+    void Deliver(JUST_Sample & sample)
+    {
+        StubDeliver(sample, &pDest, 1);
+        if ((unsigned long)pSink->m_cInFlight > cMaxInFlight)
+        {
+            cMaxInFlight = (unsigned long)pSink->m_cInFlight;
+        }
+    }
+
+    void Drain(bool fForce)
+    {
+        JUST_Sample sample;
+        unsigned char const * pPayload = NULL;
+        PpboxStreamFormat * pFormat = NULL;
+
+        while (ring.Front(sample, &pPayload, &pFormat))
+        {
+            if (!fForce && (unsigned long)pSink->m_cInFlight >= uLimit)
+            {
+                break;
+            }
+            PpboxCoreStream * pStream = streams[sample.itrack];
+            CHECK(CreateSampleFromBuffer(sample, pPayload, sample.size, pStream, pFormat));
+            pStream->OnSampleQueued(sample.size);
+            Deliver(sample);
+            ring.Pop();
+            if (fForce)
+            {
+                break;
+            }
+        }
+    }
+
+    void Process(unsigned long iStream, PpboxMemorySample * pHost)
+    {
+        Drain(false);
+
+        if (ring.IsEmpty() && (unsigned long)pSink->m_cInFlight < uLimit)
+        {
+            JUST_Sample sample;
+            CHECK(CreateSample(sample, &MemorySampleOps, pHost, streams[iStream], false));
+            streams[iStream]->OnSampleQueued(pHost->info.size);
+            Deliver(sample);
+            return;
+        }
+
+        unsigned char * pPayload = NULL;
+        while ((pPayload = ring.Reserve(pHost->info.size)) == NULL)
+        {
+            CHECK(!ring.IsEmpty());
+            Drain(true);
+            ++cForced;
+        }
+
+        JUST_Sample sample = pHost->info;
+        unsigned long cbCopied = 0;
+        sample.itrack = iStream;
+        CHECK(CopySampleBuffers(&MemorySampleOps, pHost, pPayload, sample.size, &cbCopied));
+        sample.size = cbCopied;
+        ring.Commit(sample, AdvanceFormat(sample, streams[iStream]));
+        ++cSpilled;
+    }
+};
+
+// Checks that each track reached the backend complete and in order.
+static void CheckOrder(StubCapture * pCapture, unsigned long cVideo, unsigned long cAudio)
+{
+    unsigned long long uLast[2] = { 0, 0 };
+    unsigned long cSeen[2] = { 0, 0 };
+    bool fOrdered = true;
+
+    for (size_t i = 0; i < pCapture->log.size(); ++i)
+    {
+        JUST_Sample const & sample = pCapture->log[i];
+        if (cSeen[sample.itrack] > 0 && sample.decode_time <= uLast[sample.itrack])
+        {
+            fOrdered = false;
+        }
+        uLast[sample.itrack] = sample.decode_time;
+        ++cSeen[sample.itrack];
+    }
+
+    CHECK(fOrdered);
+    CHECK(cSeen[0] == cVideo);
+    CHECK(cSeen[1] == cAudio);
+}
+
+// Runs a stall of uStallSeconds of media, then a backend that takes two
+// samples for each one produced, then a quiet source while the rest
+// drains. fOverflow: the ring is too small for the stall.
+static void RunSoak(unsigned long long cbRing, unsigned long uStallSeconds, bool fOverflow)
+{
+    StubDestination dest("stalled");
+    SpillHost host(&dest, 64);
+    CHECK(host.ring.Open("SpillTest.ring", cbRing));
+
+    PpboxSyntheticConfig config;
+    PpboxSyntheticStream video;
+    PpboxSyntheticStream audio;
+    GetSyntheticVideoDefaults(config);
+    config.width = 1280;
+    config.height = 720;
+    config.frame_rate_num = 30;
+    config.bitrate = 2 * 1000 * 1000;
+    CHECK(video.Initialize(config));
+    GetSyntheticAudioDefaults(config);
+    config.channel_count = 2;
+    config.bitrate = 128 * 1000;
+    CHECK(audio.Initialize(config));
+
+    unsigned long long uStallEnd = (unsigned long long)uStallSeconds * 10000000;
+    unsigned long long uEnd = uStallEnd + 60ULL * 10000000;
+    unsigned long cVideo = 0;
+    unsigned long cAudio = 0;
+    unsigned long long cbUsedMax = 0;
+
+    while (video.GetTime() < uEnd)
+    {
+        bool fVideo = video.GetTime() <= audio.GetTime();
+        PpboxMemorySample * pHost = NULL;
+        CHECK((fVideo ? video : audio).NextSample(&pHost));
+        host.Process(fVideo ? 0 : 1, pHost);
+        MemorySampleOps.Release(pHost);
+        ++(fVideo ? cVideo : cAudio);
+
+        if (host.ring.GetUsed() > cbUsedMax)
+        {
+            cbUsedMax = host.ring.GetUsed();
+        }
+        CHECK(host.ring.GetStreamPayload(0) + host.ring.GetStreamPayload(1) <= host.ring.GetUsed());
+        if ((fVideo ? video : audio).GetTime() > uStallEnd)
+        {
+            StubCaptureFree(dest.pDest->hCapture, 2);
+        }
+    }
+
+    // The source went quiet, the drain timer empties the ring.
+    unsigned long cTicks = 0;
+    while (!host.ring.IsEmpty())
+    {
+        StubCaptureFree(dest.pDest->hCapture, (unsigned long)-1);
+        host.Drain(false);
+        ++cTicks;
+    }
+    StubCaptureFree(dest.pDest->hCapture, (unsigned long)-1);
+
+    CheckOrder(dest.Get(), cVideo, cAudio);
+    CHECK(host.pSink->m_cInFlight == 0);
+    CHECK(host.ring.GetStreamPayload(0) == 0 && host.ring.GetStreamPayload(1) == 0);
+    CHECK(cbUsedMax <= cbRing);
+    if (fOverflow)
+    {
+        // The ring filled up, the oldest samples went out regardless.
+        CHECK(host.cForced > 0);
+    }
+    else
+    {
+        // The ring took the whole stall, memory stayed at the limit.
+        CHECK(host.cForced == 0);
+        CHECK(host.cMaxInFlight <= host.uLimit);
+    }
+
+    printf("  %lu s stall, %.0f MB ring: %lu samples, %lu spilled, %lu forced out, %.1f MB ring peak, %lu in memory at most, %lu drain ticks\n",
+        uStallSeconds, cbRing / 1048576.0, cVideo + cAudio, host.cSpilled, host.cForced,
+        cbUsedMax / 1048576.0, host.cMaxInFlight, cTicks);
+}
+
+static unsigned long GetSoakSeconds()
+{
+    char const * psz = getenv("PPBOX_SOAK_SECONDS");
+    return psz ? strtoul(psz, NULL, 10) : 180;
+}
+
+static void TestSoak()
+{
+    unsigned long uSeconds = GetSoakSeconds();
+
+    // Big enough for the stall: 2.1 Mbps is about 16 MB a minute.
+    RunSoak(((uSeconds + 59) / 60 + 1) * 20ULL * 1048576, uSeconds, false);
+}
+
+static void TestOverflow()
+{
+    RunSoak(4ULL * 1048576, GetSoakSeconds(), true);
+}
+
+static void TestRingWrap()
+{
+    PpboxSpillRing ring;
+    CHECK(!ring.Open("SpillTest.ring", SPILL_FLUSH_BYTES - 1));
+    CHECK(ring.Open("SpillTest.ring", SPILL_FLUSH_BYTES));
+
+    // Records of 300 KB: three fit, the fourth wraps behind a pad.
+    const unsigned long cbPayload = 300 * 1024;
+    JUST_Sample sample;
+    memset(&sample, 0, sizeof(sample));
+    unsigned long long uPut = 0;
+    unsigned long long uGot = 0;
+
+    for (int i = 0; i < 20; ++i)
+    {
+        unsigned char * pPayload = NULL;
+        while ((pPayload = ring.Reserve(cbPayload)) == NULL)
+        {
+            JUST_Sample front;
+            unsigned char const * pFront = NULL;
+            PpboxStreamFormat * pFormat = NULL;
+            CHECK(ring.Front(front, &pFront, &pFormat));
+            CHECK(front.decode_time == uGot && pFront[0] == (unsigned char)uGot);
+            ring.Pop();
+            ++uGot;
+        }
+        sample.decode_time = uPut;
+        sample.size = cbPayload;
+        pPayload[0] = (unsigned char)uPut;
+        ring.Commit(sample, NULL);
+        ++uPut;
+        CHECK(ring.GetCount() <= 3);
+    }
+
+    CHECK(uPut - uGot == ring.GetCount());
+    ring.Close();
+    CHECK(!ring.IsOpen());
+}
+
+// Samples spilled before a format change are replayed in the old format,
+// however late; the first sync sample after it brings the new one.
+static void TestSpillKeepsFormat()
+{
+    PpboxCoreSink * pSink = new PpboxCoreSink;
+    PpboxCoreStream * pStream = new PpboxCoreStream(pSink, 0);
+    StubDestination dest("dest", 1);
+    StubDestination * pDest = &dest;
+    dest.Get()->fFreeOnPut = true;
+
+    PpboxSyntheticConfig config;
+    GetSyntheticVideoDefaults(config);
+    PpboxSyntheticStream synthetic;
+    CHECK(synthetic.Initialize(config));
+    PpboxCoreMediaType type;
+    synthetic.GetMediaType(type);
+    PpboxStreamFormat * pOld = CreateStreamFormat(type);
+    type.width /= 2;
+    type.height /= 2;
+    PpboxStreamFormat * pNew = CreateStreamFormat(type);
+    pStream->SetFormat(pOld, false);
+
+    PpboxSpillRing ring;
+    CHECK(ring.Open("SpillTest.ring", SPILL_FLUSH_BYTES));
+
+    // sync, delta, format change, delta, sync.
+    unsigned char payload[16] = {0};
+    bool const fSync[4] = { true, false, false, true };
+    for (int i = 0; i < 4; ++i)
+    {
+        if (i == 2)
+        {
+            pNew->AddRef();
+            pStream->SetFormat(pNew, true);
+        }
+        JUST_Sample sample;
+        memset(&sample, 0, sizeof(sample));
+        sample.decode_time = i;
+        sample.flags = fSync[i] ? JUST_SampleFlag::sync : 0;
+        sample.size = sizeof(payload);
+        unsigned char * pPayload = ring.Reserve(sample.size);
+        CHECK(pPayload != NULL);
+        memcpy(pPayload, payload, sizeof(payload));
+        ring.Commit(sample, AdvanceFormat(sample, pStream));
+    }
+    CHECK(pStream->m_pFormat == pNew);
+
+    PpboxStreamFormat * const expected[4] = { pOld, pOld, pOld, pNew };
+    for (int i = 0; i < 4; ++i)
+    {
+        JUST_Sample sample;
+        unsigned char const * pPayload = NULL;
+        PpboxStreamFormat * pFormat = NULL;
+        CHECK(ring.Front(sample, &pPayload, &pFormat));
+        CHECK(CreateSampleFromBuffer(sample, pPayload, sample.size, pStream, pFormat));
+        CHECK(((PpboxSampleContext *)sample.context)->pFormat == expected[i]);
+        CHECK(((sample.flags & SampleFlag_FormatChange) != 0) == (i == 3));
+        pStream->OnSampleQueued(sample.size);
+        StubDeliver(sample, &pDest, 1);
+        ring.Pop();
+    }
+    CHECK(ring.IsEmpty());
+
+    // Left in the ring, a record lets go of its format on Close.
+    JUST_Sample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.size = sizeof(payload);
+    CHECK(ring.Reserve(sample.size) != NULL);
+    ring.Commit(sample, pNew);
+    CHECK(pNew->cRef == 3);
+    ring.Close();
+    CHECK(pNew->cRef == 2);
+
+    pNew->Release();
+    pStream->Release();
+    pSink->Release();
+}
+
+int main()
+{
+    RUN_TEST(TestRingWrap);
+    RUN_TEST(TestSpillKeepsFormat);
+    RUN_TEST(TestSoak);
+    RUN_TEST(TestOverflow);
+
+    CHECK(StubCaptureLiveCount() == 0);
+    return TEST_RESULT();
+}
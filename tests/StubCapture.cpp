@@ -0,0 +1,237 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// StubCapture.cpp
+// A JUST_Capture* backend in memory, and the host side of delivery, for
+// the portable core tests.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "StubCapture.h"
+
+#include <thread>
+#include <chrono>
+
+static long s_cLiveCaptures = 0;
+static long s_cCreated = 0;
+static long s_cPuts = 0;
+static unsigned long s_uConnectDelay = 0;
+
+/* JUST_Capture* */
+
+PP_handle JUST_CaptureCreate(char const * type, char const * dest)
+{
+    StubCapture * pCapture = new StubCapture;
+    pCapture->type = type ? type : "";
+    pCapture->destination = dest ? dest : "";
+    memset(&pCapture->config, 0, sizeof(pCapture->config));
+    pCapture->cInit = 0;
+    pCapture->cSetStream = 0;
+    pCapture->cbFetched = 0;
+    pCapture->cbPerSecond = 0;
+    pCapture->fFreeOnPut = false;
+    pCapture->fLog = true;
+    PpboxInterlockedIncrement(&s_cLiveCaptures);
+    PpboxInterlockedIncrement(&s_cCreated);
+    if (s_uConnectDelay)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(s_uConnectDelay));
+    }
+    return pCapture;
+}
+
+PP_bool JUST_CaptureInit(PP_handle capture, JUST_CaptureConfigData * config)
+{
+    StubCapture * pCapture = StubCaptureFromHandle(capture);
+    std::lock_guard<std::mutex> lock(pCapture->lock);
+    pCapture->config = *config;
+    pCapture->streams.clear();
+    ++pCapture->cInit;
+    return true;
+}
+
+PP_bool JUST_CaptureSetStream(PP_handle capture, PP_uint index, JUST_StreamInfo * info)
+{
+    StubCapture * pCapture = StubCaptureFromHandle(capture);
+    std::lock_guard<std::mutex> lock(pCapture->lock);
+    if (index >= pCapture->config.stream_count)
+    {
+        return false;
+    }
+    if (index >= pCapture->streams.size())
+    {
+        JUST_StreamInfo empty;
+        memset(&empty, 0, sizeof(empty));
+        pCapture->streams.resize(index + 1, empty);
+    }
+    pCapture->streams[index] = *info;
+    ++pCapture->cSetStream;
+    return true;
+}
+
+PP_bool JUST_CapturePutSample(PP_handle capture, JUST_Sample * sample)
+{
+    StubCapture * pCapture = StubCaptureFromHandle(capture);
+    bool fFree = false;
+    unsigned long cbPerSecond = 0;
+    {
+        std::lock_guard<std::mutex> lock(pCapture->lock);
+        pCapture->held.push_back(*sample);
+        if (pCapture->fLog)
+        {
+            pCapture->log.push_back(*sample);
+            pCapture->log.back().context = NULL;
+            pCapture->sequence.push_back((unsigned long)PpboxInterlockedIncrement(&s_cPuts));
+            pCapture->times.push_back(PpboxGetMicroseconds());
+        }
+        fFree = pCapture->fFreeOnPut;
+        cbPerSecond = pCapture->cbPerSecond;
+    }
+    if (cbPerSecond)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(sample->size * 1000000ULL / cbPerSecond));
+    }
+    if (fFree)
+    {
+        StubCaptureFree(capture, 1);
+    }
+    return true;
+}
+
+PP_bool JUST_CaptureDestroy(PP_handle capture)
+{
+    // Whatever is still held goes back, as the backend would on close.
+    StubCaptureFree(capture, (unsigned long)-1);
+    delete StubCaptureFromHandle(capture);
+    PpboxInterlockedDecrement(&s_cLiveCaptures);
+    return true;
+}
+
+/* Test side */
+
+StubCapture * StubCaptureFromHandle(PP_handle hCapture)
+{
+    return (StubCapture *)hCapture;
+}
+
+long StubCaptureLiveCount()
+{
+    return s_cLiveCaptures;
+}
+
+long StubCaptureCreateCount()
+{
+    return s_cCreated;
+}
+
+void StubCaptureSetConnectDelay(unsigned long uMicroseconds)
+{
+    s_uConnectDelay = uMicroseconds;
+}
+
+unsigned long StubCaptureFree(PP_handle hCapture, unsigned long cSamples)
+{
+    StubCapture * pCapture = StubCaptureFromHandle(hCapture);
+    unsigned long cFreed = 0;
+
+    while (cFreed < cSamples)
+    {
+        JUST_Sample sample;
+        {
+            std::lock_guard<std::mutex> lock(pCapture->lock);
+            if (pCapture->held.empty())
+            {
+                break;
+            }
+            sample = pCapture->held.front();
+            pCapture->held.erase(pCapture->held.begin());
+        }
+
+        // Multi-buffer samples come with the buffer count in size.
+        JUST_ConstBuffer buffers[64];
+        unsigned long cBuffers = sample.buffer ? 1 : sample.size;
+        if (cBuffers <= 64 && pCapture->config.get_sample_buffers(sample.context, buffers))
+        {
+            std::vector<unsigned char> payload;
+            unsigned long long cbPayload = 0;
+            for (unsigned long i = 0; i < cBuffers; ++i)
+            {
+                if (pCapture->fLog)
+                {
+                    payload.insert(payload.end(), buffers[i].data, buffers[i].data + buffers[i].len);
+                }
+                cbPayload += buffers[i].len;
+            }
+            std::lock_guard<std::mutex> lock(pCapture->lock);
+            pCapture->cbFetched += cbPayload;
+            if (pCapture->fLog)
+            {
+                pCapture->lastPayload.swap(payload);
+            }
+        }
+
+        pCapture->config.free_sample(sample.context);
+        ++cFreed;
+    }
+
+    return cFreed;
+}
+
+StubDestination::StubDestination(char const * pszDest, unsigned long cStreams)
+{
+    JUST_CaptureConfigData config;
+    memset(&config, 0, sizeof(config));
+    config.stream_count = cStreams;
+    config.get_sample_buffers = GetSampleBuffers;
+    config.free_sample = FreeSample;
+
+    pDest = CreateCaptureDest(JUST_CaptureCreate("stub", pszDest), 0);
+    JUST_CaptureInit(pDest->hCapture, &config);
+}
+
+StubDestination::~StubDestination()
+{
+    // Frees what the handle holds, which releases the samples' references.
+    JUST_CaptureDestroy(pDest->hCapture);
+    pDest->Release();
+}
+
+void StubDeliver(JUST_Sample & sample, StubDestination ** ppDests, unsigned long cDests)
+{
+    PpboxSampleContext * pContext = (PpboxSampleContext *)sample.context;
+    pContext->uPutTime = PpboxGetMicroseconds();
+
+    for (unsigned long i = 0; i < cDests; ++i)
+    {
+        PpboxCaptureDest & dest = *ppDests[i]->pDest;
+        PpboxSampleRef & ref = pContext->refs[i];
+        ref.pContext = pContext;
+        ref.pDest = &dest;
+        dest.AddRef();
+        PpboxInterlockedIncrement(&pContext->cRef);
+        PpboxInterlockedIncrement(&dest.cInFlight);
+        PpboxInterlockedIncrement(&dest.cPut);
+
+        JUST_Sample destSample = sample;
+        destSample.context = &ref;
+        if (dest.pQueue)
+        {
+            dest.pQueue->Put(destSample, pContext->pStream->m_Priority);
+        }
+        else
+        {
+            PutCaptureSample(dest.hCapture, destSample);
+        }
+    }
+
+    if (PpboxInterlockedDecrement(&pContext->cRef) == 0)
+    {
+        ReleaseSample(pContext);
+    }
+}
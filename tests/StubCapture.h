@@ -0,0 +1,80 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// StubCapture.h
+// A JUST_Capture* backend in memory, and the host side of delivery, for
+// the portable core tests.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "PpboxCore.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+// StubCapture: What a handle was told. Samples are held until the test
+// frees them with StubCaptureFree, as a backend stalled on its output
+// would, unless fFreeOnPut is set. Benchmarks clear fLog: samples are
+// then neither logged nor their payloads kept, only counted. With
+// cbPerSecond, each put takes as long as writing the sample out at that
+// rate, as a backend on a slow link.
+struct StubCapture
+{
+    std::mutex                      lock;
+    std::string                     type;
+    std::string                     destination;
+    JUST_CaptureConfigData          config;
+    unsigned long                   cInit;
+    std::vector<JUST_StreamInfo>    streams;        // By track, as last set; format buffers not owned.
+    unsigned long                   cSetStream;
+    std::vector<JUST_Sample>        held;           // Put and not freed yet, oldest first.
+    std::vector<JUST_Sample>        log;            // Everything put, context cleared.
+    std::vector<unsigned long>      sequence;       // Of each log entry, in puts to all handles.
+    std::vector<unsigned long long> times;          // Of each log entry, PpboxGetMicroseconds when put.
+    unsigned long long              cbFetched;      // Through get_sample_buffers.
+    std::vector<unsigned char>      lastPayload;    // Of the last sample fetched.
+    unsigned long                   cbPerSecond;    // 0 = puts do not wait.
+    bool                            fFreeOnPut;
+    bool                            fLog;
+};
+
+StubCapture * StubCaptureFromHandle(PP_handle hCapture);
+
+// Handles created and not destroyed, over all tests in the process.
+long StubCaptureLiveCount();
+
+// Handles ever created, over all tests in the process.
+long StubCaptureCreateCount();
+
+// How long JUST_CaptureCreate blocks, as connecting to a destination.
+void StubCaptureSetConnectDelay(unsigned long uMicroseconds);
+
+// Fetches and frees up to cSamples of the oldest held samples, as a
+// backend writing them out; returns how many.
+unsigned long StubCaptureFree(PP_handle hCapture, unsigned long cSamples);
+
+// StubDestination: A capture handle set up as the sink sets them up.
+// The destination may outlive it, as long as samples put to it do.
+struct StubDestination
+{
+    PpboxCaptureDest *  pDest;
+
+    explicit StubDestination(char const * pszDest, unsigned long cStreams = MAX_STREAMS);
+    ~StubDestination();
+
+    StubCapture *   Get() const { return StubCaptureFromHandle(pDest->hCapture); }
+};
+
+// Puts a sample from CreateSample to each destination, taking over the
+// reference CreateSample gave, as PpboxMediaSink::DeliverSample does;
+// through the destination's queue, if it has one.
+void StubDeliver(JUST_Sample & sample, StubDestination ** ppDests, unsigned long cDests);
@@ -0,0 +1,21 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// IPpboxBoostTypes.h
+// Stub of the JUST SDK basic types, for the portable core tests.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+typedef unsigned char       PP_uchar;
+typedef unsigned int        PP_uint;
+typedef unsigned long long  PP_ulong;
+typedef bool                PP_bool;
+typedef void *              PP_handle;
@@ -0,0 +1,106 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// IPpboxRuntime.h
+// Stub of the JUST SDK capture interface, for the portable core tests.
+// Only what the core uses, with the SDK's names; the implementation is
+// tests/StubCapture.cpp.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "IPpboxBoostTypes.h"
+
+struct JUST_StreamType
+{
+    enum Enum { VIDE = 1, AUDI = 2 };
+};
+
+struct JUST_VideoSubType
+{
+    enum Enum { AVC1 = 1, WMV3, HVC1, VP09 };
+};
+
+struct JUST_AudioSubType
+{
+    enum Enum { MP4A = 1, MP3, WMA2, OPUS };
+};
+
+struct JUST_FormatType
+{
+    enum Enum { none = 0, video_avc_byte_stream, audio_raw, video_hevc_byte_stream };
+};
+
+struct JUST_SampleFlag
+{
+    enum Enum { sync = 1, discontinuity = 2 };
+};
+
+struct JUST_ConstBuffer
+{
+    PP_uchar const *    data;
+    PP_uint             len;
+};
+
+struct JUST_Sample
+{
+    PP_uint             itrack;
+    PP_uint             flags;
+    PP_ulong            time;
+    PP_ulong            decode_time;
+    PP_uint             composite_time_delta;
+    PP_uint             duration;
+    PP_uint             size;               // Buffer count if buffer is NULL.
+    PP_uchar const *    buffer;
+    void const *        context;
+};
+
+struct JUST_StreamInfo
+{
+    PP_uint             type;
+    PP_uint             sub_type;
+    PP_uint             time_scale;
+    PP_uint             bitrate;
+    union
+    {
+        struct
+        {
+            PP_uint     width;
+            PP_uint     height;
+            PP_uint     frame_rate_num;
+            PP_uint     frame_rate_den;
+        } video;
+        struct
+        {
+            PP_uint     channel_count;
+            PP_uint     sample_size;
+            PP_uint     sample_rate;
+            PP_uint     block_align;
+            PP_uint     sample_per_frame;
+        } audio;
+    } format;
+    PP_uint             format_type;
+    PP_uint             format_size;
+    PP_uchar const *    format_buffer;
+};
+
+struct JUST_CaptureConfigData
+{
+    PP_uint             stream_count;
+    PP_uint             flags;
+    bool                (*get_sample_buffers)(void const *, JUST_ConstBuffer *);
+    bool                (*free_sample)(void const *);
+};
+
+PP_handle JUST_CaptureCreate(char const * type, char const * dest);
+PP_bool JUST_CaptureInit(PP_handle capture, JUST_CaptureConfigData * config);
+PP_bool JUST_CaptureSetStream(PP_handle capture, PP_uint index, JUST_StreamInfo * info);
+PP_bool JUST_CapturePutSample(PP_handle capture, JUST_Sample * sample);
+PP_bool JUST_CaptureDestroy(PP_handle capture);